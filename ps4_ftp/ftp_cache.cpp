@@ -0,0 +1,354 @@
+/*
+* Block cache for RETR.
+*/
+
+#include "ftp_cache.h"
+
+#define CACHE_SHARDS 8
+#define CACHE_HASH_SIZE 256 /* Per shard, must be a power of two */
+/* Share of a shard the protected segment may fill, in quarters */
+#define CACHE_PROTECTED_QUARTERS 3
+
+#define CACHE_LOADING 0
+#define CACHE_READY 1
+#define CACHE_FAILED 2
+
+typedef struct cache_entry {
+	/* Handed out to callers, must stay the first member */
+	ftps4_cache_block_t blk;
+	ftps4_cache_key_t key;
+	unsigned long long index;
+	int state;
+	int refs;
+	/* Set once the entry is out of the hash and LRU, freed at refs == 0 */
+	int detached;
+	/* Set while in the protected segment */
+	int prot;
+	struct cache_entry *hnext;
+	struct cache_entry *lru_prev;
+	struct cache_entry *lru_next;
+	unsigned char *data;
+} cache_entry;
+
+/* Most recently used at the head */
+typedef struct {
+	cache_entry *head;
+	cache_entry *tail;
+} cache_lru;
+
+typedef struct {
+	ScePthreadMutex mtx;
+	ScePthreadCond cond;
+	cache_entry *buckets[CACHE_HASH_SIZE];
+	/* Blocks asked for once */
+	cache_lru probation;
+	/* Blocks asked for again while cached */
+	cache_lru protect;
+	unsigned int count;
+	unsigned int capacity;
+	unsigned int prot_count;
+	unsigned int prot_capacity;
+	ftps4_cache_stats_t stats;
+} cache_shard;
+
+static cache_shard *shards = NULL;
+
+static unsigned long long cache_hash(const ftps4_cache_key_t *key, unsigned long long index) {
+	unsigned long long h = 0xcbf29ce484222325ULL;
+	h = (h ^ key->dev) * 0x100000001b3ULL;
+	h = (h ^ key->ino) * 0x100000001b3ULL;
+	h = (h ^ key->size) * 0x100000001b3ULL;
+	h = (h ^ key->mtime) * 0x100000001b3ULL;
+	h = (h ^ key->mtime_nsec) * 0x100000001b3ULL;
+	h = (h ^ index) * 0x100000001b3ULL;
+	return h ^ (h >> 29);
+}
+
+static int key_equal(const ftps4_cache_key_t *a, const ftps4_cache_key_t *b) {
+	return a->dev == b->dev && a->ino == b->ino && a->size == b->size &&
+		a->mtime == b->mtime && a->mtime_nsec == b->mtime_nsec;
+}
+
+static cache_lru *entry_lru(cache_shard *shard, cache_entry *e) {
+	return e->prot ? &shard->protect : &shard->probation;
+}
+
+static void lru_unlink(cache_shard *shard, cache_entry *e) {
+	cache_lru *lru = entry_lru(shard, e);
+
+	if (e->lru_prev) e->lru_prev->lru_next = e->lru_next;
+	else lru->head = e->lru_next;
+	if (e->lru_next) e->lru_next->lru_prev = e->lru_prev;
+	else lru->tail = e->lru_prev;
+	e->lru_prev = e->lru_next = NULL;
+}
+
+static void lru_push_front(cache_shard *shard, cache_entry *e) {
+	cache_lru *lru = entry_lru(shard, e);
+
+	e->lru_prev = NULL;
+	e->lru_next = lru->head;
+	if (lru->head) lru->head->lru_prev = e;
+	lru->head = e;
+	if (!lru->tail) lru->tail = e;
+}
+
+/* Moves a block that was asked for again to the head of the protected
+* segment, the protected tail going back on probation when it is full */
+static void entry_touch(cache_shard *shard, cache_entry *e) {
+	cache_entry *d;
+
+	lru_unlink(shard, e);
+	if (!e->prot) {
+		e->prot = 1;
+		shard->prot_count++;
+		shard->stats.promotions++;
+	}
+	lru_push_front(shard, e);
+
+	while (shard->prot_count > shard->prot_capacity && (d = shard->protect.tail) != NULL) {
+		lru_unlink(shard, d);
+		d->prot = 0;
+		shard->prot_count--;
+		lru_push_front(shard, d);
+	}
+}
+
+static void entry_free(cache_entry *e) {
+	free(e->data);
+	free(e);
+}
+
+/* Takes the entry out of the hash and LRU, the shard lock must be held */
+static void entry_detach(cache_shard *shard, cache_entry *e) {
+	cache_entry **pp = &shard->buckets[cache_hash(&e->key, e->index) & (CACHE_HASH_SIZE - 1)];
+
+	while (*pp && *pp != e) pp = &(*pp)->hnext;
+	if (*pp) *pp = e->hnext;
+	lru_unlink(shard, e);
+
+	shard->count--;
+	if (e->prot) shard->prot_count--;
+	if (e->state == CACHE_READY) shard->stats.bytes -= e->blk.len;
+	e->detached = 1;
+	if (e->refs == 0) entry_free(e);
+}
+
+static void lru_evict(cache_shard *shard, cache_lru *lru) {
+	cache_entry *e, *prev;
+
+	for (e = lru->tail; e && shard->count >= shard->capacity; e = prev) {
+		prev = e->lru_prev;
+		if (e->refs == 0) {
+			entry_detach(shard, e);
+			shard->stats.evictions++;
+		}
+	}
+}
+
+/* Evicts unused entries from the cold end until there is room for one more,
+* probation first */
+static int shard_make_room(cache_shard *shard) {
+	lru_evict(shard, &shard->probation);
+	lru_evict(shard, &shard->protect);
+	return shard->count < shard->capacity;
+}
+
+static int read_block(int fd, unsigned long long offset, unsigned char *data, unsigned int *len) {
+	long n;
+	unsigned int got = 0;
+
+	if (Sys::lseek(fd, offset, SEEK_SET) < 0) return -1;
+	while (got < FTPS4_CACHE_BLOCK_SIZE) {
+		n = Sys::read(fd, data + got, FTPS4_CACHE_BLOCK_SIZE - got);
+		if (n < 0) return -1;
+		if (n == 0) break;
+		got += n;
+	}
+	*len = got;
+	return 0;
+}
+
+void ftps4_cache_init(unsigned long long size) {
+	int i;
+	unsigned int blocks;
+
+	if (shards) return;
+
+	blocks = (unsigned int)(size / FTPS4_CACHE_BLOCK_SIZE);
+	if (blocks < CACHE_SHARDS) return;
+
+	shards = (cache_shard *)calloc(CACHE_SHARDS, sizeof(*shards));
+	if (shards == NULL) return;
+
+	for (i = 0; i < CACHE_SHARDS; i++) {
+		scePthreadMutexInit(&shards[i].mtx, NULL, "FTPS4_cache_mutex");
+		scePthreadCondInit(&shards[i].cond, NULL, "FTPS4_cache_cond");
+		shards[i].capacity = blocks / CACHE_SHARDS;
+		shards[i].prot_capacity = shards[i].capacity * CACHE_PROTECTED_QUARTERS / 4;
+		shards[i].stats.capacity = (unsigned long long)shards[i].capacity * FTPS4_CACHE_BLOCK_SIZE;
+	}
+}
+
+void ftps4_cache_fini() {
+	int i;
+	cache_entry *e, *next;
+
+	if (!shards) return;
+
+	/* Every session is gone at this point, nothing holds a block */
+	for (i = 0; i < CACHE_SHARDS; i++) {
+		for (e = shards[i].probation.head; e; e = next) {
+			next = e->lru_next;
+			entry_free(e);
+		}
+		for (e = shards[i].protect.head; e; e = next) {
+			next = e->lru_next;
+			entry_free(e);
+		}
+		scePthreadCondDestroy(&shards[i].cond);
+		scePthreadMutexDestroy(&shards[i].mtx);
+	}
+	free(shards);
+	shards = NULL;
+}
+
+int ftps4_cache_enabled() { return shards != NULL; }
+
+void ftps4_cache_key_from_stat(ftps4_cache_key_t *key, const struct stat *st) {
+	key->dev = st->st_dev;
+	key->ino = st->st_ino;
+	key->size = st->st_size;
+	key->mtime = st->st_mtim.tv_sec;
+	key->mtime_nsec = st->st_mtim.tv_nsec;
+}
+
+const ftps4_cache_block_t *ftps4_cache_get(const ftps4_cache_key_t *key, unsigned long long offset, int fd) {
+	unsigned long long index = offset / FTPS4_CACHE_BLOCK_SIZE;
+	unsigned long long h;
+	cache_shard *shard;
+	cache_entry *e;
+	int ret;
+
+	if (!shards) return NULL;
+
+	h = cache_hash(key, index);
+	shard = &shards[(h >> 32) % CACHE_SHARDS];
+
+	scePthreadMutexLock(&shard->mtx);
+
+	for (e = shard->buckets[h & (CACHE_HASH_SIZE - 1)]; e; e = e->hnext) {
+		if (e->index == index && key_equal(&e->key, key)) break;
+	}
+
+	if (e) {
+		e->refs++;
+		entry_touch(shard, e);
+		shard->stats.hits++;
+		if (e->state == CACHE_LOADING) {
+			/* Someone else is already reading it, wait for that read */
+			shard->stats.shared++;
+			while (e->state == CACHE_LOADING) scePthreadCondWait(&shard->cond, &shard->mtx);
+		}
+		if (e->state == CACHE_FAILED) {
+			if (--e->refs == 0 && e->detached) entry_free(e);
+			e = NULL;
+		}
+		scePthreadMutexUnlock(&shard->mtx);
+		return e ? &e->blk : NULL;
+	}
+
+	shard->stats.misses++;
+	if (!shard_make_room(shard) ||
+		(e = (cache_entry *)calloc(1, sizeof(*e))) == NULL ||
+		(e->data = (unsigned char *)malloc(FTPS4_CACHE_BLOCK_SIZE)) == NULL) {
+		free(e);
+		shard->stats.bypassed++;
+		scePthreadMutexUnlock(&shard->mtx);
+		return NULL;
+	}
+
+	e->key = *key;
+	e->index = index;
+	e->state = CACHE_LOADING;
+	e->refs = 1;
+	e->blk.data = e->data;
+	e->blk.offset = index * FTPS4_CACHE_BLOCK_SIZE;
+	e->hnext = shard->buckets[h & (CACHE_HASH_SIZE - 1)];
+	shard->buckets[h & (CACHE_HASH_SIZE - 1)] = e;
+	lru_push_front(shard, e);
+	shard->count++;
+
+	scePthreadMutexUnlock(&shard->mtx);
+
+	/* Read outside the lock, other sessions asking for it wait on the cond */
+	ret = read_block(fd, e->blk.offset, e->data, &e->blk.len);
+
+	scePthreadMutexLock(&shard->mtx);
+	if (ret < 0) {
+		entry_detach(shard, e);
+		e->state = CACHE_FAILED;
+	} else {
+		e->state = CACHE_READY;
+		shard->stats.bytes += e->blk.len;
+	}
+	scePthreadCondBroadcast(&shard->cond);
+	if (ret < 0 && --e->refs == 0) entry_free(e);
+	scePthreadMutexUnlock(&shard->mtx);
+
+	return ret < 0 ? NULL : &e->blk;
+}
+
+void ftps4_cache_put(const ftps4_cache_block_t *block) {
+	cache_entry *e = (cache_entry *)block;
+	cache_shard *shard = &shards[(cache_hash(&e->key, e->index) >> 32) % CACHE_SHARDS];
+
+	scePthreadMutexLock(&shard->mtx);
+	if (--e->refs == 0 && e->detached) entry_free(e);
+	scePthreadMutexUnlock(&shard->mtx);
+}
+
+static void lru_drop(cache_shard *shard, cache_lru *lru, int all, unsigned long long dev, unsigned long long ino) {
+	cache_entry *e, *next;
+
+	for (e = lru->head; e; e = next) {
+		next = e->lru_next;
+		if (e->refs == 0 && (all || (e->key.dev == dev && e->key.ino == ino))) entry_detach(shard, e);
+	}
+}
+
+static void cache_drop(int all, unsigned long long dev, unsigned long long ino) {
+	int i;
+
+	if (!shards) return;
+
+	for (i = 0; i < CACHE_SHARDS; i++) {
+		scePthreadMutexLock(&shards[i].mtx);
+		lru_drop(&shards[i], &shards[i].probation, all, dev, ino);
+		lru_drop(&shards[i], &shards[i].protect, all, dev, ino);
+		scePthreadMutexUnlock(&shards[i].mtx);
+	}
+}
+
+void ftps4_cache_invalidate(unsigned long long dev, unsigned long long ino) { cache_drop(0, dev, ino); }
+void ftps4_cache_flush() { cache_drop(1, 0, 0); }
+
+void ftps4_cache_get_stats(ftps4_cache_stats_t *stats) {
+	int i;
+
+	memset(stats, 0, sizeof(*stats));
+	if (!shards) return;
+
+	for (i = 0; i < CACHE_SHARDS; i++) {
+		scePthreadMutexLock(&shards[i].mtx);
+		stats->hits += shards[i].stats.hits;
+		stats->misses += shards[i].stats.misses;
+		stats->shared += shards[i].stats.shared;
+		stats->evictions += shards[i].stats.evictions;
+		stats->promotions += shards[i].stats.promotions;
+		stats->bypassed += shards[i].stats.bypassed;
+		stats->bytes += shards[i].stats.bytes;
+		stats->capacity += shards[i].stats.capacity;
+		scePthreadMutexUnlock(&shards[i].mtx);
+	}
+}
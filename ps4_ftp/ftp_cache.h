@@ -0,0 +1,68 @@
+/*
+* Block cache for RETR.
+*
+* Blocks are keyed by file identity (device, inode, size and mtime down to
+* the nanosecond, so a modified file never hits stale data) and block index.
+* Files up to one block are therefore cached whole. The cache is split into
+* shards, each with its own lock and a segmented LRU: blocks start out on
+* probation and only move to the protected segment when they are asked for
+* again, so one large RETR streaming through can't push out the hot set. A
+* block that is being read from disk is shared by every session asking for
+* it.
+*/
+
+#pragma once
+
+#include <application.h>
+
+#define FTPS4_CACHE_BLOCK_SIZE (256 * 1024)
+#define FTPS4_CACHE_DEFAULT_SIZE (32 * 1024 * 1024)
+
+typedef struct {
+	unsigned long long dev;
+	unsigned long long ino;
+	unsigned long long size;
+	unsigned long long mtime;
+	unsigned long long mtime_nsec;
+} ftps4_cache_key_t;
+
+typedef struct {
+	const unsigned char *data;
+	/* Less than FTPS4_CACHE_BLOCK_SIZE only for the last block of a file */
+	unsigned int len;
+	/* File offset of data[0] */
+	unsigned long long offset;
+} ftps4_cache_block_t;
+
+typedef struct {
+	unsigned long long hits;
+	unsigned long long misses;
+	/* Hits that waited for another session's disk read */
+	unsigned long long shared;
+	unsigned long long evictions;
+	/* Blocks moved to the protected segment by a second request */
+	unsigned long long promotions;
+	/* Misses that bypassed the cache because every block was in use */
+	unsigned long long bypassed;
+	unsigned long long bytes;
+	unsigned long long capacity;
+} ftps4_cache_stats_t;
+
+/* size is the memory budget in bytes, 0 disables the cache */
+void ftps4_cache_init(unsigned long long size);
+void ftps4_cache_fini();
+int ftps4_cache_enabled();
+
+void ftps4_cache_key_from_stat(ftps4_cache_key_t *key, const struct stat *st);
+
+/* Returns the block holding offset, reading it through fd on a miss.
+* Returns NULL on read errors or when the cache can't take the block,
+* the caller then reads the file itself. */
+const ftps4_cache_block_t *ftps4_cache_get(const ftps4_cache_key_t *key, unsigned long long offset, int fd);
+void ftps4_cache_put(const ftps4_cache_block_t *block);
+
+/* Drops every unused block of the file */
+void ftps4_cache_invalidate(unsigned long long dev, unsigned long long ino);
+/* Drops every unused block */
+void ftps4_cache_flush();
+void ftps4_cache_get_stats(ftps4_cache_stats_t *stats);
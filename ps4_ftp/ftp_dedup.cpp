@@ -0,0 +1,309 @@
+/*
+* Content index for upload dedup.
+*
+* Entries remember the file's identity (device, inode, size, mtime to the
+* nanosecond) next to
+* the path, a lookup only trusts an entry whose file still matches, so a
+* file that was modified, replaced or deleted is never handed out. The index
+* is an append-only text file that is compacted when it is loaded.
+*/
+
+#include "ftp_dedup.h"
+
+#define DEDUP_COPY_BUF_SIZE (1024 * 1024)
+/* How often a waiting session gets to look at its control connection */
+#define DEDUP_POLL_INTERVAL (100 * 1000)
+
+typedef struct {
+	unsigned char hash[FTPS4_SHA256_SIZE];
+	unsigned long long size;
+	unsigned long long dev;
+	unsigned long long ino;
+	unsigned long long mtime;
+	unsigned long long mtime_nsec;
+	char path[PATH_MAXX];
+	int used;
+} dedup_entry;
+
+static dedup_entry *dedup_table = NULL;
+/* Next slot to overwrite once the table is full */
+static unsigned int dedup_next = 0;
+static ScePthreadMutex dedup_mtx;
+static char dedup_index[PATH_MAXX];
+
+static int dedup_entry_valid(const dedup_entry *e) {
+	struct stat st;
+
+	return Sys::stat(e->path, &st) >= 0 && S_ISREG(st.st_mode) &&
+		(unsigned long long)st.st_size == e->size &&
+		(unsigned long long)st.st_dev == e->dev &&
+		(unsigned long long)st.st_ino == e->ino &&
+		(unsigned long long)st.st_mtime == e->mtime &&
+		(unsigned long long)st.st_mtim.tv_nsec == e->mtime_nsec;
+}
+
+static dedup_entry *dedup_find_path(const char *path) {
+	unsigned int i;
+
+	for (i = 0; i < FTPS4_DEDUP_MAX_ENTRIES; i++) {
+		if (dedup_table[i].used && strcmp(dedup_table[i].path, path) == 0) return &dedup_table[i];
+	}
+	return NULL;
+}
+
+static dedup_entry *dedup_slot(const char *path) {
+	dedup_entry *e;
+	unsigned int i;
+
+	/* A path holds one content at a time */
+	if ((e = dedup_find_path(path))) return e;
+
+	for (i = 0; i < FTPS4_DEDUP_MAX_ENTRIES; i++) {
+		if (!dedup_table[i].used) return &dedup_table[i];
+	}
+	e = &dedup_table[dedup_next];
+	dedup_next = (dedup_next + 1) % FTPS4_DEDUP_MAX_ENTRIES;
+	return e;
+}
+
+static int dedup_format(const dedup_entry *e, char *line, unsigned int size) {
+	char hex[FTPS4_SHA256_SIZE * 2 + 1];
+
+	ftps4_sha256_to_hex(e->hash, hex);
+	return snprintf(line, size, "%s %llu %llu %llu %llu.%09llu %s\n", hex, e->size, e->dev, e->ino, e->mtime, e->mtime_nsec, e->path);
+}
+
+static void dedup_append(const dedup_entry *e) {
+	char line[PATH_MAXX + 160];
+	int fd, len;
+
+	fd = Sys::open(dedup_index, O_CREAT | O_WRONLY | O_APPEND, 0777);
+	if (fd < 0) return;
+	len = dedup_format(e, line, sizeof(line));
+	Sys::write(fd, line, len);
+	Sys::close(fd);
+}
+
+/* Rewrites the index with the entries that are still valid */
+static void dedup_compact() {
+	char tmp[PATH_MAXX + 8];
+	char line[PATH_MAXX + 160];
+	unsigned int i;
+	int fd, len;
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", dedup_index);
+	fd = Sys::open(tmp, O_CREAT | O_WRONLY | O_TRUNC, 0777);
+	if (fd < 0) return;
+
+	for (i = 0; i < FTPS4_DEDUP_MAX_ENTRIES; i++) {
+		if (!dedup_table[i].used) continue;
+		len = dedup_format(&dedup_table[i], line, sizeof(line));
+		Sys::write(fd, line, len);
+	}
+	Sys::close(fd);
+	Sys::rename(tmp, dedup_index);
+}
+
+static void dedup_load() {
+	char line[PATH_MAXX + 160];
+	char hex[FTPS4_SHA256_SIZE * 2 + 1];
+	dedup_entry e, *slot;
+	FILE *f;
+	int pos;
+
+	f = fopen(dedup_index, "r");
+	if (!f) return;
+
+	while (fgets(line, sizeof(line), f)) {
+		memset(&e, 0, sizeof(e));
+		/* Lines written before the nanoseconds were kept don't match any file any more */
+		if (sscanf(line, "%64s %llu %llu %llu %llu.%llu %n", hex, &e.size, &e.dev, &e.ino, &e.mtime, &e.mtime_nsec, &pos) < 6) continue;
+		if (ftps4_sha256_from_hex(hex, e.hash) < 0) continue;
+		snprintf(e.path, sizeof(e.path), "%s", line + pos);
+		e.path[strcspn(e.path, "\r\n")] = '\0';
+		if (e.path[0] != '/' || !dedup_entry_valid(&e)) continue;
+
+		/* Later lines win */
+		e.used = 1;
+		slot = dedup_slot(e.path);
+		*slot = e;
+	}
+	fclose(f);
+}
+
+void ftps4_dedup_init(const char *index_path) {
+	if (!index_path || !index_path[0]) return;
+
+	dedup_table = (dedup_entry *)calloc(FTPS4_DEDUP_MAX_ENTRIES, sizeof(dedup_entry));
+	if (dedup_table == NULL) return;
+
+	snprintf(dedup_index, sizeof(dedup_index), "%s", index_path);
+	scePthreadMutexInit(&dedup_mtx, NULL, "FTPS4_dedup_mutex");
+	dedup_next = 0;
+	dedup_load();
+	dedup_compact();
+}
+
+void ftps4_dedup_fini() {
+	if (dedup_table == NULL) return;
+
+	scePthreadMutexDestroy(&dedup_mtx);
+	free(dedup_table);
+	dedup_table = NULL;
+}
+
+int ftps4_dedup_enabled() {
+	return dedup_table != NULL;
+}
+
+int ftps4_dedup_lookup(const unsigned char hash[FTPS4_SHA256_SIZE], unsigned long long size, char *path, unsigned int path_size) {
+	unsigned int i;
+	int ret = -1;
+
+	if (dedup_table == NULL) return -1;
+
+	scePthreadMutexLock(&dedup_mtx);
+	for (i = 0; i < FTPS4_DEDUP_MAX_ENTRIES && ret < 0; i++) {
+		dedup_entry *e = &dedup_table[i];
+		if (!e->used || e->size != size || memcmp(e->hash, hash, FTPS4_SHA256_SIZE) != 0) continue;
+
+		if (dedup_entry_valid(e)) {
+			snprintf(path, path_size, "%s", e->path);
+			ret = 0;
+		} else {
+			/* Changed or gone, the index forgets it */
+			e->used = 0;
+		}
+	}
+	scePthreadMutexUnlock(&dedup_mtx);
+	return ret;
+}
+
+void ftps4_dedup_record(const unsigned char hash[FTPS4_SHA256_SIZE], const char *path) {
+	struct stat st;
+	dedup_entry *e;
+
+	if (dedup_table == NULL || Sys::stat(path, &st) < 0 || !S_ISREG(st.st_mode)) return;
+
+	scePthreadMutexLock(&dedup_mtx);
+	e = dedup_slot(path);
+	memcpy(e->hash, hash, FTPS4_SHA256_SIZE);
+	e->size = st.st_size;
+	e->dev = st.st_dev;
+	e->ino = st.st_ino;
+	e->mtime = st.st_mtime;
+	e->mtime_nsec = st.st_mtim.tv_nsec;
+	snprintf(e->path, sizeof(e->path), "%s", path);
+	e->used = 1;
+	dedup_append(e);
+	scePthreadMutexUnlock(&dedup_mtx);
+}
+
+typedef struct {
+	const char *src;
+	const char *dst;
+	ScePthreadMutex mtx;
+	ScePthreadCond cond;
+	volatile int stop;
+	int done;
+	int ret;
+} dedup_copy_job;
+
+static void *dedup_copy_worker(void *arg) {
+	dedup_copy_job *job = (dedup_copy_job *)arg;
+	unsigned char *buf;
+	int in = -1, out = -1, n = 0, ret = -1;
+
+	buf = (unsigned char *)malloc(DEDUP_COPY_BUF_SIZE);
+	if (buf && (in = Sys::open(job->src, O_RDONLY, 0)) >= 0 &&
+		(out = Sys::open(job->dst, O_CREAT | O_WRONLY | O_TRUNC, 0777)) >= 0) {
+		ret = 0;
+		while (!job->stop && (n = Sys::read(in, buf, DEDUP_COPY_BUF_SIZE)) > 0) {
+			if (Sys::write(out, buf, n) != n) {
+				ret = -1;
+				break;
+			}
+		}
+		if (n < 0 || job->stop) ret = -1;
+	}
+
+	if (in >= 0) Sys::close(in);
+	if (out >= 0) Sys::close(out);
+	free(buf);
+	if (ret < 0) Sys::unlink(job->dst);
+
+	scePthreadMutexLock(&job->mtx);
+	job->ret = ret;
+	job->done = 1;
+	scePthreadCondSignal(&job->cond);
+	scePthreadMutexUnlock(&job->mtx);
+	return NULL;
+}
+
+/* Copies src to dst on a thread of its own. The caller keeps asking cancel
+* meanwhile, a copy it cancels is stopped and dst removed. */
+static int dedup_copy(const char *src, const char *dst, ftps4_dedup_cancel_func cancel, void *arg) {
+	dedup_copy_job job;
+	ScePthread thid;
+	int started;
+
+	memset(&job, 0, sizeof(job));
+	job.src = src;
+	job.dst = dst;
+	scePthreadMutexInit(&job.mtx, NULL, "FTPS4_dedup_copy_mutex");
+	scePthreadCondInit(&job.cond, NULL, "FTPS4_dedup_copy_cond");
+
+	/* Without a thread the copy still happens, just here */
+	started = scePthreadCreate(&thid, NULL, dedup_copy_worker, &job, "FTPS4_dedup_thread") >= 0;
+	if (!started) dedup_copy_worker(&job);
+
+	scePthreadMutexLock(&job.mtx);
+	while (!job.done) {
+		scePthreadCondTimedwait(&job.cond, &job.mtx, DEDUP_POLL_INTERVAL);
+		if (job.done || !cancel) continue;
+		scePthreadMutexUnlock(&job.mtx);
+		if (cancel(arg)) job.stop = 1;
+		scePthreadMutexLock(&job.mtx);
+	}
+	scePthreadMutexUnlock(&job.mtx);
+
+	if (started) scePthreadJoin(thid, NULL);
+	scePthreadCondDestroy(&job.cond);
+	scePthreadMutexDestroy(&job.mtx);
+	return job.ret;
+}
+
+int ftps4_dedup_materialize(const char *src, const char *dst, ftps4_dedup_cancel_func cancel, void *arg) {
+	char tmp[PATH_MAXX + 16];
+
+	if (strcmp(src, dst) == 0) return 0;
+
+	/* Built next to dst and renamed over it, a failure leaves dst as it was */
+	snprintf(tmp, sizeof(tmp), "%s.ftps4dedup", dst);
+	Sys::unlink(tmp);
+	/* Different filesystems (internal drive and USB) can't share an inode */
+	if (Sys::link(src, tmp) < 0 && dedup_copy(src, tmp, cancel, arg) < 0) return -1;
+
+	/* Like STOR, an existing destination is replaced */
+	if (Sys::rename(tmp, dst) < 0) {
+		Sys::unlink(tmp);
+		return -1;
+	}
+	return 0;
+}
+
+int ftps4_dedup_unshare(const char *path, ftps4_dedup_cancel_func cancel, void *arg) {
+	char tmp[PATH_MAXX + 16];
+	struct stat st;
+
+	if (Sys::stat(path, &st) < 0 || !S_ISREG(st.st_mode) || st.st_nlink < 2) return 0;
+
+	snprintf(tmp, sizeof(tmp), "%s.ftps4dedup", path);
+	Sys::unlink(tmp);
+	if (dedup_copy(path, tmp, cancel, arg) < 0) return -1;
+	if (Sys::rename(tmp, path) < 0) {
+		Sys::unlink(tmp);
+		return -1;
+	}
+	return 0;
+}
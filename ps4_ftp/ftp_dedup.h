@@ -0,0 +1,32 @@
+/*
+* Content index for upload dedup: which file on the console holds the
+* content with a given SHA-256.
+*/
+
+#pragma once
+
+#include <application.h>
+#include "ftp_path.h"
+#include "ftp_sha256.h"
+
+#define FTPS4_DEDUP_MAX_ENTRIES 1024
+#define FTPS4_DEDUP_DEFAULT_INDEX "/data/ftps4_dedup.idx"
+
+/* Loads the index kept in index_path, NULL disables dedup */
+void ftps4_dedup_init(const char *index_path);
+void ftps4_dedup_fini();
+int ftps4_dedup_enabled();
+
+/* Finds an unchanged file with this content, returns < 0 if there is none */
+int ftps4_dedup_lookup(const unsigned char hash[FTPS4_SHA256_SIZE], unsigned long long size, char *path, unsigned int path_size);
+/* Records that path (as it is now) holds this content */
+void ftps4_dedup_record(const unsigned char hash[FTPS4_SHA256_SIZE], const char *path);
+/* Asked while a copy runs, returning nonzero stops it */
+typedef int (*ftps4_dedup_cancel_func)(void *arg);
+
+/* Puts the content of src at dst, a hard link if possible, a copy otherwise.
+* dst is only replaced once the new file is complete. */
+int ftps4_dedup_materialize(const char *src, const char *dst, ftps4_dedup_cancel_func cancel, void *arg);
+/* Gives path an inode of its own if it shares one with other names (as a
+* materialized file does), so writing into it leaves them alone */
+int ftps4_dedup_unshare(const char *path, ftps4_dedup_cancel_func cancel, void *arg);
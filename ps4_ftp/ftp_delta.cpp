@@ -0,0 +1,158 @@
+/*
+* rsync style delta updates, signature side.
+*
+* The weak checksum is computed 16 bytes at a time with SSE2 where it is
+* available. A window of blocks is split into one contiguous run per worker
+* thread, each with its own descriptor, so disk reads and hashing overlap.
+*/
+
+#include "ftp_delta.h"
+#include "ftp_sha256.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#define DELTA_THREADS 4
+/* Bytes a worker reads at once, rounded to whole blocks */
+#define DELTA_READ_SIZE (1024 * 1024)
+
+typedef struct {
+	const char *path;
+	unsigned int block_size;
+	unsigned long long first;
+	unsigned int count;
+	ftps4_delta_sig_t *out;
+	/* Blocks done, < 0 on error */
+	int done;
+} delta_job;
+
+unsigned int ftps4_delta_weak(const unsigned char *p, unsigned int n) {
+	unsigned int a = 0, b = 0, i = 0;
+
+#if defined(__SSE2__)
+	/* For chunk c (at 16c) the chunk's own sum s and weighted sum t = sum k * x[16c + k]
+	* give b = n * A - 16 * sum c * s_c - T, sum c * s_c = m * S - sum S_c with S
+	* the running total of the s_c over the m chunks */
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i w_lo = _mm_setr_epi16(0, 1, 2, 3, 4, 5, 6, 7);
+	const __m128i w_hi = _mm_setr_epi16(8, 9, 10, 11, 12, 13, 14, 15);
+	__m128i run = zero, run_sum = zero, weighted = zero, x;
+	unsigned int m = n / 16;
+	unsigned long long s, ss;
+	unsigned int t;
+	unsigned int tt[4];
+
+	for (; i < m; i++) {
+		x = _mm_loadu_si128((const __m128i *)(p + i * 16));
+		run = _mm_add_epi64(run, _mm_sad_epu8(x, zero));
+		run_sum = _mm_add_epi64(run_sum, run);
+		weighted = _mm_add_epi32(weighted, _mm_madd_epi16(_mm_unpacklo_epi8(x, zero), w_lo));
+		weighted = _mm_add_epi32(weighted, _mm_madd_epi16(_mm_unpackhi_epi8(x, zero), w_hi));
+	}
+
+	s = (unsigned long long)_mm_cvtsi128_si64(run) + (unsigned long long)_mm_cvtsi128_si64(_mm_unpackhi_epi64(run, run));
+	ss = (unsigned long long)_mm_cvtsi128_si64(run_sum) + (unsigned long long)_mm_cvtsi128_si64(_mm_unpackhi_epi64(run_sum, run_sum));
+	_mm_storeu_si128((__m128i *)tt, weighted);
+	t = tt[0] + tt[1] + tt[2] + tt[3];
+
+	a = (unsigned int)s;
+	b = n * a - 16 * (unsigned int)(m * s - ss) - t;
+	i = m * 16;
+#endif
+
+	for (; i < n; i++) {
+		a += p[i];
+		b += (n - i) * p[i];
+	}
+	return (a & 0xFFFF) | (b << 16);
+}
+
+static void *delta_worker(void *arg) {
+	delta_job *job = (delta_job *)arg;
+	unsigned char digest[FTPS4_SHA256_SIZE];
+	unsigned char *buf;
+	unsigned int per_read, blocks, i;
+	int fd, n, got;
+
+	job->done = -1;
+	per_read = DELTA_READ_SIZE / job->block_size;
+	if (!per_read) per_read = 1;
+
+	buf = (unsigned char *)malloc((size_t)per_read * job->block_size);
+	if (buf == NULL) return NULL;
+
+	fd = Sys::open(job->path, O_RDONLY, 0);
+	if (fd < 0 || Sys::lseek(fd, job->first * job->block_size, SEEK_SET) < 0) {
+		if (fd >= 0) Sys::close(fd);
+		free(buf);
+		return NULL;
+	}
+
+	job->done = 0;
+	while ((unsigned int)job->done < job->count) {
+		blocks = job->count - job->done < per_read ? job->count - job->done : per_read;
+
+		for (got = 0; got < (int)(blocks * job->block_size); got += n) {
+			n = Sys::read(fd, buf + got, blocks * job->block_size - got);
+			if (n <= 0) break;
+		}
+		if (n < 0) {
+			job->done = -1;
+			break;
+		}
+
+		for (i = 0; i * job->block_size < (unsigned int)got; i++) {
+			unsigned int len = got - i * job->block_size;
+			if (len > job->block_size) len = job->block_size;
+
+			job->out[job->done].weak = ftps4_delta_weak(buf + i * job->block_size, len);
+			ftps4_sha256(buf + i * job->block_size, len, digest);
+			memcpy(job->out[job->done].strong, digest, FTPS4_DELTA_STRONG_SIZE);
+			job->done++;
+		}
+		/* End of file */
+		if (got < (int)(blocks * job->block_size)) break;
+	}
+
+	Sys::close(fd);
+	free(buf);
+	return NULL;
+}
+
+int ftps4_delta_signatures(const char *path, unsigned int block_size, unsigned long long first, unsigned int count, ftps4_delta_sig_t *out) {
+	delta_job jobs[DELTA_THREADS];
+	ScePthread thids[DELTA_THREADS];
+	int started[DELTA_THREADS];
+	unsigned int per_job, i;
+	int total = 0;
+
+	per_job = (count + DELTA_THREADS - 1) / DELTA_THREADS;
+
+	for (i = 0; i < DELTA_THREADS; i++) {
+		jobs[i].path = path;
+		jobs[i].block_size = block_size;
+		jobs[i].first = first + (unsigned long long)i * per_job;
+		jobs[i].count = i * per_job < count ? (count - i * per_job < per_job ? count - i * per_job : per_job) : 0;
+		jobs[i].out = out + i * per_job;
+		jobs[i].done = 0;
+
+		started[i] = 0;
+		if (!jobs[i].count) continue;
+		/* Without a thread the work is still done, just here */
+		if (scePthreadCreate(&thids[i], NULL, delta_worker, &jobs[i], "FTPS4_delta_thread") >= 0) started[i] = 1;
+		else delta_worker(&jobs[i]);
+	}
+
+	for (i = 0; i < DELTA_THREADS; i++) {
+		if (started[i]) scePthreadJoin(thids[i], NULL);
+	}
+
+	/* Runs are contiguous, a short one is the end of the file */
+	for (i = 0; i < DELTA_THREADS && jobs[i].count; i++) {
+		if (jobs[i].done < 0) return -1;
+		total += jobs[i].done;
+		if ((unsigned int)jobs[i].done < jobs[i].count) break;
+	}
+	return total;
+}
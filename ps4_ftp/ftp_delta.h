@@ -0,0 +1,45 @@
+/*
+* rsync style delta updates: block signatures of a file on the console and
+* the instruction stream that rebuilds a new version from it.
+*
+* Signature stream (SITE SIGN, server to client, big endian):
+*   u32 block size, u64 file size, then per block (the last one may be short)
+*   u32 weak checksum, FTPS4_DELTA_STRONG_SIZE bytes strong hash.
+*
+* Weak checksum of bytes x[0..n-1], all sums modulo 2^16:
+*   a = sum x[i], b = sum (n - i) * x[i], weak = a | b << 16
+* which rolls by one byte as a -= out, a += in, b -= n * out, b += a.
+* The strong hash is the start of the block's SHA-256.
+*
+* Delta stream (SITE DELTA, client to server, big endian):
+*   'C' u64 offset u32 length   copy from the current file
+*   'L' u32 length, bytes       literal data
+*   'E' 32 bytes                SHA-256 of the whole new file, ends the stream
+*/
+
+#pragma once
+
+#include <application.h>
+
+#define FTPS4_DELTA_STRONG_SIZE 16
+#define FTPS4_DELTA_DEFAULT_BLOCK (64 * 1024)
+#define FTPS4_DELTA_MIN_BLOCK 1024
+#define FTPS4_DELTA_MAX_BLOCK (4 * 1024 * 1024)
+/* Largest single literal the server accepts */
+#define FTPS4_DELTA_MAX_LITERAL (4 * 1024 * 1024)
+
+#define FTPS4_DELTA_OP_COPY 'C'
+#define FTPS4_DELTA_OP_LITERAL 'L'
+#define FTPS4_DELTA_OP_END 'E'
+
+typedef struct {
+	unsigned int weak;
+	unsigned char strong[FTPS4_DELTA_STRONG_SIZE];
+} ftps4_delta_sig_t;
+
+unsigned int ftps4_delta_weak(const unsigned char *p, unsigned int n);
+
+/* Computes the signatures of count blocks starting at block first of path,
+* split over several threads. Returns the number of blocks done (less at the
+* end of the file) or < 0 on error. */
+int ftps4_delta_signatures(const char *path, unsigned int block_size, unsigned long long first, unsigned int count, ftps4_delta_sig_t *out);
@@ -0,0 +1,45 @@
+/*
+* Directory reading for the modules that walk trees.
+*
+* getdents() wants a buffer of at least the directory's block size. The size
+* is taken once and kept apart from anything the callback does, which is
+* free to stat the entries.
+*/
+
+#include "ftp_dir.h"
+
+int ftps4_dir_read(const char *path, ftps4_dir_func func, void *arg) {
+	struct stat st;
+	struct dirent *dent, *dend;
+	unsigned char *dentbuf;
+	unsigned int dentbufsize;
+	int dfd, dentsize, ret = 0;
+
+	dfd = Sys::open(path, O_RDONLY, 0);
+	if (dfd < 0) return -1;
+	if (Sys::fstat(dfd, &st) < 0 || !S_ISDIR(st.st_mode)) {
+		Sys::close(dfd);
+		return -1;
+	}
+
+	dentbufsize = st.st_blksize;
+	dentbuf = (unsigned char *)malloc(dentbufsize);
+	if (dentbuf == NULL) {
+		Sys::close(dfd);
+		return -1;
+	}
+
+	while (!ret && (dentsize = Sys::getdents(dfd, (char *)dentbuf, dentbufsize)) > 0) {
+		dent = (struct dirent *)dentbuf;
+		dend = (struct dirent *)(&dentbuf[dentsize]);
+
+		for (; !ret && dent < dend && dent->d_reclen; dent = (struct dirent *)((char *)dent + dent->d_reclen)) {
+			if (!dent->d_name[0] || strcmp(dent->d_name, ".") == 0 || strcmp(dent->d_name, "..") == 0) continue;
+			ret = func(arg, dent->d_name, dent->d_type);
+		}
+	}
+
+	Sys::close(dfd);
+	free(dentbuf);
+	return ret;
+}
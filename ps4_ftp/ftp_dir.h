@@ -0,0 +1,16 @@
+/*
+* Directory reading for the modules that walk trees (SITE DU, RMTREE, WATCH,
+* FIND and the HTTP index).
+*/
+
+#pragma once
+
+#include <application.h>
+
+/* Gets every entry but "." and "..", type is its d_type. A nonzero return
+* stops the read and becomes its result. */
+typedef int (*ftps4_dir_func)(void *arg, const char *name, int type);
+
+/* Reads the directory at path, returns < 0 if it can't be opened, otherwise
+* 0 or what func stopped the read with */
+int ftps4_dir_read(const char *path, ftps4_dir_func func, void *arg);
@@ -0,0 +1,403 @@
+/*
+* Recursive disk usage (SITE DU).
+*
+* The caller's thread reads the top directory itself, every subdirectory
+* becomes a work item tagged with the top level child it belongs to. A
+* small pool of workers takes items off a shared stack, stats the entries
+* and pushes the directories it finds. Each child counts the directories of
+* its subtree still pending, when that reaches zero its totals are final and
+* the caller emits them while the walk goes on.
+*
+* Results are cached per path and dropped when a command changes anything
+* at, above or below that path.
+*/
+
+#include "ftp_du.h"
+#include "ftp_dir.h"
+
+typedef struct du_item {
+	struct du_item *next;
+	int child;
+	char path[1];
+} du_item;
+
+typedef struct {
+	char name[PATH_MAXX];
+	unsigned long long bytes;
+	unsigned long long files;
+	unsigned long long dirs;
+	/* Directories of this subtree queued or being scanned */
+	int pending;
+	int emitted;
+} du_child;
+
+typedef struct {
+	ScePthreadMutex mtx;
+	ScePthreadCond cond;
+	du_item *stack;
+	int active;
+	int finished;
+	du_child *children;
+	int num_children;
+	/* Set when a directory was left out for lack of memory */
+	int dropped;
+} du_walk;
+
+typedef struct {
+	char path[PATH_MAXX];
+	/* Result lines, '\n' separated */
+	char *text;
+	unsigned long long time;
+} du_cache_entry;
+
+static du_cache_entry du_cache[FTPS4_DU_CACHE_ENTRIES];
+static ScePthreadMutex du_cache_mtx;
+/* Bumped by every invalidation, a walk that saw it change keeps its result */
+static unsigned int du_cache_gen;
+
+static du_item *du_item_new(const char *path, int child) {
+	size_t len = strlen(path);
+	du_item *item = (du_item *)malloc(sizeof(du_item) + len);
+
+	if (item == NULL) return NULL;
+	memcpy(item->path, path, len + 1);
+	item->child = child;
+	item->next = NULL;
+	return item;
+}
+
+typedef struct {
+	const char *path;
+	unsigned long long *bytes;
+	unsigned long long *files;
+	void (*push)(void *ctx, const char *path, const char *name);
+	void *ctx;
+} du_scan_ctx;
+
+static int du_scan_entry(void *arg, const char *name, int type) {
+	du_scan_ctx *scan = (du_scan_ctx *)arg;
+	char full_path[PATH_MAXX];
+	struct stat st;
+
+#if defined(DT_LNK)
+	/* Links could loop, and what they point to is counted where it lives */
+	if (type == DT_LNK) return 0;
+#else
+	(void)type;
+#endif
+	if ((unsigned int)snprintf(full_path, sizeof(full_path), "%s%s%s",
+		scan->path, scan->path[1] ? "/" : "", name) >= sizeof(full_path)) return 0;
+	if (Sys::stat(full_path, &st) < 0) return 0;
+
+	if (S_ISDIR(st.st_mode)) {
+		scan->push(scan->ctx, full_path, name);
+	} else {
+		*scan->bytes += st.st_size;
+		(*scan->files)++;
+	}
+	return 0;
+}
+
+/* Scans one directory. Files are added to *bytes and *files, directories
+* are handed to push() (child paths are built in a local buffer). */
+static int du_scan(const char *path, unsigned long long *bytes, unsigned long long *files,
+	void (*push)(void *ctx, const char *path, const char *name), void *ctx) {
+	du_scan_ctx scan;
+
+	scan.path = path;
+	scan.bytes = bytes;
+	scan.files = files;
+	scan.push = push;
+	scan.ctx = ctx;
+	return ftps4_dir_read(path, du_scan_entry, &scan) < 0 ? -1 : 0;
+}
+
+typedef struct {
+	du_walk *walk;
+	int child;
+} du_push_ctx;
+
+static void du_push_item(void *arg, const char *path, const char *name) {
+	du_push_ctx *ctx = (du_push_ctx *)arg;
+	du_item *item = du_item_new(path, ctx->child);
+	(void)name;
+
+	scePthreadMutexLock(&ctx->walk->mtx);
+	if (item == NULL) {
+		ctx->walk->dropped = 1;
+		scePthreadMutexUnlock(&ctx->walk->mtx);
+		return;
+	}
+	item->next = ctx->walk->stack;
+	ctx->walk->stack = item;
+	ctx->walk->children[ctx->child].pending++;
+	scePthreadCondSignal(&ctx->walk->cond);
+	scePthreadMutexUnlock(&ctx->walk->mtx);
+}
+
+static void *du_worker(void *arg) {
+	du_walk *walk = (du_walk *)arg;
+	du_item *item;
+	du_push_ctx ctx;
+	unsigned long long bytes, files;
+	du_child *child;
+
+	ctx.walk = walk;
+
+	scePthreadMutexLock(&walk->mtx);
+	while (1) {
+		while (!walk->stack && !walk->finished) scePthreadCondWait(&walk->cond, &walk->mtx);
+		if (!walk->stack) break;
+
+		item = walk->stack;
+		walk->stack = item->next;
+		walk->active++;
+		scePthreadMutexUnlock(&walk->mtx);
+
+		bytes = files = 0;
+		ctx.child = item->child;
+		du_scan(item->path, &bytes, &files, du_push_item, &ctx);
+
+		scePthreadMutexLock(&walk->mtx);
+		child = &walk->children[item->child];
+		child->bytes += bytes;
+		child->files += files;
+		child->dirs++;
+		child->pending--;
+		walk->active--;
+		/* Nothing queued and nobody who could queue more */
+		if (!walk->stack && !walk->active) walk->finished = 1;
+		scePthreadCondBroadcast(&walk->cond);
+		free(item);
+	}
+	scePthreadMutexUnlock(&walk->mtx);
+	return NULL;
+}
+
+typedef struct {
+	du_walk *walk;
+	int cap;
+} du_top_ctx;
+
+/* Subdirectories of the queried path each get their own totals */
+static void du_push_child(void *arg, const char *path, const char *name) {
+	du_top_ctx *ctx = (du_top_ctx *)arg;
+	du_walk *walk = ctx->walk;
+	du_child *children;
+	du_item *item;
+	int cap;
+
+	if (walk->num_children == ctx->cap) {
+		cap = ctx->cap ? ctx->cap * 2 : 32;
+		children = (du_child *)realloc(walk->children, cap * sizeof(du_child));
+		if (children == NULL) {
+			walk->dropped = 1;
+			return;
+		}
+		walk->children = children;
+		ctx->cap = cap;
+	}
+	if ((item = du_item_new(path, walk->num_children)) == NULL) {
+		walk->dropped = 1;
+		return;
+	}
+
+	memset(&walk->children[walk->num_children], 0, sizeof(du_child));
+	snprintf(walk->children[walk->num_children].name, PATH_MAXX, "%s", name);
+	walk->children[walk->num_children].pending = 1;
+	walk->num_children++;
+
+	/* The workers aren't running yet */
+	item->next = walk->stack;
+	walk->stack = item;
+}
+
+/* Sends a line to the caller and appends it to the text kept for the cache */
+static void du_output(char **text, size_t *len, ftps4_du_emit_func emit, void *arg, const char *line) {
+	size_t n = strlen(line);
+	char *grown;
+
+	emit(arg, line);
+	if (*text == NULL && *len) return;
+	grown = (char *)realloc(*text, *len + n + 2);
+	if (grown == NULL) {
+		/* Not cached then, the result is still complete */
+		free(*text);
+		*text = NULL;
+		*len = 1;
+		return;
+	}
+	*text = grown;
+	memcpy(*text + *len, line, n);
+	(*text)[*len + n] = '\n';
+	*len += n + 1;
+	(*text)[*len] = '\0';
+}
+
+static int du_cache_lookup(const char *path, ftps4_du_emit_func emit, void *arg) {
+	unsigned long long now = sceKernelGetProcessTime();
+	char *text = NULL, *line, *eol;
+	int i;
+
+	scePthreadMutexLock(&du_cache_mtx);
+	for (i = 0; i < FTPS4_DU_CACHE_ENTRIES; i++) {
+		du_cache_entry *e = &du_cache[i];
+		if (!e->text || strcmp(e->path, path) != 0) continue;
+		if (now - e->time > (unsigned long long)FTPS4_DU_CACHE_TTL * 1000 * 1000) break;
+		text = strdup(e->text);
+		break;
+	}
+	scePthreadMutexUnlock(&du_cache_mtx);
+
+	if (text == NULL) return -1;
+	for (line = text; (eol = strchr(line, '\n')); line = eol + 1) {
+		*eol = '\0';
+		emit(arg, line);
+	}
+	free(text);
+	return 0;
+}
+
+/* Keeps text for path unless something was invalidated since gen */
+static void du_cache_store(const char *path, char *text, unsigned int gen) {
+	du_cache_entry *victim = &du_cache[0];
+	int i;
+
+	scePthreadMutexLock(&du_cache_mtx);
+	if (du_cache_gen != gen) {
+		scePthreadMutexUnlock(&du_cache_mtx);
+		free(text);
+		return;
+	}
+	for (i = 0; i < FTPS4_DU_CACHE_ENTRIES; i++) {
+		du_cache_entry *e = &du_cache[i];
+		if (e->text && strcmp(e->path, path) == 0) {
+			victim = e;
+			break;
+		}
+		if (!e->text || e->time < victim->time) victim = e;
+	}
+	free(victim->text);
+	snprintf(victim->path, sizeof(victim->path), "%s", path);
+	victim->text = text;
+	victim->time = sceKernelGetProcessTime();
+	scePthreadMutexUnlock(&du_cache_mtx);
+}
+
+int ftps4_du_run(const char *path, ftps4_du_emit_func emit, void *arg) {
+	du_walk walk;
+	du_top_ctx top;
+	ScePthread thids[FTPS4_DU_WORKERS];
+	int started[FTPS4_DU_WORKERS];
+	unsigned long long bytes = 0, files = 0, dirs = 0;
+	char line[PATH_MAXX + 96];
+	char *text = NULL;
+	size_t text_len = 0;
+	unsigned int gen;
+	int i, next = 0;
+
+	if (du_cache_lookup(path, emit, arg) == 0) return 0;
+
+	/* Changes made from here on may or may not be in the result */
+	scePthreadMutexLock(&du_cache_mtx);
+	gen = du_cache_gen;
+	scePthreadMutexUnlock(&du_cache_mtx);
+
+	memset(&walk, 0, sizeof(walk));
+	top.walk = &walk;
+	top.cap = 0;
+	if (du_scan(path, &bytes, &files, du_push_child, &top) < 0) {
+		free(walk.children);
+		return -1;
+	}
+
+	scePthreadMutexInit(&walk.mtx, NULL, "FTPS4_du_mutex");
+	scePthreadCondInit(&walk.cond, NULL, "FTPS4_du_cond");
+	walk.finished = walk.stack == NULL;
+
+	for (i = 0; i < FTPS4_DU_WORKERS; i++)
+		started[i] = scePthreadCreate(&thids[i], NULL, du_worker, &walk, "FTPS4_du_thread") >= 0;
+	/* Not even one worker, do the walk here */
+	for (i = 0; i < FTPS4_DU_WORKERS && !started[i]; i++);
+	if (i == FTPS4_DU_WORKERS) du_worker(&walk);
+
+	/* Children are reported in the order they are done */
+	scePthreadMutexLock(&walk.mtx);
+	while (next < walk.num_children) {
+		for (i = 0; i < walk.num_children; i++) {
+			du_child *c = &walk.children[i];
+			if (c->emitted || c->pending) continue;
+			c->emitted = 1;
+			next++;
+			snprintf(line, sizeof(line), "%llu %llu %llu %s", c->bytes, c->files, c->dirs, c->name);
+			scePthreadMutexUnlock(&walk.mtx);
+			du_output(&text, &text_len, emit, arg, line);
+			scePthreadMutexLock(&walk.mtx);
+		}
+		if (next < walk.num_children) scePthreadCondWait(&walk.cond, &walk.mtx);
+	}
+	scePthreadMutexUnlock(&walk.mtx);
+
+	for (i = 0; i < FTPS4_DU_WORKERS; i++) {
+		if (started[i]) scePthreadJoin(thids[i], NULL);
+	}
+
+	for (i = 0; i < walk.num_children; i++) {
+		bytes += walk.children[i].bytes;
+		files += walk.children[i].files;
+		dirs += walk.children[i].dirs;
+	}
+	/* An incomplete walk has no total and isn't kept */
+	if (!walk.dropped) {
+		snprintf(line, sizeof(line), "%llu %llu %llu", bytes, files, dirs);
+		du_output(&text, &text_len, emit, arg, line);
+		if (text) du_cache_store(path, text, gen);
+	} else {
+		free(text);
+	}
+
+	scePthreadCondDestroy(&walk.cond);
+	scePthreadMutexDestroy(&walk.mtx);
+	free(walk.children);
+	return walk.dropped ? -2 : 0;
+}
+
+/* Non zero when a is b or one of its parent directories */
+static int du_path_within(const char *a, const char *b) {
+	size_t len = strlen(a);
+	if (len == 1) return 1;
+	return strncmp(a, b, len) == 0 && (b[len] == '\0' || b[len] == '/');
+}
+
+void ftps4_du_invalidate(const char *path) {
+	int i;
+
+	scePthreadMutexLock(&du_cache_mtx);
+	du_cache_gen++;
+	for (i = 0; i < FTPS4_DU_CACHE_ENTRIES; i++) {
+		du_cache_entry *e = &du_cache[i];
+		if (!e->text) continue;
+		/* Totals of every parent change, and so does anything below a moved or removed directory */
+		if (du_path_within(e->path, path) || du_path_within(path, e->path)) {
+			free(e->text);
+			e->text = NULL;
+		}
+	}
+	scePthreadMutexUnlock(&du_cache_mtx);
+}
+
+void ftps4_du_init() {
+	memset(du_cache, 0, sizeof(du_cache));
+	du_cache_gen = 0;
+	scePthreadMutexInit(&du_cache_mtx, NULL, "FTPS4_du_cache_mutex");
+}
+
+void ftps4_du_fini() {
+	int i;
+
+	for (i = 0; i < FTPS4_DU_CACHE_ENTRIES; i++) {
+		free(du_cache[i].text);
+		du_cache[i].text = NULL;
+	}
+	scePthreadMutexDestroy(&du_cache_mtx);
+}
@@ -0,0 +1,30 @@
+/*
+* Recursive disk usage (SITE DU).
+*/
+
+#pragma once
+
+#include <application.h>
+#include "ftp_path.h"
+
+/* Directories scanned in parallel per query */
+#define FTPS4_DU_WORKERS 4
+/* Results kept for repeated queries */
+#define FTPS4_DU_CACHE_ENTRIES 16
+/* Changes made behind the server's back show up after this many seconds */
+#define FTPS4_DU_CACHE_TTL (5 * 60)
+
+/* Gets one line of the result (no line end) as soon as it is known */
+typedef void (*ftps4_du_emit_func)(void *arg, const char *line);
+
+void ftps4_du_init();
+void ftps4_du_fini();
+
+/* Walks path (canonical), emitting "<bytes> <files> <dirs> <name>" for
+* each subdirectory as its subtree is done and "<bytes> <files> <dirs>"
+* for the whole tree last. Returns -1 if path can't be read, -2 if
+* directories had to be left out for lack of memory (there is no total
+* then). */
+int ftps4_du_run(const char *path, ftps4_du_emit_func emit, void *arg);
+/* Forgets cached results that path (canonical) being changed makes stale */
+void ftps4_du_invalidate(const char *path);
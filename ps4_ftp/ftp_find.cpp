@@ -0,0 +1,800 @@
+/*
+* Filename index for SITE FIND.
+*
+* Every file and directory is a node of 8 bytes: its parent node and the
+* id of its name. Names are interned, so the many sce_sys, param.sfo and
+* icon0.png of a game library are stored once, and a query only matches
+* each distinct name once before it goes over the nodes, building the
+* path of the hits alone. Each name also has a signature of the characters
+* in it, most names are ruled out by that without reading them. Two hash
+* tables (open addressing, linear probing) find names by text and nodes by
+* parent and name for the updates.
+*
+* Removed entries are only marked dead (a node whose ancestor is dead is
+* gone as well), the space comes back with the next rebuild, which is made
+* aside and swapped in once complete. Queries hold a reference to the
+* index they search so a swap doesn't pull it from under them.
+*/
+
+#include "ftp_find.h"
+#include "ftp_dir.h"
+#include "ftp_log.h"
+
+/* Matches gathered under the lock before they are passed on */
+#define FIND_BATCH 64
+/* Nodes a query looks at per lock hold, the builder gets in between */
+#define FIND_SCAN_STEP (64 * 1024)
+/* The builder pauses briefly every so many directories */
+#define FIND_PAUSE_EVERY 32
+#define FIND_PAUSE (2 * 1000)
+/* Rebuild early once this share of the nodes (and at least FIND_DEAD_MIN) is dead */
+#define FIND_DEAD_SHARE 4
+#define FIND_DEAD_MIN 4096
+#define FIND_MAX_DEPTH 128
+#define FIND_NONE 0xFFFFFFFFu
+
+typedef struct {
+	unsigned int parent;
+	unsigned int name : 29;
+	unsigned int dir : 1;
+	/* Removed, or replaced by a newer node of the same name */
+	unsigned int dead : 1;
+	/* Only leads to a root (like /mnt for /mnt/usb0), not indexed itself */
+	unsigned int lead : 1;
+} find_node;
+
+typedef struct {
+	find_node *nodes;
+	unsigned int count, nodes_cap;
+	/* Name n is the NUL terminated string at pool + name_off[n] */
+	char *pool;
+	unsigned int pool_len, pool_cap;
+	unsigned int *name_off;
+	/* Signature of each name, see find_sig() */
+	unsigned int *name_sig;
+	unsigned int n_names, names_cap, sigs_cap;
+	/* Slots hold an id + 1, 0 is empty. Sizes are powers of two. */
+	unsigned int *name_hash, name_hash_size;
+	unsigned int *node_hash, node_hash_size;
+	/* Directories still to be walked */
+	unsigned int *pending;
+	unsigned int n_pending, pending_cap;
+	unsigned int dead;
+	/* Queries searching it plus one while it is published or being built */
+	int refs;
+	/* Set once the first walk is done */
+	int complete;
+	int truncated;
+	unsigned long long built;
+} find_index;
+
+/* A directory read by the builder: type ('d' or 'f') and name, NUL terminated */
+typedef struct {
+	char *buf;
+	unsigned int len, cap;
+} find_list;
+
+typedef struct {
+	const char *pattern;
+	/* The part matched against names, the last component for path patterns */
+	const char *name;
+	char lower[PATH_MAXX];
+	size_t lower_len;
+	/* Characters any matching name has */
+	unsigned int sig;
+	int glob;
+	int path;
+	/* The name part alone can't tell, every node goes to the path check */
+	int all_names;
+} find_query;
+
+static char find_roots[1024];
+static find_index *find_live = NULL;
+static find_index *find_next = NULL;
+static ScePthread find_thid;
+static ScePthreadMutex find_mtx;
+static ScePthreadCond find_cond;
+static int find_running = 0;
+
+static int find_lower(unsigned char c) { return c >= 'A' && c <= 'Z' ? c + ('a' - 'A') : c; }
+
+/* Letters (in either case) have a bit of their own, digits and '.' share
+* one each and everything else the last four */
+static unsigned int find_sig_bit(unsigned char c) {
+	c = (unsigned char)find_lower(c);
+	if (c >= 'a' && c <= 'z') return 1u << (c - 'a');
+	if (c >= '0' && c <= '9') return 1u << 26;
+	if (c == '.') return 1u << 27;
+	return 1u << (28 + (c & 3));
+}
+
+static unsigned int find_sig(const char *s) {
+	unsigned int sig = 0;
+
+	while (*s) sig |= find_sig_bit(*s++);
+	return sig;
+}
+
+/* Matches c against the class whose text starts at *pp (after the '[') and
+* moves *pp past its ']'. Returns -1, leaving *pp alone, if there is no ']'
+* (the '[' is an ordinary character then). */
+static int find_class(const char **pp, char c) {
+	const char *p = *pp;
+	int neg = 0, hit = 0, lo, hi, lc = find_lower(c);
+
+	if (*p == '!' || *p == '^') {
+		neg = 1;
+		p++;
+	}
+	/* A ']' right at the start is part of the set */
+	if (*p == ']') {
+		hit = c == ']';
+		p++;
+	}
+	while (*p && *p != ']') {
+		lo = find_lower(*p);
+		if (p[1] == '-' && p[2] && p[2] != ']') {
+			hi = find_lower(p[2]);
+			p += 3;
+		} else {
+			hi = lo;
+			p++;
+		}
+		if (lc >= lo && lc <= hi) hit = 1;
+	}
+	if (*p != ']') return -1;
+	*pp = p + 1;
+	return hit != neg;
+}
+
+/* Glob match ignoring case, with path set a '*' or '?' doesn't match '/' */
+static int find_glob(const char *p, const char *s, int path) {
+	const char *star_p = NULL, *star_s = NULL, *next;
+	int m;
+
+	while (*s) {
+		if (*p == '*') {
+			while (*p == '*') p++;
+			star_p = p;
+			star_s = s;
+			continue;
+		}
+
+		next = p + 1;
+		if (*p == '?') m = !path || *s != '/';
+		else if (*p == '[' && (m = find_class(&next, *s)) >= 0) m = m && (!path || *s != '/');
+		else m = *p && find_lower(*p) == find_lower(*s);
+
+		if (m) {
+			p = next;
+			s++;
+			continue;
+		}
+		/* Let the last '*' take one more character, within its component for paths */
+		if (!star_p || (path && *star_s == '/')) return 0;
+		p = star_p;
+		s = ++star_s;
+	}
+	while (*p == '*') p++;
+	return *p == '\0';
+}
+
+static int find_contains(const char *s, const char *lower, size_t len) {
+	char first = lower[0], upper = first >= 'a' && first <= 'z' ? first - ('a' - 'A') : first;
+	size_t i;
+
+	if (len == 0) return 1;
+	for (;; s++) {
+		/* Only positions starting like lower get compared */
+		while (*s != first && *s != upper && *s) s++;
+		if (!*s) return 0;
+		for (i = 1; i < len && find_lower(s[i]) == (unsigned char)lower[i]; i++);
+		if (i == len) return 1;
+	}
+}
+
+/* Signature of the characters every name matching the glob p has */
+static unsigned int find_glob_sig(const char *p) {
+	unsigned int sig = 0;
+	const char *next;
+
+	while (*p) {
+		next = p + 1;
+		if (*p == '*' || *p == '?') p++;
+		else if (*p == '[' && find_class(&next, '\0') >= 0) p = next;
+		else sig |= find_sig_bit(*p++);
+	}
+	return sig;
+}
+
+static void find_query_init(find_query *q, const char *pattern) {
+	size_t i;
+
+	q->pattern = pattern;
+	q->glob = strpbrk(pattern, "*?[") != NULL;
+	q->path = strchr(pattern, '/') != NULL;
+	q->name = q->path ? strrchr(pattern, '/') + 1 : pattern;
+	/* A substring may span components, and an empty last component says nothing */
+	q->all_names = q->path && (!q->glob || !q->name[0]);
+	q->sig = q->all_names ? 0 : q->glob ? find_glob_sig(q->name) : find_sig(pattern);
+
+	for (i = 0; pattern[i] && i < sizeof(q->lower) - 1; i++) q->lower[i] = (char)find_lower(pattern[i]);
+	q->lower[i] = '\0';
+	q->lower_len = i;
+}
+
+static int find_name_match(const find_query *q, const char *name, unsigned int sig) {
+	if ((sig & q->sig) != q->sig) return 0;
+	if (q->all_names) return 1;
+	if (q->path) return find_glob(q->name, name, 1);
+	if (q->glob) return find_glob(q->pattern, name, 0);
+	return find_contains(name, q->lower, q->lower_len);
+}
+
+static int find_path_match(const find_query *q, const char *path) {
+	if (!q->path) return 1;
+	if (q->glob) return find_glob(q->pattern, path, 1);
+	return find_contains(path, q->lower, q->lower_len);
+}
+
+static unsigned int find_hash_str(const char *s) {
+	unsigned int h = 2166136261u;
+
+	while (*s) h = (h ^ (unsigned char)*s++) * 16777619u;
+	return h;
+}
+
+static unsigned int find_hash_node(unsigned int parent, unsigned int name) {
+	unsigned int h = parent * 0x9E3779B1u ^ name * 0x85EBCA6Bu;
+
+	return h ^ (h >> 15);
+}
+
+/* Makes room for n more elements of size in *p, returns < 0 without memory */
+static int find_reserve(void **p, unsigned int *cap, unsigned int used, unsigned int n, size_t size) {
+	unsigned int new_cap = *cap ? *cap : 1024;
+	void *grown;
+
+	if (used + n <= *cap) return 0;
+	while (new_cap < used + n) new_cap *= 2;
+	if ((grown = realloc(*p, (size_t)new_cap * size)) == NULL) return -1;
+	*p = grown;
+	*cap = new_cap;
+	return 0;
+}
+
+static unsigned int *find_name_slot(find_index *idx, const char *name) {
+	unsigned int mask = idx->name_hash_size - 1, h = find_hash_str(name) & mask, v;
+
+	while ((v = idx->name_hash[h]) != 0 && strcmp(idx->pool + idx->name_off[v - 1], name) != 0) h = (h + 1) & mask;
+	return &idx->name_hash[h];
+}
+
+static unsigned int *find_node_slot(find_index *idx, unsigned int parent, unsigned int name) {
+	unsigned int mask = idx->node_hash_size - 1, h = find_hash_node(parent, name) & mask, v;
+
+	while ((v = idx->node_hash[h]) != 0 && (idx->nodes[v - 1].parent != parent || idx->nodes[v - 1].name != name))
+		h = (h + 1) & mask;
+	return &idx->node_hash[h];
+}
+
+/* Doubles a hash table once it is half full, key gives the hash of an id */
+static int find_rehash(find_index *idx, unsigned int **table, unsigned int *size, unsigned int used, int names) {
+	unsigned int *old = *table, old_size = *size, i, h, mask;
+	const find_node *n;
+
+	if ((used + 1) * 2 <= old_size) return 0;
+	if ((*table = (unsigned int *)calloc(old_size * 2, sizeof(**table))) == NULL) {
+		*table = old;
+		return -1;
+	}
+	*size = old_size * 2;
+	mask = *size - 1;
+
+	for (i = 0; i < old_size; i++) {
+		if (!old[i]) continue;
+		if (names) {
+			h = find_hash_str(idx->pool + idx->name_off[old[i] - 1]);
+		} else {
+			n = &idx->nodes[old[i] - 1];
+			h = find_hash_node(n->parent, n->name);
+		}
+		for (h &= mask; (*table)[h]; h = (h + 1) & mask);
+		(*table)[h] = old[i];
+	}
+	free(old);
+	return 0;
+}
+
+/* Id of name, interned if insert is set, FIND_NONE if it isn't there (or no memory) */
+static unsigned int find_intern(find_index *idx, const char *name, int insert) {
+	unsigned int *slot = find_name_slot(idx, name);
+	unsigned int len = strlen(name) + 1;
+
+	if (*slot) return *slot - 1;
+	if (!insert) return FIND_NONE;
+
+	if (find_rehash(idx, &idx->name_hash, &idx->name_hash_size, idx->n_names, 1) < 0 ||
+		find_reserve((void **)&idx->pool, &idx->pool_cap, idx->pool_len, len, 1) < 0 ||
+		find_reserve((void **)&idx->name_off, &idx->names_cap, idx->n_names, 1, sizeof(*idx->name_off)) < 0 ||
+		find_reserve((void **)&idx->name_sig, &idx->sigs_cap, idx->n_names, 1, sizeof(*idx->name_sig)) < 0)
+		return FIND_NONE;
+
+	memcpy(idx->pool + idx->pool_len, name, len);
+	idx->name_off[idx->n_names] = idx->pool_len;
+	idx->name_sig[idx->n_names] = find_sig(name);
+	idx->pool_len += len;
+	*find_name_slot(idx, name) = idx->n_names + 1;
+	return idx->n_names++;
+}
+
+/* Live node called name below parent, FIND_NONE if there is none */
+static unsigned int find_lookup(find_index *idx, unsigned int parent, const char *name) {
+	unsigned int id = find_intern(idx, name, 0), v;
+
+	if (id == FIND_NONE) return FIND_NONE;
+	v = *find_node_slot(idx, parent, id);
+	return v && !idx->nodes[v - 1].dead ? v - 1 : FIND_NONE;
+}
+
+static unsigned int find_resolve(find_index *idx, const char *path) {
+	char name[PATH_MAXX];
+	unsigned int node = 0;
+	const char *end;
+	size_t len;
+
+	while (*path == '/') path++;
+	while (*path && node != FIND_NONE) {
+		end = strchr(path, '/');
+		len = end ? (size_t)(end - path) : strlen(path);
+		if (len >= sizeof(name)) return FIND_NONE;
+		memcpy(name, path, len);
+		name[len] = '\0';
+		node = find_lookup(idx, node, name);
+		path += len;
+		while (*path == '/') path++;
+	}
+	return node;
+}
+
+/* Adds name below parent unless a live node of that kind is there already.
+* A new node replaces whatever had the name before, *added tells if one was made. */
+static unsigned int find_add(find_index *idx, unsigned int parent, const char *name, int dir, int replace, int *added) {
+	unsigned int id, *slot;
+	find_node *n;
+
+	*added = 0;
+	if ((id = find_intern(idx, name, 1)) == FIND_NONE) {
+		idx->truncated = 1;
+		return FIND_NONE;
+	}
+	slot = find_node_slot(idx, parent, id);
+	if (*slot && !replace) {
+		n = &idx->nodes[*slot - 1];
+		if (!n->dead && n->dir == (unsigned int)dir) return *slot - 1;
+	}
+
+	if (idx->count >= FTPS4_FIND_MAX_ENTRIES ||
+		find_rehash(idx, &idx->node_hash, &idx->node_hash_size, idx->count, 0) < 0 ||
+		find_reserve((void **)&idx->nodes, &idx->nodes_cap, idx->count, 1, sizeof(*idx->nodes)) < 0) {
+		idx->truncated = 1;
+		return FIND_NONE;
+	}
+
+	/* The rehash may have moved the slot */
+	slot = find_node_slot(idx, parent, id);
+	if (*slot && !idx->nodes[*slot - 1].dead) {
+		idx->nodes[*slot - 1].dead = 1;
+		idx->dead++;
+	}
+
+	n = &idx->nodes[idx->count];
+	n->parent = parent;
+	n->name = id;
+	n->dir = dir ? 1 : 0;
+	n->dead = 0;
+	n->lead = 0;
+	*slot = idx->count + 1;
+	*added = 1;
+	return idx->count++;
+}
+
+static void find_push(find_index *idx, unsigned int dir) {
+	if (find_reserve((void **)&idx->pending, &idx->pending_cap, idx->n_pending, 1, sizeof(*idx->pending)) < 0) {
+		idx->truncated = 1;
+		return;
+	}
+	idx->pending[idx->n_pending++] = dir;
+}
+
+/* Writes the path of node, returns its length or < 0 if it (or an ancestor) is dead */
+static int find_path(find_index *idx, unsigned int node, char *buf, unsigned int size) {
+	unsigned int chain[FIND_MAX_DEPTH], depth = 0, len = 0, n;
+	const char *name;
+
+	for (; node != 0; node = idx->nodes[node].parent) {
+		if (idx->nodes[node].dead || depth == FIND_MAX_DEPTH) return -1;
+		chain[depth++] = node;
+	}
+	if (depth == 0) {
+		if (size < 2) return -1;
+		strcpy(buf, "/");
+		return 1;
+	}
+
+	while (depth > 0) {
+		name = idx->pool + idx->name_off[idx->nodes[chain[--depth]].name];
+		n = strlen(name);
+		if (len + 1 + n >= size) return -1;
+		buf[len++] = '/';
+		memcpy(buf + len, name, n);
+		len += n;
+	}
+	buf[len] = '\0';
+	return len;
+}
+
+static void find_index_free(find_index *idx) {
+	free(idx->nodes);
+	free(idx->pool);
+	free(idx->name_off);
+	free(idx->name_sig);
+	free(idx->name_hash);
+	free(idx->node_hash);
+	free(idx->pending);
+	free(idx);
+}
+
+static void find_unref(find_index *idx) {
+	if (--idx->refs == 0) find_index_free(idx);
+}
+
+/* Adds the root at path (canonical) and queues it, its ancestors are leads */
+static void find_add_root(find_index *idx, const char *path) {
+	char name[PATH_MAXX];
+	unsigned int node = 0, child;
+	const char *end;
+	size_t len;
+	int added;
+
+	while (*path == '/') path++;
+	while (*path) {
+		end = strchr(path, '/');
+		len = end ? (size_t)(end - path) : strlen(path);
+		memcpy(name, path, len);
+		name[len] = '\0';
+		path += len;
+		while (*path == '/') path++;
+
+		if ((child = find_lookup(idx, node, name)) == FIND_NONE) {
+			if ((child = find_add(idx, node, name, 1, 0, &added)) == FIND_NONE) return;
+			/* Below an earlier root it is indexed like the rest, and may not have been walked yet */
+			idx->nodes[child].lead = *path != '\0' && idx->nodes[node].lead;
+			if (!idx->nodes[child].lead) find_push(idx, child);
+		} else if (!*path && idx->nodes[child].lead) {
+			/* An ancestor of an earlier root, it gets walked now */
+			idx->nodes[child].lead = 0;
+			find_push(idx, child);
+		} else if (*path == '\0') {
+			/* Under an earlier root, that walk covers it */
+			return;
+		}
+		node = child;
+	}
+}
+
+static find_index *find_index_new(const char *roots) {
+	char root[PATH_MAXX];
+	ftps4_path_t canonical;
+	struct stat st;
+	find_index *idx;
+	const char *end;
+	size_t len;
+
+	if ((idx = (find_index *)calloc(1, sizeof(*idx))) == NULL) return NULL;
+	idx->name_hash_size = idx->node_hash_size = 4096;
+	idx->name_hash = (unsigned int *)calloc(idx->name_hash_size, sizeof(*idx->name_hash));
+	idx->node_hash = (unsigned int *)calloc(idx->node_hash_size, sizeof(*idx->node_hash));
+	if (!idx->name_hash || !idx->node_hash ||
+		find_reserve((void **)&idx->nodes, &idx->nodes_cap, 0, 1, sizeof(*idx->nodes)) < 0 ||
+		find_intern(idx, "", 1) == FIND_NONE) {
+		find_index_free(idx);
+		return NULL;
+	}
+
+	/* Node 0 is "/", it isn't in the node table */
+	memset(&idx->nodes[0], 0, sizeof(idx->nodes[0]));
+	idx->nodes[0].dir = 1;
+	idx->nodes[0].lead = 1;
+	idx->count = 1;
+	idx->refs = 1;
+
+	for (; *roots; roots = end ? end + 1 : roots + len) {
+		end = strchr(roots, ':');
+		len = end ? (size_t)(end - roots) : strlen(roots);
+		if (len == 0 || len >= sizeof(root)) continue;
+		memcpy(root, roots, len);
+		root[len] = '\0';
+
+		/* Drives that aren't plugged in are picked up by a later rebuild */
+		if (ftps4_path_resolve(NULL, root, &canonical) < 0 ||
+			Sys::stat(canonical.path, &st) < 0 || !S_ISDIR(st.st_mode)) continue;
+		if (strcmp(canonical.path, "/") == 0) {
+			idx->nodes[0].lead = 0;
+			find_push(idx, 0);
+		} else {
+			find_add_root(idx, canonical.path);
+		}
+	}
+	return idx;
+}
+
+static void find_list_add(find_list *list, char type, const char *name) {
+	unsigned int len = strlen(name) + 2;
+
+	if (find_reserve((void **)&list->buf, &list->cap, list->len, len, 1) < 0) return;
+	list->buf[list->len] = type;
+	memcpy(list->buf + list->len + 1, name, len - 1);
+	list->len += len;
+}
+
+typedef struct {
+	const char *path;
+	find_list *list;
+} find_read_ctx;
+
+static int find_read_entry(void *arg, const char *name, int type) {
+	find_read_ctx *ctx = (find_read_ctx *)arg;
+	char full_path[PATH_MAXX];
+	struct stat st;
+	int dir;
+
+	if (type == DT_DIR) dir = 1;
+	else if (type != DT_UNKNOWN) dir = 0;
+	else if ((unsigned int)snprintf(full_path, sizeof(full_path), "%s/%s", strcmp(ctx->path, "/") ? ctx->path : "",
+		name) < sizeof(full_path) && Sys::stat(full_path, &st) >= 0) dir = S_ISDIR(st.st_mode);
+	else return 0;
+
+	find_list_add(ctx->list, dir ? 'd' : 'f', name);
+	return 0;
+}
+
+/* Reads the entries of the directory at path, links aren't followed */
+static void find_read_dir(const char *path, find_list *list) {
+	find_read_ctx ctx;
+
+	list->len = 0;
+	ctx.path = path;
+	ctx.list = list;
+	ftps4_dir_read(path, find_read_entry, &ctx);
+}
+
+/* Adds what find_read_dir() found in dir and queues the new subdirectories */
+static void find_add_list(find_index *idx, unsigned int dir, const find_list *list) {
+	const char *e;
+	unsigned int id;
+	int added;
+
+	if (idx->nodes[dir].dead) return;
+	for (e = list->buf; e < list->buf + list->len; e += strlen(e) + 1) {
+		if ((id = find_add(idx, dir, e + 1, e[0] == 'd', 0, &added)) == FIND_NONE) return;
+		if (added && e[0] == 'd') find_push(idx, id);
+	}
+}
+
+static void *find_thread(void *arg) {
+	char path[PATH_MAXX];
+	find_list list = { NULL, 0, 0 };
+	find_index *idx;
+	unsigned long long now, due;
+	unsigned int dir, walked = 0;
+	(void)arg;
+
+	scePthreadMutexLock(&find_mtx);
+	while (find_running) {
+		now = sceKernelGetProcessTime();
+
+		if (find_live == NULL) {
+			/* The first index is searched while it is being built */
+			scePthreadMutexUnlock(&find_mtx);
+			idx = find_index_new(find_roots);
+			scePthreadMutexLock(&find_mtx);
+			if (idx) {
+				idx->built = now;
+				find_live = idx;
+			} else {
+				scePthreadCondTimedwait(&find_cond, &find_mtx, FIND_PAUSE * 1000);
+			}
+			continue;
+		}
+
+		/* A rebuild goes first, the live index only has updates queued */
+		idx = find_next ? find_next : find_live;
+		if (idx->n_pending > 0) {
+			dir = idx->pending[--idx->n_pending];
+			if (find_path(idx, dir, path, sizeof(path)) < 0) continue;
+
+			idx->refs++;
+			scePthreadMutexUnlock(&find_mtx);
+			find_read_dir(path, &list);
+			if (++walked % FIND_PAUSE_EVERY == 0) sceKernelUsleep(FIND_PAUSE);
+			scePthreadMutexLock(&find_mtx);
+			find_add_list(idx, dir, &list);
+			find_unref(idx);
+			continue;
+		}
+
+		if (!idx->complete) {
+			idx->complete = 1;
+			FTPS4_LOG_INFO("Search index: %u entries, %u names%s.\n", idx->count - 1, idx->n_names,
+				idx->truncated ? " (truncated)" : "");
+		}
+		if (find_next) {
+			/* Rebuilt, queries that still search the old one keep it until they are done */
+			find_unref(find_live);
+			find_live = find_next;
+			find_next = NULL;
+			continue;
+		}
+
+		due = find_live->built + FTPS4_FIND_REFRESH;
+		if (now >= due || (find_live->dead >= FIND_DEAD_MIN && find_live->dead > find_live->count / FIND_DEAD_SHARE)) {
+			scePthreadMutexUnlock(&find_mtx);
+			idx = find_index_new(find_roots);
+			scePthreadMutexLock(&find_mtx);
+			if (idx) {
+				idx->built = now;
+				find_next = idx;
+			} else {
+				find_live->built = now;
+			}
+			continue;
+		}
+		scePthreadCondTimedwait(&find_cond, &find_mtx, (unsigned int)(due - now));
+	}
+	scePthreadMutexUnlock(&find_mtx);
+
+	free(list.buf);
+	return NULL;
+}
+
+void ftps4_find_init(const char *roots) {
+	snprintf(find_roots, sizeof(find_roots), "%s", roots ? roots : "");
+	find_live = find_next = NULL;
+	if (!find_roots[0]) return;
+
+	scePthreadMutexInit(&find_mtx, NULL, "FTPS4_find_mutex");
+	scePthreadCondInit(&find_cond, NULL, "FTPS4_find_cond");
+	find_running = 1;
+	if (scePthreadCreate(&find_thid, NULL, find_thread, NULL, "FTPS4_find_thread") < 0) {
+		find_running = 0;
+		scePthreadCondDestroy(&find_cond);
+		scePthreadMutexDestroy(&find_mtx);
+	}
+}
+
+void ftps4_find_fini() {
+	if (!find_running) return;
+
+	scePthreadMutexLock(&find_mtx);
+	find_running = 0;
+	scePthreadCondBroadcast(&find_cond);
+	scePthreadMutexUnlock(&find_mtx);
+	scePthreadJoin(find_thid, NULL);
+
+	if (find_live) find_unref(find_live);
+	if (find_next) find_unref(find_next);
+	find_live = find_next = NULL;
+
+	scePthreadCondDestroy(&find_cond);
+	scePthreadMutexDestroy(&find_mtx);
+}
+
+int ftps4_find_enabled() { return find_running; }
+
+/* dir is < 0 if path is gone, otherwise whether it is a directory */
+static void find_apply(find_index *idx, ftps4_watch_event_t event, const char *path, int dir) {
+	char parent_path[PATH_MAXX];
+	const char *name = strrchr(path, '/');
+	unsigned int parent, node;
+	int added;
+
+	if (name == NULL || name[1] == '\0' || (size_t)(name - path) >= sizeof(parent_path)) return;
+	memcpy(parent_path, path, name - path);
+	parent_path[name - path] = '\0';
+	name++;
+
+	/* Only what is below a root is indexed */
+	parent = find_resolve(idx, parent_path);
+	if (parent == FIND_NONE || idx->nodes[parent].lead) return;
+
+	node = find_lookup(idx, parent, name);
+	if (event == FTPS4_WATCH_DELETED || dir < 0) {
+		if (node != FIND_NONE) {
+			idx->nodes[node].dead = 1;
+			idx->dead++;
+		}
+		return;
+	}
+
+	/* A directory reported as modified lost or got entries nobody listed (SITE RMTREE
+	* stopping half way), it is walked again */
+	if (node != FIND_NONE && idx->nodes[node].dir == (unsigned int)dir && !(dir && event == FTPS4_WATCH_MODIFIED)) return;
+	node = find_add(idx, parent, name, dir, 1, &added);
+	if (node != FIND_NONE && dir) find_push(idx, node);
+}
+
+void ftps4_find_notify(ftps4_watch_event_t event, const char *path) {
+	struct stat st;
+	int dir = -1;
+
+	if (!find_running) return;
+	if (event != FTPS4_WATCH_DELETED && Sys::stat(path, &st) >= 0) dir = S_ISDIR(st.st_mode);
+
+	scePthreadMutexLock(&find_mtx);
+	if (find_live) find_apply(find_live, event, path, dir);
+	if (find_next) find_apply(find_next, event, path, dir);
+	scePthreadCondSignal(&find_cond);
+	scePthreadMutexUnlock(&find_mtx);
+}
+
+int ftps4_find_query(const char *pattern, ftps4_find_emit_func emit, void *arg, ftps4_find_stats_t *stats) {
+	find_query q;
+	find_index *idx;
+	unsigned char *hits = NULL;
+	char *batch;
+	unsigned int i, n_names, node = 1, end, found, j;
+	const find_node *n;
+	int len, stop = 0;
+
+	memset(stats, 0, sizeof(*stats));
+	if (!find_running) return -1;
+	if ((batch = (char *)malloc(FIND_BATCH * PATH_MAXX)) == NULL) return -1;
+	find_query_init(&q, pattern);
+
+	scePthreadMutexLock(&find_mtx);
+	if ((idx = find_live) == NULL) {
+		/* Not even started on the roots */
+		scePthreadMutexUnlock(&find_mtx);
+		free(batch);
+		stats->building = 1;
+		return 0;
+	}
+	idx->refs++;
+
+	/* Every distinct name is matched once, names interned later are matched as they come */
+	n_names = idx->n_names;
+	if ((hits = (unsigned char *)malloc(n_names ? n_names : 1)) != NULL) {
+		for (i = 0; i < n_names; i++) hits[i] = (unsigned char)find_name_match(&q, idx->pool + idx->name_off[i], idx->name_sig[i]);
+	}
+	stats->building = !idx->complete;
+
+	while (!stop && node < idx->count) {
+		end = idx->count - node > FIND_SCAN_STEP ? node + FIND_SCAN_STEP : idx->count;
+		for (found = 0; node < end && found < FIND_BATCH; node++) {
+			n = &idx->nodes[node];
+			if (n->dead || n->lead) continue;
+			if (hits && n->name < n_names ? !hits[n->name] :
+				!find_name_match(&q, idx->pool + idx->name_off[n->name], idx->name_sig[n->name])) continue;
+			if ((len = find_path(idx, node, batch + found * PATH_MAXX, PATH_MAXX)) < 0) continue;
+			if (!find_path_match(&q, batch + found * PATH_MAXX)) continue;
+			found++;
+		}
+		/* Sending may block on the network, the index doesn't wait for it */
+		scePthreadMutexUnlock(&find_mtx);
+		for (j = 0; j < found && !stop; j++) {
+			stats->matches++;
+			stop = emit(arg, batch + j * PATH_MAXX);
+		}
+		scePthreadMutexLock(&find_mtx);
+	}
+
+	stats->entries = idx->count - 1;
+	stats->truncated = idx->truncated;
+	find_unref(idx);
+	scePthreadMutexUnlock(&find_mtx);
+
+	free(hits);
+	free(batch);
+	return 0;
+}
@@ -0,0 +1,46 @@
+/*
+* Filename index for SITE FIND.
+*
+* A background thread walks the indexed roots one directory at a time and
+* queries can use what it has so far. The server's own changes are applied
+* as they happen, anything else changing the roots is picked up by the next
+* rebuild (every FTPS4_FIND_REFRESH, or sooner once many entries are gone).
+*/
+
+#pragma once
+
+#include <application.h>
+#include "ftp_path.h"
+#include "ftp_watch.h"
+
+/* Colon separated directories indexed by default: internal storage and USB drives */
+#define FTPS4_FIND_DEFAULT_ROOTS "/user:/data:/mnt/usb0:/mnt/usb1"
+#define FTPS4_FIND_REFRESH (30 * 60 * 1000 * 1000ULL)
+/* Entries indexed at most, the rest of a bigger tree is left out */
+#define FTPS4_FIND_MAX_ENTRIES (4 * 1024 * 1024)
+
+typedef struct {
+	unsigned int matches;
+	/* Entries in the index that was searched */
+	unsigned int entries;
+	/* Set while the first walk of the roots is still going */
+	int building;
+	/* Set when FTPS4_FIND_MAX_ENTRIES (or memory) cut the index short */
+	int truncated;
+} ftps4_find_stats_t;
+
+/* Gets each matching path, non zero stops the query */
+typedef int (*ftps4_find_emit_func)(void *arg, const char *path);
+
+/* roots is colon separated, empty disables the index */
+void ftps4_find_init(const char *roots);
+void ftps4_find_fini();
+int ftps4_find_enabled();
+
+/* Records a change of path (canonical) made by this server */
+void ftps4_find_notify(ftps4_watch_event_t event, const char *path);
+/* Passes every indexed path matching pattern to emit. A pattern with * ? or
+* [...] is a glob, anything else a substring of the name, both ignore case.
+* Patterns with a '/' are matched against the whole path, a '*' not going
+* past a '/'. Returns < 0 if there is no index. */
+int ftps4_find_query(const char *pattern, ftps4_find_emit_func emit, void *arg, ftps4_find_stats_t *stats);
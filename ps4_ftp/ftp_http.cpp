@@ -0,0 +1,210 @@
+/*
+* HTTP/1.1 request parsing and response helpers for the read-only HTTP
+* frontend.
+*/
+
+#include "ftp_http.h"
+
+static const char *http_days[] = { "Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat" };
+static const char *http_months[] = { "Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec" };
+
+static int http_hex(char c) {
+	if (c >= '0' && c <= '9') return c - '0';
+	if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+	return -1;
+}
+
+/* Case insensitive match of a header name, returns where its value starts */
+static const char *http_header(const char *line, const char *name) {
+	size_t len = strlen(name);
+
+	if (strncasecmp(line, name, len) != 0 || line[len] != ':') return NULL;
+	line += len + 1;
+	while (*line == ' ' || *line == '\t') line++;
+	return line;
+}
+
+/* Non zero if the comma separated header value has token */
+static int http_has_token(const char *value, const char *token) {
+	size_t len = strlen(token);
+
+	while (*value) {
+		while (*value == ' ' || *value == ',') value++;
+		if (strncasecmp(value, token, len) == 0 && (value[len] == '\0' || value[len] == ',' || value[len] == ' ')) return 1;
+		while (*value && *value != ',') value++;
+	}
+	return 0;
+}
+
+/* End of the line starting at p, the head always ends with one */
+static const char *http_eol(const char *p, const char *end) {
+	while (p + 1 < end && !(p[0] == '\r' && p[1] == '\n')) p++;
+	return p;
+}
+
+int ftps4_http_parse_request(const char *buf, unsigned int len, ftps4_http_request_t *req) {
+	char line[256];
+	char path[PATH_MAXX];
+	const char *start = buf, *end = NULL, *p, *eol, *target, *value;
+	unsigned int i, n;
+	int hi, lo, keep_alive = -1;
+	ftps4_path_t resolved;
+
+	/* Blank lines before the request are ignored (RFC 7230 3.5) */
+	while (len >= 2 && buf[0] == '\r' && buf[1] == '\n') {
+		buf += 2;
+		len -= 2;
+	}
+	for (i = 0; i + 3 < len; i++) {
+		if (buf[i] == '\r' && buf[i + 1] == '\n' && buf[i + 2] == '\r' && buf[i + 3] == '\n') {
+			end = buf + i + 4;
+			break;
+		}
+	}
+	if (end == NULL) return len >= FTPS4_HTTP_MAX_HEAD ? -1 : 0;
+
+	memset(req, 0, sizeof(*req));
+
+	/* Request line: method, target and version */
+	eol = http_eol(buf, end);
+	if (eol - buf >= 4 && memcmp(buf, "GET ", 4) == 0) req->method = FTPS4_HTTP_GET;
+	else if (eol - buf >= 5 && memcmp(buf, "HEAD ", 5) == 0) req->method = FTPS4_HTTP_HEAD;
+	else req->method = FTPS4_HTTP_OTHER;
+
+	for (target = buf; target < eol && *target != ' '; target++);
+	if (target++ == eol) return -1;
+	for (p = target; p < eol && *p != ' '; p++);
+	if (eol - p != 9 || memcmp(p, " HTTP/1.", 8) != 0) return -1;
+	/* HTTP/1.1 keeps the connection unless told otherwise, 1.0 the other way round */
+	req->keep_alive = p[8] != '0';
+
+	/* Decode the path part, the query is of no use here */
+	for (i = 0; target < p && *target != '?' && *target != '#'; target++) {
+		if (i + 1 >= sizeof(path)) return -1;
+		if (*target == '%') {
+			if (p - target < 3 || (hi = http_hex(target[1])) < 0 || (lo = http_hex(target[2])) < 0) return -1;
+			path[i] = (char)(hi << 4 | lo);
+			target += 2;
+		} else path[i] = *target;
+		/* A NUL or line end inside a name can't name a file */
+		if (path[i] == '\0' || path[i] == '\r' || path[i] == '\n') return -1;
+		i++;
+	}
+	path[i] = '\0';
+	if (path[0] != '/') return -1;
+	req->trailing_slash = path[i - 1] == '/';
+	if (ftps4_path_resolve(NULL, path, &resolved) < 0) return -1;
+	memcpy(req->path, resolved.path, ftps4_path_len(&resolved) + 1);
+
+	/* Headers, longer ones than line are none of the ones looked at */
+	for (p = eol + 2; p < end - 2; p = eol + 2) {
+		eol = http_eol(p, end);
+		n = eol - p;
+		if (n >= sizeof(line)) continue;
+		memcpy(line, p, n);
+		line[n] = '\0';
+
+		if ((value = http_header(line, "Connection"))) {
+			if (http_has_token(value, "close")) keep_alive = 0;
+			else if (http_has_token(value, "keep-alive")) keep_alive = 1;
+		} else if ((value = http_header(line, "Range"))) {
+			snprintf(req->range, sizeof(req->range), "%s", value);
+		} else if ((value = http_header(line, "Content-Length"))) {
+			if (strtoull(value, NULL, 10) > 0) req->has_body = 1;
+		} else if (http_header(line, "Transfer-Encoding")) {
+			req->has_body = 1;
+		}
+	}
+	if (keep_alive >= 0) req->keep_alive = keep_alive;
+
+	return end - start;
+}
+
+int ftps4_http_parse_range(const char *value, unsigned long long size,
+	unsigned long long *start, unsigned long long *end) {
+	unsigned long long first, last;
+	char *p;
+
+	if (strncmp(value, "bytes=", 6) != 0) return 1;
+	value += 6;
+	/* Several ranges would need a multipart reply, the whole file will do */
+	if (strchr(value, ',')) return 1;
+
+	if (*value == '-') {
+		/* The last N bytes */
+		last = strtoull(value + 1, &p, 10);
+		if (p == value + 1 || *p) return 1;
+		if (last == 0 || size == 0) return -1;
+		*start = last < size ? size - last : 0;
+		*end = size;
+		return 0;
+	}
+
+	first = strtoull(value, &p, 10);
+	if (p == value || *p != '-') return 1;
+	value = p + 1;
+	if (first >= size) return -1;
+	if (*value == '\0') {
+		*start = first;
+		*end = size;
+		return 0;
+	}
+	last = strtoull(value, &p, 10);
+	if (*p || last < first) return 1;
+	*start = first;
+	*end = last < size ? last + 1 : size;
+	return 0;
+}
+
+void ftps4_http_date(time_t t, char *buf, unsigned int size) {
+	struct tm tm;
+
+	gmtime_s(&t, &tm);
+	snprintf(buf, size, "%s, %02d %s %04d %02d:%02d:%02d GMT",
+		http_days[tm.tm_wday], tm.tm_mday, http_months[tm.tm_mon], tm.tm_year + 1900,
+		tm.tm_hour, tm.tm_min, tm.tm_sec);
+}
+
+int ftps4_http_url_encode(const char *name, char *buf, unsigned int size) {
+	static const char hex[] = "0123456789ABCDEF";
+	unsigned int n = 0;
+	unsigned char c;
+
+	for (; (c = (unsigned char)*name); name++) {
+		if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') ||
+			c == '-' || c == '_' || c == '.' || c == '~') {
+			if (n + 1 >= size) return -1;
+			buf[n++] = c;
+		} else {
+			if (n + 3 >= size) return -1;
+			buf[n++] = '%';
+			buf[n++] = hex[c >> 4];
+			buf[n++] = hex[c & 15];
+		}
+	}
+	buf[n] = '\0';
+	return n;
+}
+
+int ftps4_http_html_escape(const char *name, char *buf, unsigned int size) {
+	unsigned int n = 0, len;
+	const char *rep;
+	char c[2] = { 0, 0 };
+
+	for (; *name; name++) {
+		switch (*name) {
+		case '&': rep = "&amp;"; break;
+		case '<': rep = "&lt;"; break;
+		case '>': rep = "&gt;"; break;
+		case '"': rep = "&quot;"; break;
+		default: c[0] = *name; rep = c; break;
+		}
+		len = strlen(rep);
+		if (n + len >= size) return -1;
+		memcpy(buf + n, rep, len);
+		n += len;
+	}
+	buf[n] = '\0';
+	return n;
+}
@@ -0,0 +1,46 @@
+/*
+* HTTP/1.1 request parsing and response helpers for the read-only HTTP
+* frontend. The connections themselves are sessions of the FTP server.
+*/
+
+#pragma once
+
+#include <application.h>
+#include "ftp_path.h"
+
+/* Largest request head (request line and headers) accepted */
+#define FTPS4_HTTP_MAX_HEAD (8 * 1024)
+
+typedef enum {
+	FTPS4_HTTP_GET,
+	FTPS4_HTTP_HEAD,
+	FTPS4_HTTP_OTHER,
+} ftps4_http_method_t;
+
+typedef struct {
+	ftps4_http_method_t method;
+	/* Decoded path of the target, without the query */
+	char path[PATH_MAXX];
+	/* The target ended with '/' */
+	int trailing_slash;
+	int keep_alive;
+	/* Range header value, empty if there was none */
+	char range[64];
+	/* Set when a body follows the head, it isn't read */
+	int has_body;
+} ftps4_http_request_t;
+
+/* Parses the request head at the start of buf. Returns its length once
+* complete, 0 if more is needed and < 0 if it is malformed (or too long). */
+int ftps4_http_parse_request(const char *buf, unsigned int len, ftps4_http_request_t *req);
+/* Applies a Range header value to a file of size bytes, giving [*start, *end).
+* Returns 0 for a range to send, < 0 if it is unsatisfiable and > 0 when
+* the whole file goes out instead (no or an unsupported range). */
+int ftps4_http_parse_range(const char *value, unsigned long long size,
+	unsigned long long *start, unsigned long long *end);
+/* Formats t as an HTTP date (RFC 7231 IMF-fixdate) */
+void ftps4_http_date(time_t t, char *buf, unsigned int size);
+/* Percent-encodes name for a URL path segment, returns < 0 if it doesn't fit */
+int ftps4_http_url_encode(const char *name, char *buf, unsigned int size);
+/* Escapes name for HTML text, returns < 0 if it doesn't fit */
+int ftps4_http_html_escape(const char *name, char *buf, unsigned int size);
@@ -0,0 +1,126 @@
+/*
+* Block aligned file I/O for RETR and STOR.
+*
+* Reads and writes are issued in chunks that are a multiple of the file's
+* st_blksize and start on a block boundary. A REST offset inside a block
+* reads the whole block and skips the head, a STOR at such an offset first
+* writes up to the next boundary. Writes are coalesced from the small
+* pieces the data socket returns into full chunks.
+*/
+
+#include "ftp_io.h"
+
+static unsigned int io_block_size(int fd) {
+	struct stat st;
+	unsigned int blk;
+
+	if (Sys::fstat(fd, &st) < 0 || st.st_blksize <= 0) return FTPS4_IO_DEFAULT_BLOCK;
+	blk = (unsigned int)st.st_blksize;
+	/* Anything odd (not a power of two, huge) gets the default */
+	if (blk < 512 || blk > FTPS4_IO_MAX_BLOCK || (blk & (blk - 1))) return FTPS4_IO_DEFAULT_BLOCK;
+	return blk;
+}
+
+int ftps4_io_init(ftps4_io_t *io, int fd, unsigned int buf_size) {
+	memset(io, 0, sizeof(*io));
+	io->fd = fd;
+	io->blksize = io_block_size(fd);
+
+	io->chunk = buf_size - buf_size % io->blksize;
+	if (io->chunk < io->blksize) io->chunk = io->blksize;
+
+	io->raw = malloc(io->chunk + io->blksize);
+	if (io->raw == NULL) return -1;
+	io->buf = (unsigned char *)(((uintptr_t)io->raw + io->blksize - 1) & ~(uintptr_t)(io->blksize - 1));
+	return 0;
+}
+
+void ftps4_io_fini(ftps4_io_t *io) {
+	free(io->raw);
+	io->raw = NULL;
+	io->buf = NULL;
+}
+
+int ftps4_io_seek_read(ftps4_io_t *io, unsigned long long offset) {
+	io->pos = offset - offset % io->blksize;
+	io->skip = (unsigned int)(offset - io->pos);
+	io->fill = 0;
+	if (Sys::lseek(io->fd, io->pos, SEEK_SET) < 0) return -1;
+
+#if defined(POSIX_FADV_SEQUENTIAL)
+	/* Let the kernel read ahead further than it would on its own */
+	posix_fadvise(io->fd, io->pos, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+	return 0;
+}
+
+int ftps4_io_read(ftps4_io_t *io, const unsigned char **data) {
+	int n;
+
+	io->pos += io->fill;
+	io->fill = 0;
+
+	do {
+		n = Sys::read(io->fd, io->buf, io->chunk);
+		if (n <= 0) return n;
+		/* A resume inside the last block may read nothing past the offset */
+		if ((unsigned int)n <= io->skip) {
+			io->skip -= n;
+			io->pos += n;
+			continue;
+		}
+		break;
+	} while (1);
+
+	io->fill = n;
+	*data = io->buf + io->skip;
+	n -= io->skip;
+	io->skip = 0;
+	return n;
+}
+
+void ftps4_io_begin_write(ftps4_io_t *io, unsigned long long offset, ftps4_sparse_t *sparse) {
+	io->pos = offset;
+	io->fill = 0;
+	io->skip = 0;
+	io->sparse = sparse;
+	/* The first write ends on a boundary, every one after it is aligned */
+	io->limit = io->chunk - (unsigned int)(offset % io->blksize);
+}
+
+unsigned int ftps4_io_space(ftps4_io_t *io, unsigned char **data) {
+	*data = io->buf + io->fill;
+	return io->limit - io->fill;
+}
+
+static int io_write_out(ftps4_io_t *io) {
+	const unsigned char *p = io->buf;
+	unsigned int left = io->fill;
+	int n;
+
+	if (io->sparse) {
+		if (left && ftps4_sparse_write(io->sparse, io->fd, p, left) < 0) return -1;
+	} else {
+		while (left > 0) {
+			n = Sys::write(io->fd, p, left);
+			if (n <= 0) return -1;
+			p += n;
+			left -= n;
+		}
+	}
+
+	io->pos += io->fill;
+	io->fill = 0;
+	io->limit = io->chunk;
+	return 0;
+}
+
+int ftps4_io_commit(ftps4_io_t *io, unsigned int len) {
+	io->fill += len;
+	if (io->fill < io->limit) return 0;
+	return io_write_out(io);
+}
+
+int ftps4_io_flush(ftps4_io_t *io) {
+	return io_write_out(io);
+}
@@ -0,0 +1,50 @@
+/*
+* Block aligned file I/O for RETR and STOR.
+*/
+
+#pragma once
+
+#include <application.h>
+#include "ftp_sparse.h"
+
+/* Used when st_blksize is missing or unusable */
+#define FTPS4_IO_DEFAULT_BLOCK 4096
+#define FTPS4_IO_MAX_BLOCK (1024 * 1024)
+
+typedef struct {
+	int fd;
+	/* Filesystem block size of the file */
+	unsigned int blksize;
+	/* Bytes moved per read or write, a multiple of blksize */
+	unsigned int chunk;
+	/* Aligned to blksize inside raw */
+	unsigned char *buf;
+	void *raw;
+	/* File offset of buf[0] */
+	unsigned long long pos;
+	/* Bytes in buf, for reads the first skip of them are before the requested offset */
+	unsigned int fill;
+	unsigned int skip;
+	/* Fill level at which a write goes out, ends on a block boundary */
+	unsigned int limit;
+	/* Leave zero blocks out of writes when set */
+	ftps4_sparse_t *sparse;
+} ftps4_io_t;
+
+/* Sets io up for fd with a buffer of about buf_size bytes, returns < 0 without memory */
+int ftps4_io_init(ftps4_io_t *io, int fd, unsigned int buf_size);
+void ftps4_io_fini(ftps4_io_t *io);
+
+/* Positions a read at offset, the disk reads themselves start on a block boundary */
+int ftps4_io_seek_read(ftps4_io_t *io, unsigned long long offset);
+/* Reads the next chunk, returns its length (0 at EOF, < 0 on error) and the data in *data */
+int ftps4_io_read(ftps4_io_t *io, const unsigned char **data);
+
+/* Starts writing at offset (where the fd already points) */
+void ftps4_io_begin_write(ftps4_io_t *io, unsigned long long offset, ftps4_sparse_t *sparse);
+/* Room left in the write buffer and where it is */
+unsigned int ftps4_io_space(ftps4_io_t *io, unsigned char **data);
+/* Accounts for len bytes put at the space returned above, writes out full chunks */
+int ftps4_io_commit(ftps4_io_t *io, unsigned int len);
+/* Writes out whatever is still buffered */
+int ftps4_io_flush(ftps4_io_t *io);
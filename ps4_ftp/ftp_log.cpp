@@ -0,0 +1,138 @@
+/*
+* Asynchronous logging for the FTP server.
+*
+* The ring buffer is a bounded multi-producer queue: each slot carries a
+* sequence number that tells producers whether it is free and the flusher
+* whether it is filled. Producers never block, when the ring is full the
+* line is dropped and counted instead of stalling command handling, the
+* flusher reports the count once it has caught up.
+*/
+
+#include <atomic>
+
+#include "ftp_log.h"
+
+#define LOG_RING_SIZE 1024 /* Must be a power of two */
+#define LOG_LINE_SIZE 256
+/* How often the flusher looks for new lines */
+#define LOG_FLUSH_INTERVAL (20 * 1000)
+
+typedef struct {
+	std::atomic<unsigned int> seq;
+	int level;
+	char text[LOG_LINE_SIZE];
+} log_slot;
+
+static log_slot log_ring[LOG_RING_SIZE];
+static std::atomic<unsigned int> log_head;
+static unsigned int log_tail;
+static std::atomic<unsigned int> log_dropped;
+
+static Logger *log_sinks[2];
+static volatile int log_running = 0;
+static ScePthread log_thid;
+
+static int log_pop(int *level, char *text) {
+	log_slot *slot = &log_ring[log_tail & (LOG_RING_SIZE - 1)];
+	unsigned int seq = slot->seq.load(std::memory_order_acquire);
+
+	if ((int)(seq - (log_tail + 1)) < 0) return 0;
+
+	*level = slot->level;
+	memcpy(text, slot->text, LOG_LINE_SIZE);
+	slot->seq.store(log_tail + LOG_RING_SIZE, std::memory_order_release);
+	log_tail++;
+	return 1;
+}
+
+static void log_drain() {
+	char text[LOG_LINE_SIZE];
+	unsigned int dropped;
+	int level;
+
+	while (log_pop(&level, text)) {
+		if (log_sinks[level]) log_sinks[level]->Log("%s", text);
+		if (level == FTPS4_LOG_LEVEL_INFO) Console::WriteLine("%s", text);
+	}
+
+	/* Said where the lines went missing, straight to the sink: the ring may
+	* still be full */
+	dropped = log_dropped.exchange(0, std::memory_order_relaxed);
+	if (dropped) {
+		snprintf(text, sizeof(text), "%u log lines dropped, the log ring was full.\n", dropped);
+		level = log_sinks[FTPS4_LOG_LEVEL_INFO] ? FTPS4_LOG_LEVEL_INFO : FTPS4_LOG_LEVEL_DEBUG;
+		if (log_sinks[level]) log_sinks[level]->Log("%s", text);
+	}
+}
+
+static void *log_thread(void *arg) {
+	(void)arg;
+
+	while (log_running) {
+		log_drain();
+		sceKernelUsleep(LOG_FLUSH_INTERVAL);
+	}
+	log_drain();
+	return NULL;
+}
+
+void ftps4_log_init(Logger *debug, Logger *info) {
+	unsigned int i;
+
+	if (log_running) return;
+
+	for (i = 0; i < LOG_RING_SIZE; i++) {
+		log_ring[i].seq.store(i, std::memory_order_relaxed);
+	}
+	log_head.store(0);
+	log_tail = 0;
+	log_dropped.store(0);
+
+	log_sinks[FTPS4_LOG_LEVEL_DEBUG] = debug;
+	log_sinks[FTPS4_LOG_LEVEL_INFO] = info;
+
+	log_running = 1;
+	scePthreadCreate(&log_thid, NULL, log_thread, NULL, "FTPS4_log_thread");
+}
+
+void ftps4_log_fini() {
+	if (!log_running) return;
+
+	log_running = 0;
+	scePthreadJoin(log_thid, NULL);
+
+	log_sinks[FTPS4_LOG_LEVEL_DEBUG] = NULL;
+	log_sinks[FTPS4_LOG_LEVEL_INFO] = NULL;
+}
+
+int ftps4_log_enabled(int level) { return log_running && log_sinks[level] != NULL; }
+
+void ftps4_log_write(int level, const char *fmt, ...) {
+	va_list args;
+	log_slot *slot;
+	unsigned int pos, seq;
+	int diff;
+
+	pos = log_head.load(std::memory_order_relaxed);
+	for (;;) {
+		slot = &log_ring[pos & (LOG_RING_SIZE - 1)];
+		seq = slot->seq.load(std::memory_order_acquire);
+		diff = (int)(seq - pos);
+		if (diff == 0) {
+			if (log_head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+		} else if (diff < 0) {
+			/* Full, the flusher is behind */
+			log_dropped.fetch_add(1, std::memory_order_relaxed);
+			return;
+		} else {
+			pos = log_head.load(std::memory_order_relaxed);
+		}
+	}
+
+	slot->level = level;
+	va_start(args, fmt);
+	vsnprintf(slot->text, sizeof(slot->text), fmt, args);
+	va_end(args);
+
+	slot->seq.store(pos + 1, std::memory_order_release);
+}
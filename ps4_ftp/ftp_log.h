@@ -0,0 +1,33 @@
+/*
+* Asynchronous logging for the FTP server.
+*
+* Call sites format into a lock-free ring buffer and return, a background
+* thread writes the lines to the Logger sinks (and the console for info).
+* Debug call sites compile to nothing in release builds unless
+* FTPS4_DEBUG_LOG is defined.
+*/
+
+#pragma once
+
+#include <application.h>
+
+#define FTPS4_LOG_LEVEL_DEBUG 0
+#define FTPS4_LOG_LEVEL_INFO 1
+
+/* Sinks may be NULL, which disables that level */
+void ftps4_log_init(Logger *debug, Logger *info);
+/* Flushes everything still queued and stops the flusher thread */
+void ftps4_log_fini();
+
+int ftps4_log_enabled(int level);
+void ftps4_log_write(int level, const char *fmt, ...);
+
+#if defined(NDEBUG) && !defined(FTPS4_DEBUG_LOG)
+#define FTPS4_LOG_DEBUG(...) do { } while (0)
+#else
+#define FTPS4_LOG_DEBUG(...) \
+	do { if (ftps4_log_enabled(FTPS4_LOG_LEVEL_DEBUG)) ftps4_log_write(FTPS4_LOG_LEVEL_DEBUG, __VA_ARGS__); } while (0)
+#endif
+
+#define FTPS4_LOG_INFO(...) \
+	do { if (ftps4_log_enabled(FTPS4_LOG_LEVEL_INFO)) ftps4_log_write(FTPS4_LOG_LEVEL_INFO, __VA_ARGS__); } while (0)
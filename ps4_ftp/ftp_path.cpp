@@ -0,0 +1,76 @@
+/*
+* Canonical paths.
+*
+* Every path a command names goes through ftps4_path_resolve() once, which
+* works on the component form of the session's working directory and copies
+* at most PATH_MAXX - 1 bytes, so nothing further down has to deal with
+* "..", "//" or unterminated buffers.
+*/
+
+#include "ftp_path.h"
+
+static int path_end_of_arg(char c) {
+	return c == '\0' || c == '\r' || c == '\n' || c == '\t';
+}
+
+void ftps4_path_root(ftps4_path_t *p) {
+	p->path[0] = '/';
+	p->path[1] = '\0';
+	p->depth = 0;
+}
+
+int ftps4_path_resolve(const ftps4_path_t *base, const char *arg, ftps4_path_t *out) {
+	ftps4_path_t tmp;
+	const char *comp;
+	unsigned int len, comp_len;
+
+	if (arg[0] == '/' || base == NULL) {
+		ftps4_path_root(&tmp);
+	} else {
+		/* Only the part of base that is actually in use */
+		len = ftps4_path_len(base);
+		memcpy(tmp.path, base->path, len + 1);
+		memcpy(tmp.ends, base->ends, base->depth);
+		tmp.depth = base->depth;
+	}
+	len = ftps4_path_len(&tmp);
+
+	while (!path_end_of_arg(*arg)) {
+		while (*arg == '/') arg++;
+		comp = arg;
+		while (!path_end_of_arg(*arg) && *arg != '/') arg++;
+		comp_len = (unsigned int)(arg - comp);
+
+		if (comp_len == 0 || (comp_len == 1 && comp[0] == '.')) continue;
+
+		if (comp_len == 2 && comp[0] == '.' && comp[1] == '.') {
+			if (tmp.depth) tmp.depth--;
+			len = ftps4_path_len(&tmp);
+			continue;
+		}
+
+		if (tmp.depth == FTPS4_PATH_MAX_DEPTH) return -1;
+		/* The root is "/", every other path gets a separator first */
+		if (tmp.depth) {
+			if (len + 1 + comp_len >= PATH_MAXX) return -1;
+			tmp.path[len++] = '/';
+		} else {
+			if (1 + comp_len >= PATH_MAXX) return -1;
+			len = 1;
+		}
+		memcpy(tmp.path + len, comp, comp_len);
+		len += comp_len;
+		tmp.ends[tmp.depth++] = (unsigned char)len;
+	}
+
+	tmp.path[len] = '\0';
+	memcpy(out->path, tmp.path, len + 1);
+	memcpy(out->ends, tmp.ends, tmp.depth);
+	out->depth = tmp.depth;
+	return 0;
+}
+
+void ftps4_path_up(ftps4_path_t *p) {
+	if (p->depth) p->depth--;
+	p->path[ftps4_path_len(p)] = '\0';
+}
@@ -0,0 +1,35 @@
+/*
+* Canonical paths.
+*/
+
+#pragma once
+
+#include <application.h>
+
+#define PATH_MAXX 255
+/* Deepest path a session can use */
+#define FTPS4_PATH_MAX_DEPTH 32
+
+/* A canonical absolute path: starts with '/', no empty, "." or ".."
+* components and no trailing '/' (except for the root itself), so two
+* spellings of the same location always compare equal. The component ends
+* are kept alongside so resolving relative to it never rescans the string. */
+typedef struct {
+	char path[PATH_MAXX];
+	unsigned char depth;
+	/* ends[i] is the length of the path up to and including component i */
+	unsigned char ends[FTPS4_PATH_MAX_DEPTH];
+} ftps4_path_t;
+
+void ftps4_path_root(ftps4_path_t *p);
+/* Resolves arg (up to the end of line) against base into out. An absolute
+* arg ignores base, ".." never leaves the root. Returns < 0 if the result
+* would be longer than PATH_MAXX - 1 or deeper than FTPS4_PATH_MAX_DEPTH,
+* out is unchanged then. out may be base. */
+int ftps4_path_resolve(const ftps4_path_t *base, const char *arg, ftps4_path_t *out);
+/* Goes to the parent directory */
+void ftps4_path_up(ftps4_path_t *p);
+/* Length of p->path */
+static inline unsigned int ftps4_path_len(const ftps4_path_t *p) {
+	return p->depth ? p->ends[p->depth - 1] : 1;
+}
@@ -0,0 +1,328 @@
+/*
+* Predictive prefetch for mirroring clients.
+*
+* One thread serves every session that is prefetching, a block at a time
+* and in turn, so a session can't take the disk from the others. What it
+* reads goes through ftps4_cache_get() like a RETR would, a RETR of a
+* block that is being prefetched waits for that read instead of issuing
+* its own. Each session has a window of files, from the one after its last
+* RETR for as long as their sizes stay within the budget; the file that
+* crosses it (even the first one) is only read up to the budget. The window
+* only moves when the client asks for the next file.
+*/
+
+#include "ftp_prefetch.h"
+#include "ftp_cache.h"
+#include "ftp_log.h"
+
+/* Sessions streaks start prefetching at */
+#define PREFETCH_MIN_STREAK 2
+
+struct ftps4_prefetch {
+	/* Queue of sessions with something to prefetch */
+	struct ftps4_prefetch *next;
+	int queued;
+	/* Set while the thread reads for this session outside the lock */
+	int busy;
+	/* Changes whenever the window does, a read for an old one is dropped.
+	* Unique across sessions so a freed one can't be mistaken for another. */
+	unsigned int gen;
+	/* The listing: names are NUL separated in one buffer */
+	char dir[PATH_MAXX];
+	char *names;
+	unsigned int names_len;
+	unsigned int names_cap;
+	unsigned int *name_off;
+	unsigned long long *sizes;
+	int count;
+	int cap;
+	/* Listing index of the last RETR, -1 if none, and the in order ones so far */
+	int pos;
+	int streak;
+	/* Window being prefetched, files [cur, last), the offset in cur and
+	* how much of the last file fits in the budget */
+	int cur;
+	int last;
+	unsigned long long cur_off;
+	unsigned long long last_len;
+};
+
+static ScePthreadMutex prefetch_mtx;
+static ScePthreadCond prefetch_cond;
+static ScePthread prefetch_thid;
+static int prefetch_running = 0;
+static unsigned long long prefetch_budget;
+static unsigned int prefetch_gen_seq = 0;
+static ftps4_prefetch_t *prefetch_head = NULL;
+static ftps4_prefetch_t *prefetch_tail = NULL;
+
+/* The prefetch mutex must be held */
+static void prefetch_enqueue(ftps4_prefetch_t *pf) {
+	if (pf->queued) return;
+	pf->next = NULL;
+	if (prefetch_tail) prefetch_tail->next = pf;
+	else prefetch_head = pf;
+	prefetch_tail = pf;
+	pf->queued = 1;
+	scePthreadCondSignal(&prefetch_cond);
+}
+
+/* The prefetch mutex must be held */
+static void prefetch_dequeue(ftps4_prefetch_t *pf) {
+	ftps4_prefetch_t **it;
+
+	if (!pf->queued) return;
+	for (it = &prefetch_head; *it; it = &(*it)->next) {
+		if (*it == pf) {
+			*it = pf->next;
+			break;
+		}
+	}
+	prefetch_tail = NULL;
+	for (it = &prefetch_head; *it; it = &(*it)->next) prefetch_tail = *it;
+	pf->queued = 0;
+}
+
+/* The prefetch mutex must be held */
+static void prefetch_stop(ftps4_prefetch_t *pf) {
+	prefetch_dequeue(pf);
+	pf->gen = ++prefetch_gen_seq;
+	pf->cur = pf->last = 0;
+	pf->cur_off = 0;
+	pf->last_len = 0;
+}
+
+static void *prefetch_thread(void *arg) {
+	ftps4_prefetch_t *pf;
+	char path[PATH_MAXX];
+	ftps4_cache_key_t key;
+	const ftps4_cache_block_t *blk;
+	struct stat st;
+	unsigned long long offset, end;
+	unsigned int gen;
+	int cur, fd = -1, ok;
+	/* The file fd is open on, by session, window and index */
+	ftps4_prefetch_t *fd_pf = NULL;
+	unsigned int fd_gen = 0;
+	int fd_cur = -1;
+	(void)arg;
+
+	scePthreadMutexLock(&prefetch_mtx);
+	while (1) {
+		if (!prefetch_head && fd >= 0) {
+			/* Idle, don't keep a file open that may be deleted */
+			Sys::close(fd);
+			fd = -1;
+		}
+		while (prefetch_running && !prefetch_head) scePthreadCondWait(&prefetch_cond, &prefetch_mtx);
+		if (!prefetch_running) break;
+
+		pf = prefetch_head;
+		prefetch_dequeue(pf);
+		if (pf->cur >= pf->last) continue;
+
+		cur = pf->cur;
+		offset = pf->cur_off;
+		/* Where the budget ends in the last file, the others are read whole */
+		end = cur == pf->last - 1 ? pf->last_len : ~0ULL;
+		gen = pf->gen;
+		snprintf(path, sizeof(path), "%s%s%s", pf->dir, pf->dir[1] ? "/" : "", pf->names + pf->name_off[cur]);
+		pf->busy = 1;
+		scePthreadMutexUnlock(&prefetch_mtx);
+
+		if (fd >= 0 && (fd_pf != pf || fd_gen != gen || fd_cur != cur)) {
+			Sys::close(fd);
+			fd = -1;
+		}
+		ok = 0;
+		if (fd < 0 && Sys::stat(path, &st) >= 0 && S_ISREG(st.st_mode) && (fd = Sys::open(path, O_RDONLY, 0)) >= 0) {
+			ftps4_cache_key_from_stat(&key, &st);
+			fd_pf = pf;
+			fd_gen = gen;
+			fd_cur = cur;
+		}
+		if (fd >= 0 && end > key.size) end = key.size;
+		if (fd >= 0 && offset < end) {
+			/* A hit costs nothing, blocks a RETR already pulled in are skipped over */
+			blk = ftps4_cache_get(&key, offset, fd);
+			if (blk) {
+				offset = blk->offset + blk->len;
+				ftps4_cache_put(blk);
+				ok = 1;
+			}
+		}
+
+		scePthreadMutexLock(&prefetch_mtx);
+		pf->busy = 0;
+		scePthreadCondBroadcast(&prefetch_cond);
+		if (pf->gen != gen) continue;
+
+		if (ok && offset < end) {
+			pf->cur_off = offset;
+		} else {
+			/* Done with this file, or it can't be read (or cached) at all */
+			if (!ok && fd >= 0 && offset < end) FTPS4_LOG_DEBUG("Prefetch of %s stopped at %llu\n", path, offset);
+			pf->cur++;
+			pf->cur_off = 0;
+		}
+		if (pf->cur < pf->last) prefetch_enqueue(pf);
+	}
+	scePthreadMutexUnlock(&prefetch_mtx);
+
+	if (fd >= 0) Sys::close(fd);
+	return NULL;
+}
+
+void ftps4_prefetch_init(unsigned long long budget) {
+	prefetch_head = prefetch_tail = NULL;
+	prefetch_budget = budget;
+	if (!budget || !ftps4_cache_enabled()) return;
+
+	scePthreadMutexInit(&prefetch_mtx, NULL, "FTPS4_prefetch_mutex");
+	scePthreadCondInit(&prefetch_cond, NULL, "FTPS4_prefetch_cond");
+	prefetch_running = 1;
+	if (scePthreadCreate(&prefetch_thid, NULL, prefetch_thread, NULL, "FTPS4_prefetch_thread") < 0) {
+		prefetch_running = 0;
+		scePthreadCondDestroy(&prefetch_cond);
+		scePthreadMutexDestroy(&prefetch_mtx);
+	}
+}
+
+void ftps4_prefetch_fini() {
+	if (!prefetch_running) return;
+
+	scePthreadMutexLock(&prefetch_mtx);
+	prefetch_running = 0;
+	scePthreadCondBroadcast(&prefetch_cond);
+	scePthreadMutexUnlock(&prefetch_mtx);
+	scePthreadJoin(prefetch_thid, NULL);
+
+	scePthreadCondDestroy(&prefetch_cond);
+	scePthreadMutexDestroy(&prefetch_mtx);
+}
+
+void ftps4_prefetch_list_begin(ftps4_prefetch_t **pf, const char *dir) {
+	ftps4_prefetch_t *p = *pf;
+
+	if (!prefetch_running) return;
+	if (p == NULL) {
+		if ((p = (ftps4_prefetch_t *)calloc(1, sizeof(*p))) == NULL) return;
+		*pf = p;
+	}
+
+	scePthreadMutexLock(&prefetch_mtx);
+	prefetch_stop(p);
+	snprintf(p->dir, sizeof(p->dir), "%s", dir);
+	p->names_len = 0;
+	p->count = 0;
+	p->pos = -1;
+	p->streak = 0;
+	scePthreadMutexUnlock(&prefetch_mtx);
+}
+
+void ftps4_prefetch_list_add(ftps4_prefetch_t *pf, const char *name, unsigned long long size) {
+	unsigned int len = strlen(name) + 1;
+	unsigned int names_cap, *name_off;
+	unsigned long long *sizes;
+	char *names;
+	int cap;
+
+	if (!prefetch_running || pf == NULL || pf->count >= FTPS4_PREFETCH_MAX_FILES) return;
+
+	/* Only the session's own thread touches the listing while nothing is queued */
+	if (pf->count == pf->cap) {
+		cap = pf->cap ? pf->cap * 2 : 64;
+		if ((name_off = (unsigned int *)realloc(pf->name_off, cap * sizeof(*name_off))) == NULL) return;
+		pf->name_off = name_off;
+		if ((sizes = (unsigned long long *)realloc(pf->sizes, cap * sizeof(*sizes))) == NULL) return;
+		pf->sizes = sizes;
+		pf->cap = cap;
+	}
+	if (pf->names_len + len > pf->names_cap) {
+		names_cap = pf->names_cap ? pf->names_cap * 2 : 4096;
+		while (names_cap < pf->names_len + len) names_cap *= 2;
+		if ((names = (char *)realloc(pf->names, names_cap)) == NULL) return;
+		pf->names = names;
+		pf->names_cap = names_cap;
+	}
+
+	memcpy(pf->names + pf->names_len, name, len);
+	pf->name_off[pf->count] = pf->names_len;
+	pf->sizes[pf->count] = size;
+	pf->names_len += len;
+	pf->count++;
+}
+
+void ftps4_prefetch_retr(ftps4_prefetch_t *pf, const char *path) {
+	const char *name = strrchr(path, '/');
+	unsigned int dir_len;
+	unsigned long long ahead;
+	int i;
+
+	if (!prefetch_running || pf == NULL || name == NULL) return;
+	dir_len = name == path ? 1 : name - path;
+	name++;
+
+	scePthreadMutexLock(&prefetch_mtx);
+
+	/* Where this file is in the listing, only going forward counts */
+	i = -1;
+	if (strlen(pf->dir) == dir_len && strncmp(pf->dir, path, dir_len) == 0) {
+		for (i = pf->pos + 1; i < pf->count; i++) {
+			if (strcmp(pf->names + pf->name_off[i], name) == 0) break;
+		}
+		if (i == pf->count) i = -1;
+	}
+
+	if (i < 0) {
+		/* Not what the listing predicted, maybe a new run starts later */
+		if (pf->streak >= PREFETCH_MIN_STREAK) FTPS4_LOG_DEBUG("Prefetch stopped, %s is out of order\n", path);
+		prefetch_stop(pf);
+		pf->streak = 0;
+		scePthreadMutexUnlock(&prefetch_mtx);
+		return;
+	}
+
+	pf->pos = i;
+	pf->streak++;
+	if (pf->streak >= PREFETCH_MIN_STREAK) {
+		/* Move the window on, files already prefetched are cache hits */
+		prefetch_stop(pf);
+		pf->cur = i + 1;
+		for (pf->last = pf->cur, ahead = 0; pf->last < pf->count && ahead < prefetch_budget; ahead += pf->last_len) {
+			pf->last_len = pf->sizes[pf->last] < prefetch_budget - ahead ? pf->sizes[pf->last] : prefetch_budget - ahead;
+			pf->last++;
+		}
+		if (pf->cur < pf->last) prefetch_enqueue(pf);
+	}
+
+	scePthreadMutexUnlock(&prefetch_mtx);
+}
+
+void ftps4_prefetch_cancel(ftps4_prefetch_t *pf) {
+	if (!prefetch_running || pf == NULL) return;
+
+	scePthreadMutexLock(&prefetch_mtx);
+	prefetch_stop(pf);
+	pf->streak = 0;
+	scePthreadMutexUnlock(&prefetch_mtx);
+}
+
+void ftps4_prefetch_end(ftps4_prefetch_t **pf) {
+	ftps4_prefetch_t *p = *pf;
+
+	if (p == NULL) return;
+	*pf = NULL;
+
+	if (prefetch_running) {
+		scePthreadMutexLock(&prefetch_mtx);
+		prefetch_stop(p);
+		while (p->busy) scePthreadCondWait(&prefetch_cond, &prefetch_mtx);
+		scePthreadMutexUnlock(&prefetch_mtx);
+	}
+
+	free(p->names);
+	free(p->name_off);
+	free(p->sizes);
+	free(p);
+}
@@ -0,0 +1,35 @@
+/*
+* Predictive prefetch for mirroring clients.
+*
+* A session remembers the regular files of the last directory it listed.
+* Once it has fetched two of them in listing order, a background thread
+* reads the files that come next into the block cache, up to a byte budget
+* ahead of the client. Any RETR out of that order, a new listing or an
+* upload stops it.
+*/
+
+#pragma once
+
+#include <application.h>
+#include "ftp_path.h"
+
+#define FTPS4_PREFETCH_DEFAULT_BUDGET (8 * 1024 * 1024)
+/* Files of a listing that are remembered, later ones are never prefetched */
+#define FTPS4_PREFETCH_MAX_FILES 4096
+
+typedef struct ftps4_prefetch ftps4_prefetch_t;
+
+/* budget is how far ahead of a client the prefetch may get in bytes,
+* 0 disables it. Needs the block cache, call after ftps4_cache_init(). */
+void ftps4_prefetch_init(unsigned long long budget);
+void ftps4_prefetch_fini();
+
+/* A listing of dir (canonical) starts, *pf is allocated on first use */
+void ftps4_prefetch_list_begin(ftps4_prefetch_t **pf, const char *dir);
+void ftps4_prefetch_list_add(ftps4_prefetch_t *pf, const char *name, unsigned long long size);
+/* RETR of path (canonical) starts, moves the prefetch on or stops it */
+void ftps4_prefetch_retr(ftps4_prefetch_t *pf, const char *path);
+/* Stops the prefetch, the listing is kept */
+void ftps4_prefetch_cancel(ftps4_prefetch_t *pf);
+/* Session end, waits for a read in progress for it and frees *pf */
+void ftps4_prefetch_end(ftps4_prefetch_t **pf);
@@ -0,0 +1,134 @@
+/*
+* SHA-256 (FIPS 180-4), plain C. The console's CPU has no SHA extensions.
+*/
+
+#include "ftp_sha256.h"
+
+static const unsigned int sha256_k[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define ROR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static void sha256_block(unsigned int state[8], const unsigned char *p) {
+	unsigned int w[64];
+	unsigned int a, b, c, d, e, f, g, h, t1, t2;
+	int i;
+
+	for (i = 0; i < 16; i++)
+		w[i] = ((unsigned int)p[i * 4] << 24) | ((unsigned int)p[i * 4 + 1] << 16) |
+			((unsigned int)p[i * 4 + 2] << 8) | p[i * 4 + 3];
+	for (; i < 64; i++)
+		w[i] = w[i - 16] + (ROR(w[i - 15], 7) ^ ROR(w[i - 15], 18) ^ (w[i - 15] >> 3)) +
+			w[i - 7] + (ROR(w[i - 2], 17) ^ ROR(w[i - 2], 19) ^ (w[i - 2] >> 10));
+
+	a = state[0]; b = state[1]; c = state[2]; d = state[3];
+	e = state[4]; f = state[5]; g = state[6]; h = state[7];
+
+	for (i = 0; i < 64; i++) {
+		t1 = h + (ROR(e, 6) ^ ROR(e, 11) ^ ROR(e, 25)) + ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+		t2 = (ROR(a, 2) ^ ROR(a, 13) ^ ROR(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+		h = g; g = f; f = e; e = d + t1;
+		d = c; c = b; b = a; a = t1 + t2;
+	}
+
+	state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+	state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+}
+
+void ftps4_sha256_init(ftps4_sha256_t *ctx) {
+	static const unsigned int iv[8] = {
+		0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+	};
+	memcpy(ctx->state, iv, sizeof(iv));
+	ctx->length = 0;
+	ctx->fill = 0;
+}
+
+void ftps4_sha256_update(ftps4_sha256_t *ctx, const void *data, unsigned int len) {
+	const unsigned char *p = (const unsigned char *)data;
+	unsigned int n;
+
+	ctx->length += len;
+
+	if (ctx->fill) {
+		n = 64 - ctx->fill < len ? 64 - ctx->fill : len;
+		memcpy(ctx->block + ctx->fill, p, n);
+		ctx->fill += n;
+		p += n;
+		len -= n;
+		if (ctx->fill < 64) return;
+		sha256_block(ctx->state, ctx->block);
+		ctx->fill = 0;
+	}
+
+	/* Whole blocks straight from the caller's buffer */
+	for (; len >= 64; p += 64, len -= 64) sha256_block(ctx->state, p);
+
+	memcpy(ctx->block, p, len);
+	ctx->fill = len;
+}
+
+void ftps4_sha256_final(ftps4_sha256_t *ctx, unsigned char digest[FTPS4_SHA256_SIZE]) {
+	unsigned long long bits = ctx->length * 8;
+	int i;
+
+	ctx->block[ctx->fill++] = 0x80;
+	if (ctx->fill > 56) {
+		memset(ctx->block + ctx->fill, 0, 64 - ctx->fill);
+		sha256_block(ctx->state, ctx->block);
+		ctx->fill = 0;
+	}
+	memset(ctx->block + ctx->fill, 0, 56 - ctx->fill);
+	for (i = 0; i < 8; i++) ctx->block[56 + i] = (unsigned char)(bits >> (56 - i * 8));
+	sha256_block(ctx->state, ctx->block);
+
+	for (i = 0; i < 8; i++) {
+		digest[i * 4] = (unsigned char)(ctx->state[i] >> 24);
+		digest[i * 4 + 1] = (unsigned char)(ctx->state[i] >> 16);
+		digest[i * 4 + 2] = (unsigned char)(ctx->state[i] >> 8);
+		digest[i * 4 + 3] = (unsigned char)ctx->state[i];
+	}
+}
+
+void ftps4_sha256(const void *data, unsigned int len, unsigned char digest[FTPS4_SHA256_SIZE]) {
+	ftps4_sha256_t ctx;
+	ftps4_sha256_init(&ctx);
+	ftps4_sha256_update(&ctx, data, len);
+	ftps4_sha256_final(&ctx, digest);
+}
+
+void ftps4_sha256_to_hex(const unsigned char digest[FTPS4_SHA256_SIZE], char hex[FTPS4_SHA256_SIZE * 2 + 1]) {
+	static const char digits[] = "0123456789abcdef";
+	int i;
+
+	for (i = 0; i < FTPS4_SHA256_SIZE; i++) {
+		hex[i * 2] = digits[digest[i] >> 4];
+		hex[i * 2 + 1] = digits[digest[i] & 0xF];
+	}
+	hex[FTPS4_SHA256_SIZE * 2] = '\0';
+}
+
+static int hex_value(char c) {
+	if (c >= '0' && c <= '9') return c - '0';
+	if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+	return -1;
+}
+
+int ftps4_sha256_from_hex(const char *hex, unsigned char digest[FTPS4_SHA256_SIZE]) {
+	int i, hi, lo;
+
+	for (i = 0; i < FTPS4_SHA256_SIZE; i++) {
+		if ((hi = hex_value(hex[i * 2])) < 0 || (lo = hex_value(hex[i * 2 + 1])) < 0) return -1;
+		digest[i] = (unsigned char)((hi << 4) | lo);
+	}
+	return hex_value(hex[FTPS4_SHA256_SIZE * 2]) < 0 ? 0 : -1;
+}
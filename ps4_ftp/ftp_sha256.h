@@ -0,0 +1,26 @@
+/*
+* SHA-256 (FIPS 180-4).
+*/
+
+#pragma once
+
+#include <application.h>
+
+#define FTPS4_SHA256_SIZE 32
+
+typedef struct {
+	unsigned int state[8];
+	unsigned long long length;
+	unsigned char block[64];
+	unsigned int fill;
+} ftps4_sha256_t;
+
+void ftps4_sha256_init(ftps4_sha256_t *ctx);
+void ftps4_sha256_update(ftps4_sha256_t *ctx, const void *data, unsigned int len);
+void ftps4_sha256_final(ftps4_sha256_t *ctx, unsigned char digest[FTPS4_SHA256_SIZE]);
+void ftps4_sha256(const void *data, unsigned int len, unsigned char digest[FTPS4_SHA256_SIZE]);
+
+/* 64 lowercase hex digits plus the terminator */
+void ftps4_sha256_to_hex(const unsigned char digest[FTPS4_SHA256_SIZE], char hex[FTPS4_SHA256_SIZE * 2 + 1]);
+/* Returns < 0 unless hex is exactly 64 hex digits */
+int ftps4_sha256_from_hex(const char *hex, unsigned char digest[FTPS4_SHA256_SIZE]);
@@ -0,0 +1,194 @@
+/*
+* Bandwidth shaping for the data connections.
+*
+* Every limit is a token bucket that is allowed to go into debt: a transfer
+* charges what it just moved and then sleeps until the debt is paid back.
+* Interactive transfers (LIST, small RETR) may run one extra burst of debt
+* on the global bucket before they wait on it, so bulk transfers pay for them
+* first while the cap still holds for both. Bulk transfers additionally get
+* an equal share of the global rate each, which keeps a client with many
+* connections from starving the others.
+*/
+
+#include "ftp_shaper.h"
+
+#define MAX_SHAPER_IPS 32
+/* Never sleep longer than this at once so aborts stay responsive */
+#define SHAPER_MAX_SLEEP (250 * 1000)
+
+typedef struct {
+	unsigned int s_addr;
+	int refs;
+	ftps4_bucket_t bucket;
+} shaper_ip_entry;
+
+static ScePthreadMutex shaper_mtx;
+static int shaper_initialized = 0;
+
+static unsigned long long global_rate = 0;
+static unsigned long long session_rate = 0;
+static unsigned long long ip_rate = 0;
+static unsigned long long small_file = SHAPER_DEFAULT_SMALL_FILE;
+
+static ftps4_bucket_t global_bucket;
+static shaper_ip_entry ip_table[MAX_SHAPER_IPS];
+static int bulk_count = 0;
+
+static long long bucket_burst(unsigned long long rate) {
+	long long burst = (long long)(rate / 8);
+	if (burst < SHAPER_SLICE_SIZE) burst = SHAPER_SLICE_SIZE;
+	return burst;
+}
+
+/* Time until the bucket is back above -slack */
+static unsigned long long bucket_wait(ftps4_bucket_t *b, unsigned long long rate, long long slack) {
+	if (!rate || b->tokens >= -slack) return 0;
+	return (unsigned long long)(-slack - b->tokens) * 1000 * 1000 / rate;
+}
+
+static unsigned long long bucket_take(ftps4_bucket_t *b, unsigned long long rate, unsigned int len, unsigned long long now) {
+	long long burst;
+	unsigned long long elapsed;
+
+	if (rate != b->rate) {
+		/* Limit changed or was just enabled, start with a full bucket */
+		b->rate = rate;
+		b->last = 0;
+	}
+	if (!rate) return 0;
+
+	burst = bucket_burst(rate);
+
+	if (!b->last) {
+		b->tokens = burst;
+	} else {
+		elapsed = now - b->last;
+		if (elapsed > 1000 * 1000) elapsed = 1000 * 1000;
+		b->tokens += (long long)(elapsed * rate / (1000 * 1000));
+		if (b->tokens > burst) b->tokens = burst;
+	}
+	b->last = now;
+
+	b->tokens -= len;
+	return bucket_wait(b, rate, 0);
+}
+
+void ftps4_shaper_init() {
+	if (shaper_initialized) return;
+	scePthreadMutexInit(&shaper_mtx, NULL, "FTPS4_shaper_mutex");
+	memset(&global_bucket, 0, sizeof(global_bucket));
+	memset(ip_table, 0, sizeof(ip_table));
+	bulk_count = 0;
+	shaper_initialized = 1;
+}
+
+void ftps4_shaper_fini() {
+	if (!shaper_initialized) return;
+	scePthreadMutexDestroy(&shaper_mtx);
+	shaper_initialized = 0;
+}
+
+void ftps4_shaper_session_start(ftps4_shaper_flow_t *flow, unsigned int s_addr) {
+	int i, free_slot = -1;
+
+	memset(flow, 0, sizeof(*flow));
+	flow->ip_slot = -1;
+
+	scePthreadMutexLock(&shaper_mtx);
+	for (i = 0; i < MAX_SHAPER_IPS; i++) {
+		if (ip_table[i].refs > 0 && ip_table[i].s_addr == s_addr) {
+			flow->ip_slot = i;
+			break;
+		}
+		if (ip_table[i].refs == 0 && free_slot < 0) free_slot = i;
+	}
+	if (flow->ip_slot < 0 && free_slot >= 0) {
+		/* Table full means no per IP limit for this session */
+		memset(&ip_table[free_slot], 0, sizeof(ip_table[free_slot]));
+		ip_table[free_slot].s_addr = s_addr;
+		flow->ip_slot = free_slot;
+	}
+	if (flow->ip_slot >= 0) ip_table[flow->ip_slot].refs++;
+	scePthreadMutexUnlock(&shaper_mtx);
+}
+
+void ftps4_shaper_session_end(ftps4_shaper_flow_t *flow) {
+	ftps4_shaper_transfer_end(flow);
+
+	scePthreadMutexLock(&shaper_mtx);
+	if (flow->ip_slot >= 0) ip_table[flow->ip_slot].refs--;
+	scePthreadMutexUnlock(&shaper_mtx);
+	flow->ip_slot = -1;
+}
+
+void ftps4_shaper_transfer_start(ftps4_shaper_flow_t *flow, int cls) {
+	if (flow->active) ftps4_shaper_transfer_end(flow);
+
+	flow->cls = cls;
+	flow->active = 1;
+	flow->share.last = 0;
+
+	if (cls == SHAPER_CLASS_BULK) {
+		scePthreadMutexLock(&shaper_mtx);
+		bulk_count++;
+		scePthreadMutexUnlock(&shaper_mtx);
+	}
+}
+
+void ftps4_shaper_transfer_end(ftps4_shaper_flow_t *flow) {
+	if (!flow->active) return;
+
+	if (flow->cls == SHAPER_CLASS_BULK) {
+		scePthreadMutexLock(&shaper_mtx);
+		bulk_count--;
+		scePthreadMutexUnlock(&shaper_mtx);
+	}
+	flow->active = 0;
+}
+
+unsigned int ftps4_shaper_slice(ftps4_shaper_flow_t *flow) {
+	(void)flow;
+	if (session_rate || ip_rate || global_rate) return SHAPER_SLICE_SIZE;
+	return 0;
+}
+
+void ftps4_shaper_consume(ftps4_shaper_flow_t *flow, unsigned int len) {
+	unsigned long long now, w, wait = 0;
+	int n_bulk = 1;
+
+	if (!global_rate && !session_rate && !ip_rate) return;
+
+	now = sceKernelGetProcessTime();
+
+	/* The session bucket is only touched by the session's own thread */
+	wait = bucket_take(&flow->session, session_rate, len, now);
+
+	scePthreadMutexLock(&shaper_mtx);
+	if (flow->ip_slot >= 0) {
+		w = bucket_take(&ip_table[flow->ip_slot].bucket, ip_rate, len, now);
+		if (w > wait) wait = w;
+	}
+	w = bucket_take(&global_bucket, global_rate, len, now);
+	if (flow->cls != SHAPER_CLASS_BULK) w = bucket_wait(&global_bucket, global_rate, bucket_burst(global_rate));
+	if (w > wait) wait = w;
+	if (bulk_count > 0) n_bulk = bulk_count;
+	scePthreadMutexUnlock(&shaper_mtx);
+
+	if (flow->cls == SHAPER_CLASS_BULK && global_rate) {
+		w = bucket_take(&flow->share, global_rate / n_bulk, len, now);
+		if (w > wait) wait = w;
+	}
+
+	if (wait > SHAPER_MAX_SLEEP) wait = SHAPER_MAX_SLEEP;
+	if (wait) sceKernelUsleep((unsigned int)wait);
+}
+
+void ftps4_shaper_set_global_rate(unsigned long long rate) { global_rate = rate; }
+void ftps4_shaper_set_session_rate(unsigned long long rate) { session_rate = rate; }
+void ftps4_shaper_set_ip_rate(unsigned long long rate) { ip_rate = rate; }
+void ftps4_shaper_set_small_file(unsigned long long size) { small_file = size; }
+unsigned long long ftps4_shaper_get_global_rate() { return global_rate; }
+unsigned long long ftps4_shaper_get_session_rate() { return session_rate; }
+unsigned long long ftps4_shaper_get_ip_rate() { return ip_rate; }
+unsigned long long ftps4_shaper_get_small_file() { return small_file; }
+int ftps4_shaper_get_bulk_count() { return bulk_count; }
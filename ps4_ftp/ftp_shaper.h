@@ -0,0 +1,66 @@
+/*
+* Bandwidth shaping for the data connections.
+*/
+
+#pragma once
+
+#include <application.h>
+
+/* Transfers that go ahead of bulk ones on the global budget */
+#define SHAPER_CLASS_INTERACTIVE 0
+/* Transfers that share the global budget fairly */
+#define SHAPER_CLASS_BULK 1
+
+/* RETR of files up to this size counts as interactive */
+#define SHAPER_DEFAULT_SMALL_FILE (1 * 1024 * 1024)
+/* Largest amount of data moved between two shaping decisions */
+#define SHAPER_SLICE_SIZE (64 * 1024)
+
+typedef struct {
+	/* Bytes per second, 0 means unlimited */
+	unsigned long long rate;
+	/* Available bytes, negative while in debt */
+	long long tokens;
+	/* Process time of the last refill in microseconds */
+	unsigned long long last;
+} ftps4_bucket_t;
+
+typedef struct {
+	/* Per session limit */
+	ftps4_bucket_t session;
+	/* Fair share of the global limit while a bulk transfer is running */
+	ftps4_bucket_t share;
+	/* Slot in the per IP table, -1 if none */
+	int ip_slot;
+	/* SHAPER_CLASS_* of the running transfer */
+	int cls;
+	/* Set while a transfer is registered with the shaper */
+	int active;
+} ftps4_shaper_flow_t;
+
+void ftps4_shaper_init();
+void ftps4_shaper_fini();
+
+/* Session lifetime, binds the flow to the remote IP */
+void ftps4_shaper_session_start(ftps4_shaper_flow_t *flow, unsigned int s_addr);
+void ftps4_shaper_session_end(ftps4_shaper_flow_t *flow);
+
+/* Transfer lifetime */
+void ftps4_shaper_transfer_start(ftps4_shaper_flow_t *flow, int cls);
+void ftps4_shaper_transfer_end(ftps4_shaper_flow_t *flow);
+
+/* Returns how many bytes may be moved in one go (0 means no limit applies) */
+unsigned int ftps4_shaper_slice(ftps4_shaper_flow_t *flow);
+/* Charges len bytes to every bucket the flow belongs to and sleeps if over budget */
+void ftps4_shaper_consume(ftps4_shaper_flow_t *flow, unsigned int len);
+
+/* Runtime configuration, rates are in bytes per second and 0 disables the limit */
+void ftps4_shaper_set_global_rate(unsigned long long rate);
+void ftps4_shaper_set_session_rate(unsigned long long rate);
+void ftps4_shaper_set_ip_rate(unsigned long long rate);
+void ftps4_shaper_set_small_file(unsigned long long size);
+unsigned long long ftps4_shaper_get_global_rate();
+unsigned long long ftps4_shaper_get_session_rate();
+unsigned long long ftps4_shaper_get_ip_rate();
+unsigned long long ftps4_shaper_get_small_file();
+int ftps4_shaper_get_bulk_count();
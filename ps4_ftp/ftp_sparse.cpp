@@ -0,0 +1,117 @@
+/*
+* Sparse writes for STOR.
+*
+* The incoming buffer is cut into SPARSE_BLOCK_SIZE blocks. Consecutive
+* non zero blocks go out in one write, zero blocks only move the file
+* offset. The caller must only use this on a range of the file that reads
+* back as zeros already (freshly truncated or past the end of file).
+*/
+
+#include "ftp_sparse.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+int ftps4_sparse_is_zero(const unsigned char *buf, unsigned int len) {
+	unsigned int i = 0;
+
+#if defined(__SSE2__)
+	/* OR 64 bytes per round together and test them once */
+	__m128i acc = _mm_setzero_si128();
+
+	for (; i + 64 <= len; i += 64) {
+		acc = _mm_or_si128(acc, _mm_loadu_si128((const __m128i *)(buf + i)));
+		acc = _mm_or_si128(acc, _mm_loadu_si128((const __m128i *)(buf + i + 16)));
+		acc = _mm_or_si128(acc, _mm_loadu_si128((const __m128i *)(buf + i + 32)));
+		acc = _mm_or_si128(acc, _mm_loadu_si128((const __m128i *)(buf + i + 48)));
+		/* Bail out early once per 512 bytes, data blocks are rarely zero at all */
+		if ((i & 511) == 448 &&
+			_mm_movemask_epi8(_mm_cmpeq_epi8(acc, _mm_setzero_si128())) != 0xFFFF)
+			return 0;
+	}
+	if (_mm_movemask_epi8(_mm_cmpeq_epi8(acc, _mm_setzero_si128())) != 0xFFFF)
+		return 0;
+#else
+	unsigned long long acc = 0;
+
+	for (; i + 8 <= len; i += 8) {
+		unsigned long long w;
+		memcpy(&w, buf + i, sizeof(w));
+		acc |= w;
+		if ((i & 511) == 504 && acc) return 0;
+	}
+	if (acc) return 0;
+#endif
+
+	for (; i < len; i++) {
+		if (buf[i]) return 0;
+	}
+	return 1;
+}
+
+void ftps4_sparse_begin(ftps4_sparse_t *sp) {
+	sp->hole = 0;
+	sp->skipped = 0;
+}
+
+static int sparse_flush_hole(ftps4_sparse_t *sp, int fd) {
+	if (!sp->hole) return 0;
+	if (Sys::lseek(fd, sp->hole, SEEK_CUR) < 0) return -1;
+	sp->hole = 0;
+	return 0;
+}
+
+static int sparse_write_all(int fd, const unsigned char *buf, unsigned int len) {
+	int n;
+
+	while (len > 0) {
+		n = Sys::write(fd, buf, len);
+		if (n <= 0) return -1;
+		buf += n;
+		len -= n;
+	}
+	return 0;
+}
+
+int ftps4_sparse_write(ftps4_sparse_t *sp, int fd, const unsigned char *buf, unsigned int len) {
+	unsigned int pos = 0, start = 0, blk;
+
+	while (pos < len) {
+		blk = len - pos < SPARSE_BLOCK_SIZE ? len - pos : SPARSE_BLOCK_SIZE;
+
+		/* A short tail block is written, it may be the middle of a block on disk */
+		if (blk == SPARSE_BLOCK_SIZE && ftps4_sparse_is_zero(buf + pos, blk)) {
+			if (pos > start) {
+				if (sparse_flush_hole(sp, fd) < 0) return -1;
+				if (sparse_write_all(fd, buf + start, pos - start) < 0) return -1;
+			}
+			sp->hole += blk;
+			sp->skipped += blk;
+			start = pos + blk;
+		}
+		pos += blk;
+	}
+
+	if (pos > start) {
+		if (sparse_flush_hole(sp, fd) < 0) return -1;
+		if (sparse_write_all(fd, buf + start, pos - start) < 0) return -1;
+	}
+	return len;
+}
+
+int ftps4_sparse_finish(ftps4_sparse_t *sp, int fd) {
+	struct stat st;
+	long long end;
+
+	if (!sp->hole) return 0;
+
+	end = Sys::lseek(fd, sp->hole, SEEK_CUR);
+	if (end < 0) return -1;
+	sp->hole = 0;
+
+	/* Only ever grow, another segment writer may already be further out */
+	if (Sys::fstat(fd, &st) < 0) return -1;
+	if (st.st_size < end && Sys::ftruncate(fd, end) < 0) return -1;
+	return 0;
+}
@@ -0,0 +1,27 @@
+/*
+* Sparse writes for STOR, runs of zero blocks are seeked over instead of
+* written so mostly empty images don't cost their full size in disk I/O.
+*/
+
+#pragma once
+
+#include <application.h>
+
+/* Only whole blocks of zeros become holes */
+#define SPARSE_BLOCK_SIZE 4096
+
+typedef struct {
+	/* Zero bytes skipped but not yet seeked over */
+	unsigned long long hole;
+	/* Bytes that were not written */
+	unsigned long long skipped;
+} ftps4_sparse_t;
+
+/* Non zero when len bytes at buf are all zero */
+int ftps4_sparse_is_zero(const unsigned char *buf, unsigned int len);
+
+void ftps4_sparse_begin(ftps4_sparse_t *sp);
+/* Writes buf to fd at its current offset leaving zero blocks out, returns len or < 0 */
+int ftps4_sparse_write(ftps4_sparse_t *sp, int fd, const unsigned char *buf, unsigned int len);
+/* Seeks over a trailing hole and grows the file to cover it, returns < 0 on error */
+int ftps4_sparse_finish(ftps4_sparse_t *sp, int fd);
@@ -0,0 +1,135 @@
+/*
+* Span tracing.
+*
+* Spans go into a fixed ring: a writer claims the next slot with one atomic
+* increment and overwrites whatever was there, so tracing never allocates or
+* blocks. Each slot carries a sequence number that is cleared while the slot
+* is written, the dump skips slots that changed under it.
+*/
+
+#include <atomic>
+
+#include "ftp_trace.h"
+
+/* Dump output is built in chunks of this size */
+#define TRACE_DUMP_BUF_SIZE (16 * 1024)
+
+typedef struct {
+	std::atomic<unsigned int> seq;
+	const char *name;
+	char detail[FTPS4_TRACE_DETAIL_SIZE];
+	int session;
+	unsigned long long start;
+	unsigned long long dur;
+	unsigned long long arg;
+} trace_slot;
+
+volatile int ftps4_trace_on = 0;
+
+static trace_slot trace_ring[FTPS4_TRACE_SPANS];
+static std::atomic<unsigned int> trace_head;
+
+void ftps4_trace_set_enabled(int enabled) {
+	ftps4_trace_on = enabled;
+}
+
+void ftps4_trace_clear() {
+	unsigned int i;
+
+	for (i = 0; i < FTPS4_TRACE_SPANS; i++) trace_ring[i].seq.store(0, std::memory_order_relaxed);
+	trace_head.store(0, std::memory_order_release);
+}
+
+void ftps4_trace_span(const char *name, const char *detail, int session, unsigned long long start, unsigned long long arg) {
+	unsigned long long end = sceKernelGetProcessTime();
+	unsigned int idx = trace_head.fetch_add(1, std::memory_order_relaxed);
+	trace_slot *slot = &trace_ring[idx & (FTPS4_TRACE_SPANS - 1)];
+	unsigned int i = 0;
+
+	slot->seq.store(0, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+
+	slot->name = name;
+	/* Details come from clients, keep only what needs no escaping in JSON */
+	if (detail) {
+		for (; i < FTPS4_TRACE_DETAIL_SIZE - 1 && detail[i]; i++)
+			slot->detail[i] = (detail[i] > ' ' && detail[i] < 0x7F && detail[i] != '"' && detail[i] != '\\') ? detail[i] : '_';
+	}
+	slot->detail[i] = '\0';
+	slot->session = session;
+	slot->start = start;
+	slot->dur = end - start;
+	slot->arg = arg;
+
+	slot->seq.store(idx + 1, std::memory_order_release);
+}
+
+static int trace_write_all(int fd, const char *buf, unsigned int len) {
+	int n;
+
+	while (len > 0) {
+		n = Sys::write(fd, buf, len);
+		if (n <= 0) return -1;
+		buf += n;
+		len -= n;
+	}
+	return 0;
+}
+
+int ftps4_trace_dump(const char *path) {
+	char *buf;
+	unsigned int head, first, idx, seq, len = 0;
+	int fd, count = 0, ret = 0;
+	trace_slot span;
+	trace_slot *slot;
+
+	buf = (char *)malloc(TRACE_DUMP_BUF_SIZE);
+	if (buf == NULL) return -1;
+
+	fd = Sys::open(path, O_CREAT | O_WRONLY | O_TRUNC, 0777);
+	if (fd < 0) {
+		free(buf);
+		return -1;
+	}
+
+	head = trace_head.load(std::memory_order_acquire);
+	first = head > FTPS4_TRACE_SPANS ? head - FTPS4_TRACE_SPANS : 0;
+
+	len = snprintf(buf, TRACE_DUMP_BUF_SIZE, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+
+	for (idx = first; idx < head && ret == 0; idx++) {
+		slot = &trace_ring[idx & (FTPS4_TRACE_SPANS - 1)];
+
+		seq = slot->seq.load(std::memory_order_acquire);
+		if (seq != idx + 1) continue;
+		span.name = slot->name;
+		memcpy(span.detail, slot->detail, sizeof(span.detail));
+		span.session = slot->session;
+		span.start = slot->start;
+		span.dur = slot->dur;
+		span.arg = slot->arg;
+		std::atomic_thread_fence(std::memory_order_acquire);
+		/* Overwritten while we copied it */
+		if (slot->seq.load(std::memory_order_relaxed) != seq) continue;
+		span.detail[FTPS4_TRACE_DETAIL_SIZE - 1] = '\0';
+
+		/* Sessions are the threads, everything runs in one process */
+		len += snprintf(buf + len, TRACE_DUMP_BUF_SIZE - len,
+			"%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%i,\"ts\":%llu,\"dur\":%llu,"
+			"\"args\":{\"detail\":\"%s\",\"value\":%llu}}",
+			count ? "," : "", span.name, span.session, span.start, span.dur, span.detail, span.arg);
+		count++;
+
+		if (len > TRACE_DUMP_BUF_SIZE - 512) {
+			ret = trace_write_all(fd, buf, len);
+			len = 0;
+		}
+	}
+
+	len += snprintf(buf + len, TRACE_DUMP_BUF_SIZE - len, "]}\n");
+	if (ret == 0) ret = trace_write_all(fd, buf, len);
+
+	Sys::close(fd);
+	free(buf);
+	return ret < 0 ? ret : count;
+}
@@ -0,0 +1,27 @@
+/*
+* Span tracing, dumped as a Chrome / Perfetto trace (JSON).
+*/
+
+#pragma once
+
+#include <application.h>
+
+/* Spans kept in memory, the oldest are overwritten */
+#define FTPS4_TRACE_SPANS 8192 /* Must be a power of two */
+#define FTPS4_TRACE_DETAIL_SIZE 16
+
+/* Read on every trace point, only ftps4_trace_set_enabled() writes it */
+extern volatile int ftps4_trace_on;
+
+void ftps4_trace_set_enabled(int enabled);
+void ftps4_trace_clear();
+/* Records a span that started at start (process time) and ends now. name must
+* be a string literal, detail (may be NULL) is copied. */
+void ftps4_trace_span(const char *name, const char *detail, int session, unsigned long long start, unsigned long long arg);
+/* Writes the spans in memory to path, returns how many or < 0 on error */
+int ftps4_trace_dump(const char *path);
+
+/* Costs one load and branch while tracing is off */
+#define FTPS4_TRACE_BEGIN(t) unsigned long long t = ftps4_trace_on ? sceKernelGetProcessTime() : 0
+#define FTPS4_TRACE_END(t, name, detail, session, arg) \
+	do { if (t) ftps4_trace_span(name, detail, session, t, arg); } while (0)
@@ -0,0 +1,240 @@
+/*
+* Whole tree namespace operations (SITE RMTREE, SITE MKDIRS).
+*
+* A removal works like the SITE DU walk: directories are items on a shared
+* stack served by a pool of workers, each unlinks the files of one
+* directory and queues its subdirectories. A directory counts its own scan
+* and every subdirectory not yet gone as pending, whoever brings that to
+* zero removes it and releases its parent, so the tree comes down bottom up
+* without any thread waiting for another.
+*/
+
+#include "ftp_tree.h"
+#include "ftp_cache.h"
+#include "ftp_dir.h"
+
+typedef struct tree_dir {
+	struct tree_dir *parent;
+	/* Work stack link */
+	struct tree_dir *next;
+	int pending;
+	char path[1];
+} tree_dir;
+
+typedef struct {
+	ScePthreadMutex mtx;
+	ScePthreadCond cond;
+	tree_dir *stack;
+	int active;
+	int finished;
+	ftps4_tree_stats_t stats;
+} tree_walk;
+
+static tree_dir *tree_dir_new(tree_dir *parent, const char *path) {
+	size_t len = strlen(path);
+	tree_dir *d = (tree_dir *)malloc(sizeof(tree_dir) + len);
+
+	if (d == NULL) return NULL;
+	memcpy(d->path, path, len + 1);
+	d->parent = parent;
+	d->next = NULL;
+	/* Its own scan */
+	d->pending = 1;
+	return d;
+}
+
+/* Drops one pending reference, removing the directory (and then maybe its
+* parents) once nothing below it is left */
+static void tree_dir_release(tree_walk *walk, tree_dir *d) {
+	tree_dir *parent;
+	int left, ret;
+
+	while (d) {
+		scePthreadMutexLock(&walk->mtx);
+		left = --d->pending;
+		scePthreadMutexUnlock(&walk->mtx);
+		if (left) return;
+
+		ret = Sys::rmdir(d->path);
+
+		scePthreadMutexLock(&walk->mtx);
+		if (ret < 0) walk->stats.failed++;
+		else walk->stats.dirs++;
+		scePthreadMutexUnlock(&walk->mtx);
+
+		parent = d->parent;
+		free(d);
+		d = parent;
+	}
+}
+
+int ftps4_tree_is_link(const char *path) {
+	char target[8];
+
+	/* Only succeeds on a link itself, a short buffer just truncates */
+	return Sys::readlink(path, target, sizeof(target)) >= 0;
+}
+
+typedef struct {
+	tree_walk *walk;
+	tree_dir *d;
+	unsigned long long files;
+	unsigned long long failed;
+} tree_scan_ctx;
+
+static int tree_scan_entry(void *arg, const char *name, int type) {
+	tree_scan_ctx *scan = (tree_scan_ctx *)arg;
+	tree_walk *walk = scan->walk;
+	char full_path[PATH_MAXX];
+	struct stat st;
+	tree_dir *sub;
+	int is_link = 0;
+
+	if ((unsigned int)snprintf(full_path, sizeof(full_path), "%s/%s", scan->d->path, name) >= sizeof(full_path)) {
+		scan->failed++;
+		return 0;
+	}
+
+	/* A link to a directory goes, what it points to stays. stat() would
+	* follow it, so without a type from the directory it is asked for. */
+#if defined(DT_LNK)
+	if (type == DT_LNK) is_link = 1;
+	else if (type == DT_UNKNOWN) is_link = ftps4_tree_is_link(full_path);
+#else
+	(void)type;
+	is_link = ftps4_tree_is_link(full_path);
+#endif
+	if (!is_link && Sys::stat(full_path, &st) < 0) {
+		scan->failed++;
+		return 0;
+	}
+
+	if (!is_link && S_ISDIR(st.st_mode)) {
+		if ((sub = tree_dir_new(scan->d, full_path)) == NULL) {
+			scan->failed++;
+			return 0;
+		}
+		scePthreadMutexLock(&walk->mtx);
+		scan->d->pending++;
+		sub->next = walk->stack;
+		walk->stack = sub;
+		scePthreadCondSignal(&walk->cond);
+		scePthreadMutexUnlock(&walk->mtx);
+	} else {
+		if (!is_link && !S_ISLNK(st.st_mode) && ftps4_cache_enabled()) ftps4_cache_invalidate(st.st_dev, st.st_ino);
+		if (Sys::unlink(full_path) < 0) scan->failed++;
+		else scan->files++;
+	}
+	return 0;
+}
+
+/* Unlinks the files of d and queues its subdirectories */
+static void tree_scan(tree_walk *walk, tree_dir *d) {
+	tree_scan_ctx scan;
+
+	scan.walk = walk;
+	scan.d = d;
+	scan.files = 0;
+	scan.failed = 0;
+	if (ftps4_dir_read(d->path, tree_scan_entry, &scan) < 0) return;
+
+	scePthreadMutexLock(&walk->mtx);
+	walk->stats.files += scan.files;
+	walk->stats.failed += scan.failed;
+	scePthreadMutexUnlock(&walk->mtx);
+}
+
+static void *tree_worker(void *arg) {
+	tree_walk *walk = (tree_walk *)arg;
+	tree_dir *d;
+
+	scePthreadMutexLock(&walk->mtx);
+	while (1) {
+		while (!walk->stack && !walk->finished) scePthreadCondWait(&walk->cond, &walk->mtx);
+		if (!walk->stack) break;
+
+		d = walk->stack;
+		walk->stack = d->next;
+		walk->active++;
+		scePthreadMutexUnlock(&walk->mtx);
+
+		tree_scan(walk, d);
+		/* Its subdirectories hold it until they are gone */
+		tree_dir_release(walk, d);
+
+		scePthreadMutexLock(&walk->mtx);
+		walk->active--;
+		if (!walk->stack && !walk->active) walk->finished = 1;
+		scePthreadCondBroadcast(&walk->cond);
+	}
+	scePthreadMutexUnlock(&walk->mtx);
+	return NULL;
+}
+
+int ftps4_tree_remove(const char *path, ftps4_tree_stats_t *stats,
+	ftps4_tree_progress_func progress, void *arg, unsigned int interval_us) {
+	tree_walk walk;
+	ScePthread thids[FTPS4_TREE_WORKERS];
+	int started[FTPS4_TREE_WORKERS];
+	ftps4_tree_stats_t now;
+	int i, any = 0;
+
+	memset(&walk, 0, sizeof(walk));
+	memset(stats, 0, sizeof(*stats));
+	/* The root isn't followed either */
+	if (ftps4_tree_is_link(path)) {
+		stats->failed = 1;
+		return -1;
+	}
+	if ((walk.stack = tree_dir_new(NULL, path)) == NULL) return -1;
+
+	scePthreadMutexInit(&walk.mtx, NULL, "FTPS4_tree_mutex");
+	scePthreadCondInit(&walk.cond, NULL, "FTPS4_tree_cond");
+
+	for (i = 0; i < FTPS4_TREE_WORKERS; i++) {
+		started[i] = scePthreadCreate(&thids[i], NULL, tree_worker, &walk, "FTPS4_tree_thread") >= 0;
+		any |= started[i];
+	}
+	/* Not even one worker, do it all here */
+	if (!any) tree_worker(&walk);
+
+	scePthreadMutexLock(&walk.mtx);
+	while (!walk.finished) {
+		scePthreadCondTimedwait(&walk.cond, &walk.mtx, interval_us);
+		if (walk.finished || !progress) continue;
+		now = walk.stats;
+		scePthreadMutexUnlock(&walk.mtx);
+		progress(arg, &now);
+		scePthreadMutexLock(&walk.mtx);
+	}
+	scePthreadMutexUnlock(&walk.mtx);
+
+	for (i = 0; i < FTPS4_TREE_WORKERS; i++) {
+		if (started[i]) scePthreadJoin(thids[i], NULL);
+	}
+
+	*stats = walk.stats;
+	scePthreadCondDestroy(&walk.cond);
+	scePthreadMutexDestroy(&walk.mtx);
+	return stats->failed ? -1 : 0;
+}
+
+int ftps4_tree_mkdirs(const ftps4_path_t *path, unsigned int *created) {
+	char prefix[PATH_MAXX];
+	struct stat st;
+	int i;
+
+	*created = 0;
+	for (i = 0; i < path->depth; i++) {
+		memcpy(prefix, path->path, path->ends[i]);
+		prefix[path->ends[i]] = '\0';
+
+		if (Sys::mkdir(prefix, 0777) >= 0) {
+			(*created)++;
+			continue;
+		}
+		/* Already there is fine as long as it is a directory */
+		if (Sys::stat(prefix, &st) < 0 || !S_ISDIR(st.st_mode)) return -1;
+	}
+	return 0;
+}
@@ -0,0 +1,32 @@
+/*
+* Whole tree namespace operations (SITE RMTREE, SITE MKDIRS).
+*/
+
+#pragma once
+
+#include <application.h>
+#include "ftp_path.h"
+
+/* Directories worked on in parallel by a removal */
+#define FTPS4_TREE_WORKERS 4
+
+typedef struct {
+	unsigned long long files;
+	unsigned long long dirs;
+	/* Entries that could not be removed */
+	unsigned long long failed;
+} ftps4_tree_stats_t;
+
+/* Gets the counts so far, every interval_us while a removal runs */
+typedef void (*ftps4_tree_progress_func)(void *arg, const ftps4_tree_stats_t *stats);
+
+/* Removes the directory path (canonical) and everything below it. Symbolic
+* links are removed, not followed. Returns < 0 if anything was left over,
+* stats has the final counts either way. */
+int ftps4_tree_remove(const char *path, ftps4_tree_stats_t *stats,
+	ftps4_tree_progress_func progress, void *arg, unsigned int interval_us);
+/* Non zero if path is a symbolic link itself (stat() follows them) */
+int ftps4_tree_is_link(const char *path);
+/* Creates path and every missing parent, *created is how many were.
+* Returns < 0 if a component can't be made a directory. */
+int ftps4_tree_mkdirs(const ftps4_path_t *path, unsigned int *created);
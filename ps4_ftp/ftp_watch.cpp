@@ -0,0 +1,370 @@
+/*
+* Change notification (SITE WATCH).
+*
+* Waiters sleep on one condition variable that every journal append wakes,
+* so a change made through the server is seen right away. A waiter that
+* times out a slice rescans the directory it watches if that is due. The
+* cheap check is the directory's own mtime, which changes whenever an
+* entry is added, removed or renamed, the entries themselves are only
+* stat()ed every few checks to catch files written in place.
+*
+* Changes the server reports also update the snapshot of the directory
+* they are in, so the next rescan doesn't report them a second time.
+* Snapshots are kept for the most recently watched directories only, a
+* waiter whose directory lost its snapshot is told to list it again.
+*/
+
+#include "ftp_watch.h"
+#include "ftp_dir.h"
+
+/* Slices a waiter sleeps in between cancel checks */
+#define WATCH_SLICE (250 * 1000)
+
+typedef struct {
+	char path[PATH_MAXX];
+	ftps4_watch_event_t event;
+} watch_change;
+
+typedef struct {
+	char *name;
+	unsigned long long size;
+	long long mtime;
+	int dir;
+} watch_entry;
+
+typedef struct {
+	char path[PATH_MAXX];
+	int used;
+	/* Set while one waiter rescans it outside the lock */
+	int scanning;
+	/* Nothing to compare to before the first scan */
+	int scanned;
+	unsigned int checks;
+	/* Server changes applied to the snapshot, a rescan that raced one is dropped */
+	unsigned int notified;
+	long long dir_mtime;
+	unsigned long long last_scan;
+	unsigned long long last_use;
+	/* Sorted by name */
+	watch_entry *entries;
+	int count;
+} watch_dir;
+
+static watch_change journal[FTPS4_WATCH_JOURNAL_SIZE];
+/* Token of the last change, change n is at journal[n % FTPS4_WATCH_JOURNAL_SIZE] */
+static unsigned long long watch_seq;
+static watch_dir watch_dirs[FTPS4_WATCH_MAX_DIRS];
+static ScePthreadMutex watch_mtx;
+static ScePthreadCond watch_cond;
+
+static const char *watch_names[] = { "created", "modified", "deleted", "overflow" };
+
+const char *ftps4_watch_event_name(ftps4_watch_event_t event) { return watch_names[event]; }
+
+/* Non zero when path is dir or below it */
+static int watch_under(const char *dir, const char *path) {
+	size_t len = strlen(dir);
+	if (len == 1) return 1;
+	return strncmp(dir, path, len) == 0 && (path[len] == '\0' || path[len] == '/');
+}
+
+static int watch_entry_cmp(const void *a, const void *b) {
+	return strcmp(((const watch_entry *)a)->name, ((const watch_entry *)b)->name);
+}
+
+static void watch_entries_free(watch_entry *entries, int count) {
+	int i;
+	for (i = 0; i < count; i++) free(entries[i].name);
+	free(entries);
+}
+
+/* Index of name in d, or where it would go as -(index + 1) */
+static int watch_find(const watch_dir *d, const char *name) {
+	int lo = 0, hi = d->count - 1, mid, c;
+
+	while (lo <= hi) {
+		mid = (lo + hi) / 2;
+		c = strcmp(d->entries[mid].name, name);
+		if (c == 0) return mid;
+		if (c < 0) lo = mid + 1;
+		else hi = mid - 1;
+	}
+	return -(lo + 1);
+}
+
+/* The watch mutex must be held */
+static void watch_append(ftps4_watch_event_t event, const char *path) {
+	watch_change *c;
+
+	watch_seq++;
+	c = &journal[watch_seq % FTPS4_WATCH_JOURNAL_SIZE];
+	c->event = event;
+	snprintf(c->path, sizeof(c->path), "%s", path);
+	scePthreadCondBroadcast(&watch_cond);
+}
+
+typedef struct {
+	const char *path;
+	watch_entry *entries;
+	int count;
+	int cap;
+} watch_read_ctx;
+
+static int watch_read_entry(void *arg, const char *name, int type) {
+	watch_read_ctx *rd = (watch_read_ctx *)arg;
+	char full_path[PATH_MAXX];
+	struct stat st;
+	watch_entry *grown;
+	(void)type;
+
+	if ((unsigned int)snprintf(full_path, sizeof(full_path), "%s%s%s",
+		rd->path, rd->path[1] ? "/" : "", name) >= sizeof(full_path)) return 0;
+	if (Sys::stat(full_path, &st) < 0) return 0;
+
+	if (rd->count == rd->cap) {
+		if ((grown = (watch_entry *)realloc(rd->entries, (rd->cap ? rd->cap * 2 : 64) * sizeof(*grown))) == NULL) return -1;
+		rd->entries = grown;
+		rd->cap = rd->cap ? rd->cap * 2 : 64;
+	}
+	if ((rd->entries[rd->count].name = strdup(name)) == NULL) return -1;
+	rd->entries[rd->count].size = st.st_size;
+	rd->entries[rd->count].mtime = st.st_mtime;
+	rd->entries[rd->count].dir = S_ISDIR(st.st_mode);
+	rd->count++;
+	return 0;
+}
+
+/* Reads the direct entries of path, sorted. Returns < 0 if it can't be read
+* completely, a partial listing would report entries as deleted. */
+static int watch_read_dir(const char *path, watch_entry **out, int *out_count) {
+	watch_read_ctx rd;
+
+	rd.path = path;
+	rd.entries = NULL;
+	rd.count = 0;
+	rd.cap = 0;
+	if (ftps4_dir_read(path, watch_read_entry, &rd) != 0) {
+		watch_entries_free(rd.entries, rd.count);
+		return -1;
+	}
+
+	qsort(rd.entries, rd.count, sizeof(*rd.entries), watch_entry_cmp);
+	*out = rd.entries;
+	*out_count = rd.count;
+	return 0;
+}
+
+/* Rescans the watched directory path if that is due, journaling what
+* changed since the last scan. The watch mutex must be held, it is
+* released during the scan. Returns non zero when path had no snapshot
+* (never watched, or evicted by others), outside changes before now are
+* unknown then. */
+static int watch_scan(const char *path) {
+	watch_dir *d = NULL, *victim = NULL;
+	int fresh = 0;
+	watch_entry *entries = NULL, *old;
+	char full_path[PATH_MAXX];
+	unsigned long long now = sceKernelGetProcessTime();
+	struct stat st;
+	long long dir_mtime;
+	unsigned int notified;
+	int i, j, c, count = 0, old_count, deep;
+
+	for (i = 0; i < FTPS4_WATCH_MAX_DIRS; i++) {
+		if (watch_dirs[i].used && strcmp(watch_dirs[i].path, path) == 0) {
+			d = &watch_dirs[i];
+			break;
+		}
+		if (watch_dirs[i].scanning) continue;
+		if (!victim || !watch_dirs[i].used || (victim->used && watch_dirs[i].last_use < victim->last_use)) victim = &watch_dirs[i];
+	}
+	if (d == NULL) {
+		/* Least recently watched goes */
+		if (victim == NULL) return 0;
+		watch_entries_free(victim->entries, victim->count);
+		memset(victim, 0, sizeof(*victim));
+		snprintf(victim->path, sizeof(victim->path), "%s", path);
+		victim->used = 1;
+		d = victim;
+		fresh = 1;
+	}
+	d->last_use = now;
+	if (d->scanning || (d->scanned && now - d->last_scan < FTPS4_WATCH_SCAN_INTERVAL)) return fresh;
+
+	d->scanning = 1;
+	notified = d->notified;
+	scePthreadMutexUnlock(&watch_mtx);
+
+	/* Unchanged directory mtime means no entry came or went */
+	dir_mtime = Sys::stat(path, &st) < 0 ? -1 : st.st_mtime;
+	deep = !d->scanned || dir_mtime != d->dir_mtime || d->checks % FTPS4_WATCH_DEEP_EVERY == 0;
+	if (deep && dir_mtime >= 0 && watch_read_dir(path, &entries, &count) < 0) dir_mtime = -1;
+
+	scePthreadMutexLock(&watch_mtx);
+	d->scanning = 0;
+	if (notified != d->notified) {
+		/* The listing may predate a change already journaled, try again */
+		watch_entries_free(entries, count);
+		return fresh;
+	}
+	d->checks++;
+	d->last_scan = now;
+	if (!deep) return fresh;
+
+	if (d->scanned) {
+		/* Both sides are sorted, walk them like a merge */
+		old = d->entries;
+		old_count = d->count;
+		for (i = 0, j = 0; i < old_count || j < count;) {
+			c = i == old_count ? 1 : j == count ? -1 : strcmp(old[i].name, entries[j].name);
+			snprintf(full_path, sizeof(full_path), "%s%s%s", path, path[1] ? "/" : "", c <= 0 ? old[i].name : entries[j].name);
+			if (c < 0) {
+				watch_append(FTPS4_WATCH_DELETED, full_path);
+				i++;
+			} else if (c > 0) {
+				watch_append(FTPS4_WATCH_CREATED, full_path);
+				j++;
+			} else {
+				/* A directory's mtime moves with its content, which is reported on its own */
+				if (!entries[j].dir && (old[i].size != entries[j].size || old[i].mtime != entries[j].mtime))
+					watch_append(FTPS4_WATCH_MODIFIED, full_path);
+				i++;
+				j++;
+			}
+		}
+		if (dir_mtime < 0 && d->dir_mtime >= 0) watch_append(FTPS4_WATCH_DELETED, path);
+	}
+
+	watch_entries_free(d->entries, d->count);
+	d->entries = entries;
+	d->count = count;
+	d->dir_mtime = dir_mtime;
+	d->scanned = 1;
+	return fresh;
+}
+
+void ftps4_watch_notify(ftps4_watch_event_t event, const char *path) {
+	const char *name = strrchr(path, '/');
+	unsigned int dir_len;
+	struct stat st;
+	watch_entry *grown;
+	watch_dir *d;
+	int i, k, exists;
+
+	if (name == NULL) return;
+	dir_len = name == path ? 1 : name - path;
+	name++;
+	exists = event != FTPS4_WATCH_DELETED && Sys::stat(path, &st) >= 0;
+
+	scePthreadMutexLock(&watch_mtx);
+	watch_append(event, path);
+
+	/* Keep the snapshot of the parent in step so its rescan stays quiet */
+	for (i = 0; i < FTPS4_WATCH_MAX_DIRS; i++) {
+		d = &watch_dirs[i];
+		if (!d->used || !d->scanned || strlen(d->path) != dir_len || strncmp(d->path, path, dir_len) != 0) continue;
+
+		d->notified++;
+		k = watch_find(d, name);
+		if (!exists) {
+			if (k < 0) break;
+			free(d->entries[k].name);
+			memmove(&d->entries[k], &d->entries[k + 1], (d->count - k - 1) * sizeof(*d->entries));
+			d->count--;
+			break;
+		}
+		if (k < 0) {
+			k = -k - 1;
+			grown = (watch_entry *)realloc(d->entries, (d->count + 1) * sizeof(*d->entries));
+			if (grown == NULL) break;
+			d->entries = grown;
+			if ((name = strdup(name)) == NULL) break;
+			memmove(&d->entries[k + 1], &d->entries[k], (d->count - k) * sizeof(*d->entries));
+			d->entries[k].name = (char *)name;
+			d->count++;
+		}
+		d->entries[k].size = st.st_size;
+		d->entries[k].mtime = st.st_mtime;
+		d->entries[k].dir = S_ISDIR(st.st_mode);
+		break;
+	}
+	scePthreadMutexUnlock(&watch_mtx);
+}
+
+unsigned long long ftps4_watch_wait(const char *path, unsigned long long token, unsigned long long timeout_us,
+	ftps4_watch_emit_func emit, ftps4_watch_cancel_func cancel, void *arg) {
+	watch_change *found;
+	unsigned long long now, seen, deadline = sceKernelGetProcessTime() + timeout_us;
+	/* Whether anything before now was asked about */
+	int since = token != 0;
+	int n = 0, i, stop;
+
+	if ((found = (watch_change *)malloc(FTPS4_WATCH_MAX_REPORT * sizeof(*found))) == NULL) return token;
+
+	scePthreadMutexLock(&watch_mtx);
+	if (!token || token > watch_seq) token = watch_seq;
+
+	while (1) {
+		/* Outside changes show up in the journal like any other. Without a
+		* snapshot from before they can't be told apart from what was there. */
+		if (watch_scan(path) && since) {
+			found[0].event = FTPS4_WATCH_OVERFLOW;
+			snprintf(found[0].path, sizeof(found[0].path), "%s", path);
+			token = watch_seq;
+			n = 1;
+			break;
+		}
+		since = 1;
+
+		if (watch_seq - token > FTPS4_WATCH_JOURNAL_SIZE) {
+			/* Waited too long between calls, what happened is gone */
+			found[0].event = FTPS4_WATCH_OVERFLOW;
+			snprintf(found[0].path, sizeof(found[0].path), "%s", path);
+			token = watch_seq;
+			n = 1;
+		}
+		for (; token < watch_seq && n < FTPS4_WATCH_MAX_REPORT; token++) {
+			watch_change *c = &journal[(token + 1) % FTPS4_WATCH_JOURNAL_SIZE];
+			if (watch_under(path, c->path)) found[n++] = *c;
+		}
+		if (n) break;
+
+		now = sceKernelGetProcessTime();
+		if (now >= deadline) break;
+		if (cancel) {
+			/* cancel talks to the client and may block, notifiers must not
+			* wait for it. The loop checks everything again afterwards. */
+			seen = watch_seq;
+			scePthreadMutexUnlock(&watch_mtx);
+			stop = cancel(arg);
+			scePthreadMutexLock(&watch_mtx);
+			if (stop) break;
+			if (watch_seq != seen) continue;
+			now = sceKernelGetProcessTime();
+			if (now >= deadline) break;
+		}
+		scePthreadCondTimedwait(&watch_cond, &watch_mtx, deadline - now < WATCH_SLICE ? deadline - now : WATCH_SLICE);
+	}
+	scePthreadMutexUnlock(&watch_mtx);
+
+	for (i = 0; i < n; i++) emit(arg, found[i].event, found[i].path);
+	free(found);
+	return token;
+}
+
+void ftps4_watch_init() {
+	/* Tokens handed out are never 0, that asks for changes from now on */
+	watch_seq = 1;
+	memset(watch_dirs, 0, sizeof(watch_dirs));
+	scePthreadMutexInit(&watch_mtx, NULL, "FTPS4_watch_mutex");
+	scePthreadCondInit(&watch_cond, NULL, "FTPS4_watch_cond");
+}
+
+void ftps4_watch_fini() {
+	int i;
+
+	for (i = 0; i < FTPS4_WATCH_MAX_DIRS; i++) watch_entries_free(watch_dirs[i].entries, watch_dirs[i].count);
+	memset(watch_dirs, 0, sizeof(watch_dirs));
+	scePthreadCondDestroy(&watch_cond);
+	scePthreadMutexDestroy(&watch_mtx);
+}
@@ -0,0 +1,48 @@
+/*
+* Change notification (SITE WATCH).
+*
+* Changes are kept in a journal numbered by a token that only grows. The
+* server's own commands report what they change, changes made by anything
+* else are found by rescanning the directories being watched now and then
+* (their direct entries only, by size and mtime).
+*/
+
+#pragma once
+
+#include <application.h>
+#include "ftp_path.h"
+
+#define FTPS4_WATCH_JOURNAL_SIZE 1024
+/* Directories kept rescanned for outside changes */
+#define FTPS4_WATCH_MAX_DIRS 16
+/* How often a watched directory is checked for outside changes, every
+* FTPS4_WATCH_DEEP_EVERY check also stats its entries */
+#define FTPS4_WATCH_SCAN_INTERVAL (2 * 1000 * 1000)
+#define FTPS4_WATCH_DEEP_EVERY 5
+/* Changes returned by one wait, the rest come with the next one */
+#define FTPS4_WATCH_MAX_REPORT 64
+
+typedef enum {
+	FTPS4_WATCH_CREATED,
+	FTPS4_WATCH_MODIFIED,
+	FTPS4_WATCH_DELETED,
+	/* Changes were lost (the journal wrapped or the directory's snapshot
+	* was dropped), list the path again */
+	FTPS4_WATCH_OVERFLOW,
+} ftps4_watch_event_t;
+
+typedef void (*ftps4_watch_emit_func)(void *arg, ftps4_watch_event_t event, const char *path);
+/* Polled while waiting, non zero ends the wait */
+typedef int (*ftps4_watch_cancel_func)(void *arg);
+
+void ftps4_watch_init();
+void ftps4_watch_fini();
+
+/* Records a change of path (canonical) made by this server */
+void ftps4_watch_notify(ftps4_watch_event_t event, const char *path);
+/* Waits up to timeout_us for changes at or below path (canonical) after
+* token, 0 meaning from now on. Each change found is passed to emit, the
+* return value is the token to wait from next time. */
+unsigned long long ftps4_watch_wait(const char *path, unsigned long long token, unsigned long long timeout_us,
+	ftps4_watch_emit_func emit, ftps4_watch_cancel_func cancel, void *arg);
+const char *ftps4_watch_event_name(ftps4_watch_event_t event);
@@ -7,9 +7,19 @@ Application app;
 // The Port to use.
 #define PS4_PORT 1337
 
+// The Ports to use for passive data connections.
+#define PS4_PASV_PORT_MIN 1338
+#define PS4_PASV_PORT_MAX 1369
+
+// The Port of the read-only HTTP frontend.
+#define PS4_HTTP_PORT 8080
+
 // Flag to indicate, the app is running.
 int run;
 
+// Flag to indicate, the HTTP frontend is wanted (off unless PS4FTP/usehttp.txt is on the USB drive).
+int use_http;
+
 // Loggers.
 Logger debug;
 Logger info;
@@ -24,7 +34,11 @@ char mount_from_path[PATH_MAXX]; /* Yes, global. Lazy */ /* As long it works, wh
 void custom_MTFR(ftps4_client_info_t *client) {
 	char from_path[PATH_MAX];
 	/* Get the origin filename */
-	FTP::ftps4_gen_ftp_fullpath(client, from_path, sizeof(from_path));
+	if (FTP::ftps4_gen_ftp_fullpath(client, from_path, sizeof(from_path)) < 0) {
+		mount_from_path[0] = '\0';
+		FTP::ftps4_ext_client_send_ctrl_msg(client, "550 Invalid path." FTPS4_EOL);
+		return;
+	}
 
 	/* The file to be renamed is the received path */
 	strncpy(mount_from_path, from_path, sizeof(mount_from_path));
@@ -39,7 +53,10 @@ void custom_MTTO(ftps4_client_info_t *client) {
 	int result;
 
 	/* Get the destination filename */
-	FTP::ftps4_gen_ftp_fullpath(client, path_to, sizeof(path_to));
+	if (FTP::ftps4_gen_ftp_fullpath(client, path_to, sizeof(path_to)) < 0 || !mount_from_path[0]) {
+		FTP::ftps4_ext_client_send_ctrl_msg(client, "550 Invalid path." FTPS4_EOL);
+		return;
+	}
 
 	/* Just in case */
 	Sys::unmount(path_to, 0);
@@ -78,7 +95,10 @@ void custom_UMT(ftps4_client_info_t *client) {
 	int result;
 	char mount_path[PATH_MAX];
 
-	FTP::ftps4_gen_ftp_fullpath(client, mount_path, sizeof(mount_path));
+	if (FTP::ftps4_gen_ftp_fullpath(client, mount_path, sizeof(mount_path)) < 0) {
+		FTP::ftps4_ext_client_send_ctrl_msg(client, "550 Invalid path." FTPS4_EOL);
+		return;
+	}
 
 	result = Sys::unmount(mount_path, 0);
 	if (result < 0) {
@@ -100,6 +120,7 @@ bool UsbCheck(int device) {
 	String test = "ghse7ihbredguwezs.txt";
 	String folder = "PS4FTP/";
 	String debugTest = "PS4FTP/usedebug.txt";
+	String httpTest = "PS4FTP/usehttp.txt";
 	String _debug = "PS4FTP/debug_log_";
 
 	if (device == 0) usb += "usb0/";
@@ -141,6 +162,20 @@ bool UsbCheck(int device) {
 		// Set the info logger for the FTP.
 		FTP::info = &info;
 
+		// Traces go next to the logs.
+		format = usb;
+		format += folder;
+		FTP::ftps4_set_trace_dir(format.c_str());
+
+		// Shall we serve HTTP ?
+		format = usb;
+		format += httpTest;
+		check = fopen(format.c_str(), "r");
+		if (check) {
+			fclose(check);
+			use_http = 1;
+		}
+
 		// Shall we use debug logging ?
 		format = usb;
 		format += debugTest;
@@ -181,6 +216,8 @@ void *FtpEntry(void *) {
 		run = 1;
 
 		// Initialize the FTP.
+		FTP::ftps4_set_pasv_port_range(PS4_PASV_PORT_MIN, PS4_PASV_PORT_MAX);
+		if (use_http) FTP::ftps4_set_http_port(PS4_HTTP_PORT);
 		FTP::ftps4_init(PS4_IP, PS4_PORT);
 		FTP::ftps4_ext_add_custom_command("SHUTDOWN", custom_SHUTDOWN);
 		FTP::ftps4_ext_add_custom_command("MTFR", custom_MTFR);
@@ -194,6 +231,7 @@ void *FtpEntry(void *) {
 		Console::LineBreak();
 		Console::LineBreak();
 		Console::WriteWarning("PS4 listening on IP %s Port %i\n", PS4_IP, PS4_PORT);
+		if (use_http) Console::WriteWarning("HTTP downloads on http://%s:%i/\n", PS4_IP, PS4_HTTP_PORT);
 		Console::WriteLine("Press Options to exit on any time\n.");
 
 		// While we are running.
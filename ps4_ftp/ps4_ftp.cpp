@@ -3,6 +3,24 @@
 */
 
 #include "ps4_ftp.h"
+#include "ftp_log.h"
+#include "ftp_cache.h"
+#include "ftp_sparse.h"
+#include "ftp_io.h"
+#include "ftp_path.h"
+#include "ftp_trace.h"
+#include "ftp_dedup.h"
+#include "ftp_delta.h"
+#include "ftp_du.h"
+#include "ftp_prefetch.h"
+#include "ftp_tree.h"
+#include "ftp_watch.h"
+#include "ftp_http.h"
+#include "ftp_find.h"
+#include "ftp_dir.h"
+
+#include <atomic>
+#include <new>
 
 #define UNUSED(x) (void)(x)
 
@@ -12,9 +30,30 @@
 #define FTP_DEFAULT_PATH   "/"
 #define IN_ADDR_ANY 0
 #define MAX_CUSTOM_COMMANDS 16
-
-static bool useDebug = false;
-static bool useInfo = false;
+#define MAX_PASV_POOL 64
+#define DEFAULT_MAX_CLIENTS 32
+/* Session registry slot state: owned by a session, visible to iterators,
+* its data sockets being changed or aborted (see client_data_lock()), and
+* the number of iterators holding the session in the low bits */
+#define SESSION_USED 0x80000000u
+#define SESSION_LIVE 0x40000000u
+#define SESSION_DATA_LOCK 0x20000000u
+#define SESSION_PINS 0x1FFFFFFFu
+/* How long an unregistering session sleeps while iterators still hold it */
+#define SESSION_UNPIN_WAIT (1 * 1000)
+/* How long client_data_lock() sleeps while the other side holds it */
+#define SESSION_LOCK_WAIT 100
+#define MAX_UPLOADS 32
+/* How often an upload waiting for another session's copy of the file looks again */
+#define UPLOAD_UNSHARE_WAIT (50 * 1000)
+#define DEFAULT_CTRL_IDLE_TIMEOUT (15 * 60)
+#define DEFAULT_DATA_STALL_TIMEOUT (2 * 60)
+/* How long ftps4_fini() waits for all sessions together */
+#define SHUTDOWN_TIMEOUT (3 * 1000 * 1000)
+#define REAPER_INTERVAL (1000 * 1000)
+/* Granularity of interruptible waits on the data connection */
+#define ABORT_POLL_INTERVAL (100 * 1000)
+#define DEFAULT_DATA_TIMEOUT_MS (10 * 1000)
 
 Logger *FTP::debug;
 Logger *FTP::info;
@@ -31,39 +70,495 @@ static struct {
 } custom_command_dispatchers[MAX_CUSTOM_COMMANDS];
 
 static int ftp_initialized = 0;
+/* Set when ftps4_fini() gave up waiting for sessions, the server stays
+* initialized (ftps4_init() refuses) until a later ftps4_fini() sees them go */
+static int ftp_draining = 0;
 static unsigned int file_buf_size = DEFAULT_FILE_BUF_SIZE;
 static struct SceNetInAddr ps4_addr;
-static unsigned short int ps4_port;
-static ScePthread server_thid;
-static int server_sockfd;
-static int number_clients = 0;
-static ftps4_client_info_t *client_list = NULL;
-static ScePthreadMutex client_list_mtx;
-
-#define client_send_ctrl_msg(cl, str) \
-	sceNetSend(cl->ctrl_sockfd, str, strlen(str), 0)
-
-static inline void client_send_data_msg(ftps4_client_info_t *client, const char *str) {
-	if (client->data_con_type == FTP_DATA_CONNECTION_ACTIVE) {
-		sceNetSend(client->data_sockfd, str, strlen(str), 0);
-	} else {
-		sceNetSend(client->pasv_sockfd, str, strlen(str), 0);
+/* A listening socket and the thread accepting on it */
+typedef struct {
+	const char *name;
+	unsigned short port;
+	int sockfd;
+	ScePthread thid;
+	/* Its sessions speak HTTP rather than FTP */
+	int http;
+	/* Sent to connections refused for lack of sessions */
+	const char *busy_msg;
+} listener_t;
+
+static listener_t ftp_listener;
+/* Read-only HTTP frontend, 0 as port disables it */
+static listener_t http_listener;
+static unsigned short http_port = 0;
+/* Sessions registered and session numbers handed out, never reused */
+static std::atomic<int> number_clients;
+static std::atomic<int> next_client_num;
+static unsigned int max_clients = DEFAULT_MAX_CLIENTS;
+/* Session slab and the registry state of each slot (SESSION_* bits) */
+static ftps4_client_info_t *client_slab = NULL;
+static std::atomic<unsigned int> *client_state = NULL;
+/* Where client_alloc() starts looking for a free slot */
+static std::atomic<unsigned int> client_alloc_hint;
+/* Live client threads, they are detached and signal when they exit */
+static int client_threads = 0;
+static ScePthreadMutex client_threads_mtx;
+static ScePthreadCond client_threads_cond;
+/* Idle reaper, timeouts are in seconds and 0 disables them */
+static unsigned int ctrl_idle_timeout = DEFAULT_CTRL_IDLE_TIMEOUT;
+static unsigned int data_stall_timeout = DEFAULT_DATA_STALL_TIMEOUT;
+static ScePthread reaper_thid;
+static ScePthreadMutex reaper_mtx;
+static ScePthreadCond reaper_cond;
+static int reaper_running = 0;
+static unsigned short pasv_port_min = 0;
+static unsigned short pasv_port_max = 0;
+static unsigned int data_timeout_ms = DEFAULT_DATA_TIMEOUT_MS;
+static unsigned long long cache_size = FTPS4_CACHE_DEFAULT_SIZE;
+static unsigned long long prefetch_size = FTPS4_PREFETCH_DEFAULT_BUDGET;
+/* Content index for SITE DEDUP, empty disables it */
+static char dedup_index[PATH_MAXX] = FTPS4_DEDUP_DEFAULT_INDEX;
+/* Where SITE TRACE DUMP puts its files */
+static char trace_dir[PATH_MAXX] = ".";
+/* Colon separated directories SITE FIND indexes, empty disables it */
+static char find_roots[1024] = FTPS4_FIND_DEFAULT_ROOTS;
+
+/* Pre-bound PASV listeners, handed out to one session at a time */
+static struct {
+	int sockfd;
+	unsigned short port;
+	int in_use;
+} pasv_pool[MAX_PASV_POOL];
+static int pasv_pool_size = 0;
+static ScePthreadMutex pasv_pool_mtx;
+
+/* MODE B block descriptor bits (RFC 959) */
+#define MODE_B_DESC_EOR 0x80
+#define MODE_B_DESC_EOF 0x40
+
+/* Most data moved between two looks at the control connection */
+#define CTRL_POLL_SLICE (64 * 1024)
+/* How far past a full recv_buffer the control socket is searched for ABOR */
+#define CTRL_PEEK_SIZE 1024
+
+/* SITE SIGN hashes this much of the file per round */
+#define DELTA_SIGN_WINDOW (32 * 1024 * 1024)
+#define DELTA_COPY_BUF_SIZE (1024 * 1024)
+/* SITE RMTREE and SITE RENAMES progress */
+#define TREE_PROGRESS_INTERVAL (1 * 1000 * 1000)
+#define RENAME_PROGRESS_STEP 1000
+/* Largest SITE RENAMES list, and how many failed pairs are listed */
+#define RENAME_LIST_MAX (1024 * 1024)
+#define RENAME_MAX_REPORTED 32
+/* Longest a SITE WATCH waits in seconds */
+#define WATCH_MAX_WAIT (10 * 60)
+/* HTTP connections idle longer than this between requests are closed */
+#define HTTP_KEEPALIVE_TIMEOUT (15 * 1000 * 1000)
+/* Directory index pages grow up to this, entries past it are left out */
+#define HTTP_INDEX_MAX (1024 * 1024)
+
+/* Why a transfer failed, decides between 426 and 451 */
+#define XFER_ERROR_NONE 0
+#define XFER_ERROR_NETWORK 1
+#define XFER_ERROR_LOCAL 2
+
+/* Sends all of buf on the control connection. A connection that fails is
+* beyond saving: the session is aborted, its receive side woken up so it
+* ends and the running transfer stops. */
+static int client_send_ctrl_raw(ftps4_client_info_t *client, const char *buf, unsigned int len) {
+	int ret;
+
+	while (len > 0) {
+		ret = sceNetSend(client->ctrl_sockfd, buf, len, 0);
+		if (ret > 0) {
+			buf += ret;
+			len -= ret;
+			continue;
+		}
+		if (!client->abort_requested) {
+			FTPS4_LOG_DEBUG("Control send failed: 0x%08X\n", ret);
+			client->abort_requested = 1;
+			client->data_abort = 1;
+			sceNetSocketAbort(client->ctrl_sockfd, SCE_NET_SOCKET_ABORT_FLAG_RCV_PRESERVATION);
+		}
+		return -1;
+	}
+	return 0;
+}
+
+/* Sends every queued control reply in one go */
+static void client_flush_ctrl(ftps4_client_info_t *client) {
+	if (client->ctrl_out_len == 0) return;
+	client_send_ctrl_raw(client, client->ctrl_out, client->ctrl_out_len);
+	client->ctrl_out_len = 0;
+}
+
+/* Queues a control reply, it goes out with the next flush: before the session
+* blocks on the control socket again and before a data transfer starts */
+static void client_send_ctrl_msg(ftps4_client_info_t *client, const char *str) {
+	unsigned int len = strlen(str);
+
+	if (client->ctrl_out_len + len > sizeof(client->ctrl_out)) {
+		client_flush_ctrl(client);
+		if (len > sizeof(client->ctrl_out)) {
+			client_send_ctrl_raw(client, str, len);
+			return;
+		}
 	}
+	memcpy(client->ctrl_out + client->ctrl_out_len, str, len);
+	client->ctrl_out_len += len;
+}
+
+/* Skips the Telnet IP/Synch bytes clients put in front of an urgent ABOR */
+static char *skip_telnet_prefix(char *line) {
+	while ((unsigned char)*line >= 0xF0) line++;
+	return line;
 }
 
-static inline int client_recv_data_raw(ftps4_client_info_t *client, void *buf, unsigned int len) {
-	if (client->data_con_type == FTP_DATA_CONNECTION_ACTIVE) {
-		return sceNetRecv(client->data_sockfd, buf, len, 0);
+static void client_send_transfer_status(ftps4_client_info_t *client) {
+	char msg[256];
+	unsigned long long elapsed = sceKernelGetProcessTime() - client->xfer_start;
+	unsigned long long rate = elapsed ? client->xfer_bytes * 1000 * 1000 / 1024 / elapsed : 0;
+
+	if (client->xfer_total >= 0) {
+		snprintf(msg, sizeof(msg),
+			"213-Transfer in progress" FTPS4_EOL
+			" %llu of %lld bytes, %llu KiB/s" FTPS4_EOL
+			"213 End of status" FTPS4_EOL,
+			client->xfer_bytes, client->xfer_total, rate);
 	} else {
-		return sceNetRecv(client->pasv_sockfd, buf, len, 0);
+		snprintf(msg, sizeof(msg),
+			"213-Transfer in progress" FTPS4_EOL
+			" %llu bytes, %llu KiB/s" FTPS4_EOL
+			"213 End of status" FTPS4_EOL,
+			client->xfer_bytes, rate);
+	}
+	client_send_ctrl_msg(client, msg);
+}
+
+static int is_abor_line(const char *cmd) {
+	return strncasecmp(cmd, "ABOR", 4) == 0 && (cmd[4] == '\r' || cmd[4] == '\n');
+}
+
+/* Nothing more is read while recv_buffer is full of pipelined commands, so
+* look further into the socket for an ABOR that has to stop the transfer.
+* The line stays in the socket and is dropped when it is read later. */
+static void client_peek_abor(ftps4_client_info_t *client) {
+	char buf[CTRL_PEEK_SIZE + 1];
+	char *line, *end;
+	int ret;
+
+	ret = sceNetRecv(client->ctrl_sockfd, buf, CTRL_PEEK_SIZE, SCE_NET_MSG_PEEK | SCE_NET_MSG_DONTWAIT);
+	if (ret <= 0) return;
+	buf[ret] = '\0';
+	end = buf + ret;
+
+	/* The socket may start in the middle of the buffer's last line */
+	line = buf;
+	if (client->recv_buffer[client->n_recv - 1] != '\n') {
+		line = (char *)memchr(buf, '\n', ret);
+		if (!line) return;
+		line++;
+	}
+	while (line < end) {
+		if (is_abor_line(skip_telnet_prefix(line))) {
+			FTPS4_LOG_INFO("\t%i> ABOR (during transfer)\n", client->num);
+			client->data_abort = 1;
+			client->abor_pending = 1;
+			client->abor_queued = 1;
+			return;
+		}
+		line = (char *)memchr(line, '\n', end - line);
+		if (!line) return;
+		line++;
+	}
+}
+
+/* Looks at the control connection without blocking while a transfer runs.
+* ABOR and STAT are handled right away, anything else stays queued and is
+* dispatched once the transfer is over. */
+static void client_poll_ctrl(ftps4_client_info_t *client) {
+	char *line, *eol, *cmd;
+	unsigned int pos, next;
+	int ret;
+
+	if (client->n_recv < (int)sizeof(client->recv_buffer) - 1) {
+		ret = sceNetRecv(client->ctrl_sockfd, client->recv_buffer + client->n_recv,
+			sizeof(client->recv_buffer) - 1 - client->n_recv, SCE_NET_MSG_DONTWAIT);
+		if (ret == 0) {
+			/* Nobody is left to tell about the transfer. An HTTP client may
+			* close its sending side once the request is out (HTTP/1.0 does),
+			* that only ends the requests: the response still goes out and
+			* http_thread() sees the end when it reads the next one. */
+			if (!client->http) client->data_abort = 1;
+			return;
+		}
+		if (ret < 0) return;
+		client->n_recv += ret;
+		client->recv_buffer[client->n_recv] = '\0';
+		client->ctrl_activity = sceKernelGetProcessTime();
+	}
+	/* A pipelined HTTP request, it waits for the response to finish */
+	if (client->http) return;
+	if (client->n_recv >= (int)sizeof(client->recv_buffer) - 1 && !client->abor_queued) client_peek_abor(client);
+
+	/* The line being executed is in front of the buffer, leave it alone */
+	pos = client->line_len;
+	while (pos < (unsigned int)client->n_recv) {
+		line = client->recv_buffer + pos;
+		eol = (char *)memchr(line, '\n', client->n_recv - pos);
+		if (!eol) break;
+		next = eol + 1 - client->recv_buffer;
+
+		cmd = skip_telnet_prefix(line);
+		if (is_abor_line(cmd)) {
+			FTPS4_LOG_INFO("\t%i> ABOR (during transfer)\n", client->num);
+			client->data_abort = 1;
+			client->abor_pending = 1;
+		} else if (strncasecmp(cmd, "STAT", 4) == 0 && (cmd[4] == '\r' || cmd[4] == '\n')) {
+			client_send_transfer_status(client);
+			client_flush_ctrl(client);
+		} else {
+			pos = next;
+			continue;
+		}
+
+		/* Handled, drop the line */
+		memmove(line, client->recv_buffer + next, client->n_recv - next);
+		client->n_recv -= next - pos;
+		client->recv_buffer[client->n_recv] = '\0';
 	}
 }
 
-static inline void client_send_data_raw(ftps4_client_info_t *client, const void *buf, unsigned int len) {
-	if (client->data_con_type == FTP_DATA_CONNECTION_ACTIVE) {
-		sceNetSend(client->data_sockfd, buf, len, 0);
+static int socket_set_nbio(int sockfd, int enable) {
+	return sceNetSetsockopt(sockfd, SCE_NET_SOL_SOCKET, SCE_NET_SO_NBIO, &enable, sizeof(enable));
+}
+
+/* Waits until the socket is readable/writable (SCE_NET_EPOLL* events),
+* returns > 0 when ready, 0 on timeout and < 0 on error */
+static int socket_wait(int sockfd, unsigned int events, unsigned int timeout_us) {
+	int eid, ret;
+	SceNetEpollEvent ev;
+
+	eid = sceNetEpollCreate("FTPS4_wait", 0);
+	if (eid < 0) return eid;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = events;
+	ret = sceNetEpollControl(eid, SCE_NET_EPOLL_CTL_ADD, sockfd, &ev);
+	if (ret >= 0) ret = sceNetEpollWait(eid, &ev, 1, timeout_us);
+
+	sceNetEpollDestroy(eid);
+	return ret;
+}
+
+/* Marks the running transfer as failed, the first reason sticks */
+static void client_fail_transfer(ftps4_client_info_t *client, int error) {
+	if (!client->xfer_error && !client->data_abort) client->xfer_error = error;
+	client->data_abort = 1;
+}
+
+static inline int client_data_sockfd(ftps4_client_info_t *client) {
+	return client->data_con_type == FTP_DATA_CONNECTION_ACTIVE ? client->data_sockfd : client->pasv_sockfd;
+}
+
+/* Registers sockfd for events with the data connection's epoll instance,
+* creating it on first use. Returns < 0 on error. */
+static int client_data_wait_set(ftps4_client_info_t *client, int sockfd, unsigned int events) {
+	SceNetEpollEvent ev;
+	int ret;
+
+	if (client->data_eid >= 0 && client->data_wait_fd == sockfd && client->data_wait_events == events) return 0;
+
+	if (client->data_eid < 0) {
+		client->data_eid = sceNetEpollCreate("FTPS4_data", 0);
+		if (client->data_eid < 0) return client->data_eid;
+		client->data_wait_fd = -1;
+	}
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = events;
+	if (client->data_wait_fd == sockfd) {
+		ret = sceNetEpollControl(client->data_eid, SCE_NET_EPOLL_CTL_MOD, sockfd, &ev);
 	} else {
-		sceNetSend(client->pasv_sockfd, buf, len, 0);
+		if (client->data_wait_fd >= 0) sceNetEpollControl(client->data_eid, SCE_NET_EPOLL_CTL_DEL, client->data_wait_fd, NULL);
+		ret = sceNetEpollControl(client->data_eid, SCE_NET_EPOLL_CTL_ADD, sockfd, &ev);
+	}
+	client->data_wait_fd = ret < 0 ? -1 : sockfd;
+	client->data_wait_events = events;
+	return ret;
+}
+
+/* Drops the data connection's epoll instance */
+static void client_data_wait_end(ftps4_client_info_t *client) {
+	if (client->data_eid < 0) return;
+	sceNetEpollDestroy(client->data_eid);
+	client->data_eid = -1;
+	client->data_wait_fd = -1;
+}
+
+/* Waits for the (non-blocking) data socket during a transfer, looking at the
+* control connection in between. Returns > 0 when ready and < 0 once the
+* transfer is aborted or nothing moved for the stall timeout. */
+static int client_wait_data_io(ftps4_client_info_t *client, int sockfd, unsigned int events) {
+	SceNetEpollEvent ev;
+	int ret;
+
+	ret = client_data_wait_set(client, sockfd, events);
+	if (ret < 0) return ret;
+
+	while (1) {
+		if (client->data_abort) return SCE_NET_ERROR_EINTR;
+
+		ret = sceNetEpollWait(client->data_eid, &ev, 1, ABORT_POLL_INTERVAL);
+		if (ret != 0) return ret;
+
+		client_poll_ctrl(client);
+		if (data_stall_timeout &&
+			sceKernelGetProcessTime() - client->data_activity > (unsigned long long)data_stall_timeout * 1000 * 1000)
+			return SCE_NET_ERROR_ETIMEDOUT;
+	}
+}
+
+/* Returns what was received, 0 if the peer closed the connection or < 0 on error */
+static int client_recv_data_raw(ftps4_client_info_t *client, void *buf, unsigned int len) {
+	int sockfd = client_data_sockfd(client);
+	int ret;
+
+	while (1) {
+		ret = sceNetRecv(sockfd, buf, len, 0);
+		if (ret >= 0) break;
+		if (ret != SCE_NET_ERROR_EAGAIN && ret != SCE_NET_ERROR_EINTR) break;
+		if (ret == SCE_NET_ERROR_EAGAIN && (ret = client_wait_data_io(client, sockfd, SCE_NET_EPOLLIN)) < 0) break;
+	}
+
+	if (ret < 0) {
+		FTPS4_LOG_DEBUG("Data recv failed: 0x%08X\n", ret);
+		client_fail_transfer(client, XFER_ERROR_NETWORK);
+	}
+	/* Progress for the stalled transfer reaper */
+	if (ret > 0) client->data_activity = sceKernelGetProcessTime();
+	return ret;
+}
+
+/* Sends all of buf, returns 0 or < 0 if the transfer failed or was aborted */
+static int client_send_data_raw(ftps4_client_info_t *client, const void *buf, unsigned int len) {
+	const unsigned char *p = (const unsigned char *)buf;
+	int sockfd = client_data_sockfd(client);
+	int ret;
+
+	while (len > 0) {
+		if (client->data_abort) return SCE_NET_ERROR_EINTR;
+
+		ret = sceNetSend(sockfd, p, len, 0);
+		if (ret > 0) {
+			/* Short sends are normal on a non-blocking socket */
+			p += ret;
+			len -= ret;
+			client->data_activity = sceKernelGetProcessTime();
+			continue;
+		}
+		if (ret == SCE_NET_ERROR_EINTR) continue;
+		if (ret == SCE_NET_ERROR_EAGAIN && (ret = client_wait_data_io(client, sockfd, SCE_NET_EPOLLOUT)) > 0) continue;
+
+		FTPS4_LOG_DEBUG("Data send failed: 0x%08X\n", ret);
+		client_fail_transfer(client, XFER_ERROR_NETWORK);
+		return ret < 0 ? ret : -1;
+	}
+	return 0;
+}
+
+/* Receives exactly len bytes, returns len, 0 if the peer closed first or < 0 on error */
+static int client_recv_data_full(ftps4_client_info_t *client, void *buf, unsigned int len) {
+	unsigned int got = 0;
+	int n;
+
+	while (got < len) {
+		n = client_recv_data_raw(client, (unsigned char *)buf + got, len - got);
+		if (n <= 0) return n;
+		got += n;
+	}
+	return got;
+}
+
+/* Sends over the data connection, framed in blocks when in MODE B.
+* Returns 0 or < 0 if the transfer failed. */
+static int client_send_data(ftps4_client_info_t *client, const void *buf, unsigned int len) {
+	const unsigned char *p = (const unsigned char *)buf;
+	unsigned char header[3];
+	unsigned int n;
+
+	if (client->transfer_mode != FTP_TRANSFER_MODE_BLOCK) {
+		if (client_send_data_raw(client, buf, len) < 0) return -1;
+		client->xfer_bytes += len;
+		return 0;
+	}
+
+	while (len > 0) {
+		n = len < 0xFFFF ? len : 0xFFFF;
+		header[0] = 0;
+		header[1] = (n >> 8) & 0xFF;
+		header[2] = n & 0xFF;
+		if (client_send_data_raw(client, header, sizeof(header)) < 0 ||
+			client_send_data_raw(client, p, n) < 0)
+			return -1;
+		client->xfer_bytes += n;
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/* Receives from the data connection, unframing blocks when in MODE B.
+* Returns 0 at the end of the file and < 0 on error. */
+static int client_recv_data(ftps4_client_info_t *client, void *buf, unsigned int len) {
+	unsigned char header[3];
+	int n;
+
+	if (client->transfer_mode != FTP_TRANSFER_MODE_BLOCK) {
+		n = client_recv_data_raw(client, buf, len);
+		if (n > 0) client->xfer_bytes += n;
+		return n;
+	}
+
+	while (client->block_left == 0) {
+		if (client->block_desc & MODE_B_DESC_EOF) return 0;
+
+		n = client_recv_data_full(client, header, sizeof(header));
+		/* Closing the connection without an EOF block aborts the transfer */
+		if (n <= 0) return n < 0 ? n : -1;
+
+		client->block_desc = header[0];
+		client->block_left = (header[1] << 8) | header[2];
+	}
+
+	if (len > client->block_left) len = client->block_left;
+	n = client_recv_data_raw(client, buf, len);
+	if (n <= 0) return n < 0 ? n : -1;
+	client->block_left -= n;
+	client->xfer_bytes += n;
+	return n;
+}
+
+static inline int client_send_data_msg(ftps4_client_info_t *client, const char *str) {
+	return client_send_data(client, str, strlen(str));
+}
+
+/* Sends a buffer over the data connection, charging the shaper slice by slice
+* and watching the control connection in between */
+static void client_send_data_shaped(ftps4_client_info_t *client, const unsigned char *buf, unsigned int len) {
+	unsigned int slice = ftps4_shaper_slice(&client->flow);
+	unsigned int n;
+
+	if (!slice || slice > CTRL_POLL_SLICE) slice = CTRL_POLL_SLICE;
+
+	while (len > 0 && !client->data_abort) {
+		n = len < slice ? len : slice;
+		if (client_send_data(client, buf, n) < 0) return;
+		ftps4_shaper_consume(&client->flow, n);
+		client_poll_ctrl(client);
+		buf += n;
+		len -= n;
 	}
 }
 
@@ -78,43 +573,184 @@ static void cmd_PASS_func(ftps4_client_info_t *client) { client_send_ctrl_msg(cl
 static void cmd_QUIT_func(ftps4_client_info_t *client) { client_send_ctrl_msg(client, "221 Goodbye senpai :'(" FTPS4_EOL); }
 static void cmd_SYST_func(ftps4_client_info_t *client) { client_send_ctrl_msg(client, "215 UNIX Type: L8" FTPS4_EOL); }
 
-static void cmd_PASV_func(ftps4_client_info_t *client) {
-	int ret;
-	UNUSED(ret);
+static int pasv_listener_create(unsigned short port) {
+	int sockfd, ret;
+	struct SceNetSockaddrIn addr;
+
+	sockfd = sceNetSocket("FTPS4_pasv_socket", SCE_NET_AF_INET, SCE_NET_SOCK_STREAM, 0);
+	if (sockfd < 0) return sockfd;
+
+	addr.sin_len = sizeof(addr);
+	addr.sin_family = SCE_NET_AF_INET;
+	addr.sin_addr.s_addr = sceNetHtonl(IN_ADDR_ANY);
+	/* Port 0 lets the PS4 choose a port */
+	addr.sin_port = sceNetHtons(port);
+
+	ret = sceNetBind(sockfd, (struct SceNetSockaddr *)&addr, sizeof(addr));
+	if (ret >= 0) ret = sceNetListen(sockfd, 128);
+	/* Accepts are always bounded by a timeout */
+	if (ret >= 0) ret = socket_set_nbio(sockfd, 1);
+	if (ret < 0) {
+		FTPS4_LOG_DEBUG("PASV listener on port %hu failed: 0x%08X\n", port, ret);
+		sceNetSocketClose(sockfd);
+		return ret;
+	}
+	return sockfd;
+}
 
-	char cmd[512];
-	unsigned int namelen;
-	struct SceNetSockaddrIn picked;
+static void pasv_pool_init() {
+	int i;
+	unsigned short port;
 
-	/* Create data mode socket name */
-	char data_socket_name[64];
-	sprintf(data_socket_name, "FTPS4_client_%i_data_socket", client->num);
+	scePthreadMutexInit(&pasv_pool_mtx, NULL, "FTPS4_pasv_pool_mutex");
+	pasv_pool_size = 0;
 
-	/* Create the data socket */
-	client->data_sockfd = sceNetSocket(data_socket_name, SCE_NET_AF_INET, SCE_NET_SOCK_STREAM, 0);
+	if (!pasv_port_min || pasv_port_max < pasv_port_min) return;
 
-	if (useDebug) FTP::debug->Log("PASV data socket fd: %d\n", client->data_sockfd);
+	for (port = pasv_port_min; pasv_pool_size < MAX_PASV_POOL; port++) {
+		i = pasv_pool_size;
+		pasv_pool[i].sockfd = pasv_listener_create(port);
+		if (pasv_pool[i].sockfd >= 0) {
+			pasv_pool[i].port = port;
+			pasv_pool[i].in_use = 0;
+			pasv_pool_size++;
+		}
+		if (port == pasv_port_max) break;
+	}
 
-	/* Fill the data socket address */
-	client->data_sockaddr.sin_len = sizeof(client->data_sockaddr);
-	client->data_sockaddr.sin_family = SCE_NET_AF_INET;
-	client->data_sockaddr.sin_addr.s_addr = sceNetHtonl(IN_ADDR_ANY);
-	/* Let the PS4 choose a port */
-	client->data_sockaddr.sin_port = sceNetHtons(0);
+	FTPS4_LOG_DEBUG("PASV pool: %d listeners in %hu-%hu\n", pasv_pool_size, pasv_port_min, pasv_port_max);
+}
 
-	/* Bind the data socket address to the data socket */
-	ret = sceNetBind(client->data_sockfd, (struct SceNetSockaddr *)&client->data_sockaddr, sizeof(client->data_sockaddr));
-	if (useDebug) FTP::debug->Log("sceNetBind(): 0x%08X\n", ret);
+static void pasv_pool_fini() {
+	int i;
+	for (i = 0; i < pasv_pool_size; i++) {
+		sceNetSocketClose(pasv_pool[i].sockfd);
+	}
+	pasv_pool_size = 0;
+	scePthreadMutexDestroy(&pasv_pool_mtx);
+}
 
-	/* Start listening */
-	ret = sceNetListen(client->data_sockfd, 128);
-	if (useDebug) FTP::debug->Log("sceNetListen(): 0x%08X\n", ret);
+static int pasv_pool_get() {
+	int i, slot = -1;
+
+	scePthreadMutexLock(&pasv_pool_mtx);
+	for (i = 0; i < pasv_pool_size; i++) {
+		if (!pasv_pool[i].in_use) {
+			pasv_pool[i].in_use = 1;
+			slot = i;
+			break;
+		}
+	}
+	scePthreadMutexUnlock(&pasv_pool_mtx);
+	return slot;
+}
+
+static void pasv_pool_put(int slot) {
+	int fd;
+	struct SceNetSockaddrIn addr;
+	unsigned int addrlen;
+
+	/* Drop connections nobody accepted so the next user doesn't get them */
+	do {
+		addrlen = sizeof(addr);
+		fd = sceNetAccept(pasv_pool[slot].sockfd, (struct SceNetSockaddr *)&addr, &addrlen);
+		if (fd >= 0) sceNetSocketClose(fd);
+	} while (fd >= 0);
+
+	scePthreadMutexLock(&pasv_pool_mtx);
+	pasv_pool[slot].in_use = 0;
+	scePthreadMutexUnlock(&pasv_pool_mtx);
+}
+
+/* client_abort() runs on the reaper and shutdown threads. A session holds
+* this while it closes or replaces its data sockets, so no socket is aborted
+* after it was closed (and its descriptor maybe reused) or once a pooled
+* listener went back to the pool. Held for a few calls at most. */
+static void client_data_lock(ftps4_client_info_t *client) {
+	std::atomic<unsigned int> *state = &client_state[client - client_slab];
+
+	while (state->fetch_or(SESSION_DATA_LOCK, std::memory_order_acquire) & SESSION_DATA_LOCK)
+		sceKernelUsleep(SESSION_LOCK_WAIT);
+}
+
+static void client_data_unlock(ftps4_client_info_t *client) {
+	client_state[client - client_slab].fetch_and(~SESSION_DATA_LOCK, std::memory_order_release);
+}
+
+static void client_close_data_connection(ftps4_client_info_t *client) {
+	client->in_transfer = 0;
+	client_data_wait_end(client);
+	if (client->data_con_type == FTP_DATA_CONNECTION_NONE) return;
+
+	client->data_connected = 0;
+
+	client_data_lock(client);
+	if (client->pasv_slot >= 0) {
+		pasv_pool_put(client->pasv_slot);
+		client->pasv_slot = -1;
+	} else if (client->data_sockfd >= 0) {
+		sceNetSocketClose(client->data_sockfd);
+	}
+	client->data_sockfd = -1;
+
+	/* In passive mode we have to close the client pasv socket too */
+	if (client->data_con_type == FTP_DATA_CONNECTION_PASSIVE && client->pasv_sockfd >= 0) {
+		sceNetSocketClose(client->pasv_sockfd);
+		client->pasv_sockfd = -1;
+	}
+	client->data_con_type = FTP_DATA_CONNECTION_NONE;
+	client_data_unlock(client);
+}
+
+/* Sets up the passive listener, returns the port in host order or 0 */
+static unsigned short client_setup_passive(ftps4_client_info_t *client) {
+	unsigned int namelen;
+	struct SceNetSockaddrIn picked;
+	int slot, sockfd;
+
+	/* Forget a data connection that was never used */
+	client_close_data_connection(client);
+
+	slot = pasv_pool_get();
+	if (slot >= 0) {
+		client_data_lock(client);
+		client->pasv_sockfd = -1;
+		client->pasv_slot = slot;
+		client->data_sockfd = pasv_pool[slot].sockfd;
+		client->data_con_type = FTP_DATA_CONNECTION_PASSIVE;
+		client_data_unlock(client);
+		FTPS4_LOG_DEBUG("PASV pool slot %d port %hu\n", slot, pasv_pool[slot].port);
+		return pasv_pool[slot].port;
+	}
+
+	/* Pool disabled or exhausted, let the PS4 choose a port */
+	sockfd = pasv_listener_create(0);
+	FTPS4_LOG_DEBUG("PASV data socket fd: %d\n", sockfd);
+	if (sockfd < 0) return 0;
+	client_data_lock(client);
+	client->pasv_sockfd = -1;
+	client->data_sockfd = sockfd;
+	client->data_con_type = FTP_DATA_CONNECTION_PASSIVE;
+	client_data_unlock(client);
 
 	/* Get the port that the PS4 has chosen */
 	namelen = sizeof(picked);
-	sceNetGetsockname(client->data_sockfd, (struct SceNetSockaddr *)&picked, &namelen);
+	sceNetGetsockname(sockfd, (struct SceNetSockaddr *)&picked, &namelen);
+
+	FTPS4_LOG_DEBUG("PASV mode port: 0x%04X\n", picked.sin_port);
+
+	return sceNetNtohs(picked.sin_port);
+}
 
-	if (useDebug) FTP::debug->Log("PASV mode port: 0x%04X\n", picked.sin_port);
+static void cmd_PASV_func(ftps4_client_info_t *client) {
+	char cmd[512];
+	unsigned short port;
+
+	port = client_setup_passive(client);
+	if (!port) {
+		client_send_ctrl_msg(client, "425 Can't open passive connection." FTPS4_EOL);
+		return;
+	}
 
 	/* Build the command */
 	sprintf(cmd, "227 Entering Passive Mode (%hhu,%hhu,%hhu,%hhu,%hhu,%hhu)" FTPS4_EOL,
@@ -122,13 +758,30 @@ static void cmd_PASV_func(ftps4_client_info_t *client) {
 		(ps4_addr.s_addr >> 8) & 0xFF,
 		(ps4_addr.s_addr >> 16) & 0xFF,
 		(ps4_addr.s_addr >> 24) & 0xFF,
-		(picked.sin_port >> 0) & 0xFF,
-		(picked.sin_port >> 8) & 0xFF);
+		(port >> 8) & 0xFF,
+		(port >> 0) & 0xFF);
 
 	client_send_ctrl_msg(client, cmd);
+}
 
-	/* Set the data connection type to passive! */
-	client->data_con_type = FTP_DATA_CONNECTION_PASSIVE;
+static void cmd_EPSV_func(ftps4_client_info_t *client) {
+	char cmd[64];
+	unsigned short port;
+
+	/* EPSV ALL only forbids PORT/PASV afterwards, nothing to set up */
+	if (client->recv_cmd_args && strncasecmp(client->recv_cmd_args, "ALL", 3) == 0) {
+		client_send_ctrl_msg(client, "200 EPSV ALL command successful." FTPS4_EOL);
+		return;
+	}
+
+	port = client_setup_passive(client);
+	if (!port) {
+		client_send_ctrl_msg(client, "425 Can't open passive connection." FTPS4_EOL);
+		return;
+	}
+
+	snprintf(cmd, sizeof(cmd), "229 Entering Extended Passive Mode (|||%hu|)" FTPS4_EOL, port);
+	client_send_ctrl_msg(client, cmd);
 }
 
 static void cmd_PORT_func(ftps4_client_info_t *client) {
@@ -137,7 +790,7 @@ static void cmd_PORT_func(ftps4_client_info_t *client) {
 	unsigned short data_port;
 	char ip_str[16];
 	struct SceNetInAddr data_addr;
-	int n;
+	int n, sockfd;
 	
 	if (!client->recv_cmd_args) {
 		client_send_ctrl_msg(client, "500 Syntax error, command unrecognized." FTPS4_EOL);
@@ -158,16 +811,22 @@ static void cmd_PORT_func(ftps4_client_info_t *client) {
 	/* Convert the IP to a struct in_addr */
 	sceNetInetPton(SCE_NET_AF_INET, ip_str, &data_addr);
 
-	if (useDebug) FTP::debug->Log("PORT connection to client's IP: %s Port: %d\n", ip_str, data_port);
+	FTPS4_LOG_DEBUG("PORT connection to client's IP: %s Port: %d\n", ip_str, data_port);
+
+	/* Forget a data connection that was never used */
+	client_close_data_connection(client);
 
 	/* Create data mode socket name */
 	char data_socket_name[64];
 	sprintf(data_socket_name, "FTPS4_client_%i_data_socket", client->num);
 
 	/* Create data mode socket */
-	client->data_sockfd = sceNetSocket(data_socket_name, SCE_NET_AF_INET, SCE_NET_SOCK_STREAM, 0);
+	sockfd = sceNetSocket(data_socket_name, SCE_NET_AF_INET, SCE_NET_SOCK_STREAM, 0);
+	client_data_lock(client);
+	client->data_sockfd = sockfd;
+	client_data_unlock(client);
 
-	if (useDebug) FTP::debug->Log("Client %i data socket fd: %d\n", client->num, client->data_sockfd);
+	FTPS4_LOG_DEBUG("Client %i data socket fd: %d\n", client->num, client->data_sockfd);
 
 	/* Prepare socket address for the data connection */
 	client->data_sockaddr.sin_len = sizeof(client->data_sockaddr);
@@ -177,40 +836,158 @@ static void cmd_PORT_func(ftps4_client_info_t *client) {
 
 	/* Set the data connection type to active! */
 	client->data_con_type = FTP_DATA_CONNECTION_ACTIVE;
+	client->pasv_slot = -1;
 
 	client_send_ctrl_msg(client, "200 PORT command successful!" FTPS4_EOL);
 }
 
-static void client_open_data_connection(ftps4_client_info_t *client) {
+/* Waits for a data socket for at most the data timeout, giving up early when
+* the session is aborted. Returns > 0 when ready and < 0 on error or timeout. */
+static int client_wait_data_socket(ftps4_client_info_t *client, int sockfd, unsigned int events) {
+	unsigned long long now, deadline;
+	unsigned long long slice;
 	int ret;
-	UNUSED(ret);
 
+	now = sceKernelGetProcessTime();
+	deadline = now + (unsigned long long)data_timeout_ms * 1000;
+
+	while (now < deadline) {
+		if (client->data_abort) return SCE_NET_ERROR_EINTR;
+
+		slice = deadline - now;
+		if (slice > ABORT_POLL_INTERVAL) slice = ABORT_POLL_INTERVAL;
+		ret = socket_wait(sockfd, events, (unsigned int)slice);
+		if (ret != 0) return ret;
+
+		now = sceKernelGetProcessTime();
+	}
+	return SCE_NET_ERROR_ETIMEDOUT;
+}
+
+static int client_connect_active(ftps4_client_info_t *client) {
+	int ret, err;
+	unsigned int optlen;
+
+	socket_set_nbio(client->data_sockfd, 1);
+
+	/* Connect to the client using the data socket */
+	ret = sceNetConnect(client->data_sockfd,
+		(struct SceNetSockaddr *)&client->data_sockaddr,
+		sizeof(client->data_sockaddr));
+
+	if (ret == SCE_NET_ERROR_EINPROGRESS) {
+		ret = client_wait_data_socket(client, client->data_sockfd, SCE_NET_EPOLLOUT);
+		if (ret > 0) {
+			err = 0;
+			optlen = sizeof(err);
+			sceNetGetsockopt(client->data_sockfd, SCE_NET_SOL_SOCKET, SCE_NET_SO_ERROR, &err, &optlen);
+			ret = err ? -err : 0;
+		}
+	}
+
+	FTPS4_LOG_DEBUG("sceNetConnect(): 0x%08X\n", ret);
+
+	/* The socket stays non-blocking, transfers wait for it with a timeout */
+	return ret < 0 ? ret : 0;
+}
+
+static int client_accept_passive(ftps4_client_info_t *client) {
+	int fd, ret;
 	unsigned int addrlen;
+	unsigned long long now, deadline;
 
-	if (client->data_con_type == FTP_DATA_CONNECTION_ACTIVE) {
-		/* Connect to the client using the data socket */
-		ret = sceNetConnect(client->data_sockfd,
-			(struct SceNetSockaddr *)&client->data_sockaddr,
-			sizeof(client->data_sockaddr));
+	now = sceKernelGetProcessTime();
+	deadline = now + (unsigned long long)data_timeout_ms * 1000;
+
+	while (now < deadline) {
+		ret = client_wait_data_socket(client, client->data_sockfd, SCE_NET_EPOLLIN);
+		if (ret < 0) return ret;
 
-		if (useDebug) FTP::debug->Log("sceNetConnect(): 0x%08X\n", ret);
-	} else {
 		/* Listen to the client using the data socket */
 		addrlen = sizeof(client->pasv_sockaddr);
-		client->pasv_sockfd = sceNetAccept(client->data_sockfd,
+		fd = sceNetAccept(client->data_sockfd,
 			(struct SceNetSockaddr *)&client->pasv_sockaddr,
 			&addrlen);
-		if (useDebug) FTP::debug->Log("PASV client fd: 0x%08X\n", client->pasv_sockfd);
+		FTPS4_LOG_DEBUG("PASV client fd: 0x%08X\n", fd);
+
+		if (fd >= 0) {
+			/* Pooled ports are shared, only take the connection from our client */
+			if (client->pasv_sockaddr.sin_addr.s_addr == client->addr.sin_addr.s_addr) {
+				/* Transfers wait for the socket themselves, see client_wait_data_io() */
+				socket_set_nbio(fd, 1);
+				client_data_lock(client);
+				client->pasv_sockfd = fd;
+				client_data_unlock(client);
+				return 0;
+			}
+			FTPS4_LOG_DEBUG("PASV connection from a foreign address dropped\n");
+			sceNetSocketClose(fd);
+		} else if (fd != SCE_NET_ERROR_EAGAIN) {
+			return fd;
+		}
+
+		now = sceKernelGetProcessTime();
 	}
+	return SCE_NET_ERROR_ETIMEDOUT;
 }
 
-static void client_close_data_connection(ftps4_client_info_t *client) {
-	sceNetSocketClose(client->data_sockfd);
-	/* In passive mode we have to close the client pasv socket too */
-	if (client->data_con_type == FTP_DATA_CONNECTION_PASSIVE) {
-		sceNetSocketClose(client->pasv_sockfd);
+/* Returns 0 once the data connection is established, < 0 on error or timeout */
+static int client_open_data_connection(ftps4_client_info_t *client) {
+	int ret = -1;
+
+	/* The client may wait for our reply before connecting */
+	client_flush_ctrl(client);
+
+	client->data_activity = sceKernelGetProcessTime();
+	client->in_transfer = 1;
+	/* A shutdown in progress still has to stop this transfer */
+	client->data_abort = client->abort_requested;
+	client->xfer_error = XFER_ERROR_NONE;
+	client->xfer_bytes = 0;
+	client->xfer_total = -1;
+	client->xfer_start = client->data_activity;
+
+	/* In MODE B the connection stays up between transfers */
+	if (client->data_connected) return 0;
+
+	FTPS4_TRACE_BEGIN(t_setup);
+	if (client->data_con_type == FTP_DATA_CONNECTION_ACTIVE) ret = client_connect_active(client);
+	else if (client->data_con_type == FTP_DATA_CONNECTION_PASSIVE) ret = client_accept_passive(client);
+	FTPS4_TRACE_END(t_setup, "data_setup", client->data_con_type == FTP_DATA_CONNECTION_ACTIVE ? "PORT" : "PASV", client->num, ret == 0);
+
+	if (ret == 0) client->data_connected = 1;
+	client->block_left = 0;
+	client->block_desc = 0;
+	return ret;
+}
+
+/* Ends a transfer on the data connection. In MODE B a successful transfer
+* leaves the connection open for the next one, a sent file is terminated by
+* an empty EOF block instead of closing the connection. */
+static void client_finish_data_connection(ftps4_client_info_t *client, int sent, int ok) {
+	unsigned char eof_block[3] = { MODE_B_DESC_EOF, 0, 0 };
+
+	if (client->transfer_mode == FTP_TRANSFER_MODE_BLOCK && ok && client->data_connected) {
+		/* A connection that lost the EOF block is useless for the next transfer */
+		if (sent && client_send_data_raw(client, eof_block, sizeof(eof_block)) < 0) {
+			client_close_data_connection(client);
+			return;
+		}
+		client->in_transfer = 0;
+		client->block_left = 0;
+		client->block_desc = 0;
+		return;
 	}
-	client->data_con_type = FTP_DATA_CONNECTION_NONE;
+	client_close_data_connection(client);
+}
+
+/* Final reply of a transfer: the data connection broke or the transfer was
+* aborted (426), something went wrong on our side (451) or ok_msg */
+static void client_send_transfer_result(ftps4_client_info_t *client, int ok, const char *ok_msg) {
+	if (ok && !client->data_abort && !client->xfer_error) client_send_ctrl_msg(client, ok_msg);
+	else if (client->xfer_error == XFER_ERROR_LOCAL)
+		client_send_ctrl_msg(client, "451 Requested action aborted: local error in processing." FTPS4_EOL);
+	else client_send_ctrl_msg(client, "426 Connection closed; transfer aborted." FTPS4_EOL);
 }
 
 static char file_type_char(mode_t mode) {
@@ -259,157 +1036,140 @@ static int gen_list_format(char *out, int n, mode_t file_mode, unsigned long lon
 #undef LIST_FMT
 }
 
+/* Entries sent between looks at the control connection */
+#define LIST_POLL_EVERY 64
+
+typedef struct {
+	ftps4_client_info_t *client;
+	const char *path;
+	struct tm cur_tm;
+	unsigned int sent;
+} list_ctx;
+
+/* Sends the LIST line of one entry, non zero ends the listing */
+static int list_entry(void *arg, const char *name, int type) {
+	list_ctx *ctx = (list_ctx *)arg;
+	ftps4_client_info_t *client = ctx->client;
+	char buffer[512], full_path[PATH_MAXX], link_path[PATH_MAXX];
+	struct stat st;
+	struct tm tm;
+	int err, readlinkerr;
+	(void)type;
+
+	snprintf(full_path, sizeof(full_path), "%s/%s", ctx->path, name);
+
+	FTPS4_TRACE_BEGIN(t_stat);
+	err = Sys::stat(full_path, &st);
+	FTPS4_TRACE_END(t_stat, "list_stat", NULL, client->num, 0);
+
+	if (err == 0) {
+		if (S_ISREG(st.st_mode)) ftps4_prefetch_list_add(client->prefetch, name, st.st_size);
+		if (S_ISLNK(st.st_mode)) {
+			if ((readlinkerr = Sys::readlink(full_path, link_path, sizeof(link_path))) > 0) {
+				link_path[readlinkerr] = 0;
+			} else link_path[0] = 0;
+		}
+
+		gmtime_s(&st.st_ctim.tv_sec, &tm);
+		gen_list_format(buffer, sizeof(buffer),
+			st.st_mode,
+			st.st_size,
+			tm,
+			name,
+			S_ISLNK(st.st_mode) && link_path[0] != '\0' ? link_path : NULL,
+			ctx->cur_tm);
+
+		if (client_send_data_msg(client, buffer) < 0) return 1;
+		ftps4_shaper_consume(&client->flow, strlen(buffer));
+	} else FTPS4_LOG_DEBUG("%s stat returned %d\n", full_path, errno);
+
+	if (++ctx->sent % LIST_POLL_EVERY == 0) client_poll_ctrl(client);
+	return client->data_abort;
+}
+
 static void send_LIST(ftps4_client_info_t *client, const char *path) {
-	char buffer[512];
-	uint8_t* dentbuf;
-	size_t dentbufsize;
-	int dfd, dentsize, err, readlinkerr;
-	struct dirent *dent, *dend;
+	list_ctx ctx;
 	struct stat st;
 	time_t cur_time;
-	struct tm tm, cur_tm;
 
 	if (Sys::stat(path, &st) < 0) {
 		client_send_ctrl_msg(client, "550 Invalid directory." FTPS4_EOL);
 		return;
 	}
 
-	dentbufsize = st.st_blksize;
-	if (useDebug) FTP::debug->Log("dent buffer size = %lx\n", dentbufsize);
-
-	dfd = Sys::open(path, O_RDONLY, 0);
-	if (dfd < 0) {
-		client_send_ctrl_msg(client, "550 Invalid directory." FTPS4_EOL);
-		return;
-	}
-
-	dentbuf = new uint8_t[dentbufsize];
-	memset(dentbuf, 0, dentbufsize);
+	/* Mirroring clients fetch what they listed in this order */
+	ftps4_prefetch_list_begin(&client->prefetch, path);
 
 	client_send_ctrl_msg(client, "150 Opening ASCII mode data transfer for LIST." FTPS4_EOL);
 
-	client_open_data_connection(client);
+	if (client_open_data_connection(client) < 0) {
+		client_close_data_connection(client);
+		client_send_ctrl_msg(client, "425 Can't open data connection." FTPS4_EOL);
+		return;
+	}
+	ftps4_shaper_transfer_start(&client->flow, SHAPER_CLASS_INTERACTIVE);
 
 	time(&cur_time);
-	gmtime_s(&cur_time, &cur_tm);
-
-	while ((dentsize = Sys::getdents(dfd, (char*)dentbuf, dentbufsize)) > 0) {
-		dent = (struct dirent *)dentbuf;
-		dend = (struct dirent *)(&dentbuf[dentsize]);
-
-		while (dent != dend) {
-			if (dent->d_name[0] != '\0') {
-				char full_path[PATH_MAXX];
-				snprintf(full_path, sizeof(full_path), "%s/%s", path, dent->d_name);
-
-				err = Sys::stat(full_path, &st);
-
-				if (err == 0) {
-					char link_path[PATH_MAXX];
-					if (S_ISLNK(st.st_mode)) {
-						if ((readlinkerr = Sys::readlink(full_path, link_path, sizeof(link_path))) > 0) {
-							link_path[readlinkerr] = 0;
-						} else link_path[0] = 0;
-					}
-
-					gmtime_s(&st.st_ctim.tv_sec, &tm);
-					gen_list_format(buffer, sizeof(buffer),
-						st.st_mode,
-						st.st_size,
-						tm,
-						dent->d_name,
-						S_ISLNK(st.st_mode) && link_path[0] != '\0' ? link_path : NULL,
-						cur_tm);
-
-					client_send_data_msg(client, buffer);
-					memset(buffer, 0, sizeof(buffer));
-				} else if (useDebug) FTP::debug->Log("%s stat returned %d\n", full_path, errno);
-			} else if (useDebug) FTP::debug->Log("got empty dent\n");
-			dent = (struct dirent *)((void *)(dent + dent->d_reclen));
-		}
-		memset(dentbuf, 0, dentbufsize);
+	gmtime_s(&cur_time, &ctx.cur_tm);
+	ctx.client = client;
+	ctx.path = path;
+	ctx.sent = 0;
+
+	/* A file lists as nothing */
+	if (S_ISDIR(st.st_mode) && ftps4_dir_read(path, list_entry, &ctx) < 0) {
+		FTPS4_LOG_DEBUG("Could not read %s\n", path);
+		client_fail_transfer(client, XFER_ERROR_LOCAL);
 	}
 
-	Sys::close(dfd);
-	delete[] dentbuf;
-
-	if (useDebug) FTP::debug->Log("Done sending LIST\n");
+	FTPS4_LOG_DEBUG("Done sending LIST\n");
 
-	client_close_data_connection(client);
-	client_send_ctrl_msg(client, "226 Transfer complete." FTPS4_EOL);
+	ftps4_shaper_transfer_end(&client->flow);
+	client_finish_data_connection(client, 1, !client->data_abort);
+	client_send_transfer_result(client, 1, "226 Transfer complete." FTPS4_EOL);
 }
 
 static void cmd_LIST_func(ftps4_client_info_t *client) {
-	char list_path[PATH_MAXX];
-	int list_cur_path = 1;
-	int n = !client->recv_cmd_args
-		? 0
-		: sscanf(client->recv_cmd_args, "%[^\r\n\t]", list_path);
-
-	if (n > 0 && file_exists(list_path)) list_cur_path = 0;
-
-	if (list_cur_path) send_LIST(client, client->cur_path);
-	else send_LIST(client, list_path);
+	ftps4_path_t list_path;
+
+	/* Anything that isn't an existing path (ls flags for one) lists the working directory */
+	if (client->recv_cmd_args && client->recv_cmd_args[0] &&
+		ftps4_path_resolve(&client->cwd, client->recv_cmd_args, &list_path) >= 0 &&
+		file_exists(list_path.path))
+		send_LIST(client, list_path.path);
+	else
+		send_LIST(client, client->cwd.path);
 }
 
 static void cmd_PWD_func(ftps4_client_info_t *client) {
-	char msg[PATH_MAXX];
-	snprintf(msg, sizeof(msg), "257 \"%s\" is the current directory." FTPS4_EOL, client->cur_path);
+	char msg[PATH_MAXX + 64];
+	snprintf(msg, sizeof(msg), "257 \"%s\" is the current directory." FTPS4_EOL, client->cwd.path);
 	client_send_ctrl_msg(client, msg);
 }
 
-static void dir_up(char *path) {
-	char *pch;
-	size_t len_in = strlen(path);
-	if (len_in == 1) {
-	root:
-		strcpy(path, "/");
-		return;
-	}
-	pch = strrchr(path, '/');
-	if (pch == path)
-		goto root;
-	*pch = '\0';
-}
-
 static void cmd_CWD_func(ftps4_client_info_t *client) {
-	char cmd_path[PATH_MAXX];
-	char tmp_path[PATH_MAXX];
+	ftps4_path_t path;
 	int pd;
-	int n = !client->recv_cmd_args
-		? 0
-		: sscanf(client->recv_cmd_args, "%[^\r\n\t]", cmd_path);
 
-	if (n < 1) client_send_ctrl_msg(client, "500 Syntax error, command unrecognized." FTPS4_EOL);
-	else {
-		if (strcmp(cmd_path, "/") == 0) {
-			strcpy(client->cur_path, cmd_path);
-		} else  if (strcmp(cmd_path, "..") == 0) {
-			dir_up(client->cur_path);
-		} else {
-			if (cmd_path[0] == '/') { /* Full path */
-				strcpy(tmp_path, cmd_path);
-			} else { /* Change dir relative to current dir */
-				if (strcmp(client->cur_path, "/") == 0)
-					snprintf(tmp_path, sizeof(tmp_path), "%s%s", client->cur_path, cmd_path);
-				else
-					snprintf(tmp_path, sizeof(tmp_path), "%s/%s", client->cur_path, cmd_path);
-			}
+	if (!client->recv_cmd_args || !client->recv_cmd_args[0]) {
+		client_send_ctrl_msg(client, "500 Syntax error, command unrecognized." FTPS4_EOL);
+		return;
+	}
+	if (ftps4_path_resolve(&client->cwd, client->recv_cmd_args, &path) < 0) {
+		client_send_ctrl_msg(client, "550 Invalid directory." FTPS4_EOL);
+		return;
+	}
 
-			/* If the path is not "/", check if it exists */
-			if (strcmp(tmp_path, "/") != 0) {
-				/* Check if the path exists */
-				pd = Sys::open(tmp_path, O_RDONLY, 0);
-				if (pd < 0) {
-					client_send_ctrl_msg(client, "550 Invalid directory." FTPS4_EOL);
-					return;
-				}
-				Sys::close(pd);
-			}
-			strcpy(client->cur_path, tmp_path);
+	/* If the path is not "/", check if it exists */
+	if (path.depth) {
+		pd = Sys::open(path.path, O_RDONLY, 0);
+		if (pd < 0) {
+			client_send_ctrl_msg(client, "550 Invalid directory." FTPS4_EOL);
+			return;
 		}
-		client_send_ctrl_msg(client, "250 Requested file action okay, completed." FTPS4_EOL);
+		Sys::close(pd);
 	}
+	client->cwd = path;
+	client_send_ctrl_msg(client, "250 Requested file action okay, completed." FTPS4_EOL);
 }
 
 static void cmd_TYPE_func(ftps4_client_info_t *client) {
@@ -434,230 +1194,1456 @@ static void cmd_TYPE_func(ftps4_client_info_t *client) {
 	} else client_send_ctrl_msg(client, "504 Error: bad parameters?" FTPS4_EOL);
 }
 
+static void cmd_MODE_func(ftps4_client_info_t *client) {
+	char mode;
+	int n = !client->recv_cmd_args
+		? 0
+		: sscanf(client->recv_cmd_args, "%c", &mode);
+
+	if (n < 1) {
+		client_send_ctrl_msg(client, "501 Syntax error in parameters or arguments." FTPS4_EOL);
+		return;
+	}
+
+	switch (mode) {
+	case 'S':
+	case 's':
+		/* Stream mode ends transfers by closing, drop a kept connection */
+		if (client->transfer_mode == FTP_TRANSFER_MODE_BLOCK) client_close_data_connection(client);
+		client->transfer_mode = FTP_TRANSFER_MODE_STREAM;
+		client_send_ctrl_msg(client, "200 Mode set to S." FTPS4_EOL);
+		break;
+	case 'B':
+	case 'b':
+		client->transfer_mode = FTP_TRANSFER_MODE_BLOCK;
+		client_send_ctrl_msg(client, "200 Mode set to B." FTPS4_EOL);
+		break;
+	default:
+		client_send_ctrl_msg(client, "504 Command not implemented for that parameter." FTPS4_EOL);
+		break;
+	}
+}
+
 static void cmd_CDUP_func(ftps4_client_info_t *client) {
-	dir_up(client->cur_path);
+	ftps4_path_up(&client->cwd);
 	client_send_ctrl_msg(client, "200 Command okay." FTPS4_EOL);
 }
 
+/* Sends [offset, end) from the block cache, returns the offset it got to.
+* Anything past that (the cache gave up) has to be read directly. */
+static unsigned long long send_file_cached(ftps4_client_info_t *client, int fd, const ftps4_cache_key_t *key,
+	unsigned long long offset, unsigned long long end) {
+	const ftps4_cache_block_t *blk;
+	unsigned int skip, len;
+
+	if (end > key->size) end = key->size;
+	while (offset < end && !client->data_abort) {
+		FTPS4_TRACE_BEGIN(t_get);
+		blk = ftps4_cache_get(key, offset, fd);
+		FTPS4_TRACE_END(t_get, "cache_get", NULL, client->num, blk ? blk->len : 0);
+		if (blk == NULL) break;
+
+		/* Blocks are aligned, a resumed transfer starts inside the first one */
+		skip = (unsigned int)(offset - blk->offset);
+		if (skip >= blk->len) {
+			ftps4_cache_put(blk);
+			break;
+		}
+		len = blk->len - skip;
+		if (len > end - offset) len = (unsigned int)(end - offset);
+		FTPS4_TRACE_BEGIN(t_send);
+		client_send_data_shaped(client, blk->data + skip, len);
+		FTPS4_TRACE_END(t_send, "data_send", NULL, client->num, len);
+		offset += len;
+		ftps4_cache_put(blk);
+	}
+	return offset;
+}
+
+/* Sends [offset, end) of the file io reads (end may be past EOF), through
+* the block cache when key is set. Used by RETR and the HTTP frontend,
+* failures are left in client->xfer_error. */
+static void send_file_data(ftps4_client_info_t *client, ftps4_io_t *io, const ftps4_cache_key_t *key,
+	unsigned long long offset, unsigned long long end) {
+	const unsigned char *data;
+	int bytes_read = 0;
+
+	if (key) offset = send_file_cached(client, io->fd, key, offset, end);
+
+	ftps4_io_seek_read(io, offset);
+	while (offset < end && !client->data_abort) {
+		FTPS4_TRACE_BEGIN(t_read);
+		bytes_read = ftps4_io_read(io, &data);
+		FTPS4_TRACE_END(t_read, "file_read", NULL, client->num, bytes_read > 0 ? bytes_read : 0);
+		if (bytes_read <= 0) break;
+		if ((unsigned long long)bytes_read > end - offset) bytes_read = (int)(end - offset);
+
+		FTPS4_TRACE_BEGIN(t_send);
+		client_send_data_shaped(client, data, bytes_read);
+		FTPS4_TRACE_END(t_send, "data_send", NULL, client->num, bytes_read);
+		offset += bytes_read;
+	}
+	if (bytes_read < 0) client_fail_transfer(client, XFER_ERROR_LOCAL);
+}
+
 static void send_file(ftps4_client_info_t *client, const char *path) {
-	unsigned char *buffer;
+	ftps4_io_t io;
 	int fd;
-	unsigned int bytes_read;
+	long long file_size;
+	struct stat st;
+	ftps4_cache_key_t key;
+	int use_cache;
 
-	if (useDebug) FTP::debug->Log("Opening: %s\n", path);
+	FTPS4_LOG_DEBUG("Opening: %s\n", path);
 
 	if ((fd = Sys::open(path, O_RDONLY, 0)) >= 0) {
 
-		Sys::lseek(fd, client->restore_point, SEEK_SET);
+		/* The key is that of the file opened, the path may be replaced meanwhile */
+		use_cache = ftps4_cache_enabled() && Sys::fstat(fd, &st) >= 0 && S_ISREG(st.st_mode);
+		if (use_cache) ftps4_cache_key_from_stat(&key, &st);
+
+		file_size = Sys::lseek(fd, 0, SEEK_END);
 
-		buffer = (unsigned char *)malloc(file_buf_size);
-		if (buffer == NULL) {
+		if (ftps4_io_init(&io, fd, file_buf_size) < 0) {
+			Sys::close(fd);
 			client_send_ctrl_msg(client, "550 Could not allocate memory." FTPS4_EOL);
 			return;
 		}
 
-		client_open_data_connection(client);
+		if (client_open_data_connection(client) < 0) {
+			Sys::close(fd);
+			ftps4_io_fini(&io);
+			client_close_data_connection(client);
+			client_send_ctrl_msg(client, "425 Can't open data connection." FTPS4_EOL);
+			return;
+		}
 		client_send_ctrl_msg(client, "150 Opening Image mode data transfer." FTPS4_EOL);
+		client_flush_ctrl(client);
 
-		while ((bytes_read = Sys::read(fd, buffer, file_buf_size)) > 0) {
-			client_send_data_raw(client, buffer, bytes_read);
-		}
+		if (file_size >= 0) client->xfer_total = file_size - client->restore_point;
 
+		/* Small files are interactive so library scans stay responsive */
+		if (file_size >= 0 && (unsigned long long)(file_size - client->restore_point) <= ftps4_shaper_get_small_file())
+			ftps4_shaper_transfer_start(&client->flow, SHAPER_CLASS_INTERACTIVE);
+		else
+			ftps4_shaper_transfer_start(&client->flow, SHAPER_CLASS_BULK);
+
+		/* Up to EOF, a file that grows meanwhile is sent as far as it got */
+		send_file_data(client, &io, use_cache ? &key : NULL, client->restore_point, ~0ULL);
+
+		ftps4_shaper_transfer_end(&client->flow);
 		Sys::close(fd);
-		free(buffer);
+		ftps4_io_fini(&io);
 		client->restore_point = 0;
-		client_send_ctrl_msg(client, "226 Transfer completed." FTPS4_EOL);
-		client_close_data_connection(client);
+		client_finish_data_connection(client, 1, !client->data_abort);
+		client_send_transfer_result(client, 1, "226 Transfer completed." FTPS4_EOL);
 
 	} else client_send_ctrl_msg(client, "550 File not found." FTPS4_EOL);
 }
 
-/* This function generates a FTP full-path valid path with the input path (relative or absolute)
-* from RETR, STOR, DELE, RMD, MKD, RNFR and RNTO commands */
-static void gen_ftp_fullpath(ftps4_client_info_t *client, char *path, size_t path_size) {
-	char cmd_path[PATH_MAXX];
-	int n = !client->recv_cmd_args
-		? 0
-		: sscanf(client->recv_cmd_args, "%[^\r\n\t]", cmd_path);
+/* Resolves the command argument (relative or absolute) against the cwd into
+* the canonical path, without replying. Returns 0, -1 without an argument or
+* -2 when the name doesn't fit. */
+static int resolve_ftp_fullpath(ftps4_client_info_t *client, char *path, size_t path_size) {
+	ftps4_path_t resolved;
+	unsigned int len;
 
-	if (n < 1) {
-		client_send_ctrl_msg(client, "500 Syntax error, command unrecognized." FTPS4_EOL);
-		return;
-	}
+	if (!client->recv_cmd_args || !client->recv_cmd_args[0]) return -1;
 
-	if (cmd_path[0] == '/') {
-		/* Full path */
-		strncpy(path, cmd_path, path_size);
-	} else {
-		/* The file is relative to current dir, so
-		* append the file to the current path */
-		snprintf(path, path_size, "%s/%s", client->cur_path, cmd_path);
-	}
+	len = ftps4_path_resolve(&client->cwd, client->recv_cmd_args, &resolved) < 0
+		? path_size
+		: ftps4_path_len(&resolved);
+	if (len >= path_size) return -2;
+	memcpy(path, resolved.path, len + 1);
+	return 0;
+}
+
+/* This function generates a FTP full-path valid path with the input path (relative or absolute)
+* from RETR, STOR, DELE, RMD, MKD, RNFR and RNTO commands. The result is canonical, returns < 0
+* (and has replied) if there is no usable path. */
+static int gen_ftp_fullpath(ftps4_client_info_t *client, char *path, size_t path_size) {
+	int ret = resolve_ftp_fullpath(client, path, path_size);
+
+	if (ret == -1) client_send_ctrl_msg(client, "500 Syntax error, command unrecognized." FTPS4_EOL);
+	else if (ret < 0) client_send_ctrl_msg(client, "553 File name not allowed." FTPS4_EOL);
+	return ret < 0 ? -1 : 0;
 }
 
 static void cmd_RETR_func(ftps4_client_info_t *client) {
 	char dest_path[PATH_MAXX];
-	gen_ftp_fullpath(client, dest_path, sizeof(dest_path));
+	if (gen_ftp_fullpath(client, dest_path, sizeof(dest_path)) < 0) return;
+	ftps4_prefetch_retr(client->prefetch, dest_path);
 	send_file(client, dest_path);
 }
 
+/* Drops cached blocks of a file this server is about to change, and the
+* SITE DU totals it is part of */
+static void cache_invalidate_path(const char *path) {
+	struct stat st;
+	if (ftps4_cache_enabled() && Sys::stat(path, &st) >= 0) ftps4_cache_invalidate(st.st_dev, st.st_ino);
+	ftps4_du_invalidate(path);
+}
+
+/* Reports a change this server made to SITE WATCH and the SITE FIND index */
+static void notify_change(ftps4_watch_event_t event, const char *path) {
+	ftps4_watch_notify(event, path);
+	ftps4_find_notify(event, path);
+}
+
+/* Files that are being written by STOR right now. Several sessions may upload
+* segments of the same file at different REST offsets, only the first
+* writer is allowed to truncate it. A linked file being given a copy of its
+* own holds a slot as well, openers of it wait until the copy is in place. */
+static struct {
+	unsigned long long dev;
+	unsigned long long ino;
+	int writers;
+	int unsharing;
+} upload_table[MAX_UPLOADS];
+static ScePthreadMutex upload_mtx;
+
+/* Keeps a session responsive while dedup copies a file for it */
+static int dedup_cancel(void *arg) {
+	ftps4_client_info_t *client = (ftps4_client_info_t *)arg;
+
+	/* Copying isn't idling */
+	client->ctrl_activity = sceKernelGetProcessTime();
+	client_poll_ctrl(client);
+	return client->data_abort || client->abort_requested;
+}
+
+/* Opens path for a STOR at client->restore_point and registers the writer,
+* returns the fd (< 0 on error) and the upload slot (-1 if not tracked) */
+static int upload_open(ftps4_client_info_t *client, const char *path, int *slot, int *truncated) {
+	struct stat st;
+	int i, fd, ret, exists, free_slot = -1, busy;
+	int mode;
+
+	*slot = -1;
+
+	scePthreadMutexLock(&upload_mtx);
+
+	while (1) {
+		busy = -1;
+		if ((exists = Sys::stat(path, &st) >= 0)) {
+			for (i = 0; i < MAX_UPLOADS; i++) {
+				if ((upload_table[i].writers > 0 || upload_table[i].unsharing) &&
+					upload_table[i].dev == (unsigned long long)st.st_dev &&
+					upload_table[i].ino == (unsigned long long)st.st_ino) {
+					busy = i;
+					break;
+				}
+			}
+		}
+
+		/* Another session is copying the file, look again once it is done */
+		if (busy >= 0 && upload_table[busy].unsharing) {
+			scePthreadMutexUnlock(&upload_mtx);
+			client->data_abort = client->abort_requested;
+			if (dedup_cancel(client)) return -1;
+			sceKernelUsleep(UPLOAD_UNSHARE_WAIT);
+			scePthreadMutexLock(&upload_mtx);
+			continue;
+		}
+
+		/* APPE appends, REST writes in place, a plain STOR overwrites the file
+		* unless other segments of it are being written right now */
+		mode = O_CREAT | O_RDWR;
+		if (client->append_mode) mode |= O_APPEND;
+		else if (!client->restore_point && busy < 0) mode |= O_TRUNC;
+		*truncated = (mode & O_TRUNC) != 0;
+
+		/* Dedup may have hard linked the file, writing into it must not change
+		* the other names: the first writer gives it a copy of its own
+		* (segments after it share the copy). The copy is made outside the
+		* lock so other uploads go on meanwhile. */
+		if (!exists || busy >= 0 || *truncated || st.st_nlink < 2) break;
+
+		free_slot = -1;
+		for (i = 0; i < MAX_UPLOADS; i++) {
+			if (upload_table[i].writers == 0 && !upload_table[i].unsharing) {
+				free_slot = i;
+				break;
+			}
+		}
+		if (free_slot >= 0) {
+			upload_table[free_slot].dev = st.st_dev;
+			upload_table[free_slot].ino = st.st_ino;
+			upload_table[free_slot].unsharing = 1;
+		}
+		scePthreadMutexUnlock(&upload_mtx);
+
+		client->data_abort = client->abort_requested;
+		ret = ftps4_dedup_unshare(path, dedup_cancel, client);
+
+		scePthreadMutexLock(&upload_mtx);
+		if (free_slot >= 0) upload_table[free_slot].unsharing = 0;
+		if (ret < 0) {
+			scePthreadMutexUnlock(&upload_mtx);
+			return -1;
+		}
+		/* The path has a new inode now, other writers may have got in first */
+	}
+
+	/* Overwriting a linked file only unlinks this name */
+	if (*truncated && exists && st.st_nlink > 1) Sys::unlink(path);
+
+	fd = Sys::open(path, mode, 0777);
+	if (fd >= 0 && client->restore_point && !client->append_mode) {
+		if (Sys::lseek(fd, client->restore_point, SEEK_SET) < 0) {
+			Sys::close(fd);
+			fd = -1;
+		}
+	}
+
+	if (fd >= 0) {
+		if (busy >= 0) {
+			*slot = busy;
+		} else if (Sys::stat(path, &st) >= 0) {
+			free_slot = -1;
+			for (i = 0; i < MAX_UPLOADS; i++) {
+				if (upload_table[i].writers == 0 && !upload_table[i].unsharing) {
+					free_slot = i;
+					break;
+				}
+			}
+			/* Table full only means this upload isn't coordinated */
+			if (free_slot >= 0) {
+				upload_table[free_slot].dev = st.st_dev;
+				upload_table[free_slot].ino = st.st_ino;
+				*slot = free_slot;
+			}
+		}
+		if (*slot >= 0) upload_table[*slot].writers++;
+	}
+
+	scePthreadMutexUnlock(&upload_mtx);
+	return fd;
+}
+
+/* Closes fd and unregisters the writer. A failed upload that truncated the
+* file passes its path to throw the file away, which only happens when no
+* other writer is left to put its segment there. */
+static void upload_close(int fd, int slot, const char *discard_path) {
+	Sys::close(fd);
+
+	scePthreadMutexLock(&upload_mtx);
+	if (slot >= 0) upload_table[slot].writers--;
+	if (discard_path && (slot < 0 || upload_table[slot].writers == 0)) Sys::unlink(discard_path);
+	scePthreadMutexUnlock(&upload_mtx);
+}
+
 static void receive_file(ftps4_client_info_t *client, const char *path) {
-	unsigned char *buffer;
-	int fd;
-	unsigned int bytes_recv;
+	ftps4_io_t io;
+	unsigned char *space;
+	int fd, slot, truncated, sparse, existed;
+	int bytes_recv, ret;
+	ftps4_sparse_t sp;
+	ftps4_sha256_t sha;
+	unsigned char digest[FTPS4_SHA256_SIZE];
+	struct stat st;
+	unsigned int recv_size, room;
+	unsigned long long start;
+	/* Only a whole file can go into the content index */
+	int hash = client->dedup_pending && !client->restore_point && !client->append_mode;
+
+	FTPS4_LOG_DEBUG("Opening: %s at %llu\n", path, client->restore_point);
 
-	if (useDebug) FTP::debug->Log("Opening: %s\n", path);
+	/* Not a mirror download any more, and the disk is needed for this */
+	ftps4_prefetch_cancel(client->prefetch);
+	existed = file_exists(path);
 
-	int mode = O_CREAT | O_RDWR;
-	/* if we resume broken - append missing part
-	* else - overwrite file */
-	if (client->restore_point) mode = mode | O_APPEND;
-	else mode = mode | O_TRUNC;
+	cache_invalidate_path(path);
 
-	if ((fd = Sys::open(path, mode, 0777)) >= 0) {
+	if ((fd = upload_open(client, path, &slot, &truncated)) >= 0) {
 
-		buffer = (unsigned char *)malloc(file_buf_size);
-		if (buffer == NULL) {
+		if (ftps4_io_init(&io, fd, file_buf_size) < 0) {
+			upload_close(fd, slot, NULL);
 			client_send_ctrl_msg(client, "550 Could not allocate memory." FTPS4_EOL);
 			return;
 		}
 
-		client_open_data_connection(client);
+		if (client_open_data_connection(client) < 0) {
+			upload_close(fd, slot, NULL);
+			ftps4_io_fini(&io);
+			client_close_data_connection(client);
+			client_send_ctrl_msg(client, "425 Can't open data connection." FTPS4_EOL);
+			return;
+		}
 		client_send_ctrl_msg(client, "150 Opening Image mode data transfer." FTPS4_EOL);
+		client_flush_ctrl(client);
+
+		ftps4_shaper_transfer_start(&client->flow, SHAPER_CLASS_BULK);
+		recv_size = ftps4_shaper_slice(&client->flow);
+		if (!recv_size || recv_size > file_buf_size) recv_size = file_buf_size;
+
+		if (Sys::fstat(fd, &st) < 0) st.st_size = 0;
+		start = client->append_mode ? (unsigned long long)st.st_size : client->restore_point;
+
+		/* Holes are only safe where the file reads back as zeros already */
+		sparse = client->sparse_writes && !client->append_mode &&
+			(unsigned long long)st.st_size <= client->restore_point;
+		ftps4_sparse_begin(&sp);
+		ftps4_io_begin_write(&io, start, sparse ? &sp : NULL);
+		if (hash) ftps4_sha256_init(&sha);
+
+		while (1) {
+			room = ftps4_io_space(&io, &space);
+			FTPS4_TRACE_BEGIN(t_recv);
+			bytes_recv = client_recv_data(client, space, room < recv_size ? room : recv_size);
+			FTPS4_TRACE_END(t_recv, "data_recv", NULL, client->num, bytes_recv > 0 ? bytes_recv : 0);
+			if (bytes_recv <= 0) break;
+			if (hash) ftps4_sha256_update(&sha, space, bytes_recv);
+
+			FTPS4_TRACE_BEGIN(t_write);
+			ret = ftps4_io_commit(&io, bytes_recv);
+			FTPS4_TRACE_END(t_write, "file_write", NULL, client->num, bytes_recv);
+			if (ret < 0) {
+				client_fail_transfer(client, XFER_ERROR_LOCAL);
+				bytes_recv = -1;
+				break;
+			}
+			ftps4_shaper_consume(&client->flow, bytes_recv);
+			client_poll_ctrl(client);
+			if (client->data_abort) {
+				bytes_recv = -1;
+				break;
+			}
+		}
 
-		while ((bytes_recv = client_recv_data_raw(client, buffer, file_buf_size)) > 0) {
-			Sys::write(fd, buffer, bytes_recv);
+		/* A data connection that ended without EOF (MODE B) is a network failure */
+		if (bytes_recv < 0) client_fail_transfer(client, XFER_ERROR_NETWORK);
+		else if (ftps4_io_flush(&io) < 0 || (sparse && ftps4_sparse_finish(&sp, fd) < 0)) {
+			client_fail_transfer(client, XFER_ERROR_LOCAL);
+			bytes_recv = -1;
+		} else if (sparse && sp.skipped) {
+			FTPS4_LOG_DEBUG("%s: %llu zero bytes left as holes\n", path, sp.skipped);
 		}
 
-		Sys::close(fd);
-		free(buffer);
-		client->restore_point = 0;
-		if (bytes_recv == 0) client_send_ctrl_msg(client, "226 Transfer completed." FTPS4_EOL);
-		else {
-			Sys::unlink(path);
-			client_send_ctrl_msg(client, "426 Connection closed; transfer aborted." FTPS4_EOL);
+		ftps4_shaper_transfer_end(&client->flow);
+		/* Only a file we overwrote is ours to throw away, a segment or
+		* resume keeps what the other writers already put there */
+		upload_close(fd, slot, bytes_recv != 0 && truncated ? path : NULL);
+		ftps4_io_fini(&io);
+		/* A SITE DU that ran during the upload saw a partial file */
+		ftps4_du_invalidate(path);
+
+		if (hash && bytes_recv == 0) {
+			ftps4_sha256_final(&sha, digest);
+			if (memcmp(digest, client->dedup_hash, sizeof(digest)) != 0 || sha.length != client->dedup_size)
+				FTPS4_LOG_INFO("\t%i> %s doesn't match the announced SHA-256\n", client->num, path);
+			/* Whatever was announced, the index gets what is on disk */
+			ftps4_dedup_record(digest, path);
 		}
-		client_close_data_connection(client);
+		client->dedup_pending = 0;
+		client->restore_point = 0;
+		client->append_mode = 0;
+		client_finish_data_connection(client, 0, bytes_recv == 0);
+		if (file_exists(path)) notify_change(existed ? FTPS4_WATCH_MODIFIED : FTPS4_WATCH_CREATED, path);
+		else if (existed) notify_change(FTPS4_WATCH_DELETED, path);
+		client_send_transfer_result(client, bytes_recv == 0, "226 Transfer completed." FTPS4_EOL);
 
-	} else client_send_ctrl_msg(client, "550 File not found." FTPS4_EOL);
+	} else {
+		client->restore_point = 0;
+		client->append_mode = 0;
+		client->dedup_pending = 0;
+		if (client->data_abort) client_send_ctrl_msg(client, "426 Transfer aborted." FTPS4_EOL);
+		else client_send_ctrl_msg(client, "550 File not found." FTPS4_EOL);
+	}
 }
 
 static void cmd_STOR_func(ftps4_client_info_t *client) {
 	char dest_path[PATH_MAXX];
-	gen_ftp_fullpath(client, dest_path, sizeof(dest_path));
+	if (gen_ftp_fullpath(client, dest_path, sizeof(dest_path)) < 0) return;
 	receive_file(client, dest_path);
 }
 
 static void delete_file(ftps4_client_info_t *client, const char *path) {
-	if (useDebug) FTP::debug->Log("Deleting: %s\n", path);
+	FTPS4_LOG_DEBUG("Deleting: %s\n", path);
 
-	if (Sys::unlink(path) >= 0) client_send_ctrl_msg(client, "226 File deleted." FTPS4_EOL);
-	else client_send_ctrl_msg(client, "550 Could not delete the file." FTPS4_EOL);
+	cache_invalidate_path(path);
+	if (Sys::unlink(path) >= 0) {
+		notify_change(FTPS4_WATCH_DELETED, path);
+		client_send_ctrl_msg(client, "226 File deleted." FTPS4_EOL);
+	} else client_send_ctrl_msg(client, "550 Could not delete the file." FTPS4_EOL);
 }
 
 static void cmd_DELE_func(ftps4_client_info_t *client) {
 	char dest_path[PATH_MAXX];
-	gen_ftp_fullpath(client, dest_path, sizeof(dest_path));
+	if (gen_ftp_fullpath(client, dest_path, sizeof(dest_path)) < 0) return;
 	delete_file(client, dest_path);
 }
 
 static void delete_dir(ftps4_client_info_t *client, const char *path) {
 	int ret;
-	if (useDebug) FTP::debug->Log("Deleting: %s\n", path);
+	FTPS4_LOG_DEBUG("Deleting: %s\n", path);
+	cache_invalidate_path(path);
 	ret = Sys::rmdir(path);
-	if (ret >= 0) client_send_ctrl_msg(client, "226 Directory deleted." FTPS4_EOL);
-	else if (errno == 66) client_send_ctrl_msg(client, "550 Directory is not empty." FTPS4_EOL);
+	if (ret >= 0) {
+		notify_change(FTPS4_WATCH_DELETED, path);
+		client_send_ctrl_msg(client, "226 Directory deleted." FTPS4_EOL);
+	} else if (errno == 66) client_send_ctrl_msg(client, "550 Directory is not empty." FTPS4_EOL);
 	else client_send_ctrl_msg(client, "550 Could not delete the directory." FTPS4_EOL);
 }
 
 static void cmd_RMD_func(ftps4_client_info_t *client) {
 	char dest_path[PATH_MAXX];
-	gen_ftp_fullpath(client, dest_path, sizeof(dest_path));
+	if (gen_ftp_fullpath(client, dest_path, sizeof(dest_path)) < 0) return;
 	delete_dir(client, dest_path);
 }
 
 static void create_dir(ftps4_client_info_t *client, const char *path) {
-	if (useDebug) FTP::debug->Log("Creating: %s\n", path);
+	FTPS4_LOG_DEBUG("Creating: %s\n", path);
+	cache_invalidate_path(path);
 
-	if (Sys::mkdir(path, 0777) >= 0) client_send_ctrl_msg(client, "226 Directory created." FTPS4_EOL);
-	else client_send_ctrl_msg(client, "550 Could not create the directory." FTPS4_EOL);
+	if (Sys::mkdir(path, 0777) >= 0) {
+		notify_change(FTPS4_WATCH_CREATED, path);
+		client_send_ctrl_msg(client, "226 Directory created." FTPS4_EOL);
+	} else client_send_ctrl_msg(client, "550 Could not create the directory." FTPS4_EOL);
 }
 
 static void cmd_MKD_func(ftps4_client_info_t *client) {
 	char dest_path[PATH_MAXX];
-	gen_ftp_fullpath(client, dest_path, sizeof(dest_path));
+	if (gen_ftp_fullpath(client, dest_path, sizeof(dest_path)) < 0) return;
 	create_dir(client, dest_path);
 }
 
 static void cmd_RNFR_func(ftps4_client_info_t *client) {
 	char from_path[PATH_MAXX];
 	/* Get the origin filename */
-	gen_ftp_fullpath(client, from_path, sizeof(from_path));
+	if (gen_ftp_fullpath(client, from_path, sizeof(from_path)) < 0) return;
+
+	/* Check if the file exists */
+	if (!file_exists(from_path)) {
+		client_send_ctrl_msg(client, "550 The file doesn't exist." FTPS4_EOL);
+		return;
+	}
+	/* The file to be renamed is the received path */
+	strcpy(client->rename_path, from_path);
+	client_send_ctrl_msg(client, "350 I need the destination name b0ss." FTPS4_EOL);
+}
+
+static void cmd_RNTO_func(ftps4_client_info_t *client) {
+	char path_to[PATH_MAXX];
+	/* Get the destination filename */
+	if (gen_ftp_fullpath(client, path_to, sizeof(path_to)) < 0) return;
+
+	FTPS4_LOG_DEBUG("Renaming: %s to %s\n", client->rename_path, path_to);
+
+	/* The destination may be replaced */
+	cache_invalidate_path(path_to);
+	cache_invalidate_path(client->rename_path);
+	if (Sys::rename(client->rename_path, path_to) < 0) {
+		client_send_ctrl_msg(client, "550 Error renaming the file." FTPS4_EOL);
+		return;
+	}
+	notify_change(FTPS4_WATCH_DELETED, client->rename_path);
+	notify_change(FTPS4_WATCH_CREATED, path_to);
+
+	client_send_ctrl_msg(client, "226 Rename completed." FTPS4_EOL);
+}
+
+static void cmd_SIZE_func(ftps4_client_info_t *client) {
+	struct stat s;
+	char path[PATH_MAXX];
+	char cmd[64];
+	/* Get the filename to retrieve its size */
+	if (gen_ftp_fullpath(client, path, sizeof(path)) < 0) return;
+
+	/* Check if the file exists */
+	if (Sys::stat(path, &s) < 0) {
+		client_send_ctrl_msg(client, "550 The file doesn't exist." FTPS4_EOL);
+		return;
+	}
+	/* Send the size of the file */
+	sprintf(cmd, "213: %lld" FTPS4_EOL, s.st_size);
+	client_send_ctrl_msg(client, cmd);
+}
+
+static void cmd_REST_func(ftps4_client_info_t *client) {
+	char cmd[64];
+	const char *p;
+	unsigned long long point = 0;
+
+	/* Digits only and no overflow, %llu would take "-1" for 2^64 - 1 */
+	client->restore_point = 0;
+	for (p = client->recv_cmd_args; p && *p; p++) {
+		if (*p < '0' || *p > '9' || point > (~0ULL - (*p - '0')) / 10) {
+			client_send_ctrl_msg(client, "501 Syntax error in parameters or arguments." FTPS4_EOL);
+			return;
+		}
+		point = point * 10 + (*p - '0');
+	}
+	client->restore_point = point;
+	sprintf(cmd, "350 Resuming at %llu" FTPS4_EOL, client->restore_point);
+	client_send_ctrl_msg(client, cmd);
+}
+
+static void cmd_ABOR_func(ftps4_client_info_t *client) {
+	/* Nothing is running, just drop a data connection that may be open */
+	client_close_data_connection(client);
+	client_send_ctrl_msg(client, "226 Abort successful." FTPS4_EOL);
+}
+
+static void cmd_STAT_func(ftps4_client_info_t *client) {
+	char msg[512];
+	snprintf(msg, sizeof(msg),
+		"211-FTPS4 status" FTPS4_EOL
+		" Client %i, working directory \"%s\"" FTPS4_EOL
+		" Mode %s, data connection %s" FTPS4_EOL
+		" %i of %u sessions in use, %i since start" FTPS4_EOL
+		"211 End of status" FTPS4_EOL,
+		client->num, client->cwd.path,
+		client->transfer_mode == FTP_TRANSFER_MODE_BLOCK ? "B" : "S",
+		client->data_connected ? "open" : "closed",
+		number_clients.load(), max_clients, next_client_num.load());
+	client_send_ctrl_msg(client, msg);
+}
+
+static void cmd_FEAT_func(ftps4_client_info_t *client) {
+	/*So client would know that we support resume */
+	client_send_ctrl_msg(client, "211-extensions" FTPS4_EOL);
+	client_send_ctrl_msg(client, "REST STREAM" FTPS4_EOL);
+	client_send_ctrl_msg(client, "EPSV" FTPS4_EOL);
+	client_send_ctrl_msg(client, "MODE B" FTPS4_EOL);
+	client_send_ctrl_msg(client, "211 end" FTPS4_EOL);
+}
+
+static void cmd_APPE_func(ftps4_client_info_t *client) {
+	char dest_path[PATH_MAXX];
+	if (gen_ftp_fullpath(client, dest_path, sizeof(dest_path)) < 0) return;
+	/* APPE always writes at the end of the file, whatever REST said */
+	client->restore_point = 0;
+	client->append_mode = 1;
+	receive_file(client, dest_path);
+}
+
+/* SITE RATE [GLOBAL|SESSION|IP|SMALL <bytes>] */
+static void site_RATE_func(ftps4_client_info_t *client) {
+	char which[16];
+	char msg[512];
+	unsigned long long value;
+	int n = !client->recv_cmd_args
+		? 0
+		: sscanf(client->recv_cmd_args, "%15s %llu", which, &value);
+
+	if (n < 1) {
+		snprintf(msg, sizeof(msg),
+			"211-Rate limits in bytes/s, 0 is unlimited" FTPS4_EOL
+			" GLOBAL %llu" FTPS4_EOL
+			" SESSION %llu" FTPS4_EOL
+			" IP %llu" FTPS4_EOL
+			" SMALL %llu" FTPS4_EOL
+			"211 %i bulk transfer(s) running" FTPS4_EOL,
+			ftps4_shaper_get_global_rate(),
+			ftps4_shaper_get_session_rate(),
+			ftps4_shaper_get_ip_rate(),
+			ftps4_shaper_get_small_file(),
+			ftps4_shaper_get_bulk_count());
+		client_send_ctrl_msg(client, msg);
+		return;
+	}
+
+	if (n < 2) {
+		client_send_ctrl_msg(client, "501 Syntax error in parameters or arguments." FTPS4_EOL);
+		return;
+	}
+
+	if (strcasecmp(which, "GLOBAL") == 0) ftps4_shaper_set_global_rate(value);
+	else if (strcasecmp(which, "SESSION") == 0) ftps4_shaper_set_session_rate(value);
+	else if (strcasecmp(which, "IP") == 0) ftps4_shaper_set_ip_rate(value);
+	else if (strcasecmp(which, "SMALL") == 0) ftps4_shaper_set_small_file(value);
+	else {
+		client_send_ctrl_msg(client, "501 Syntax error in parameters or arguments." FTPS4_EOL);
+		return;
+	}
+
+	snprintf(msg, sizeof(msg), "200 %s set to %llu." FTPS4_EOL, which, value);
+	client_send_ctrl_msg(client, msg);
+}
+
+/* SITE CACHE [FLUSH] */
+static void site_CACHE_func(ftps4_client_info_t *client) {
+	char msg[512];
+	ftps4_cache_stats_t stats;
+	unsigned long long lookups;
+
+	if (!ftps4_cache_enabled()) {
+		client_send_ctrl_msg(client, "211 Block cache disabled." FTPS4_EOL);
+		return;
+	}
+
+	if (client->recv_cmd_args && strncasecmp(client->recv_cmd_args, "FLUSH", 5) == 0) {
+		ftps4_cache_flush();
+		client_send_ctrl_msg(client, "200 Block cache flushed." FTPS4_EOL);
+		return;
+	}
+
+	ftps4_cache_get_stats(&stats);
+	lookups = stats.hits + stats.misses;
+	snprintf(msg, sizeof(msg),
+		"211-Block cache" FTPS4_EOL
+		" Hits %llu (%llu shared reads)" FTPS4_EOL
+		" Misses %llu (%llu bypassed)" FTPS4_EOL
+		" Hit ratio %llu%%" FTPS4_EOL
+		" Evictions %llu, promotions %llu" FTPS4_EOL
+		"211 %llu of %llu bytes used" FTPS4_EOL,
+		stats.hits, stats.shared,
+		stats.misses, stats.bypassed,
+		lookups ? stats.hits * 100 / lookups : 0,
+		stats.evictions, stats.promotions,
+		stats.bytes, stats.capacity);
+	client_send_ctrl_msg(client, msg);
+}
+
+/* SITE SPARSE [ON|OFF] */
+static void site_SPARSE_func(ftps4_client_info_t *client) {
+	if (!client->recv_cmd_args) {
+		client_send_ctrl_msg(client, client->sparse_writes
+			? "211 Sparse uploads are on." FTPS4_EOL
+			: "211 Sparse uploads are off." FTPS4_EOL);
+		return;
+	}
+
+	if (strncasecmp(client->recv_cmd_args, "ON", 2) == 0) client->sparse_writes = 1;
+	else if (strncasecmp(client->recv_cmd_args, "OFF", 3) == 0) client->sparse_writes = 0;
+	else {
+		client_send_ctrl_msg(client, "501 Syntax error in parameters or arguments." FTPS4_EOL);
+		return;
+	}
+	client_send_ctrl_msg(client, "200 OK." FTPS4_EOL);
+}
+
+/* SITE TRACE [ON|OFF|CLEAR|DUMP] */
+static void site_TRACE_func(ftps4_client_info_t *client) {
+	char path[PATH_MAXX + 64];
+	char msg[PATH_MAXX + 128];
+	int count;
+
+	if (!client->recv_cmd_args) {
+		client_send_ctrl_msg(client, ftps4_trace_on
+			? "211 Tracing is on." FTPS4_EOL
+			: "211 Tracing is off." FTPS4_EOL);
+		return;
+	}
+
+	if (strncasecmp(client->recv_cmd_args, "ON", 2) == 0) ftps4_trace_set_enabled(1);
+	else if (strncasecmp(client->recv_cmd_args, "OFF", 3) == 0) ftps4_trace_set_enabled(0);
+	else if (strncasecmp(client->recv_cmd_args, "CLEAR", 5) == 0) ftps4_trace_clear();
+	else if (strncasecmp(client->recv_cmd_args, "DUMP", 4) == 0) {
+		snprintf(path, sizeof(path), "%s/ftps4_trace_%llu.json", trace_dir, (unsigned long long)sceKernelGetProcessTime());
+		if ((count = ftps4_trace_dump(path)) < 0) {
+			client_send_ctrl_msg(client, "451 Could not write the trace." FTPS4_EOL);
+			return;
+		}
+		snprintf(msg, sizeof(msg), "200 %i spans written to %s." FTPS4_EOL, count, path);
+		client_send_ctrl_msg(client, msg);
+		return;
+	} else {
+		client_send_ctrl_msg(client, "501 Syntax error in parameters or arguments." FTPS4_EOL);
+		return;
+	}
+	client_send_ctrl_msg(client, "200 OK." FTPS4_EOL);
+}
+
+/* SITE DEDUP <sha256> <size> <path>, stores path from a file with the same
+* content if there is one, otherwise the next STOR is indexed */
+static void site_DEDUP_func(ftps4_client_info_t *client) {
+	char hex[FTPS4_SHA256_SIZE * 2 + 2];
+	char src[PATH_MAXX];
+	char dest_path[PATH_MAXX];
+	unsigned char digest[FTPS4_SHA256_SIZE];
+	unsigned long long size;
+	int pos = 0;
+
+	if (!ftps4_dedup_enabled()) {
+		client_send_ctrl_msg(client, "502 Content index disabled." FTPS4_EOL);
+		return;
+	}
+
+	if (!client->recv_cmd_args ||
+		sscanf(client->recv_cmd_args, "%65s %llu %n", hex, &size, &pos) < 2 || !pos ||
+		ftps4_sha256_from_hex(hex, digest) < 0) {
+		client_send_ctrl_msg(client, "501 Syntax error in parameters or arguments." FTPS4_EOL);
+		return;
+	}
+	client->recv_cmd_args += pos;
+	if (gen_ftp_fullpath(client, dest_path, sizeof(dest_path)) < 0) return;
+
+	if (ftps4_dedup_lookup(digest, size, src, sizeof(src)) >= 0) {
+		int existed = file_exists(dest_path);
+		cache_invalidate_path(dest_path);
+		/* A copy across filesystems runs on its own thread, ABOR stops it */
+		client_flush_ctrl(client);
+		client->data_abort = client->abort_requested;
+		if (ftps4_dedup_materialize(src, dest_path, dedup_cancel, client) >= 0) {
+			notify_change(existed ? FTPS4_WATCH_MODIFIED : FTPS4_WATCH_CREATED, dest_path);
+			FTPS4_LOG_DEBUG("Dedup: %s from %s\n", dest_path, src);
+			ftps4_dedup_record(digest, dest_path);
+			client->dedup_pending = 0;
+			client_send_ctrl_msg(client, "250 Content already present, file stored without transfer." FTPS4_EOL);
+			return;
+		}
+		if (client->data_abort) {
+			client->data_abort = 0;
+			client_send_ctrl_msg(client, "426 Copy aborted." FTPS4_EOL);
+			return;
+		}
+	}
+
+	memcpy(client->dedup_hash, digest, sizeof(digest));
+	client->dedup_size = size;
+	client->dedup_pending = 1;
+	client_send_ctrl_msg(client, "350 Content unknown, send it with STOR." FTPS4_EOL);
+}
+
+static void put_be32(unsigned char *p, unsigned int v) {
+	p[0] = (unsigned char)(v >> 24);
+	p[1] = (unsigned char)(v >> 16);
+	p[2] = (unsigned char)(v >> 8);
+	p[3] = (unsigned char)v;
+}
+
+static unsigned int get_be32(const unsigned char *p) {
+	return ((unsigned int)p[0] << 24) | ((unsigned int)p[1] << 16) | ((unsigned int)p[2] << 8) | p[3];
+}
+
+/* SITE SIGN <block size, 0 for the default> <path>, sends the block
+* signatures of path over the data connection (format in ftp_delta.h) */
+static void site_SIGN_func(ftps4_client_info_t *client) {
+	char path[PATH_MAXX];
+	char msg[128];
+	struct stat st;
+	unsigned int block_size, window, i;
+	unsigned long long blocks, first = 0;
+	ftps4_delta_sig_t *sigs;
+	unsigned char *out;
+	int pos = 0, n = 0;
+
+	if (!client->recv_cmd_args || sscanf(client->recv_cmd_args, "%u %n", &block_size, &pos) < 1 || !pos) {
+		client_send_ctrl_msg(client, "501 Syntax error in parameters or arguments." FTPS4_EOL);
+		return;
+	}
+	if (!block_size) block_size = FTPS4_DELTA_DEFAULT_BLOCK;
+	if (block_size < FTPS4_DELTA_MIN_BLOCK || block_size > FTPS4_DELTA_MAX_BLOCK) {
+		client_send_ctrl_msg(client, "501 Block size out of range." FTPS4_EOL);
+		return;
+	}
+	client->recv_cmd_args += pos;
+	if (gen_ftp_fullpath(client, path, sizeof(path)) < 0) return;
+
+	if (Sys::stat(path, &st) < 0 || !S_ISREG(st.st_mode)) {
+		client_send_ctrl_msg(client, "550 File not found." FTPS4_EOL);
+		return;
+	}
+	blocks = ((unsigned long long)st.st_size + block_size - 1) / block_size;
+
+	/* A window at a time: its blocks are hashed in parallel, then sent */
+	window = DELTA_SIGN_WINDOW / block_size;
+	sigs = (ftps4_delta_sig_t *)malloc(window * sizeof(*sigs));
+	out = (unsigned char *)malloc(window * (4 + FTPS4_DELTA_STRONG_SIZE));
+	if (sigs == NULL || out == NULL) {
+		free(sigs);
+		free(out);
+		client_send_ctrl_msg(client, "550 Could not allocate memory." FTPS4_EOL);
+		return;
+	}
+
+	client_send_ctrl_msg(client, "150 Sending block signatures." FTPS4_EOL);
+	if (client_open_data_connection(client) < 0) {
+		free(sigs);
+		free(out);
+		client_close_data_connection(client);
+		client_send_ctrl_msg(client, "425 Can't open data connection." FTPS4_EOL);
+		return;
+	}
+	ftps4_shaper_transfer_start(&client->flow, SHAPER_CLASS_INTERACTIVE);
+
+	put_be32(out, block_size);
+	put_be32(out + 4, (unsigned int)((unsigned long long)st.st_size >> 32));
+	put_be32(out + 8, (unsigned int)st.st_size);
+	client_send_data_shaped(client, out, 12);
+
+	while (first < blocks && !client->data_abort) {
+		FTPS4_TRACE_BEGIN(t_sign);
+		n = ftps4_delta_signatures(path, block_size, first,
+			blocks - first < window ? (unsigned int)(blocks - first) : window, sigs);
+		FTPS4_TRACE_END(t_sign, "delta_sign", NULL, client->num, n > 0 ? n : 0);
+		if (n <= 0) {
+			client_fail_transfer(client, XFER_ERROR_LOCAL);
+			break;
+		}
+
+		for (i = 0; i < (unsigned int)n; i++) {
+			put_be32(out + i * (4 + FTPS4_DELTA_STRONG_SIZE), sigs[i].weak);
+			memcpy(out + i * (4 + FTPS4_DELTA_STRONG_SIZE) + 4, sigs[i].strong, FTPS4_DELTA_STRONG_SIZE);
+		}
+		client_send_data_shaped(client, out, n * (4 + FTPS4_DELTA_STRONG_SIZE));
+		first += n;
+	}
+
+	ftps4_shaper_transfer_end(&client->flow);
+	free(sigs);
+	free(out);
+	client_finish_data_connection(client, 1, !client->data_abort);
+	snprintf(msg, sizeof(msg), "226 %llu block signatures sent." FTPS4_EOL, first);
+	client_send_transfer_result(client, 1, msg);
+}
+
+/* Receives exactly len bytes of the delta stream */
+static int delta_recv(ftps4_client_info_t *client, void *buf, unsigned int len) {
+	unsigned int got = 0;
+	int n;
+
+	while (got < len) {
+		n = client_recv_data(client, (unsigned char *)buf + got, len - got);
+		if (n <= 0) {
+			/* Ending in the middle of the stream is as bad as a broken connection */
+			client_fail_transfer(client, XFER_ERROR_NETWORK);
+			return -1;
+		}
+		got += n;
+	}
+	return 0;
+}
+
+static int delta_write(int fd, ftps4_sha256_t *sha, const unsigned char *buf, unsigned int len) {
+	unsigned int done = 0;
+	int n;
+
+	ftps4_sha256_update(sha, buf, len);
+	while (done < len) {
+		n = Sys::write(fd, buf + done, len - done);
+		if (n <= 0) return -1;
+		done += n;
+	}
+	return 0;
+}
+
+/* SITE DELTA <path>, rebuilds path from its current content and the delta
+* stream on the data connection (format in ftp_delta.h). The new file is
+* built next to it and only replaces it once its SHA-256 checks out. */
+static void site_DELTA_func(ftps4_client_info_t *client) {
+	char path[PATH_MAXX];
+	char tmp_path[PATH_MAXX + 16];
+	char msg[256];
+	const char *err = NULL;
+	unsigned char hdr[FTPS4_SHA256_SIZE];
+	unsigned char digest[FTPS4_SHA256_SIZE];
+	unsigned char *buf;
+	unsigned long long offset, old_size = 0, reused = 0, received = 0;
+	unsigned long long started = sceKernelGetProcessTime();
+	unsigned int len, n;
+	int old_fd, out_fd, done = 0;
+	ftps4_sha256_t sha;
+	struct stat st;
+
+	if (gen_ftp_fullpath(client, path, sizeof(path)) < 0) return;
+	snprintf(tmp_path, sizeof(tmp_path), "%s.ftps4delta", path);
+
+	/* Without a current file only literals can be used */
+	old_fd = Sys::open(path, O_RDONLY, 0);
+	if (old_fd >= 0 && Sys::fstat(old_fd, &st) >= 0) old_size = st.st_size;
+
+	buf = (unsigned char *)malloc(DELTA_COPY_BUF_SIZE);
+	out_fd = Sys::open(tmp_path, O_CREAT | O_WRONLY | O_TRUNC, 0777);
+	if (buf == NULL || out_fd < 0) {
+		if (out_fd >= 0) Sys::close(out_fd);
+		if (old_fd >= 0) Sys::close(old_fd);
+		free(buf);
+		client_send_ctrl_msg(client, "550 Could not create the file." FTPS4_EOL);
+		return;
+	}
+
+	client_send_ctrl_msg(client, "150 Waiting for the delta." FTPS4_EOL);
+	if (client_open_data_connection(client) < 0) {
+		Sys::close(out_fd);
+		Sys::unlink(tmp_path);
+		if (old_fd >= 0) Sys::close(old_fd);
+		free(buf);
+		client_close_data_connection(client);
+		client_send_ctrl_msg(client, "425 Can't open data connection." FTPS4_EOL);
+		return;
+	}
+	ftps4_shaper_transfer_start(&client->flow, SHAPER_CLASS_BULK);
+	ftps4_sha256_init(&sha);
+
+	while (!done && !err && !client->data_abort) {
+		if (delta_recv(client, hdr, 1) < 0) break;
+
+		switch (hdr[0]) {
+		case FTPS4_DELTA_OP_COPY:
+			if (delta_recv(client, hdr, 12) < 0) break;
+			offset = ((unsigned long long)get_be32(hdr) << 32) | get_be32(hdr + 4);
+			len = get_be32(hdr + 8);
+			if (old_fd < 0 || offset > old_size || len > old_size - offset ||
+				Sys::lseek(old_fd, offset, SEEK_SET) < 0) {
+				err = "451 Delta copies outside of the current file." FTPS4_EOL;
+				break;
+			}
+			/* A copy may span gigabytes, ABOR is looked for after every chunk */
+			while (len > 0 && !client->data_abort) {
+				n = len < DELTA_COPY_BUF_SIZE ? len : DELTA_COPY_BUF_SIZE;
+				if (Sys::read(old_fd, buf, n) != (int)n || delta_write(out_fd, &sha, buf, n) < 0) {
+					client_fail_transfer(client, XFER_ERROR_LOCAL);
+					break;
+				}
+				reused += n;
+				len -= n;
+				/* Progress on disk isn't a stalled transfer */
+				client->data_activity = sceKernelGetProcessTime();
+				client_poll_ctrl(client);
+			}
+			break;
+		case FTPS4_DELTA_OP_LITERAL:
+			if (delta_recv(client, hdr, 4) < 0) break;
+			len = get_be32(hdr);
+			if (len > FTPS4_DELTA_MAX_LITERAL) {
+				err = "451 Delta literal too large." FTPS4_EOL;
+				break;
+			}
+			while (len > 0) {
+				n = len < DELTA_COPY_BUF_SIZE ? len : DELTA_COPY_BUF_SIZE;
+				if (delta_recv(client, buf, n) < 0) break;
+				if (delta_write(out_fd, &sha, buf, n) < 0) {
+					client_fail_transfer(client, XFER_ERROR_LOCAL);
+					break;
+				}
+				ftps4_shaper_consume(&client->flow, n);
+				received += n;
+				len -= n;
+			}
+			break;
+		case FTPS4_DELTA_OP_END:
+			if (delta_recv(client, hdr, FTPS4_SHA256_SIZE) < 0) break;
+			ftps4_sha256_final(&sha, digest);
+			if (memcmp(digest, hdr, FTPS4_SHA256_SIZE) != 0)
+				err = "451 Rebuilt file doesn't match its SHA-256, the old one is kept." FTPS4_EOL;
+			done = 1;
+			break;
+		default:
+			err = "451 Invalid delta stream." FTPS4_EOL;
+			break;
+		}
+		client_poll_ctrl(client);
+	}
+
+	ftps4_shaper_transfer_end(&client->flow);
+	if (Sys::close(out_fd) < 0) client_fail_transfer(client, XFER_ERROR_LOCAL);
+	if (old_fd >= 0) Sys::close(old_fd);
+	free(buf);
+	client_finish_data_connection(client, 0, done && !err && !client->data_abort);
+
+	if (done && !err && !client->data_abort && !client->xfer_error) {
+		cache_invalidate_path(path);
+		if (Sys::rename(tmp_path, path) < 0) {
+			Sys::unlink(tmp_path);
+			client_send_ctrl_msg(client, "451 Could not replace the file." FTPS4_EOL);
+			return;
+		}
+		notify_change(old_fd >= 0 ? FTPS4_WATCH_MODIFIED : FTPS4_WATCH_CREATED, path);
+		snprintf(msg, sizeof(msg), "226 Delta applied, %llu bytes reused, %llu bytes received in %llu ms." FTPS4_EOL,
+			reused, received, (unsigned long long)(sceKernelGetProcessTime() - started) / 1000);
+		FTPS4_LOG_DEBUG("Delta %s: %llu reused, %llu received\n", path, reused, received);
+		client_send_ctrl_msg(client, msg);
+		return;
+	}
+
+	Sys::unlink(tmp_path);
+	if (err) client_send_ctrl_msg(client, err);
+	else client_send_transfer_result(client, 0, NULL);
+}
+
+static void rmtree_progress(void *arg, const ftps4_tree_stats_t *stats) {
+	ftps4_client_info_t *client = (ftps4_client_info_t *)arg;
+	char msg[128];
+
+	snprintf(msg, sizeof(msg), " %llu files, %llu directories removed" FTPS4_EOL, stats->files, stats->dirs);
+	client_send_ctrl_msg(client, msg);
+	client_flush_ctrl(client);
+}
+
+/* SITE RMTREE <path>, removes a directory and everything in it. Progress
+* comes as a preliminary 150 reply, then the final one. */
+static void site_RMTREE_func(ftps4_client_info_t *client) {
+	char path[PATH_MAXX];
+	char msg[PATH_MAXX + 64];
+	ftps4_tree_stats_t stats;
+	struct stat st;
+	int ret;
+
+	if (gen_ftp_fullpath(client, path, sizeof(path)) < 0) return;
+
+	/* A link to a directory isn't one to remove a tree from, DELE removes the link */
+	if (ftps4_tree_is_link(path) || Sys::stat(path, &st) < 0 || !S_ISDIR(st.st_mode)) {
+		client_send_ctrl_msg(client, "550 Directory not found." FTPS4_EOL);
+		return;
+	}
+	if (strcmp(path, "/") == 0) {
+		client_send_ctrl_msg(client, "550 Refusing to remove the root directory." FTPS4_EOL);
+		return;
+	}
+
+	FTPS4_LOG_DEBUG("Removing tree: %s\n", path);
+	cache_invalidate_path(path);
+
+	snprintf(msg, sizeof(msg), "150-Removing %s" FTPS4_EOL, path);
+	client_send_ctrl_msg(client, msg);
+	client_flush_ctrl(client);
+
+	ret = ftps4_tree_remove(path, &stats, rmtree_progress, client, TREE_PROGRESS_INTERVAL);
+	if (stats.files || stats.dirs) notify_change(file_exists(path) ? FTPS4_WATCH_MODIFIED : FTPS4_WATCH_DELETED, path);
+	client_send_ctrl_msg(client, "150 Removal done." FTPS4_EOL);
+
+	if (ret < 0)
+		snprintf(msg, sizeof(msg), "550 Removed %llu files and %llu directories, %llu entries could not be removed." FTPS4_EOL,
+			stats.files, stats.dirs, stats.failed);
+	else
+		snprintf(msg, sizeof(msg), "250 Removed %llu files and %llu directories." FTPS4_EOL, stats.files, stats.dirs);
+	client_send_ctrl_msg(client, msg);
+}
+
+/* SITE MKDIRS <path>, creates path along with every missing parent */
+static void site_MKDIRS_func(ftps4_client_info_t *client) {
+	ftps4_path_t path;
+	char msg[PATH_MAXX + 64];
+	char top[PATH_MAXX];
+	unsigned int created;
+	int ret;
+
+	if (!client->recv_cmd_args || !client->recv_cmd_args[0]) {
+		client_send_ctrl_msg(client, "501 Syntax error in parameters or arguments." FTPS4_EOL);
+		return;
+	}
+	if (ftps4_path_resolve(&client->cwd, client->recv_cmd_args, &path) < 0) {
+		client_send_ctrl_msg(client, "553 File name not allowed." FTPS4_EOL);
+		return;
+	}
+
+	FTPS4_LOG_DEBUG("Creating tree: %s\n", path.path);
+	cache_invalidate_path(path.path);
+
+	ret = ftps4_tree_mkdirs(&path, &created);
+	/* The topmost new directory stands for the ones below it */
+	if (created) {
+		snprintf(top, sizeof(top), "%.*s", path.ends[path.depth - created], path.path);
+		notify_change(FTPS4_WATCH_CREATED, top);
+	}
+	if (ret < 0) {
+		snprintf(msg, sizeof(msg), "550 Could not create \"%s\", %u directories were created." FTPS4_EOL, path.path, created);
+	} else {
+		snprintf(msg, sizeof(msg), "257 \"%s\" created, %u new directories." FTPS4_EOL, path.path, created);
+	}
+	client_send_ctrl_msg(client, msg);
+}
+
+/* SITE RENAMES, renames every "<from>\t<to>" line sent over the data
+* connection, paths relative to the working directory. Progress and the
+* pairs that failed come as a preliminary 150 reply, then the final one. */
+static void site_RENAMES_func(ftps4_client_info_t *client) {
+	ftps4_path_t from, to;
+	char msg[2 * PATH_MAXX + 64];
+	char *list, *line, *eol, *tab;
+	unsigned int len = 0, total = 0, done = 0, failed = 0;
+	int n;
+
+	if ((list = (char *)malloc(RENAME_LIST_MAX + 1)) == NULL) {
+		client_send_ctrl_msg(client, "550 Could not allocate memory." FTPS4_EOL);
+		return;
+	}
+
+	client_send_ctrl_msg(client, "150 Waiting for the rename list." FTPS4_EOL);
+	if (client_open_data_connection(client) < 0) {
+		free(list);
+		client_close_data_connection(client);
+		client_send_ctrl_msg(client, "425 Can't open data connection." FTPS4_EOL);
+		return;
+	}
+	ftps4_shaper_transfer_start(&client->flow, SHAPER_CLASS_INTERACTIVE);
+	while (len < RENAME_LIST_MAX && (n = client_recv_data(client, list + len, RENAME_LIST_MAX - len)) > 0) {
+		ftps4_shaper_consume(&client->flow, n);
+		len += n;
+		client_poll_ctrl(client);
+		if (client->data_abort) break;
+	}
+	ftps4_shaper_transfer_end(&client->flow);
+	/* A full buffer means the list didn't fit */
+	if (len == RENAME_LIST_MAX) client_fail_transfer(client, XFER_ERROR_LOCAL);
+	client_finish_data_connection(client, 0, !client->data_abort);
+	if (client->data_abort || client->xfer_error) {
+		free(list);
+		client_send_transfer_result(client, 0, NULL);
+		return;
+	}
+	list[len] = '\0';
+
+	client_send_ctrl_msg(client, "150-Renaming" FTPS4_EOL);
+	client_flush_ctrl(client);
+
+	for (line = list; *line; line = eol) {
+		eol = line + strcspn(line, "\r\n");
+		if (*eol) *eol++ = '\0';
+		while (*eol == '\r' || *eol == '\n') eol++;
+		if (!*line) continue;
+		total++;
+
+		/* ftps4_path_resolve() takes the argument up to the end of line */
+		tab = strchr(line, '\t');
+		if (tab) *tab = '\0';
+		if (tab == NULL || ftps4_path_resolve(&client->cwd, line, &from) < 0 ||
+			ftps4_path_resolve(&client->cwd, tab + 1, &to) < 0) {
+			if (failed++ < RENAME_MAX_REPORTED) {
+				snprintf(msg, sizeof(msg), " Invalid line %u" FTPS4_EOL, total);
+				client_send_ctrl_msg(client, msg);
+			}
+			continue;
+		}
+
+		cache_invalidate_path(to.path);
+		cache_invalidate_path(from.path);
+		if (Sys::rename(from.path, to.path) < 0) {
+			if (failed++ < RENAME_MAX_REPORTED) {
+				snprintf(msg, sizeof(msg), " Could not rename %s to %s" FTPS4_EOL, from.path, to.path);
+				client_send_ctrl_msg(client, msg);
+			}
+			continue;
+		}
+		notify_change(FTPS4_WATCH_DELETED, from.path);
+		notify_change(FTPS4_WATCH_CREATED, to.path);
+		if (++done % RENAME_PROGRESS_STEP == 0) {
+			snprintf(msg, sizeof(msg), " %u renamed" FTPS4_EOL, done);
+			client_send_ctrl_msg(client, msg);
+			client_flush_ctrl(client);
+		}
+	}
+	free(list);
+
+	client_send_ctrl_msg(client, "150 Renaming done." FTPS4_EOL);
+	if (failed)
+		snprintf(msg, sizeof(msg), "550 Renamed %u of %u, %u failed." FTPS4_EOL, done, total, failed);
+	else
+		snprintf(msg, sizeof(msg), "250 Renamed %u of %u." FTPS4_EOL, done, total);
+	client_send_ctrl_msg(client, msg);
+}
+
+typedef struct {
+	ftps4_client_info_t *client;
+	unsigned int changes;
+} watch_reply;
+
+static void watch_emit(void *arg, ftps4_watch_event_t event, const char *path) {
+	watch_reply *reply = (watch_reply *)arg;
+	char msg[PATH_MAXX + 32];
+
+	if (!reply->changes++) client_send_ctrl_msg(reply->client, "213-Changes:" FTPS4_EOL);
+	snprintf(msg, sizeof(msg), " %s %s" FTPS4_EOL, ftps4_watch_event_name(event), path);
+	client_send_ctrl_msg(reply->client, msg);
+}
+
+static int watch_cancel(void *arg) {
+	ftps4_client_info_t *client = ((watch_reply *)arg)->client;
+
+	/* Waiting for changes isn't idling */
+	client->ctrl_activity = sceKernelGetProcessTime();
+	client_poll_ctrl(client);
+	return client->data_abort || client->abort_requested;
+}
+
+/* SITE WATCH <token> <seconds> [path], waits until something at or below
+* path (the working directory by default) changes after token (0 for now)
+* and lists the changes. The last line has the token to pass next time. */
+static void site_WATCH_func(ftps4_client_info_t *client) {
+	char path[PATH_MAXX];
+	char msg[64];
+	unsigned long long token;
+	unsigned int seconds;
+	watch_reply reply;
+	int pos = 0;
+
+	if (!client->recv_cmd_args ||
+		sscanf(client->recv_cmd_args, "%llu %u%n", &token, &seconds, &pos) < 2) {
+		client_send_ctrl_msg(client, "501 Syntax error in parameters or arguments." FTPS4_EOL);
+		return;
+	}
+	client->recv_cmd_args += pos;
+	while (*client->recv_cmd_args == ' ') client->recv_cmd_args++;
+	if (client->recv_cmd_args[0]) {
+		if (gen_ftp_fullpath(client, path, sizeof(path)) < 0) return;
+	} else {
+		snprintf(path, sizeof(path), "%s", client->cwd.path);
+	}
+	if (seconds > WATCH_MAX_WAIT) seconds = WATCH_MAX_WAIT;
+
+	/* Replies are flushed before waiting, earlier pipelined commands get theirs now */
+	client_flush_ctrl(client);
+
+	reply.client = client;
+	reply.changes = 0;
+	client->data_abort = 0;
+	token = ftps4_watch_wait(path, token, (unsigned long long)seconds * 1000 * 1000, watch_emit, watch_cancel, &reply);
+
+	if (client->data_abort && !reply.changes) {
+		client->data_abort = 0;
+		client_send_ctrl_msg(client, "426 Watch aborted." FTPS4_EOL);
+		return;
+	}
+	client->data_abort = 0;
+	snprintf(msg, sizeof(msg), "213 %llu" FTPS4_EOL, token);
+	client_send_ctrl_msg(client, msg);
+}
+
+static int find_emit(void *arg, const char *path) {
+	ftps4_client_info_t *client = (ftps4_client_info_t *)arg;
+	char line[PATH_MAXX + 2];
+	int len = snprintf(line, sizeof(line), "%s" FTPS4_EOL, path);
+
+	/* A failed send has already set the transfer's error, the query stops */
+	if (client_send_data(client, line, len) < 0) return 1;
+	ftps4_shaper_consume(&client->flow, len);
+	client_poll_ctrl(client);
+	return client->data_abort;
+}
+
+/* SITE FIND <pattern>, sends every indexed path matching pattern (a glob or
+* a part of the name, see ftp_find.h) over the data connection */
+static void site_FIND_func(ftps4_client_info_t *client) {
+	ftps4_find_stats_t stats;
+	char msg[128];
+	unsigned long long started;
+	int ret;
 
-	/* Check if the file exists */
-	if (!file_exists(from_path)) {
-		client_send_ctrl_msg(client, "550 The file doesn't exist." FTPS4_EOL);
+	if (!client->recv_cmd_args || !client->recv_cmd_args[0]) {
+		client_send_ctrl_msg(client, "501 Syntax error in parameters or arguments." FTPS4_EOL);
 		return;
 	}
-	/* The file to be renamed is the received path */
-	strcpy(client->rename_path, from_path);
-	client_send_ctrl_msg(client, "350 I need the destination name b0ss." FTPS4_EOL);
+	if (!ftps4_find_enabled()) {
+		client_send_ctrl_msg(client, "550 No search index (no roots configured)." FTPS4_EOL);
+		return;
+	}
+
+	client_send_ctrl_msg(client, "150 Opening ASCII mode data transfer for FIND." FTPS4_EOL);
+	if (client_open_data_connection(client) < 0) {
+		client_close_data_connection(client);
+		client_send_ctrl_msg(client, "425 Can't open data connection." FTPS4_EOL);
+		return;
+	}
+	ftps4_shaper_transfer_start(&client->flow, SHAPER_CLASS_INTERACTIVE);
+
+	started = sceKernelGetProcessTime();
+	ret = ftps4_find_query(client->recv_cmd_args, find_emit, client, &stats);
+	if (ret < 0) client_fail_transfer(client, XFER_ERROR_LOCAL);
+	FTPS4_LOG_DEBUG("FIND %s: %u of %u entries in %llu ms\n", client->recv_cmd_args, stats.matches, stats.entries,
+		(unsigned long long)(sceKernelGetProcessTime() - started) / 1000);
+
+	ftps4_shaper_transfer_end(&client->flow);
+	client_finish_data_connection(client, 1, !client->data_abort);
+	snprintf(msg, sizeof(msg), "226 %u matches in %u indexed entries%s." FTPS4_EOL, stats.matches, stats.entries,
+		stats.building ? ", the index is still being built" : stats.truncated ? ", the index is incomplete" : "");
+	client_send_transfer_result(client, 1, msg);
 }
 
-static void cmd_RNTO_func(ftps4_client_info_t *client) {
-	char path_to[PATH_MAXX];
-	/* Get the destination filename */
-	gen_ftp_fullpath(client, path_to, sizeof(path_to));
+/* Each SITE DU result line goes out as soon as the walk has it */
+static void du_emit(void *arg, const char *line) {
+	ftps4_client_info_t *client = (ftps4_client_info_t *)arg;
+	char msg[PATH_MAXX + 96];
+	const char *name = line;
+	int fields;
+
+	/* The last line, "<bytes> <files> <dirs>", is the total */
+	for (fields = 0; *name && fields < 3; fields++) {
+		name = strchr(name, ' ');
+		if (!name) break;
+		name++;
+	}
+	if (fields < 3) {
+		unsigned long long bytes = 0, files = 0, dirs = 0;
+		sscanf(line, "%llu %llu %llu", &bytes, &files, &dirs);
+		snprintf(msg, sizeof(msg), "213 %llu total bytes, %llu files, %llu directories." FTPS4_EOL, bytes, files, dirs);
+	} else {
+		snprintf(msg, sizeof(msg), " %s" FTPS4_EOL, line);
+	}
+	client_send_ctrl_msg(client, msg);
+	client_flush_ctrl(client);
+}
 
-	if (useDebug) FTP::debug->Log("Renaming: %s to %s\n", client->rename_path, path_to);
+/* SITE DU [path], sizes of the subdirectories of path (the working directory
+* by default) and of the whole tree */
+static void site_DU_func(ftps4_client_info_t *client) {
+	char path[PATH_MAXX];
+	char msg[PATH_MAXX + 64];
+	unsigned long long started = sceKernelGetProcessTime();
+	struct stat st;
+	int ret;
 
-	if (Sys::rename(client->rename_path, path_to) < 0) {
-		client_send_ctrl_msg(client, "550 Error renaming the file." FTPS4_EOL);
+	if (client->recv_cmd_args && client->recv_cmd_args[0]) {
+		if (gen_ftp_fullpath(client, path, sizeof(path)) < 0) return;
+	} else {
+		snprintf(path, sizeof(path), "%s", client->cwd.path);
 	}
 
-	client_send_ctrl_msg(client, "226 Rename completed." FTPS4_EOL);
-}
+	if (Sys::stat(path, &st) < 0 || !S_ISDIR(st.st_mode)) {
+		client_send_ctrl_msg(client, "550 Directory not found." FTPS4_EOL);
+		return;
+	}
 
-static void cmd_SIZE_func(ftps4_client_info_t *client) {
-	struct stat s;
-	char path[PATH_MAXX];
-	char cmd[64];
-	/* Get the filename to retrieve its size */
-	gen_ftp_fullpath(client, path, sizeof(path));
+	snprintf(msg, sizeof(msg), "213-Disk usage of %s (bytes files directories name):" FTPS4_EOL, path);
+	client_send_ctrl_msg(client, msg);
+	client_flush_ctrl(client);
 
-	/* Check if the file exists */
-	if (Sys::stat(path, &s) < 0) {
-		client_send_ctrl_msg(client, "550 The file doesn't exist." FTPS4_EOL);
+	ret = ftps4_du_run(path, du_emit, client);
+	if (ret == -2) {
+		client_send_ctrl_msg(client, "213 Out of memory, the walk is incomplete." FTPS4_EOL);
 		return;
 	}
-	/* Send the size of the file */
-	sprintf(cmd, "213: %lld" FTPS4_EOL, s.st_size);
-	client_send_ctrl_msg(client, cmd);
+	if (ret < 0) {
+		client_send_ctrl_msg(client, "213 Could not read the directory." FTPS4_EOL);
+		return;
+	}
+	FTPS4_LOG_DEBUG("DU %s took %llu ms\n", path, (unsigned long long)(sceKernelGetProcessTime() - started) / 1000);
 }
 
-static void cmd_REST_func(ftps4_client_info_t *client) {
-	char cmd[64];
-	sscanf(client->recv_buffer, "%*[^ ] %d", &client->restore_point);
-	sprintf(cmd, "350 Resuming at %d" FTPS4_EOL, client->restore_point);
-	client_send_ctrl_msg(client, cmd);
-}
+#define add_site_entry(name) {#name, site_##name##_func}
+static const cmd_dispatch_entry site_dispatch_table[] = {
+	add_site_entry(RATE),
+	add_site_entry(CACHE),
+	add_site_entry(SPARSE),
+	add_site_entry(TRACE),
+	add_site_entry(DEDUP),
+	add_site_entry(SIGN),
+	add_site_entry(DELTA),
+	add_site_entry(DU),
+	add_site_entry(RMTREE),
+	add_site_entry(MKDIRS),
+	add_site_entry(RENAMES),
+	add_site_entry(WATCH),
+	add_site_entry(FIND),
+	{ NULL, NULL }
+};
 
-static void cmd_FEAT_func(ftps4_client_info_t *client) {
-	/*So client would know that we support resume */
-	client_send_ctrl_msg(client, "211-extensions" FTPS4_EOL);
-	client_send_ctrl_msg(client, "REST STREAM" FTPS4_EOL);
-	client_send_ctrl_msg(client, "211 end" FTPS4_EOL);
-}
+static void cmd_SITE_func(ftps4_client_info_t *client) {
+	char site_cmd[16];
+	const char *args;
+	int i;
+	int n = !client->recv_cmd_args
+		? 0
+		: sscanf(client->recv_cmd_args, "%15s", site_cmd);
 
-static void cmd_APPE_func(ftps4_client_info_t *client) {
-	/* set restore point to not 0
-	restore point numeric value only matters if we RETR file from ps4.
-	If we STOR or APPE, it is only used to indicate that we want to resume
-	a broken transfer */
-	client->restore_point = -1;
-	char dest_path[PATH_MAXX];
-	gen_ftp_fullpath(client, dest_path, sizeof(dest_path));
-	receive_file(client, dest_path);
+	if (n < 1) {
+		client_send_ctrl_msg(client, "501 Syntax error in parameters or arguments." FTPS4_EOL);
+		return;
+	}
+
+	/* Hand the SITE command arguments to the handler like a normal command */
+	args = strchr(client->recv_cmd_args, ' ');
+	client->recv_cmd_args = args ? args + 1 : NULL;
+
+	for (i = 0; site_dispatch_table[i].cmd && site_dispatch_table[i].func; i++) {
+		if (strcasecmp(site_cmd, site_dispatch_table[i].cmd) == 0) {
+			site_dispatch_table[i].func(client);
+			return;
+		}
+	}
+	client_send_ctrl_msg(client, "504 Sorry, SITE command not implemented." FTPS4_EOL);
 }
 
 #define add_entry(name) {#name, cmd_##name##_func}
@@ -668,11 +2654,13 @@ static const cmd_dispatch_entry cmd_dispatch_table[] = {
 	add_entry(QUIT),
 	add_entry(SYST),
 	add_entry(PASV),
+	add_entry(EPSV),
 	add_entry(PORT),
 	add_entry(LIST),
 	add_entry(PWD),
 	add_entry(CWD),
 	add_entry(TYPE),
+	add_entry(MODE),
 	add_entry(CDUP),
 	add_entry(RETR),
 	add_entry(STOR),
@@ -685,6 +2673,9 @@ static const cmd_dispatch_entry cmd_dispatch_table[] = {
 	add_entry(REST),
 	add_entry(FEAT),
 	add_entry(APPE),
+	add_entry(ABOR),
+	add_entry(STAT),
+	add_entry(SITE),
 	{ NULL, NULL }
 };
 
@@ -706,176 +2697,662 @@ static cmd_dispatch_func get_dispatch_func(const char *cmd) {
 	return NULL;
 }
 
-static void client_list_add(ftps4_client_info_t *client) {
-	/* Add the client at the front of the client list */
-	scePthreadMutexLock(&client_list_mtx);
+static int client_slab_init() {
+	unsigned int i;
 
-	if (client_list == NULL) { /* List is empty */
-		client_list = client;
-		client->prev = NULL;
-		client->next = NULL;
-	} else {
-		client->next = client_list;
-		client->next->prev = client;
-		client->prev = NULL;
-		client_list = client;
+	client_slab = (ftps4_client_info_t *)malloc(max_clients * sizeof(*client_slab));
+	if (client_slab == NULL) return -1;
+	client_state = new (std::nothrow) std::atomic<unsigned int>[max_clients];
+	if (client_state == NULL) {
+		free(client_slab);
+		client_slab = NULL;
+		return -1;
 	}
-	client->restore_point = 0;
-	number_clients++;
 
-	scePthreadMutexUnlock(&client_list_mtx);
+	for (i = 0; i < max_clients; i++) client_state[i].store(0);
+	client_alloc_hint.store(0);
+	number_clients.store(0);
+	next_client_num.store(0);
+
+	FTPS4_LOG_DEBUG("Client slab: %u sessions of %u bytes\n", max_clients, (unsigned int)sizeof(*client_slab));
+	return 0;
+}
+
+static void client_slab_fini() {
+	delete[] client_state;
+	client_state = NULL;
+	free(client_slab);
+	client_slab = NULL;
+}
+
+/* Returns NULL when max_clients sessions are in use */
+static ftps4_client_info_t *client_alloc() {
+	unsigned int i, slot, start = client_alloc_hint.fetch_add(1);
+	unsigned int expected;
+
+	/* Starting at a moving hint keeps concurrent callers off the same slots */
+	for (i = 0; i < max_clients; i++) {
+		slot = (start + i) % max_clients;
+		expected = 0;
+		if (client_state[slot].compare_exchange_strong(expected, SESSION_USED)) {
+			memset(&client_slab[slot], 0, sizeof(client_slab[slot]));
+			return &client_slab[slot];
+		}
+	}
+	return NULL;
+}
+
+static void client_free(ftps4_client_info_t *client) {
+	client_state[client - client_slab].store(0, std::memory_order_release);
+}
+
+/* Makes the session visible to client_foreach() */
+static void client_list_add(ftps4_client_info_t *client) {
+	client->restore_point = 0;
+	number_clients.fetch_add(1);
+	client_state[client - client_slab].fetch_or(SESSION_LIVE, std::memory_order_release);
 }
 
+/* Hides the session from client_foreach() and waits until no iterator
+* holds it any more, after that its sockets are the owner's alone */
 static void client_list_delete(ftps4_client_info_t *client) {
-	/* Remove the client from the client list */
-	scePthreadMutexLock(&client_list_mtx);
+	std::atomic<unsigned int> *state = &client_state[client - client_slab];
+
+	state->fetch_and(~SESSION_LIVE);
+	number_clients.fetch_sub(1);
+	while (state->load(std::memory_order_acquire) & SESSION_PINS) sceKernelUsleep(SESSION_UNPIN_WAIT);
+}
 
-	if (client->prev) client->prev->next = client->next;
-	if (client->next) client->next->prev = client->prev;
-	if (client == client_list) client_list = client->next;
+/* Calls func for every registered session. Nothing is locked: each session
+* is pinned while func runs, which only delays its client_list_delete() */
+static void client_foreach(void (*func)(ftps4_client_info_t *client, void *arg), void *arg) {
+	unsigned int i, state;
 
-	number_clients--;
+	for (i = 0; i < max_clients; i++) {
+		state = client_state[i].load(std::memory_order_acquire);
+		do {
+			if (!(state & SESSION_LIVE)) break;
+		} while (!client_state[i].compare_exchange_weak(state, state + 1, std::memory_order_acquire));
+		if (!(state & SESSION_LIVE)) continue;
 
-	scePthreadMutexUnlock(&client_list_mtx);
+		func(&client_slab[i], arg);
+		client_state[i].fetch_sub(1, std::memory_order_release);
+	}
 }
 
-static void client_list_thread_end() {
-	ftps4_client_info_t *it, *next;
-	ScePthread client_thid;
+/* Wakes a session out of whatever it is blocked on. The control socket only
+* has receiving aborted so the session can still send its last reply.
+* The session must be pinned (see client_foreach()). */
+static void client_abort(ftps4_client_info_t *client, int ctrl, int data) {
 	const int data_abort_flags = SCE_NET_SOCKET_ABORT_FLAG_RCV_PRESERVATION |
 		SCE_NET_SOCKET_ABORT_FLAG_SND_PRESERVATION;
 
-	/* Iterate over the client list and close their sockets */
-	scePthreadMutexLock(&client_list_mtx);
+	if (ctrl) client->abort_requested = 1;
+	if (data) client->data_abort = 1;
+
+	if (ctrl) sceNetSocketAbort(client->ctrl_sockfd, SCE_NET_SOCKET_ABORT_FLAG_RCV_PRESERVATION);
+
+	/* If there's an open data connection, abort it. The session may be
+	* closing it right now, see client_data_lock(). */
+	if (!data) return;
+	client_data_lock(client);
+	if (client->data_con_type != FTP_DATA_CONNECTION_NONE) {
+		/* A pooled listener is shared, the accept wait polls data_abort instead */
+		if (client->pasv_slot < 0 && client->data_sockfd >= 0) sceNetSocketAbort(client->data_sockfd, data_abort_flags);
+		if (client->data_con_type == FTP_DATA_CONNECTION_PASSIVE && client->pasv_sockfd >= 0) {
+			sceNetSocketAbort(client->pasv_sockfd, data_abort_flags);
+		}
+	}
+	client_data_unlock(client);
+}
+
+static void client_thread_exited() {
+	scePthreadMutexLock(&client_threads_mtx);
+	client_threads--;
+	scePthreadCondBroadcast(&client_threads_cond);
+	scePthreadMutexUnlock(&client_threads_mtx);
+}
+
+static void client_shutdown_one(ftps4_client_info_t *client, void *arg) {
+	UNUSED(arg);
+	client_abort(client, 1, 1);
+}
 
-	it = client_list;
+/* Aborts every session at once and waits for all of them against one
+* deadline, returns how many client threads are still running */
+static int client_list_thread_end() {
+	unsigned long long now, deadline;
+	int left;
 
-	while (it) {
-		next = it->next;
-		client_thid = it->thid;
+	deadline = sceKernelGetProcessTime() + SHUTDOWN_TIMEOUT;
 
-		/* Abort the client's control socket, only abort
-		* receiving data so we can still send control messages */
-		sceNetSocketAbort(it->ctrl_sockfd, SCE_NET_SOCKET_ABORT_FLAG_RCV_PRESERVATION);
+	client_foreach(client_shutdown_one, NULL);
 
-		/* If there's an open data connection, abort it */
-		if (it->data_con_type != FTP_DATA_CONNECTION_NONE) {
-			sceNetSocketAbort(it->data_sockfd, data_abort_flags);
-			if (it->data_con_type == FTP_DATA_CONNECTION_PASSIVE) {
-				sceNetSocketAbort(it->pasv_sockfd, data_abort_flags);
-			}
-		}
+	scePthreadMutexLock(&client_threads_mtx);
+	while (client_threads > 0) {
+		now = sceKernelGetProcessTime();
+		if (now >= deadline) break;
+		scePthreadCondTimedwait(&client_threads_cond, &client_threads_mtx, deadline - now);
+	}
+	left = client_threads;
+	scePthreadMutexUnlock(&client_threads_mtx);
+
+	return left;
+}
+
+static void reaper_check(ftps4_client_info_t *it, void *arg) {
+	unsigned long long now = *(unsigned long long *)arg;
 
-		/* Wait until the client threads ends */
-		scePthreadJoin(client_thid, NULL);
+	if (it->abort_requested) return;
 
-		it = next;
+	if (it->in_transfer) {
+		if (it->data_abort) return;
+		/* Only the transfer is aborted, the session may go on */
+		if (data_stall_timeout && now - it->data_activity > (unsigned long long)data_stall_timeout * 1000 * 1000) {
+			FTPS4_LOG_INFO("Client %i transfer stalled, aborting it.\n", it->num);
+			client_abort(it, 0, 1);
+		}
+	} else if (ctrl_idle_timeout && now - it->ctrl_activity > (unsigned long long)ctrl_idle_timeout * 1000 * 1000) {
+		FTPS4_LOG_INFO("Client %i idle, closing the session.\n", it->num);
+		it->reaped = 1;
+		client_abort(it, 1, 1);
 	}
+}
+
+static void *reaper_thread(void *arg) {
+	unsigned long long now;
+	UNUSED(arg);
+
+	scePthreadMutexLock(&reaper_mtx);
+	while (reaper_running) {
+		scePthreadCondTimedwait(&reaper_cond, &reaper_mtx, REAPER_INTERVAL);
+		if (!reaper_running) break;
 
-	scePthreadMutexUnlock(&client_list_mtx);
+		now = sceKernelGetProcessTime();
+		client_foreach(reaper_check, &now);
+	}
+	scePthreadMutexUnlock(&reaper_mtx);
+	return NULL;
 }
 
-static void *client_thread(void *arg) {
+/* Runs one command line, line is NUL terminated without the EOL */
+static void client_dispatch_line(ftps4_client_info_t *client, char *line) {
 	char cmd[16];
 	cmd_dispatch_func dispatch_func;
-	ftps4_client_info_t *client = (ftps4_client_info_t *)arg;
 
-	if (useDebug) FTP::debug->Log("Client thread %i started!\n", client->num);
+	line = skip_telnet_prefix(line);
 
-	client_send_ctrl_msg(client, "220 FTPS4 Server ready." FTPS4_EOL);
+	/* Already handled by client_peek_abor() */
+	if (client->abor_queued && strncasecmp(line, "ABOR", 4) == 0 && line[4] == '\0') {
+		client->abor_queued = 0;
+		return;
+	}
 
-	while (1) {
-		memset(client->recv_buffer, 0, sizeof(client->recv_buffer));
+	FTPS4_LOG_INFO("\t%i> %s\n", client->num, line);
 
-		client->n_recv = sceNetRecv(client->ctrl_sockfd, client->recv_buffer, sizeof(client->recv_buffer), 0);
-		if (client->n_recv > 0) {
-			if (useDebug) FTP::debug->Log("Received %i bytes from client number %i:\n", client->n_recv, client->num);
+	/* The command is the first chars until the first space */
+	if (sscanf(line, "%15s", cmd) < 1) return;
+
+	client->recv_cmd_args = strchr(line, ' ');
+	if (client->recv_cmd_args)
+		client->recv_cmd_args++; /* Skip the space */
+
+	/* Wait 1 ms before sending any data */
+	FTPS4_TRACE_BEGIN(t_sleep);
+	sceKernelUsleep(1 * 1000);
+	FTPS4_TRACE_END(t_sleep, "dispatch_sleep", NULL, client->num, 0);
+
+	FTPS4_TRACE_BEGIN(t_cmd);
+	if ((dispatch_func = get_dispatch_func(cmd))) dispatch_func(client);
+	else client_send_ctrl_msg(client, "502 Sorry, command not implemented. :(" FTPS4_EOL);
+	FTPS4_TRACE_END(t_cmd, "command", cmd, client->num, 0);
+
+	/* ABOR arrived during the transfer, it got its 426, now the ABOR reply */
+	if (client->abor_pending) {
+		client->abor_pending = 0;
+		client_send_ctrl_msg(client, "226 Abort successful." FTPS4_EOL);
+	}
+
+	/* A long transfer doesn't count as idle time */
+	client->ctrl_activity = sceKernelGetProcessTime();
+}
 
-			if (useInfo) FTP::info->Log("\t%i> %s", client->num, client->recv_buffer);
-			if (useInfo) Console::WriteLine("\t%i> %s", client->num, client->recv_buffer);
+static void *client_thread(void *arg) {
+	char *eol;
+	unsigned int consumed;
+	int ret;
+	ftps4_client_info_t *client = (ftps4_client_info_t *)arg;
+
+	FTPS4_LOG_DEBUG("Client thread %i started!\n", client->num);
 
-			/* The command is the first chars until the first space */
-			sscanf(client->recv_buffer, "%s", cmd);
+	client_send_ctrl_msg(client, "220 FTPS4 Server ready." FTPS4_EOL);
+
+	client->n_recv = 0;
+	client->recv_buffer[0] = '\0';
 
-			client->recv_cmd_args = strchr(client->recv_buffer, ' ');
-			if (client->recv_cmd_args)
-				client->recv_cmd_args++; /* Skip the space */
+	while (1) {
+		/* Answer every pipelined command that is already here first */
+		eol = (char *)memchr(client->recv_buffer, '\n', client->n_recv);
+		if (eol) {
+			*eol = '\0';
+			if (eol > client->recv_buffer && eol[-1] == '\r') eol[-1] = '\0';
+
+			/* Commands polled during a transfer are appended behind this line */
+			consumed = eol + 1 - client->recv_buffer;
+			client->line_len = consumed;
+			client_dispatch_line(client, client->recv_buffer);
+			client->line_len = 0;
+
+			client->n_recv -= consumed;
+			memmove(client->recv_buffer, eol + 1, client->n_recv);
+			client->recv_buffer[client->n_recv] = '\0';
+			continue;
+		}
 
-			/* Wait 1 ms before sending any data */
-			sceKernelUsleep(1 * 1000);
+		if (client->n_recv >= (int)sizeof(client->recv_buffer) - 1) {
+			/* No EOL in a full buffer, nothing sane to do with it */
+			client->n_recv = 0;
+			client_send_ctrl_msg(client, "500 Command line too long." FTPS4_EOL);
+		}
 
-			if ((dispatch_func = get_dispatch_func(cmd))) dispatch_func(client);
-			else client_send_ctrl_msg(client, "502 Sorry, command not implemented. :(" FTPS4_EOL);
+		/* About to block, send the replies to everything answered so far */
+		client_flush_ctrl(client);
 
-		} else if (client->n_recv == 0) {
+		ret = sceNetRecv(client->ctrl_sockfd, client->recv_buffer + client->n_recv, sizeof(client->recv_buffer) - 1 - client->n_recv, 0);
+		if (ret > 0) {
+			FTPS4_LOG_DEBUG("Received %i bytes from client number %i:\n", ret, client->num);
+			client->ctrl_activity = sceKernelGetProcessTime();
+			client->n_recv += ret;
+			client->recv_buffer[client->n_recv] = '\0';
+		} else if (ret == 0) {
 			/* Value 0 means connection closed by the remote peer */
-			if (useInfo) FTP::info->Log("Connection closed by the client %i.\n", client->num);
-			if (useInfo) Console::WriteLine("Connection closed by the client %i.\n", client->num);
-			/* Delete itself from the client list */
-			client_list_delete(client);
+			FTPS4_LOG_INFO("Connection closed by the client %i.\n", client->num);
 			break;
-		} else if (client->n_recv == SCE_NET_ERROR_EINTR) {
-			/* Socket aborted (ftps4_fini() called) */
-			if (useInfo) FTP::info->Log("Client %i socket aborted.\n", client->num);
-			if (useInfo) Console::WriteLine("Client %i socket aborted.\n", client->num);
+		} else if (ret == SCE_NET_ERROR_EINTR) {
+			/* Socket aborted (idle reaper or ftps4_fini() called) */
+			if (client->reaped) client_send_ctrl_msg(client, "421 Idle timeout, closing control connection." FTPS4_EOL);
+			else client_send_ctrl_msg(client, "421 Server shutting down." FTPS4_EOL);
+			FTPS4_LOG_INFO("Client %i socket aborted.\n", client->num);
 			break;
 		} else {
 			/* Other errors */
-			if (useInfo) FTP::info->Log("Client %i socket error: 0x%08X\n", client->num, client->n_recv);
-			if (useInfo) Console::WriteLine("Client %i socket error: 0x%08X\n", client->num, client->n_recv);
-			client_list_delete(client);
+			FTPS4_LOG_INFO("Client %i socket error: 0x%08X\n", client->num, ret);
 			break;
 		}
 	}
 
+	/* Delete itself from the client list */
+	client_list_delete(client);
+
+	/* Anything still queued (the socket may be gone already) */
+	client_flush_ctrl(client);
+
 	/* Close the client's socket */
 	sceNetSocketClose(client->ctrl_sockfd);
 
 	/* If there's an open data connection, close it */
-	if (client->data_con_type != FTP_DATA_CONNECTION_NONE) {
-		sceNetSocketClose(client->data_sockfd);
-		if (client->data_con_type == FTP_DATA_CONNECTION_PASSIVE) {
-			sceNetSocketClose(client->pasv_sockfd);
+	client_close_data_connection(client);
+
+	FTPS4_LOG_DEBUG("Client thread %i exiting!\n", client->num);
+
+	ftps4_shaper_session_end(&client->flow);
+	ftps4_prefetch_end(&client->prefetch);
+	client_free(client);
+
+	/* Last thing, ftps4_fini() may tear everything down right after */
+	client_thread_exited();
+
+	scePthreadExit(NULL);
+	return NULL;
+}
+
+/* Sends a response head, fields holds further header lines each ending in FTPS4_EOL */
+static int http_send_head(ftps4_client_info_t *client, const char *status, const char *fields,
+	unsigned long long length, int keep_alive) {
+	char head[1024], date[32];
+	int n;
+
+	ftps4_http_date(time(NULL), date, sizeof(date));
+	n = snprintf(head, sizeof(head),
+		"HTTP/1.1 %s" FTPS4_EOL
+		"Server: FTPS4" FTPS4_EOL
+		"Date: %s" FTPS4_EOL
+		"%s"
+		"Content-Length: %llu" FTPS4_EOL
+		"Connection: %s" FTPS4_EOL FTPS4_EOL,
+		status, date, fields ? fields : "", length, keep_alive ? "keep-alive" : "close");
+	if (n < 0 || n >= (int)sizeof(head)) return -1;
+	return client_send_data_raw(client, head, n);
+}
+
+/* Answers with status alone, the body (left out for HEAD) repeats it as text */
+static void http_send_status(ftps4_client_info_t *client, ftps4_http_method_t method, const char *status,
+	const char *fields, int keep_alive) {
+	char all[512];
+
+	snprintf(all, sizeof(all), "Content-Type: text/plain" FTPS4_EOL "%s", fields ? fields : "");
+	if (http_send_head(client, status, all, strlen(status) + 2, keep_alive) < 0) return;
+	if (method != FTPS4_HTTP_HEAD) client_send_data_raw(client, status, strlen(status));
+	if (method != FTPS4_HTTP_HEAD) client_send_data_raw(client, FTPS4_EOL, 2);
+}
+
+/* Appends to the growing index page, returns < 0 once it would pass HTTP_INDEX_MAX */
+static int http_index_append(char **page, unsigned int *len, unsigned int *size, const char *fmt, ...) {
+	va_list args;
+	char *grown;
+	int n;
+
+	while (1) {
+		va_start(args, fmt);
+		n = vsnprintf(*page + *len, *size - *len, fmt, args);
+		va_end(args);
+		if (n < 0) return -1;
+		if (*len + n < *size) break;
+
+		if (*size * 2 > HTTP_INDEX_MAX) return -1;
+		if (!(grown = (char *)realloc(*page, *size * 2))) return -1;
+		*page = grown;
+		*size *= 2;
+	}
+	*len += n;
+	return 0;
+}
+
+typedef struct {
+	ftps4_client_info_t *client;
+	const char *path;
+	char **page;
+	unsigned int *len, *size;
+	int full;
+} http_index_ctx;
+
+/* One line of the index page, stops the read once the page is full or the
+* client went away */
+static int http_index_entry(void *arg, const char *d_name, int type) {
+	http_index_ctx *ctx = (http_index_ctx *)arg;
+	char name[PATH_MAXX * 6], link[PATH_MAXX * 3], full_path[PATH_MAXX];
+	struct stat st;
+
+	(void)type;
+	if (ctx->client->data_abort) return 1;
+	if (snprintf(full_path, sizeof(full_path), "%s/%s", strcmp(ctx->path, "/") ? ctx->path : "", d_name) >= (int)sizeof(full_path)) return 0;
+	if (Sys::stat(full_path, &st) < 0) return 0;
+	if (ftps4_http_url_encode(d_name, link, sizeof(link)) < 0 ||
+		ftps4_http_html_escape(d_name, name, sizeof(name)) < 0) return 0;
+
+	if (S_ISDIR(st.st_mode))
+		ctx->full = http_index_append(ctx->page, ctx->len, ctx->size, "<a href=\"%s/\">%s/</a>\n", link, name) < 0;
+	else
+		ctx->full = http_index_append(ctx->page, ctx->len, ctx->size, "<a href=\"%s\">%s</a> %llu\n", link, name,
+			(unsigned long long)st.st_size) < 0;
+	return ctx->full;
+}
+
+/* Builds the index page of the directory at path, NULL without memory or if it can't be read */
+static char *http_build_index(ftps4_client_info_t *client, const char *path, unsigned int *len) {
+	char name[PATH_MAXX * 6];
+	unsigned int size = 16 * 1024;
+	http_index_ctx ctx;
+	char *page;
+	int full = 0;
+
+	page = (char *)malloc(size);
+	*len = 0;
+
+	if (!page || ftps4_http_html_escape(path, name, sizeof(name)) < 0) {
+		full = 1;
+	} else {
+		http_index_append(&page, len, &size,
+			"<!DOCTYPE html>\n<html><head><meta charset=\"utf-8\"><title>Index of %s</title></head>\n"
+			"<body><h1>Index of %s</h1><pre>\n", name, name);
+		if (strcmp(path, "/") != 0) http_index_append(&page, len, &size, "<a href=\"../\">../</a>\n");
+
+		ctx.client = client;
+		ctx.path = path;
+		ctx.page = &page;
+		ctx.len = len;
+		ctx.size = &size;
+		ctx.full = 0;
+		if (ftps4_dir_read(path, http_index_entry, &ctx) < 0) full = 1;
+		/* An oversized listing is cut short, there is room left for the end */
+		if (ctx.full) FTPS4_LOG_INFO("Index of %s cut at %u bytes.\n", path, *len);
+		if (!full) full = http_index_append(&page, len, &size, "</pre></body></html>\n") < 0;
+	}
+
+	if (page && full) {
+		free(page);
+		page = NULL;
+	}
+	return page;
+}
+
+static int http_serve_index(ftps4_client_info_t *client, const ftps4_http_request_t *req, int keep_alive) {
+	unsigned int len;
+	char *page = http_build_index(client, req->path, &len);
+
+	if (!page) {
+		http_send_status(client, req->method, "500 Internal Server Error", NULL, 0);
+		return 0;
+	}
+	if (http_send_head(client, "200 OK", "Content-Type: text/html; charset=utf-8" FTPS4_EOL, len, keep_alive) >= 0 &&
+		req->method == FTPS4_HTTP_GET)
+		client_send_data(client, page, len);
+	free(page);
+	return keep_alive;
+}
+
+/* Sends the file at req->path (stat in st), whole or the requested range,
+* through the same cache and shaper path as RETR */
+static int http_serve_file(ftps4_client_info_t *client, const ftps4_http_request_t *req, struct stat *st, int keep_alive) {
+	char fields[256], date[32];
+	unsigned long long size = st->st_size, start = 0, end = st->st_size;
+	ftps4_cache_key_t key;
+	ftps4_io_t io;
+	int fd, ranged, use_cache;
+
+	ranged = req->range[0] ? ftps4_http_parse_range(req->range, size, &start, &end) : 1;
+	if (ranged < 0) {
+		snprintf(fields, sizeof(fields), "Content-Range: bytes */%llu" FTPS4_EOL, size);
+		http_send_status(client, req->method, "416 Range Not Satisfiable", fields, keep_alive);
+		return keep_alive;
+	}
+	if (ranged > 0) {
+		start = 0;
+		end = size;
+	}
+
+	if ((fd = Sys::open(req->path, O_RDONLY, 0)) < 0) {
+		http_send_status(client, req->method, "403 Forbidden", NULL, keep_alive);
+		return keep_alive;
+	}
+	if (ftps4_io_init(&io, fd, file_buf_size) < 0) {
+		Sys::close(fd);
+		http_send_status(client, req->method, "503 Service Unavailable", NULL, 0);
+		return 0;
+	}
+
+	ftps4_http_date(st->st_mtim.tv_sec, date, sizeof(date));
+	if (ranged == 0)
+		snprintf(fields, sizeof(fields),
+			"Content-Type: application/octet-stream" FTPS4_EOL "Accept-Ranges: bytes" FTPS4_EOL
+			"Last-Modified: %s" FTPS4_EOL "Content-Range: bytes %llu-%llu/%llu" FTPS4_EOL,
+			date, start, end - 1, size);
+	else
+		snprintf(fields, sizeof(fields),
+			"Content-Type: application/octet-stream" FTPS4_EOL "Accept-Ranges: bytes" FTPS4_EOL
+			"Last-Modified: %s" FTPS4_EOL, date);
+
+	if (http_send_head(client, ranged == 0 ? "206 Partial Content" : "200 OK", fields, end - start, keep_alive) >= 0 &&
+		req->method == FTPS4_HTTP_GET) {
+		client->xfer_total = end - start;
+		if (end - start <= ftps4_shaper_get_small_file())
+			ftps4_shaper_transfer_start(&client->flow, SHAPER_CLASS_INTERACTIVE);
+		else
+			ftps4_shaper_transfer_start(&client->flow, SHAPER_CLASS_BULK);
+
+		use_cache = ftps4_cache_enabled() && S_ISREG(st->st_mode);
+		if (use_cache) ftps4_cache_key_from_stat(&key, st);
+		send_file_data(client, &io, use_cache ? &key : NULL, start, end);
+
+		ftps4_shaper_transfer_end(&client->flow);
+		/* A file that shrank meanwhile leaves the promised length unsent */
+		if (client->xfer_bytes != end - start) keep_alive = 0;
+	}
+
+	Sys::close(fd);
+	ftps4_io_fini(&io);
+	return keep_alive;
+}
+
+/* Answers one request, returns non zero if the connection stays open */
+static int http_respond(ftps4_client_info_t *client, const ftps4_http_request_t *req) {
+	static const char *methods[] = { "GET", "HEAD", "?" };
+	char fields[PATH_MAXX * 3 + 32];
+	const char *name;
+	struct stat st;
+	/* A body that isn't read would be taken for the next request */
+	int keep_alive = req->keep_alive && !req->has_body;
+
+	FTPS4_LOG_INFO("\t%i HTTP> %s %s\n", client->num, methods[req->method], req->path);
+
+	if (req->method == FTPS4_HTTP_OTHER) {
+		http_send_status(client, req->method, "501 Not Implemented", "Allow: GET, HEAD" FTPS4_EOL, keep_alive);
+	} else if (Sys::stat(req->path, &st) < 0) {
+		http_send_status(client, req->method, "404 Not Found", NULL, keep_alive);
+	} else if (S_ISDIR(st.st_mode) && !req->trailing_slash && strcmp(req->path, "/") != 0) {
+		/* Relative links in the index only work below a path ending in '/' */
+		name = strrchr(req->path, '/') + 1;
+		strcpy(fields, "Location: ");
+		if (ftps4_http_url_encode(name, fields + 10, sizeof(fields) - 10 - 3) < 0) {
+			http_send_status(client, req->method, "404 Not Found", NULL, keep_alive);
+		} else {
+			strcat(fields, "/" FTPS4_EOL);
+			http_send_status(client, req->method, "301 Moved Permanently", fields, keep_alive);
+		}
+	} else if (S_ISDIR(st.st_mode)) {
+		keep_alive = http_serve_index(client, req, keep_alive);
+	} else {
+		keep_alive = http_serve_file(client, req, &st, keep_alive);
+	}
+
+	return keep_alive && !client->data_abort;
+}
+
+/* Waits for more of a request, returns what was received and 0 once the
+* connection is closed, idle for too long or the session is aborted */
+static int http_recv(ftps4_client_info_t *client, char *buf, unsigned int len) {
+	int ret;
+
+	while (!client->abort_requested) {
+		ret = sceNetRecv(client->ctrl_sockfd, buf, len, 0);
+		if (ret > 0) {
+			client->ctrl_activity = sceKernelGetProcessTime();
+			return ret;
+		}
+		if (ret == 0) break;
+		if (ret != SCE_NET_ERROR_EAGAIN && ret != SCE_NET_ERROR_EINTR) {
+			FTPS4_LOG_INFO("Client %i socket error: 0x%08X\n", client->num, ret);
+			break;
+		}
+		if (sceKernelGetProcessTime() - client->ctrl_activity > HTTP_KEEPALIVE_TIMEOUT) break;
+		if (socket_wait(client->ctrl_sockfd, SCE_NET_EPOLLIN, ABORT_POLL_INTERVAL) < 0) break;
+	}
+	return 0;
+}
+
+/* HTTP frontend session: GET and HEAD requests one after the other on a
+* kept alive connection, which doubles as the session's data connection */
+static void *http_thread(void *arg) {
+	ftps4_client_info_t *client = (ftps4_client_info_t *)arg;
+	ftps4_http_request_t req;
+	unsigned int n_head = 0, n;
+	int len, ret, keep_alive = 1;
+	char *head;
+
+	FTPS4_LOG_DEBUG("HTTP client thread %i started!\n", client->num);
+
+	head = (char *)malloc(FTPS4_HTTP_MAX_HEAD);
+	while (head && keep_alive && !client->abort_requested) {
+		/* Take over what was polled off the connection during the last response */
+		if (client->n_recv > 0) {
+			n = client->n_recv < (int)(FTPS4_HTTP_MAX_HEAD - n_head) ? client->n_recv : FTPS4_HTTP_MAX_HEAD - n_head;
+			memcpy(head + n_head, client->recv_buffer, n);
+			n_head += n;
+			client->n_recv = 0;
+		}
+
+		len = ftps4_http_parse_request(head, n_head, &req);
+		if (len == 0) {
+			ret = http_recv(client, head + n_head, FTPS4_HTTP_MAX_HEAD - n_head);
+			if (ret <= 0) break;
+			n_head += ret;
+			continue;
+		}
+
+		client->data_abort = 0;
+		client->xfer_error = XFER_ERROR_NONE;
+		client->xfer_bytes = 0;
+		client->xfer_total = -1;
+		client->xfer_start = client->data_activity = sceKernelGetProcessTime();
+		client->in_transfer = 1;
+
+		if (len < 0) {
+			http_send_status(client, FTPS4_HTTP_GET, "400 Bad Request", NULL, 0);
+			keep_alive = 0;
+		} else {
+			keep_alive = http_respond(client, &req);
+			n_head -= len;
+			memmove(head, head + len, n_head);
 		}
+
+		client->in_transfer = 0;
+		client->ctrl_activity = sceKernelGetProcessTime();
 	}
+	free(head);
+
+	client_list_delete(client);
+
+	/* The one socket is both connections */
+	client_data_wait_end(client);
+	sceNetSocketClose(client->ctrl_sockfd);
+
+	FTPS4_LOG_DEBUG("HTTP client thread %i exiting!\n", client->num);
 
-	if (useDebug) FTP::debug->Log("Client thread %i exiting!\n", client->num);
+	ftps4_shaper_session_end(&client->flow);
+	client_free(client);
 
-	free(client);
+	client_thread_exited();
 
 	scePthreadExit(NULL);
 	return NULL;
 }
 
+/* Accepts the sessions of one listener (FTP or HTTP) until it is closed */
 static void *server_thread(void *arg) {
+	listener_t *listener = (listener_t *)arg;
 	int ret, enable;
 	UNUSED(ret);
 
 	struct SceNetSockaddrIn serveraddr;
 
-	if (useDebug) FTP::debug->Log("Server thread started!\n");
-
-	/* Create server socket */
-	server_sockfd = sceNetSocket("FTPS4_server_sock", SCE_NET_AF_INET, SCE_NET_SOCK_STREAM, 0);
-
-	if (useDebug) FTP::debug->Log("Server socket fd: %d\n", server_sockfd);
+	FTPS4_LOG_DEBUG("%s thread started!\n", listener->name);
 
 	enable = 1;
-	sceNetSetsockopt(server_sockfd, SCE_NET_SOL_SOCKET, SCE_NET_SO_REUSEADDR, &enable, sizeof(enable));
+	sceNetSetsockopt(listener->sockfd, SCE_NET_SOL_SOCKET, SCE_NET_SO_REUSEADDR, &enable, sizeof(enable));
 
 	/* Fill the server's address */
 	serveraddr.sin_len = sizeof(serveraddr);
 	serveraddr.sin_family = SCE_NET_AF_INET;
 	serveraddr.sin_addr.s_addr = sceNetHtonl(IN_ADDR_ANY);
-	serveraddr.sin_port = sceNetHtons(ps4_port);
+	serveraddr.sin_port = sceNetHtons(listener->port);
 
 	/* Bind the server's address to the socket */
-	ret = sceNetBind(server_sockfd, (struct SceNetSockaddr *)&serveraddr, sizeof(serveraddr));
-	if (useDebug) FTP::debug->Log("sceNetBind(): 0x%08X\n", ret);
+	ret = sceNetBind(listener->sockfd, (struct SceNetSockaddr *)&serveraddr, sizeof(serveraddr));
+	FTPS4_LOG_DEBUG("sceNetBind(): 0x%08X\n", ret);
 
 	/* Start listening */
-	ret = sceNetListen(server_sockfd, 128);
-	if (useDebug) FTP::debug->Log("sceNetListen(): 0x%08X\n", ret);
+	ret = sceNetListen(listener->sockfd, 128);
+	FTPS4_LOG_DEBUG("sceNetListen(): 0x%08X\n", ret);
 
 	while (1) {
 		/* Accept clients */
@@ -883,11 +3360,11 @@ static void *server_thread(void *arg) {
 		int client_sockfd;
 		unsigned int addrlen = sizeof(clientaddr);
 
-		if (useDebug) FTP::debug->Log("Waiting for incoming connections...\n");
+		FTPS4_LOG_DEBUG("Waiting for incoming connections...\n");
 
-		client_sockfd = sceNetAccept(server_sockfd, (struct SceNetSockaddr *)&clientaddr, &addrlen);
+		client_sockfd = sceNetAccept(listener->sockfd, (struct SceNetSockaddr *)&clientaddr, &addrlen);
 		if (client_sockfd >= 0) {
-			if (useDebug) FTP::debug->Log("New connection, client fd: 0x%08X\n", client_sockfd);
+			FTPS4_LOG_DEBUG("New connection, client fd: 0x%08X\n", client_sockfd);
 
 			/* Get the client's IP address */
 			char remote_ip[16];
@@ -896,44 +3373,76 @@ static void *server_thread(void *arg) {
 				remote_ip,
 				sizeof(remote_ip));
 
-			if (useInfo) FTP::info->Log("Client %i connected, IP: %s port: %i\n", number_clients, remote_ip, clientaddr.sin_port);
-			if (useInfo) Console::WriteLine("Client %i connected, IP: %s port: %i\n", number_clients, remote_ip, clientaddr.sin_port);
+			/* Take a session from the slab for the new client */
+			ftps4_client_info_t *client = client_alloc();
+			if (client == NULL) {
+				/* Full, refuse right away instead of spawning a thread */
+				FTPS4_LOG_INFO("Client refused, IP: %s port: %i (too many connections)\n", remote_ip, clientaddr.sin_port);
+				sceNetSend(client_sockfd, listener->busy_msg, strlen(listener->busy_msg), 0);
+				sceNetSocketClose(client_sockfd);
+				continue;
+			}
 
-			/* Allocate the ftps4_client_info_t struct for the new client */
-			ftps4_client_info_t *client = (ftps4_client_info_t *)malloc(sizeof(*client));
-			client->num = number_clients;
+			client->num = next_client_num.fetch_add(1);
 			client->ctrl_sockfd = client_sockfd;
 			client->data_con_type = FTP_DATA_CONNECTION_NONE;
-			strcpy(client->cur_path, FTP_DEFAULT_PATH);
+			client->data_sockfd = -1;
+			client->pasv_sockfd = -1;
+			client->pasv_slot = -1;
+			client->data_eid = -1;
+			client->data_wait_fd = -1;
+			if (listener->http) {
+				/* Responses go out on the request connection, it is the data connection too */
+				client->http = 1;
+				client->data_sockfd = client_sockfd;
+				client->data_con_type = FTP_DATA_CONNECTION_ACTIVE;
+				client->data_connected = 1;
+				socket_set_nbio(client_sockfd, 1);
+			}
+			ftps4_path_resolve(NULL, FTP_DEFAULT_PATH, &client->cwd);
 			memcpy(&client->addr, &clientaddr, sizeof(client->addr));
+			ftps4_shaper_session_start(&client->flow, clientaddr.sin_addr.s_addr);
+
+			FTPS4_LOG_INFO("Client %i connected, IP: %s port: %i\n", client->num, remote_ip, clientaddr.sin_port);
 
 			/* Add the new client to the client list */
 			client_list_add(client);
 
 			/* Create a new thread for the client */
 			char client_thread_name[64];
-			sprintf(client_thread_name, "FTPS4_client_%i_thread",
-				number_clients);
-
-			/* Create a new thread for the client */
-			scePthreadCreate(&client->thid, NULL, client_thread, client, client_thread_name);
-
-			if (useDebug) FTP::debug->Log("Client %i thread UID: 0x%08X\n", number_clients, client->thid);
+			sprintf(client_thread_name, "FTPS4_%s_%i_thread",
+				listener->http ? "http" : "client", client->num);
+
+			client->ctrl_activity = sceKernelGetProcessTime();
+
+			scePthreadMutexLock(&client_threads_mtx);
+			client_threads++;
+			scePthreadMutexUnlock(&client_threads_mtx);
+
+			/* Create a new thread for the client, nobody joins it */
+			if (scePthreadCreate(&client->thid, NULL, listener->http ? http_thread : client_thread, client, client_thread_name) < 0) {
+				client_list_delete(client);
+				ftps4_shaper_session_end(&client->flow);
+				sceNetSocketClose(client_sockfd);
+				client_free(client);
+				client_thread_exited();
+				continue;
+			}
+			scePthreadDetach(client->thid);
 
-			number_clients++;
+			FTPS4_LOG_DEBUG("Client %i thread UID: 0x%08X\n", client->num, client->thid);
 		} else if (client_sockfd == SCE_NET_ERROR_EINTR) {
-			if (useInfo) FTP::info->Log("Server socket aborted.\n");
-			if (useInfo) Console::WriteLine("Server socket aborted.\n");
+			FTPS4_LOG_INFO("%s socket aborted.\n", listener->name);
 			break;
 		} else {
 			/* if sceNetAccept returns < 0, it means that the listening
 			* socket has been closed, this means that we want to
 			* finish the server thread */
-			if (useDebug) FTP::debug->Log("Server socket closed, 0x%08X\n", client_sockfd);
+			FTPS4_LOG_DEBUG("Server socket closed, 0x%08X\n", client_sockfd);
 			break;
 		}
 	}
-	if (useDebug) FTP::debug->Log("Server thread exiting!\n");
+	FTPS4_LOG_DEBUG("%s thread exiting!\n", listener->name);
 
 	/* Causing a crash? */
 	/*scePthreadExit(NULL);*/
@@ -945,27 +3454,73 @@ int FTP::ftps4_init(const char *ip, unsigned short int port) {
 
 	if (ftp_initialized) return -1;
 
-	/* If pointers to loggers are set, enable writting */
-	if (debug != nullptr) useDebug = true;
-	if (info != nullptr) useInfo = true;
-
-	/* Save the listening port of the PS4 to a global variable */
-	ps4_port = port;
+	/* If pointers to loggers are set, they become the log sinks */
+	ftps4_log_init(debug, info);
+
+	/* Save the listening ports of the PS4 */
+	memset(&ftp_listener, 0, sizeof(ftp_listener));
+	ftp_listener.name = "Server";
+	ftp_listener.port = port;
+	ftp_listener.busy_msg = "421 Too many connections, try again later." FTPS4_EOL;
+	memset(&http_listener, 0, sizeof(http_listener));
+	http_listener.name = "HTTP server";
+	http_listener.port = http_port;
+	http_listener.http = 1;
+	http_listener.busy_msg = "HTTP/1.1 503 Service Unavailable" FTPS4_EOL "Content-Length: 0" FTPS4_EOL
+		"Connection: close" FTPS4_EOL FTPS4_EOL;
 
 	/* Save the IP of the PS4 to a global variable */
 	sceNetInetPton(SCE_NET_AF_INET, ip, &ps4_addr);
 
-	/* Create the client list mutex */
-	scePthreadMutexInit(&client_list_mtx, NULL, "FTPS4_client_list_mutex");
-	if (useDebug) FTP::debug->Log("Client list mutex UID: 0x%08X\n", client_list_mtx);
+	/* Preallocate every session the server will accept */
+	if (client_slab_init() < 0) {
+		ftps4_log_fini();
+		return -1;
+	}
+
+	scePthreadMutexInit(&client_threads_mtx, NULL, "FTPS4_client_threads_mutex");
+	scePthreadCondInit(&client_threads_cond, NULL, "FTPS4_client_threads_cond");
+	client_threads = 0;
 
 	for (i = 0; i < MAX_CUSTOM_COMMANDS; i++) {
 		custom_command_dispatchers[i].valid = 0;
 	}
 
-	/* Create server thread */
-	scePthreadCreate(&server_thid, NULL, server_thread, NULL, "FTPS4_server_thread");
-	if (useDebug) FTP::debug->Log("Server thread UID: 0x%08X\n", server_thid);
+	/* Bandwidth limits persist across restarts, only the state is reset */
+	ftps4_shaper_init();
+
+	scePthreadMutexInit(&upload_mtx, NULL, "FTPS4_upload_mutex");
+	memset(upload_table, 0, sizeof(upload_table));
+
+	/* Bind the PASV listeners up front so PASV doesn't have to */
+	pasv_pool_init();
+
+	ftps4_cache_init(cache_size);
+	/* Reading further ahead than half the cache would evict what was prefetched */
+	ftps4_prefetch_init(prefetch_size < cache_size / 2 ? prefetch_size : cache_size / 2);
+	ftps4_dedup_init(dedup_index);
+	ftps4_du_init();
+	ftps4_watch_init();
+	ftps4_find_init(find_roots);
+
+	/* Create the idle reaper */
+	scePthreadMutexInit(&reaper_mtx, NULL, "FTPS4_reaper_mutex");
+	scePthreadCondInit(&reaper_cond, NULL, "FTPS4_reaper_cond");
+	reaper_running = 1;
+	scePthreadCreate(&reaper_thid, NULL, reaper_thread, NULL, "FTPS4_reaper_thread");
+
+	/* Create server thread, the socket is made here so ftps4_fini() always has one to close */
+	ftp_listener.sockfd = sceNetSocket("FTPS4_server_sock", SCE_NET_AF_INET, SCE_NET_SOCK_STREAM, 0);
+	FTPS4_LOG_DEBUG("Server socket fd: %d\n", ftp_listener.sockfd);
+	scePthreadCreate(&ftp_listener.thid, NULL, server_thread, &ftp_listener, "FTPS4_server_thread");
+	FTPS4_LOG_DEBUG("Server thread UID: 0x%08X\n", ftp_listener.thid);
+
+	/* And the HTTP frontend's next to it */
+	if (http_listener.port) {
+		http_listener.sockfd = sceNetSocket("FTPS4_http_sock", SCE_NET_AF_INET, SCE_NET_SOCK_STREAM, 0);
+		FTPS4_LOG_DEBUG("HTTP server socket fd: %d\n", http_listener.sockfd);
+		scePthreadCreate(&http_listener.thid, NULL, server_thread, &http_listener, "FTPS4_http_server_thread");
+	}
 
 	ftp_initialized = 1;
 
@@ -973,34 +3528,104 @@ int FTP::ftps4_init(const char *ip, unsigned short int port) {
 }
 
 void FTP::ftps4_fini() {
-	if (ftp_initialized) {
+	int left;
+
+	if (ftp_initialized && !ftp_draining) {
 		/* Necessary to get sceNetAccept to notice the close on PS4? */
-		sceNetSocketAbort(server_sockfd, 0);
+		sceNetSocketAbort(ftp_listener.sockfd, 0);
+		if (http_listener.port) sceNetSocketAbort(http_listener.sockfd, 0);
 		/* In order to "stop" the blocking sceNetAccept,
 		* we have to close the server socket; this way
 		* the accept call will return an error */
-		sceNetSocketClose(server_sockfd);
-
-		/* Wait until the server threads ends */
-		scePthreadJoin(server_thid, NULL);
+		sceNetSocketClose(ftp_listener.sockfd);
+		if (http_listener.port) sceNetSocketClose(http_listener.sockfd);
+
+		/* Wait until the server threads end */
+		scePthreadJoin(ftp_listener.thid, NULL);
+		if (http_listener.port) scePthreadJoin(http_listener.thid, NULL);
+
+		/* Stop the reaper before the sessions go away */
+		scePthreadMutexLock(&reaper_mtx);
+		reaper_running = 0;
+		scePthreadCondSignal(&reaper_cond);
+		scePthreadMutexUnlock(&reaper_mtx);
+		scePthreadJoin(reaper_thid, NULL);
+		scePthreadCondDestroy(&reaper_cond);
+		scePthreadMutexDestroy(&reaper_mtx);
+		ftp_draining = 1;
+	}
 
+	if (ftp_initialized) {
 		/* To close the clients we have to do the same:
 		* we have to iterate over all the clients
 		* and shutdown their sockets */
-		client_list_thread_end();
+		left = client_list_thread_end();
+		if (left > 0) {
+			/* Sessions stuck past the deadline still use the shared state,
+			* leave all of it in place, the next ftps4_fini() tries again */
+			FTPS4_LOG_INFO("%i client thread(s) did not stop in time.\n", left);
+			return;
+		}
 
-		/* Delete the client list mutex */
-		scePthreadMutexDestroy(&client_list_mtx);
+		scePthreadCondDestroy(&client_threads_cond);
+		scePthreadMutexDestroy(&client_threads_mtx);
 
-		client_list = NULL;
-		number_clients = 0;
+		pasv_pool_fini();
+		scePthreadMutexDestroy(&upload_mtx);
+		ftps4_prefetch_fini();
+		ftps4_cache_fini();
+		ftps4_dedup_fini();
+		ftps4_du_fini();
+		ftps4_watch_fini();
+		ftps4_find_fini();
+		ftps4_shaper_fini();
+		ftps4_log_fini();
 
+		client_slab_fini();
+
+		ftp_draining = 0;
 		ftp_initialized = 0;
 	}
 }
 
 int FTP::ftps4_is_initialized() { return ftp_initialized; }
 void FTP::ftps4_set_file_buf_size(unsigned int size) { file_buf_size = size; }
+void FTP::ftps4_set_data_timeout(unsigned int ms) { data_timeout_ms = ms; }
+/* Takes effect on the next ftps4_init(), 0 disables the block cache */
+void FTP::ftps4_set_cache_size(unsigned long long size) { cache_size = size; }
+/* Takes effect on the next ftps4_init(), 0 disables the prefetch */
+void FTP::ftps4_set_prefetch_size(unsigned long long size) { prefetch_size = size; }
+void FTP::ftps4_set_idle_timeouts(unsigned int ctrl_sec, unsigned int data_sec) {
+	/* 0 disables the timeout */
+	ctrl_idle_timeout = ctrl_sec;
+	data_stall_timeout = data_sec;
+}
+
+/* Takes effect on the next ftps4_init(), NULL disables dedup */
+void FTP::ftps4_set_dedup_index(const char *path) { snprintf(dedup_index, sizeof(dedup_index), "%s", path ? path : ""); }
+
+void FTP::ftps4_set_trace_dir(const char *dir) {
+	size_t len;
+
+	snprintf(trace_dir, sizeof(trace_dir), "%s", dir);
+	len = strlen(trace_dir);
+	if (len > 1 && trace_dir[len - 1] == '/') trace_dir[len - 1] = '\0';
+}
+
+/* Takes effect on the next ftps4_init(), NULL or "" disables SITE FIND */
+void FTP::ftps4_set_find_roots(const char *roots) { snprintf(find_roots, sizeof(find_roots), "%s", roots ? roots : ""); }
+
+/* Takes effect on the next ftps4_init(), HTTP sessions share max_clients with FTP */
+void FTP::ftps4_set_http_port(unsigned short port) { http_port = port; }
+
+/* Takes effect on the next ftps4_init() */
+void FTP::ftps4_set_max_clients(unsigned int max) { max_clients = max ? max : 1; }
+
+void FTP::ftps4_set_pasv_port_range(unsigned short min, unsigned short max) {
+	/* Takes effect on the next ftps4_init() */
+	pasv_port_min = min;
+	pasv_port_max = max;
+}
 
 int FTP::ftps4_ext_add_custom_command(const char *cmd, cmd_dispatch_func func) {
 	int i;
@@ -1028,4 +3653,8 @@ int FTP::ftps4_ext_del_custom_command(const char *cmd) {
 
 void FTP::ftps4_ext_client_send_ctrl_msg(ftps4_client_info_t *client, const char *msg) { client_send_ctrl_msg(client, msg); }
 void FTP::ftps4_ext_client_send_data_msg(ftps4_client_info_t *client, const char *str) { client_send_data_msg(client, str); }
-void FTP::ftps4_gen_ftp_fullpath(ftps4_client_info_t *client, char *path, size_t path_size) { gen_ftp_fullpath(client, path, path_size); }
+int FTP::ftps4_gen_ftp_fullpath(ftps4_client_info_t *client, char *path, size_t path_size) {
+	if (resolve_ftp_fullpath(client, path, path_size) == 0) return 0;
+	if (path_size) path[0] = '\0';
+	return -1;
+}
@@ -6,7 +6,11 @@
 
 #include <application.h>
 
-#define PATH_MAXX 255
+#include "ftp_shaper.h"
+#include "ftp_path.h"
+#include "ftp_sha256.h"
+#include "ftp_prefetch.h"
+
 #define FTPS4_EOL "\r\n"
 
 typedef enum {
@@ -15,38 +19,104 @@ typedef enum {
 	FTP_DATA_CONNECTION_PASSIVE,
 } DataConnectionType;
 
+typedef enum {
+	FTP_TRANSFER_MODE_STREAM,
+	/* RFC 959 block mode, the data connection outlives a transfer */
+	FTP_TRANSFER_MODE_BLOCK,
+} TransferMode;
+
+/* Sessions come from a slab preallocated by ftps4_init(), one object per
+* allowed client (see FTP::ftps4_set_max_clients()), and are registered by
+* slot without any list links. Paths are bounded by PATH_MAXX like every
+* other path buffer in the server (the working directory in its canonical
+* component form, see ftp_path.h), which keeps a session
+* under 2 KiB (more than half of it the control receive and reply buffers)
+* instead of the 2.7 KiB it took with two PATH_MAX arrays. */
 typedef struct ftps4_client_info {
-	/* Client number */
-	int num;
 	/* Thread UID */
 	ScePthread thid;
+	/* Points to the character after the first space */
+	const char *recv_cmd_args;
+	/* Client number */
+	int num;
 	/* Control connection socket FD */
 	int ctrl_sockfd;
 	/* Data connection attributes */
 	int data_sockfd;
 	DataConnectionType data_con_type;
-	struct SceNetSockaddrIn data_sockaddr;
 	/* PASV mode client socket */
-	struct SceNetSockaddrIn pasv_sockaddr;
 	int pasv_sockfd;
+	/* PASV pool slot of data_sockfd, -1 if the listener is our own */
+	int pasv_slot;
+	/* Epoll instance transfers wait on, made once per data connection (-1
+	* until then) with data_wait_fd registered for data_wait_events */
+	int data_eid;
+	int data_wait_fd;
+	unsigned int data_wait_events;
+	/* Offset for transfer resume (REST), STOR writes there in place */
+	unsigned long long restore_point;
+	/* Set by APPE, the upload goes to the end of the file */
+	int append_mode;
+	/* SITE SPARSE, STOR leaves zero blocks out as holes */
+	int sparse_writes;
+	/* SITE DEDUP announced content the next STOR is indexed under */
+	int dedup_pending;
+	unsigned long long dedup_size;
+	unsigned char dedup_hash[FTPS4_SHA256_SIZE];
+	/* Listing and read ahead state for mirroring clients, NULL until a LIST */
+	ftps4_prefetch_t *prefetch;
+	/* Receive buffer attributes, n_recv bytes not yet dispatched */
+	int n_recv;
+	/* Queued control replies */
+	unsigned int ctrl_out_len;
+	/* Process times of the last command and the last data progress */
+	unsigned long long ctrl_activity;
+	unsigned long long data_activity;
+	/* Set while a transfer is using the data connection */
+	int in_transfer;
+	/* Set when the session's sockets were aborted (shutdown or reaper) */
+	volatile int abort_requested;
+	/* Set when the running transfer has to stop */
+	volatile int data_abort;
+	/* XFER_ERROR_* reason the running transfer failed for */
+	int xfer_error;
+	/* Set when the idle reaper closed the session */
+	int reaped;
+	/* HTTP frontend session, the control connection carries requests */
+	int http;
+	/* Set when ABOR came in during a transfer and still needs its reply */
+	int abor_pending;
+	/* Set when that ABOR was seen still in the socket, behind a full
+	* recv_buffer, and has to be dropped once it is read */
+	int abor_queued;
+	/* Length of the command line being executed at the start of recv_buffer */
+	unsigned int line_len;
+	/* Progress of the running transfer, total is -1 when unknown */
+	unsigned long long xfer_bytes;
+	long long xfer_total;
+	unsigned long long xfer_start;
+	TransferMode transfer_mode;
+	/* Set while the data connection is established */
+	int data_connected;
+	/* MODE B receive state: bytes left in the block and its descriptor */
+	unsigned int block_left;
+	unsigned int block_desc;
+	struct SceNetSockaddrIn data_sockaddr;
+	struct SceNetSockaddrIn pasv_sockaddr;
 	/* Remote client net info */
 	struct SceNetSockaddrIn addr;
-	/* Receive buffer attributes */
-	int n_recv;
+	/* Bandwidth shaping state */
+	ftps4_shaper_flow_t flow;
 	char recv_buffer[512];
-	/* Points to the character after the first space */
-	const char *recv_cmd_args;
-	/* Current working directory */
-	char cur_path[PATH_MAX];
+	char ctrl_out[512];
+	/* Current working directory, canonical */
+	ftps4_path_t cwd;
 	/* Rename path */
-	char rename_path[PATH_MAX];
-	/* Client list */
-	struct ftps4_client_info *next;
-	struct ftps4_client_info *prev;
-	/* Offset for transfer resume */
-	unsigned int restore_point;
+	char rename_path[PATH_MAXX];
 } ftps4_client_info_t;
 
+static_assert(sizeof(ftps4_client_info_t) <= 2048, "ftps4_client_info_t grew past its documented footprint");
+
 typedef void(*cmd_dispatch_func)(ftps4_client_info_t *client); // Command handler
 
 class FTP {
@@ -57,12 +127,31 @@ public:
 	FTP() {}
 	~FTP(){}
 	static int ftps4_init(const char *ps4_ip, unsigned short int ps4_port);
+	/* Sessions that don't stop in time keep the server initialized, ftps4_init()
+	* then fails until a later ftps4_fini() has seen them go */
 	static void ftps4_fini();
 	static int ftps4_is_initialized();
 	static void ftps4_set_file_buf_size(unsigned int size);
+	static void ftps4_set_data_timeout(unsigned int ms);
+	static void ftps4_set_pasv_port_range(unsigned short min, unsigned short max);
+	static void ftps4_set_max_clients(unsigned int max);
+	static void ftps4_set_idle_timeouts(unsigned int ctrl_sec, unsigned int data_sec);
+	static void ftps4_set_cache_size(unsigned long long size);
+	/* How far ahead of a mirroring client files are read, 0 disables it */
+	static void ftps4_set_prefetch_size(unsigned long long size);
+	/* File the SITE DEDUP content index is kept in */
+	static void ftps4_set_dedup_index(const char *path);
+	/* Directory SITE TRACE DUMP writes to */
+	static void ftps4_set_trace_dir(const char *dir);
+	/* Colon separated directories SITE FIND indexes */
+	static void ftps4_set_find_roots(const char *roots);
+	/* Port of the read-only HTTP frontend, 0 (the default) disables it */
+	static void ftps4_set_http_port(unsigned short port);
 	static int ftps4_ext_add_custom_command(const char *cmd, cmd_dispatch_func func);
 	static int ftps4_ext_del_custom_command(const char *cmd);
 	static void ftps4_ext_client_send_ctrl_msg(ftps4_client_info_t *client, const char *msg);
 	static void ftps4_ext_client_send_data_msg(ftps4_client_info_t *client, const char *str);
-	static void ftps4_gen_ftp_fullpath(ftps4_client_info_t *client, char *path, size_t path_size);
+	/* Resolves the command argument, < 0 (path left empty) when there is none or
+	* it is not a valid path. Nothing is replied, that is up to the caller. */
+	static int ftps4_gen_ftp_fullpath(ftps4_client_info_t *client, char *path, size_t path_size);
 };
\ No newline at end of file
@@ -0,0 +1,155 @@
+/*
+* Build and query benchmark for the SITE FIND index (ftp_find).
+*
+* Lays out a synthetic game library under <dir>/find_bench: -n title
+* directories, each with an eboot.bin, a sce_sys holding param.sfo,
+* icon0.png and pic1.png, and -f data files, so the defaults make about a
+* million entries with the shared names that dominate a real library. The
+* tree is created once and reused by later runs, remove it by hand when
+* done. The tool times the background build of the index over it, reports
+* the memory it took and then times a set of queries: substrings, globs,
+* whole path patterns and a pattern nothing matches.
+*
+* Host tool, build from the repository root with:
+* g++ -O2 -pthread -Itools/host -Ips4_ftp -o find_bench tools/find_bench.cpp ps4_ftp/ftp_find.cpp ps4_ftp/ftp_dir.cpp ps4_ftp/ftp_path.cpp
+*/
+
+#include <application.h>
+#include "ftp_find.h"
+#include "ftp_log.h"
+
+/* The server's logger isn't linked, the index's info lines are dropped */
+int ftps4_log_enabled(int level) { (void)level; return 0; }
+void ftps4_log_write(int level, const char *fmt, ...) { (void)level; (void)fmt; }
+
+static const char *sce_sys_files[] = { "param.sfo", "icon0.png", "pic1.png" };
+
+/* Substrings, globs and a miss, the whole path pattern is added under the root */
+static const char *patterns[] = { "param.sfo", "cusa00042", "*.png", "file_999_99?.dat", "_12_", "no such name" };
+
+static unsigned long long now_us() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* Resident memory of the process in KiB */
+static unsigned long long rss_kib() {
+	unsigned long long pages = 0, resident = 0;
+	FILE *f = fopen("/proc/self/statm", "r");
+
+	if (f) {
+		if (fscanf(f, "%llu %llu", &pages, &resident) != 2) resident = 0;
+		fclose(f);
+	}
+	return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+static int touch(const char *path) {
+	int fd = Sys::open(path, O_CREAT | O_WRONLY, 0644);
+
+	if (fd < 0) return -1;
+	Sys::close(fd);
+	return 0;
+}
+
+/* Builds root/CUSA<title><name> into path, < 0 if it doesn't fit */
+static int title_path(char *path, const char *root, unsigned int title, const char *name) {
+	return snprintf(path, PATH_MAX, "%s/CUSA%05u%s", root, title, name) < PATH_MAX ? 0 : -1;
+}
+
+static int make_tree(const char *root, unsigned int titles, unsigned int files) {
+	char path[PATH_MAX], name[64];
+	unsigned int t, f;
+
+	if (Sys::mkdir(root, 0755) < 0) return -1;
+	for (t = 0; t < titles; t++) {
+		if (title_path(path, root, t, "") < 0 || Sys::mkdir(path, 0755) < 0) return -1;
+		if (title_path(path, root, t, "/sce_sys") < 0 || Sys::mkdir(path, 0755) < 0) return -1;
+		for (f = 0; f < sizeof(sce_sys_files) / sizeof(sce_sys_files[0]); f++) {
+			snprintf(name, sizeof(name), "/sce_sys/%s", sce_sys_files[f]);
+			if (title_path(path, root, t, name) < 0 || touch(path) < 0) return -1;
+		}
+		if (title_path(path, root, t, "/eboot.bin") < 0 || touch(path) < 0) return -1;
+		for (f = 0; f < files; f++) {
+			snprintf(name, sizeof(name), "/file_%u_%u.dat", t, f);
+			if (title_path(path, root, t, name) < 0 || touch(path) < 0) return -1;
+		}
+	}
+	return 0;
+}
+
+static int count_match(void *arg, const char *path) {
+	(void)path;
+	(*(unsigned int *)arg)++;
+	return 0;
+}
+
+static void bench(const char *label, const char *pattern, unsigned int rounds) {
+	ftps4_find_stats_t stats;
+	unsigned long long start;
+	unsigned int matches = 0, r;
+
+	start = now_us();
+	for (r = 0; r < rounds; r++) {
+		matches = 0;
+		ftps4_find_query(pattern, count_match, &matches, &stats);
+	}
+	printf("%-26s %9u %10.2f\n", label, matches, (now_us() - start) / 1e3 / rounds);
+}
+
+int main(int argc, char **argv) {
+	const char *dir = ".";
+	unsigned int titles = 1000, files = 994, rounds = 5, matches;
+	unsigned long long start, elapsed, rss;
+	ftps4_find_stats_t stats;
+	char path[PATH_MAX], root[PATH_MAX], pattern[PATH_MAX + 32];
+	struct stat st;
+	size_t p;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "d:n:f:r:")) != -1) {
+		switch (opt) {
+		case 'd': dir = optarg; break;
+		case 'n': titles = strtoul(optarg, NULL, 10); break;
+		case 'f': files = strtoul(optarg, NULL, 10); break;
+		case 'r': rounds = strtoul(optarg, NULL, 10); break;
+		default:
+			fprintf(stderr, "usage: %s [-d dir] [-n titles] [-f files_per_title] [-r rounds]\n", argv[0]);
+			return 1;
+		}
+	}
+	if (rounds < 1) rounds = 1;
+
+	snprintf(path, sizeof(path), "%s/find_bench", dir);
+	if (Sys::stat(path, &st) < 0) {
+		printf("Creating %u titles of %u files in %s\n", titles, files, path);
+		if (make_tree(path, titles, files) < 0) {
+			fprintf(stderr, "Could not create the tree in %s\n", path);
+			return 1;
+		}
+	} else {
+		printf("Reusing the tree in %s\n", path);
+	}
+	/* The index wants canonical roots */
+	if (!realpath(path, root)) return 1;
+
+	rss = rss_kib();
+	start = now_us();
+	ftps4_find_init(root);
+	do {
+		sceKernelUsleep(10 * 1000);
+		if (ftps4_find_query("no such name", count_match, &matches, &stats) < 0) stats.building = 1;
+	} while (stats.building);
+	elapsed = now_us() - start;
+	printf("Index: %u entries%s in %.1f s, %llu KiB\n", stats.entries, stats.truncated ? " (truncated)" : "",
+		elapsed / 1e6, rss_kib() - rss);
+
+	printf("%-26s %9s %10s\n", "pattern", "matches", "ms");
+	for (p = 0; p < sizeof(patterns) / sizeof(patterns[0]); p++) bench(patterns[p], patterns[p], rounds);
+	snprintf(pattern, sizeof(pattern), "%s/CUSA0004?/sce_sys/*", root);
+	bench("<root>/CUSA0004?/sce_sys/*", pattern, rounds);
+
+	ftps4_find_fini();
+	return 0;
+}
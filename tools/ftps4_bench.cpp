@@ -0,0 +1,942 @@
+/*
+* Micro benchmarks for the FTP server.
+*
+* Each test drives one feature of a running server (the console, or anything
+* else speaking FTP) from a single session over loopback or the LAN and
+* prints what it measured:
+*
+*   pasv   data connection setup latency, PASV against EPSV
+*   modeb  many small files (-n of -f bytes) up and down, one data
+*          connection each in MODE S against a single one in MODE B
+*   segs   upload of one -s byte file split into 1, 2, 4 ... -c segments,
+*          each sent by its own session with REST + STOR
+*   delta  SITE SIGN + SITE DELTA of a -s byte file with 0, 1, 10 and 50%
+*          of its blocks changed (and a few bytes inserted up front),
+*          bytes on the wire and time against a plain STOR of it
+*   churn  -c threads each opening and dropping -n sessions, cleanly or
+*          in the middle of things (before login, after PASV, during a
+*          listing), then checks the server still serves a session
+*
+* -d names a scratch directory on the server the tests may write to.
+*
+* Host tool, build from the repository root with:
+* g++ -O2 -pthread -Itools/host -Ips4_ftp -o ftps4_bench tools/ftps4_bench.cpp ps4_ftp/ftp_delta.cpp ps4_ftp/ftp_sha256.cpp
+*/
+
+#include <application.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <stdarg.h>
+#include <signal.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include "ftp_delta.h"
+#include "ftp_sha256.h"
+
+#define MAX_LINE 512
+#define IO_BUF_SIZE (256 * 1024)
+
+/* Samples in microseconds, grown as needed */
+typedef struct {
+	unsigned long long *v;
+	size_t count;
+	size_t size;
+} samples_t;
+
+typedef struct {
+	int fd;
+	char buf[4096];
+	size_t len;
+} ctrl_t;
+
+typedef struct {
+	const char *name;
+	int (*run)();
+} bench_t;
+
+static struct sockaddr_in server_addr;
+static const char *user = "anonymous";
+static const char *pass = "ftps4";
+static const char *scratch = "/data/ftps4_bench";
+static int count = 200;
+static unsigned long long size = 64 * 1024 * 1024;
+static unsigned int file_size = 16 * 1024;
+static int max_conns = 8;
+
+static unsigned long long now_us() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void samples_add(samples_t *s, unsigned long long v) {
+	if (s->count == s->size) {
+		s->size = s->size ? s->size * 2 : 1024;
+		s->v = (unsigned long long *)realloc(s->v, s->size * sizeof(*s->v));
+	}
+	s->v[s->count++] = v;
+}
+
+static void samples_free(samples_t *s) {
+	free(s->v);
+	memset(s, 0, sizeof(*s));
+}
+
+static int cmp_ull(const void *a, const void *b) {
+	unsigned long long x = *(const unsigned long long *)a, y = *(const unsigned long long *)b;
+	return x < y ? -1 : x > y;
+}
+
+static unsigned long long samples_pct(const samples_t *s, double pct) {
+	size_t i;
+	if (!s->count) return 0;
+	i = (size_t)(pct / 100.0 * (s->count - 1) + 0.5);
+	return s->v[i];
+}
+
+static void print_samples(const char *what, samples_t *s) {
+	qsort(s->v, s->count, sizeof(*s->v), cmp_ull);
+	printf("%-20s n=%-6zu p50 %8.3f ms  p90 %8.3f ms  p99 %8.3f ms  max %8.3f ms\n", what, s->count,
+		samples_pct(s, 50) / 1000.0, samples_pct(s, 90) / 1000.0,
+		samples_pct(s, 99) / 1000.0, samples_pct(s, 100) / 1000.0);
+}
+
+static int tcp_connect(const struct sockaddr_in *addr) {
+	int fd, one = 1;
+
+	fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd < 0) return -1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	if (connect(fd, (const struct sockaddr *)addr, sizeof(*addr)) < 0) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+static int ctrl_send(ctrl_t *c, const char *cmd) {
+	char line[MAX_LINE + 2];
+	size_t len = snprintf(line, sizeof(line), "%s\r\n", cmd);
+	return send(c->fd, line, len, MSG_NOSIGNAL) == (ssize_t)len ? 0 : -1;
+}
+
+/* Reads one (possibly multi-line) reply, returns its code or -1. The
+* last line is left in text. */
+static int ctrl_reply(ctrl_t *c, char *text, size_t text_size) {
+	char *eol;
+	size_t n;
+	ssize_t got;
+
+	while (1) {
+		while ((eol = (char *)memchr(c->buf, '\n', c->len))) {
+			n = eol + 1 - c->buf;
+			if (n >= 4 && isdigit((unsigned char)c->buf[0]) && isdigit((unsigned char)c->buf[1]) &&
+				isdigit((unsigned char)c->buf[2]) && c->buf[3] == ' ') {
+				snprintf(text, text_size, "%.*s", (int)n, c->buf);
+				memmove(c->buf, c->buf + n, c->len - n);
+				c->len -= n;
+				return atoi(text);
+			}
+			memmove(c->buf, c->buf + n, c->len - n);
+			c->len -= n;
+		}
+		if (c->len == sizeof(c->buf)) c->len = 0;
+		got = recv(c->fd, c->buf + c->len, sizeof(c->buf) - c->len, 0);
+		if (got <= 0) return -1;
+		c->len += got;
+	}
+}
+
+static int ctrl_command(ctrl_t *c, const char *cmd, char *text, size_t text_size) {
+	if (ctrl_send(c, cmd) < 0) return -1;
+	return ctrl_reply(c, text, text_size);
+}
+
+/* Like ctrl_command, printf style and without the reply text */
+static int ctrl_commandf(ctrl_t *c, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+static int ctrl_commandf(ctrl_t *c, const char *fmt, ...) {
+	char cmd[MAX_LINE], text[MAX_LINE];
+	va_list ap;
+
+	va_start(ap, fmt);
+	vsnprintf(cmd, sizeof(cmd), fmt, ap);
+	va_end(ap);
+	return ctrl_command(c, cmd, text, sizeof(text));
+}
+
+static int ctrl_login(ctrl_t *c) {
+	char text[MAX_LINE];
+
+	c->len = 0;
+	c->fd = tcp_connect(&server_addr);
+	if (c->fd < 0) return -1;
+	if (ctrl_reply(c, text, sizeof(text)) != 220 ||
+		ctrl_commandf(c, "USER %s", user) < 0 ||
+		ctrl_commandf(c, "PASS %s", pass) >= 400 ||
+		ctrl_commandf(c, "TYPE I") != 200) {
+		close(c->fd);
+		c->fd = -1;
+		return -1;
+	}
+	return 0;
+}
+
+static void ctrl_logout(ctrl_t *c) {
+	if (c->fd < 0) return;
+	ctrl_commandf(c, "QUIT");
+	close(c->fd);
+	c->fd = -1;
+}
+
+/* PASV or EPSV and connect, returns the data socket */
+static int open_data(ctrl_t *c, int epsv) {
+	char text[MAX_LINE];
+	unsigned int h1, h2, h3, h4, p1, p2, p;
+	struct sockaddr_in addr;
+	char *s;
+
+	addr = server_addr;
+	if (epsv) {
+		if (ctrl_command(c, "EPSV", text, sizeof(text)) != 229) return -1;
+		if (!(s = strstr(text, "(|||")) || sscanf(s, "(|||%u|)", &p) != 1) return -1;
+	} else {
+		if (ctrl_command(c, "PASV", text, sizeof(text)) != 227) return -1;
+		if (!(s = strchr(text, '(')) || sscanf(s, "(%u,%u,%u,%u,%u,%u)", &h1, &h2, &h3, &h4, &p1, &p2) != 6)
+			return -1;
+		p = (p1 << 8) | p2;
+	}
+	/* The server may advertise its LAN address, keep using the one we reached */
+	addr.sin_port = htons(p);
+	return tcp_connect(&addr);
+}
+
+/* Reads the data connection to EOF, returns the bytes read or -1 */
+static long long drain(int fd, unsigned char *buf) {
+	long long total = 0;
+	ssize_t n;
+
+	while ((n = recv(fd, buf, IO_BUF_SIZE, 0)) > 0) total += n;
+	return n < 0 ? -1 : total;
+}
+
+static int send_all(int fd, const void *buf, size_t len) {
+	const unsigned char *p = (const unsigned char *)buf;
+	ssize_t n;
+
+	while (len > 0) {
+		n = send(fd, p, len, MSG_NOSIGNAL);
+		if (n <= 0) return -1;
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+static int recv_all(int fd, void *buf, size_t len) {
+	unsigned char *p = (unsigned char *)buf;
+	ssize_t n;
+
+	while (len > 0) {
+		n = recv(fd, p, len, 0);
+		if (n <= 0) return -1;
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/* Sends one file in MODE B blocks, ending with an empty EOF block */
+static int block_send(int fd, const unsigned char *buf, size_t len) {
+	unsigned char header[3];
+	size_t n;
+
+	do {
+		n = len < 0xFFFF ? len : 0xFFFF;
+		header[0] = n == len ? 0x40 : 0;
+		header[1] = (n >> 8) & 0xFF;
+		header[2] = n & 0xFF;
+		if (send_all(fd, header, sizeof(header)) < 0 || send_all(fd, buf, n) < 0) return -1;
+		buf += n;
+		len -= n;
+	} while (len > 0);
+	return 0;
+}
+
+/* Reads MODE B blocks up to the EOF block, returns the payload bytes or -1 */
+static long long block_recv(int fd, unsigned char *buf) {
+	unsigned char header[3];
+	unsigned int n;
+	long long total = 0;
+
+	do {
+		if (recv_all(fd, header, sizeof(header)) < 0) return -1;
+		n = (header[1] << 8) | header[2];
+		if (n > IO_BUF_SIZE || recv_all(fd, buf, n) < 0) return -1;
+		total += n;
+	} while (!(header[0] & 0x40));
+	return total;
+}
+
+/* Data connection setup latency: PASV/EPSV plus connect, and the same with
+* an NLST of the scratch directory on top, i.e. what a small transfer costs
+* before any payload moves */
+static int bench_pasv() {
+	static const char *modes[2] = { "PASV", "EPSV" };
+	unsigned char *buf = (unsigned char *)malloc(IO_BUF_SIZE);
+	char cmd[MAX_LINE], text[MAX_LINE], what[32];
+	samples_t setup, total;
+	unsigned long long start, t;
+	ctrl_t c;
+	int m, i, fd, errors = 0;
+
+	if (!buf || ctrl_login(&c) < 0) {
+		free(buf);
+		return -1;
+	}
+	ctrl_commandf(&c, "MKD %s", scratch);
+
+	for (m = 0; m < 2; m++) {
+		memset(&setup, 0, sizeof(setup));
+		memset(&total, 0, sizeof(total));
+		for (i = 0; i < count; i++) {
+			start = now_us();
+			if ((fd = open_data(&c, m)) < 0) {
+				errors++;
+				continue;
+			}
+			t = now_us();
+			samples_add(&setup, t - start);
+			snprintf(cmd, sizeof(cmd), "NLST %s", scratch);
+			if (ctrl_command(&c, cmd, text, sizeof(text)) / 100 != 1) {
+				close(fd);
+				errors++;
+				continue;
+			}
+			drain(fd, buf);
+			close(fd);
+			if (ctrl_reply(&c, text, sizeof(text)) != 226) errors++;
+			samples_add(&total, now_us() - start);
+		}
+		snprintf(what, sizeof(what), "%s setup", modes[m]);
+		print_samples(what, &setup);
+		snprintf(what, sizeof(what), "%s + NLST", modes[m]);
+		print_samples(what, &total);
+		samples_free(&setup);
+		samples_free(&total);
+	}
+
+	ctrl_logout(&c);
+	free(buf);
+	printf("%i errors\n", errors);
+	return errors ? -1 : 0;
+}
+
+/* Moves every file of the modeb set one way, in MODE B over data_fd or
+* with a fresh PASV connection per file when data_fd < 0. Returns the time
+* taken or 0 on errors. */
+static unsigned long long modeb_round(ctrl_t *c, int data_fd, int upload, unsigned char *buf) {
+	char cmd[MAX_LINE], text[MAX_LINE];
+	unsigned long long start = now_us();
+	long long got;
+	int i, fd, code;
+
+	for (i = 0; i < count; i++) {
+		fd = data_fd;
+		if (fd < 0 && (fd = open_data(c, 0)) < 0) return 0;
+		snprintf(cmd, sizeof(cmd), "%s %s/f%05i", upload ? "STOR" : "RETR", scratch, i);
+		code = ctrl_command(c, cmd, text, sizeof(text));
+		if (code / 100 == 1) {
+			if (data_fd >= 0) {
+				got = upload ? (block_send(fd, buf, file_size) < 0 ? -1 : file_size) : block_recv(fd, buf);
+			} else if (upload) {
+				got = send_all(fd, buf, file_size) < 0 ? -1 : file_size;
+				close(fd);
+			} else {
+				got = drain(fd, buf);
+				close(fd);
+			}
+			code = ctrl_reply(c, text, sizeof(text));
+			if (got != file_size) code = -1;
+		} else if (data_fd < 0) {
+			close(fd);
+		}
+		if (code != 226 && code != 250) {
+			fprintf(stderr, "%s: %s", cmd, code < 0 ? "failed\n" : text);
+			return 0;
+		}
+	}
+	return now_us() - start;
+}
+
+static int bench_modeb() {
+	static const char *dirs[2] = { "down", "up" };
+	unsigned char *buf = (unsigned char *)malloc(IO_BUF_SIZE);
+	unsigned long long t_stream, t_block;
+	ctrl_t c;
+	int up, fd, i, ret = -1;
+
+	if (!buf || file_size > IO_BUF_SIZE || ctrl_login(&c) < 0) {
+		free(buf);
+		return -1;
+	}
+	memset(buf, 0x5A, IO_BUF_SIZE);
+	ctrl_commandf(&c, "MKD %s", scratch);
+
+	printf("%i files of %u bytes\n", count, file_size);
+	/* Uploads first so the downloads have something to read */
+	for (up = 1; up >= 0; up--) {
+		if (!(t_stream = modeb_round(&c, -1, up, buf))) goto out;
+
+		if (ctrl_commandf(&c, "MODE B") != 200 || (fd = open_data(&c, 0)) < 0) goto out;
+		t_block = modeb_round(&c, fd, up, buf);
+		close(fd);
+		if (ctrl_commandf(&c, "MODE S") != 200 || !t_block) goto out;
+
+		printf("%-4s  MODE S %8.1f files/s  MODE B %8.1f files/s  (%.2fx)\n", dirs[up],
+			count * 1e6 / t_stream, count * 1e6 / t_block, (double)t_stream / t_block);
+	}
+	ret = 0;
+
+out:
+	for (i = 0; i < count; i++) ctrl_commandf(&c, "DELE %s/f%05i", scratch, i);
+	ctrl_logout(&c);
+	free(buf);
+	return ret;
+}
+
+typedef struct {
+	pthread_t thid;
+	const char *path;
+	unsigned long long offset;
+	unsigned long long len;
+	int ok;
+} segment_t;
+
+static void *segment_thread(void *arg) {
+	segment_t *seg = (segment_t *)arg;
+	unsigned char *buf = (unsigned char *)malloc(IO_BUF_SIZE);
+	char cmd[MAX_LINE], text[MAX_LINE];
+	unsigned long long left;
+	size_t n;
+	ctrl_t c;
+	int fd;
+
+	if (!buf || ctrl_login(&c) < 0) {
+		free(buf);
+		return NULL;
+	}
+	memset(buf, 0x5A, IO_BUF_SIZE);
+	if (ctrl_commandf(&c, "REST %llu", seg->offset) == 350 && (fd = open_data(&c, 0)) >= 0) {
+		snprintf(cmd, sizeof(cmd), "STOR %s", seg->path);
+		if (ctrl_command(&c, cmd, text, sizeof(text)) / 100 == 1) {
+			for (left = seg->len; left > 0; left -= n) {
+				n = left < IO_BUF_SIZE ? left : IO_BUF_SIZE;
+				if (send_all(fd, buf, n) < 0) break;
+			}
+			close(fd);
+			seg->ok = left == 0 && ctrl_reply(&c, text, sizeof(text)) == 226;
+		} else {
+			close(fd);
+		}
+	}
+	ctrl_logout(&c);
+	free(buf);
+	return NULL;
+}
+
+static int bench_segs() {
+	char path[256], cmd[MAX_LINE], text[MAX_LINE];
+	unsigned long long start, elapsed, per, base = 0;
+	segment_t *segs = (segment_t *)calloc(max_conns, sizeof(segment_t));
+	ctrl_t c;
+	int n, i, ok = 1;
+
+	if (!segs || ctrl_login(&c) < 0) {
+		free(segs);
+		return -1;
+	}
+	ctrl_commandf(&c, "MKD %s", scratch);
+	snprintf(path, sizeof(path), "%s/segments.bin", scratch);
+
+	printf("%llu bytes\n", size);
+	for (n = 1; n <= max_conns && ok; n *= 2) {
+		ctrl_commandf(&c, "DELE %s", path);
+		per = size / n;
+		start = now_us();
+		for (i = 0; i < n; i++) {
+			segs[i].path = path;
+			segs[i].offset = per * i;
+			segs[i].len = i == n - 1 ? size - per * i : per;
+			segs[i].ok = 0;
+			pthread_create(&segs[i].thid, NULL, segment_thread, &segs[i]);
+		}
+		for (i = 0; i < n; i++) {
+			pthread_join(segs[i].thid, NULL);
+			if (!segs[i].ok) ok = 0;
+		}
+		elapsed = now_us() - start;
+
+		/* Every segment has to have landed, none truncated by another */
+		snprintf(cmd, sizeof(cmd), "SIZE %s", path);
+		if (ok && (ctrl_command(&c, cmd, text, sizeof(text)) != 213 || strtoull(text + 4, NULL, 10) != size)) {
+			fprintf(stderr, "%i segments: wrong size on the server\n", n);
+			ok = 0;
+		}
+		if (!ok) break;
+		if (n == 1) base = elapsed;
+		printf("%3i segments %8.2f MiB/s  (%.2fx)\n", n, size * 1e6 / elapsed / (1024.0 * 1024.0),
+			(double)base / elapsed);
+	}
+
+	ctrl_commandf(&c, "DELE %s", path);
+	ctrl_logout(&c);
+	free(segs);
+	return ok ? 0 : -1;
+}
+
+/* Delta ops collected before they are sent */
+typedef struct {
+	unsigned char *buf;
+	size_t len;
+	size_t size;
+} ops_t;
+
+static void ops_put(ops_t *o, const void *p, size_t n) {
+	if (o->len + n > o->size) {
+		while (o->len + n > o->size) o->size = o->size ? o->size * 2 : 1024 * 1024;
+		o->buf = (unsigned char *)realloc(o->buf, o->size);
+	}
+	memcpy(o->buf + o->len, p, n);
+	o->len += n;
+}
+
+static void put_be(unsigned char *p, unsigned long long v, int bytes) {
+	while (bytes--) {
+		p[bytes] = (unsigned char)v;
+		v >>= 8;
+	}
+}
+
+static void ops_copy(ops_t *o, unsigned long long offset, unsigned int len) {
+	unsigned char op[13];
+
+	op[0] = FTPS4_DELTA_OP_COPY;
+	put_be(op + 1, offset, 8);
+	put_be(op + 9, len, 4);
+	ops_put(o, op, sizeof(op));
+}
+
+static void ops_literal(ops_t *o, const unsigned char *p, size_t len) {
+	unsigned char op[5];
+	size_t n;
+
+	for (; len > 0; p += n, len -= n) {
+		n = len < FTPS4_DELTA_MAX_LITERAL ? len : FTPS4_DELTA_MAX_LITERAL;
+		op[0] = FTPS4_DELTA_OP_LITERAL;
+		put_be(op + 1, n, 4);
+		ops_put(o, op, sizeof(op));
+		ops_put(o, p, n);
+	}
+}
+
+static unsigned int get_be(const unsigned char *p, int bytes) {
+	unsigned int v = 0;
+	while (bytes--) v = v << 8 | *p++;
+	return v;
+}
+
+/* The client side of rsync: signatures of the server's file, ops rebuilding
+* data from it. Only whole blocks are matched. */
+static void delta_ops(const unsigned char *sig, unsigned int block_size, unsigned int blocks,
+	const unsigned char *data, size_t len, ops_t *o) {
+	const unsigned int entry = 4 + FTPS4_DELTA_STRONG_SIZE;
+	unsigned int buckets = 1, *head, *next, b, a_sum, b_sum, weak;
+	unsigned char digest[FTPS4_SHA256_SIZE];
+	unsigned long long copy_off = 0;
+	unsigned int copy_len = 0;
+	size_t pos = 0, lit = 0;
+	int rolling = 0;
+
+	while (buckets < blocks * 2) buckets *= 2;
+	head = (unsigned int *)calloc(buckets, sizeof(*head));
+	next = (unsigned int *)calloc(blocks + 1, sizeof(*next));
+	for (b = 0; b < blocks; b++) {
+		weak = get_be(sig + b * entry, 4);
+		next[b + 1] = head[weak & (buckets - 1)];
+		head[weak & (buckets - 1)] = b + 1;
+	}
+
+	a_sum = b_sum = 0;
+	while (pos + block_size <= len) {
+		if (!rolling) {
+			weak = ftps4_delta_weak(data + pos, block_size);
+			a_sum = weak & 0xFFFF;
+			b_sum = weak >> 16;
+			rolling = 1;
+		}
+		weak = (a_sum & 0xFFFF) | (b_sum & 0xFFFF) << 16;
+
+		for (b = head[weak & (buckets - 1)]; b; b = next[b]) {
+			if (get_be(sig + (b - 1) * entry, 4) != weak) continue;
+			ftps4_sha256(data + pos, block_size, digest);
+			if (!memcmp(sig + (b - 1) * entry + 4, digest, FTPS4_DELTA_STRONG_SIZE)) break;
+		}
+		if (b) {
+			ops_literal(o, data + lit, pos - lit);
+			/* Neighbouring blocks become one copy */
+			if (copy_len && copy_off + copy_len == (unsigned long long)(b - 1) * block_size &&
+				copy_len <= 0xFFFFFFFFu - block_size) {
+				copy_len += block_size;
+			} else {
+				if (copy_len) ops_copy(o, copy_off, copy_len);
+				copy_off = (unsigned long long)(b - 1) * block_size;
+				copy_len = block_size;
+			}
+			pos += block_size;
+			lit = pos;
+			rolling = 0;
+			continue;
+		}
+
+		if (copy_len && lit == pos) {
+			ops_copy(o, copy_off, copy_len);
+			copy_len = 0;
+		}
+		/* Roll one byte on */
+		if (pos + block_size < len) {
+			a_sum += data[pos + block_size] - data[pos];
+			b_sum += a_sum - block_size * data[pos];
+		}
+		pos++;
+	}
+	if (copy_len) ops_copy(o, copy_off, copy_len);
+	ops_literal(o, data + lit, len - lit);
+	free(head);
+	free(next);
+}
+
+/* Uploads data to path with a plain STOR, returns the time it took or 0 */
+static unsigned long long stor_file(ctrl_t *c, const char *path, const unsigned char *data, size_t len) {
+	char cmd[MAX_LINE], text[MAX_LINE];
+	unsigned long long start = now_us();
+	int fd, code;
+
+	if ((fd = open_data(c, 0)) < 0) return 0;
+	snprintf(cmd, sizeof(cmd), "STOR %s", path);
+	if (ctrl_command(c, cmd, text, sizeof(text)) / 100 != 1) {
+		close(fd);
+		return 0;
+	}
+	code = send_all(fd, data, len);
+	close(fd);
+	if (ctrl_reply(c, text, sizeof(text)) != 226 || code < 0) return 0;
+	return now_us() - start;
+}
+
+static int bench_delta() {
+	static const int percents[] = { 0, 1, 10, 50 };
+	const unsigned int region = 64 * 1024;
+	char path[256], cmd[MAX_LINE], text[MAX_LINE];
+	unsigned char *base, *data, *sig = NULL, op[1 + FTPS4_SHA256_SIZE];
+	unsigned long long t_stor, t_sign, t_delta, i;
+	unsigned int block_size, blocks, k;
+	size_t len, sig_len;
+	long long got;
+	ops_t o;
+	ctrl_t c;
+	int fd, ok = 1;
+
+	base = (unsigned char *)malloc(size);
+	data = (unsigned char *)malloc(size + 64);
+	memset(&o, 0, sizeof(o));
+	if (!base || !data || ctrl_login(&c) < 0) {
+		free(base);
+		free(data);
+		return -1;
+	}
+	srand(1);
+	for (i = 0; i < size; i++) base[i] = (unsigned char)rand();
+	ctrl_commandf(&c, "MKD %s", scratch);
+	snprintf(path, sizeof(path), "%s/delta.bin", scratch);
+
+	printf("%llu bytes, MiB on the wire and seconds\n", size);
+	printf("%8s %10s %8s %10s %8s %8s %8s\n", "changed", "stor MiB", "stor s", "delta MiB", "sign s", "delta s", "saved");
+	for (k = 0; k < sizeof(percents) / sizeof(percents[0]) && ok; k++) {
+		/* The new version: a few bytes inserted up front shift everything,
+		* then the given share of 64 KiB regions gets a change */
+		memcpy(data, "INSERT", 6);
+		memcpy(data + 6, base, size);
+		len = size + 6;
+		for (i = 0; i + region <= len; i += region) {
+			if ((unsigned int)rand() % 100 < (unsigned int)percents[k]) data[i + rand() % region] ^= 0xFF;
+		}
+
+		ctrl_commandf(&c, "DELE %s", path);
+		if (!(t_stor = stor_file(&c, path, base, size))) {
+			ok = 0;
+			break;
+		}
+
+		/* Signatures of what the server has */
+		t_sign = now_us();
+		if ((fd = open_data(&c, 0)) < 0) {
+			ok = 0;
+			break;
+		}
+		snprintf(cmd, sizeof(cmd), "SITE SIGN 0 %s", path);
+		if (ctrl_command(&c, cmd, text, sizeof(text)) / 100 != 1 || recv_all(fd, op, 12) < 0) {
+			close(fd);
+			ok = 0;
+			break;
+		}
+		block_size = get_be(op, 4);
+		blocks = (unsigned int)((((unsigned long long)get_be(op + 4, 4) << 32 | get_be(op + 8, 4)) + block_size - 1) / block_size);
+		sig_len = (size_t)blocks * (4 + FTPS4_DELTA_STRONG_SIZE);
+		sig = (unsigned char *)realloc(sig, sig_len + 1);
+		got = recv_all(fd, sig, sig_len);
+		close(fd);
+		if (got < 0 || ctrl_reply(&c, text, sizeof(text)) != 226) {
+			ok = 0;
+			break;
+		}
+		t_sign = now_us() - t_sign;
+
+		/* Ops, then the whole file's hash to end them */
+		t_delta = now_us();
+		o.len = 0;
+		delta_ops(sig, block_size, blocks, data, len, &o);
+		op[0] = FTPS4_DELTA_OP_END;
+		ftps4_sha256(data, (unsigned int)len, op + 1);
+		ops_put(&o, op, sizeof(op));
+
+		if ((fd = open_data(&c, 0)) < 0) {
+			ok = 0;
+			break;
+		}
+		snprintf(cmd, sizeof(cmd), "SITE DELTA %s", path);
+		if (ctrl_command(&c, cmd, text, sizeof(text)) / 100 != 1) {
+			close(fd);
+			ok = 0;
+			break;
+		}
+		got = send_all(fd, o.buf, o.len);
+		close(fd);
+		if (got < 0 || ctrl_reply(&c, text, sizeof(text)) != 226) {
+			fprintf(stderr, "SITE DELTA: %s", text);
+			ok = 0;
+			break;
+		}
+		t_delta = now_us() - t_delta;
+
+		/* The server checked the hash, the size is checked here */
+		snprintf(cmd, sizeof(cmd), "SIZE %s", path);
+		if (ctrl_command(&c, cmd, text, sizeof(text)) != 213 || strtoull(text + 4, NULL, 10) != len) {
+			fprintf(stderr, "%i%%: wrong size on the server\n", percents[k]);
+			ok = 0;
+			break;
+		}
+		printf("%7i%% %10.2f %8.3f %10.2f %8.3f %8.3f %7.1f%%\n", percents[k],
+			size / 1048576.0, t_stor / 1e6, (12 + sig_len + o.len) / 1048576.0, t_sign / 1e6, t_delta / 1e6,
+			100.0 - (12 + sig_len + o.len) * 100.0 / len);
+	}
+
+	ctrl_commandf(&c, "DELE %s", path);
+	ctrl_logout(&c);
+	free(o.buf);
+	free(sig);
+	free(data);
+	free(base);
+	return ok ? 0 : -1;
+}
+
+typedef struct {
+	pthread_t thid;
+	int id;
+	unsigned long long sessions;
+	unsigned long long refused;
+	unsigned long long errors;
+} churn_t;
+
+/* One session, ended the way kind says */
+static int churn_session(int kind, unsigned char *buf) {
+	char text[MAX_LINE];
+	ctrl_t c;
+	int fd, code;
+
+	c.len = 0;
+	if ((c.fd = tcp_connect(&server_addr)) < 0) return -1;
+	code = ctrl_reply(&c, text, sizeof(text));
+	if (code != 220) {
+		close(c.fd);
+		/* Full, the server said so */
+		return code > 0 ? 1 : -1;
+	}
+	/* Gone before logging in */
+	if (kind == 0) {
+		close(c.fd);
+		return 0;
+	}
+	if (ctrl_commandf(&c, "USER %s", user) < 0 || ctrl_commandf(&c, "PASS %s", pass) >= 400) {
+		close(c.fd);
+		return -1;
+	}
+
+	switch (kind) {
+	case 1:
+		/* Clean */
+		ctrl_logout(&c);
+		return 0;
+	case 2:
+		/* A passive listener set up and never used */
+		if (ctrl_commandf(&c, "PASV") != 227) code = -1;
+		break;
+	default:
+		/* Dropped while the listing is on its way */
+		if ((fd = open_data(&c, 0)) < 0) {
+			code = -1;
+			break;
+		}
+		if (ctrl_commandf(&c, "NLST %s", scratch) / 100 == 1) recv(fd, buf, 1, 0);
+		close(fd);
+		break;
+	}
+	close(c.fd);
+	return code < 0 ? -1 : 0;
+}
+
+static void *churn_thread(void *arg) {
+	churn_t *t = (churn_t *)arg;
+	unsigned char *buf = (unsigned char *)malloc(IO_BUF_SIZE);
+	int i, ret;
+
+	for (i = 0; i < count && buf; i++) {
+		ret = churn_session((t->id + i) % 4, buf);
+		if (ret < 0) t->errors++;
+		else if (ret > 0) t->refused++;
+		else t->sessions++;
+	}
+	free(buf);
+	return NULL;
+}
+
+static int bench_churn() {
+	churn_t *threads = (churn_t *)calloc(max_conns, sizeof(churn_t));
+	unsigned char *buf = (unsigned char *)malloc(IO_BUF_SIZE);
+	unsigned long long start, elapsed, sessions = 0, refused = 0, errors = 0;
+	long long listed = -1;
+	ctrl_t c;
+	int i, fd;
+
+	if (!threads || !buf || ctrl_login(&c) < 0) {
+		free(threads);
+		free(buf);
+		return -1;
+	}
+	ctrl_commandf(&c, "MKD %s", scratch);
+	ctrl_logout(&c);
+
+	start = now_us();
+	for (i = 0; i < max_conns; i++) {
+		threads[i].id = i;
+		pthread_create(&threads[i].thid, NULL, churn_thread, &threads[i]);
+	}
+	for (i = 0; i < max_conns; i++) {
+		pthread_join(threads[i].thid, NULL);
+		sessions += threads[i].sessions;
+		refused += threads[i].refused;
+		errors += threads[i].errors;
+	}
+	elapsed = now_us() - start;
+
+	/* Whatever was left behind, a new session has to work normally */
+	if (ctrl_login(&c) == 0) {
+		if ((fd = open_data(&c, 0)) >= 0) {
+			if (ctrl_commandf(&c, "NLST %s", scratch) / 100 == 1) {
+				listed = drain(fd, buf);
+				if (ctrl_reply(&c, (char *)buf, MAX_LINE) != 226) listed = -1;
+			}
+			close(fd);
+		}
+		ctrl_logout(&c);
+	}
+
+	printf("%i threads, %llu sessions in %.2f s, %.1f sessions/s\n", max_conns, sessions + refused + errors,
+		elapsed / 1e6, (sessions + refused + errors) * 1e6 / elapsed);
+	printf("%llu ok, %llu refused (full), %llu failed, server %s afterwards\n", sessions, refused, errors,
+		listed >= 0 ? "fine" : "NOT answering");
+	free(threads);
+	free(buf);
+	return errors || listed < 0 ? -1 : 0;
+}
+
+static const bench_t benches[] = {
+	{ "pasv", bench_pasv },
+	{ "modeb", bench_modeb },
+	{ "segs", bench_segs },
+	{ "delta", bench_delta },
+	{ "churn", bench_churn },
+};
+
+static void usage(const char *prog) {
+	size_t i;
+
+	fprintf(stderr,
+		"usage: %s [-n count] [-s bytes] [-f file_bytes] [-c conns] [-d scratch_dir] [-u user] [-p pass] host port test\n"
+		"tests:", prog);
+	for (i = 0; i < sizeof(benches) / sizeof(benches[0]); i++) fprintf(stderr, " %s", benches[i].name);
+	fprintf(stderr, "\n");
+	exit(1);
+}
+
+int main(int argc, char **argv) {
+	struct addrinfo hints, *res;
+	const bench_t *bench = NULL;
+	size_t i;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "n:s:f:c:d:u:p:")) != -1) {
+		switch (opt) {
+		case 'n': count = atoi(optarg); break;
+		case 's': size = strtoull(optarg, NULL, 10); break;
+		case 'f': file_size = strtoul(optarg, NULL, 10); break;
+		case 'c': max_conns = atoi(optarg); break;
+		case 'd': scratch = optarg; break;
+		case 'u': user = optarg; break;
+		case 'p': pass = optarg; break;
+		default: usage(argv[0]);
+		}
+	}
+	if (optind + 3 != argc || count < 1 || max_conns < 1) usage(argv[0]);
+	for (i = 0; i < sizeof(benches) / sizeof(benches[0]); i++) {
+		if (!strcmp(benches[i].name, argv[optind + 2])) bench = &benches[i];
+	}
+	if (!bench) usage(argv[0]);
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+	if (getaddrinfo(argv[optind], argv[optind + 1], &hints, &res) != 0) {
+		fprintf(stderr, "Could not resolve %s\n", argv[optind]);
+		return 1;
+	}
+	memcpy(&server_addr, res->ai_addr, sizeof(server_addr));
+	freeaddrinfo(res);
+	signal(SIGPIPE, SIG_IGN);
+
+	if (bench->run() < 0) {
+		fprintf(stderr, "%s failed\n", bench->name);
+		return 2;
+	}
+	return 0;
+}
@@ -0,0 +1,491 @@
+/*
+* Load generator for the FTP server.
+*
+* Runs many concurrent sessions against a running server (the console, or
+* anything else speaking FTP) and reports throughput, command latency
+* percentiles and data connection setup times. Sessions either replay a
+* script, one command per line, or the control transcripts recorded in an
+* info log ("\t<client>> <command>" lines), each recorded session becoming
+* one script that the clients take turns replaying.
+*
+* PORT/PASV/EPSV in a script are ignored, every data command gets its own
+* PASV. STOR/APPE upload -s bytes of generated data.
+*
+* -r bytes turns the sessions into slow peers: the data sockets get small
+* buffers and move at most that many bytes per call, -w microseconds apart,
+* so the server's sends come back short or EAGAIN and its receives get
+* dribbles. Every RETR and STOR then has to end either in 226 with all of
+* the file (checked with SIZE) or in an error reply, anything else is
+* counted as a short transfer.
+*
+* Host tool, build with: g++ -O2 -pthread -o ftps4_load ftps4_load.cpp
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+#define MAX_LINE 512
+#define MAX_SCRIPTS 256
+#define IO_BUF_SIZE (256 * 1024)
+
+typedef struct {
+	char **lines;
+	int count;
+} script_t;
+
+/* Samples in microseconds, grown as needed */
+typedef struct {
+	unsigned long long *v;
+	size_t count;
+	size_t size;
+} samples_t;
+
+typedef struct {
+	int id;
+	pthread_t thid;
+	samples_t cmd_latency;
+	samples_t data_setup;
+	unsigned long long bytes;
+	unsigned long long commands;
+	unsigned long long errors;
+	unsigned long long sessions;
+	unsigned long long short_xfers;
+} worker_t;
+
+static const char *host;
+static const char *port;
+static struct sockaddr_in server_addr;
+static script_t scripts[MAX_SCRIPTS];
+static int num_scripts = 0;
+static int num_clients = 1;
+static int repeats = 1;
+static unsigned int duration = 0;
+static unsigned long long upload_size = 1024 * 1024;
+static const char *user = "anonymous";
+static const char *pass = "ftps4";
+static unsigned int slow_bytes = 0;
+static unsigned int slow_wait = 1000;
+static volatile int stop = 0;
+static unsigned long long deadline = 0;
+
+static unsigned long long now_us() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void samples_add(samples_t *s, unsigned long long v) {
+	if (s->count == s->size) {
+		s->size = s->size ? s->size * 2 : 1024;
+		s->v = (unsigned long long *)realloc(s->v, s->size * sizeof(*s->v));
+	}
+	s->v[s->count++] = v;
+}
+
+static void samples_merge(samples_t *dst, const samples_t *src) {
+	size_t i;
+	for (i = 0; i < src->count; i++) samples_add(dst, src->v[i]);
+}
+
+static int cmp_ull(const void *a, const void *b) {
+	unsigned long long x = *(const unsigned long long *)a, y = *(const unsigned long long *)b;
+	return x < y ? -1 : x > y;
+}
+
+static unsigned long long samples_pct(const samples_t *s, double pct) {
+	size_t i;
+	if (!s->count) return 0;
+	i = (size_t)(pct / 100.0 * (s->count - 1) + 0.5);
+	return s->v[i];
+}
+
+static void script_add_line(script_t *sc, const char *line) {
+	sc->lines = (char **)realloc(sc->lines, (sc->count + 1) * sizeof(char *));
+	sc->lines[sc->count++] = strdup(line);
+}
+
+static void strip_eol(char *line) {
+	size_t len = strlen(line);
+	while (len && (line[len - 1] == '\n' || line[len - 1] == '\r')) line[--len] = '\0';
+}
+
+/* Commands the tool issues itself or that would end the session early */
+static int skip_command(const char *line) {
+	return !strncasecmp(line, "PASV", 4) || !strncasecmp(line, "EPSV", 4) ||
+		!strncasecmp(line, "PORT", 4) || !strncasecmp(line, "USER", 4) ||
+		!strncasecmp(line, "PASS", 4) || !strncasecmp(line, "QUIT", 4) ||
+		!strncasecmp(line, "SITE TRACE", 10) || !strncasecmp(line, "SHUTDOWN", 8);
+}
+
+static int load_script(const char *path) {
+	char line[MAX_LINE];
+	FILE *f = fopen(path, "r");
+
+	if (!f) return -1;
+	while (fgets(line, sizeof(line), f)) {
+		strip_eol(line);
+		if (!line[0] || line[0] == '#' || skip_command(line)) continue;
+		script_add_line(&scripts[0], line);
+	}
+	fclose(f);
+	num_scripts = 1;
+	return 0;
+}
+
+/* Picks the "\t<num>> <command>" lines out of an info log */
+static int load_recording(const char *path) {
+	char line[MAX_LINE];
+	int nums[MAX_SCRIPTS];
+	int num, i;
+	char *p, *cmd;
+	FILE *f = fopen(path, "r");
+
+	if (!f) return -1;
+	while (fgets(line, sizeof(line), f)) {
+		strip_eol(line);
+		if (!(p = strchr(line, '\t'))) continue;
+		num = strtol(p + 1, &cmd, 10);
+		if (cmd == p + 1 || cmd[0] != '>' || cmd[1] != ' ') continue;
+		cmd += 2;
+		if (!cmd[0] || skip_command(cmd)) continue;
+
+		for (i = 0; i < num_scripts && nums[i] != num; i++);
+		if (i == num_scripts) {
+			if (num_scripts == MAX_SCRIPTS) continue;
+			nums[num_scripts++] = num;
+		}
+		script_add_line(&scripts[i], cmd);
+	}
+	fclose(f);
+	return num_scripts ? 0 : -1;
+}
+
+/* bufsize > 0 shrinks the socket buffers, set before connect() so the
+* window is small from the start */
+static int tcp_connect(const struct sockaddr_in *addr, int bufsize) {
+	int fd, one = 1;
+
+	fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd < 0) return -1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	if (bufsize > 0) {
+		setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &bufsize, sizeof(bufsize));
+		setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &bufsize, sizeof(bufsize));
+	}
+	if (connect(fd, (const struct sockaddr *)addr, sizeof(*addr)) < 0) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+typedef struct {
+	int fd;
+	char buf[4096];
+	size_t len;
+} ctrl_t;
+
+static int ctrl_send(ctrl_t *c, const char *cmd) {
+	char line[MAX_LINE + 2];
+	size_t len = snprintf(line, sizeof(line), "%s\r\n", cmd);
+	return send(c->fd, line, len, MSG_NOSIGNAL) == (ssize_t)len ? 0 : -1;
+}
+
+/* Reads one (possibly multi-line) reply, returns its code or -1. The
+* last line is left in text. */
+static int ctrl_reply(ctrl_t *c, char *text, size_t text_size) {
+	char *eol;
+	size_t n;
+	ssize_t got;
+
+	while (1) {
+		while ((eol = (char *)memchr(c->buf, '\n', c->len))) {
+			n = eol + 1 - c->buf;
+			/* "123 text" ends a reply, "123-text" and others continue it */
+			if (n >= 4 && isdigit((unsigned char)c->buf[0]) && isdigit((unsigned char)c->buf[1]) &&
+				isdigit((unsigned char)c->buf[2]) && c->buf[3] == ' ') {
+				snprintf(text, text_size, "%.*s", (int)n, c->buf);
+				memmove(c->buf, c->buf + n, c->len - n);
+				c->len -= n;
+				return atoi(text);
+			}
+			memmove(c->buf, c->buf + n, c->len - n);
+			c->len -= n;
+		}
+		if (c->len == sizeof(c->buf)) c->len = 0;
+		got = recv(c->fd, c->buf + c->len, sizeof(c->buf) - c->len, 0);
+		if (got <= 0) return -1;
+		c->len += got;
+	}
+}
+
+static int ctrl_command(ctrl_t *c, const char *cmd, char *text, size_t text_size) {
+	if (ctrl_send(c, cmd) < 0) return -1;
+	return ctrl_reply(c, text, text_size);
+}
+
+/* PASV and connect, returns the data socket */
+static int open_pasv(worker_t *w, ctrl_t *c) {
+	char text[MAX_LINE];
+	unsigned int h1, h2, h3, h4, p1, p2;
+	struct sockaddr_in addr;
+	unsigned long long start = now_us();
+	char *p;
+	int fd;
+
+	if (ctrl_command(c, "PASV", text, sizeof(text)) != 227) return -1;
+	if (!(p = strchr(text, '(')) || sscanf(p, "(%u,%u,%u,%u,%u,%u)", &h1, &h2, &h3, &h4, &p1, &p2) != 6)
+		return -1;
+
+	/* The server may advertise its LAN address, loopback tests keep using ours */
+	addr = server_addr;
+	addr.sin_port = htons((p1 << 8) | p2);
+	fd = tcp_connect(&addr, slow_bytes ? 4096 : 0);
+	if (fd >= 0) samples_add(&w->data_setup, now_us() - start);
+	return fd;
+}
+
+static int is_download(const char *cmd) {
+	return !strncasecmp(cmd, "LIST", 4) || !strncasecmp(cmd, "NLST", 4) ||
+		!strncasecmp(cmd, "MLSD", 4) || !strncasecmp(cmd, "RETR", 4);
+}
+
+static int is_upload(const char *cmd) {
+	return !strncasecmp(cmd, "STOR", 4) || !strncasecmp(cmd, "APPE", 4);
+}
+
+/* SIZE of the command's argument, -1 if unknown */
+static long long file_size(ctrl_t *c, const char *cmd) {
+	char text[MAX_LINE];
+	char size_cmd[MAX_LINE];
+
+	if (strlen(cmd) < 6) return -1;
+	snprintf(size_cmd, sizeof(size_cmd), "SIZE %s", cmd + 5);
+	if (ctrl_command(c, size_cmd, text, sizeof(text)) != 213) return -1;
+	return strtoll(text + 4, NULL, 10);
+}
+
+static ssize_t data_recv(int fd, unsigned char *buf) {
+	ssize_t n = recv(fd, buf, slow_bytes ? slow_bytes : IO_BUF_SIZE, 0);
+	if (slow_bytes && n > 0) usleep(slow_wait);
+	return n;
+}
+
+static ssize_t data_send(int fd, const unsigned char *buf, unsigned long long left) {
+	size_t len = slow_bytes ? slow_bytes : IO_BUF_SIZE;
+	ssize_t n = send(fd, buf, left < len ? left : len, MSG_NOSIGNAL);
+	if (slow_bytes && n > 0) usleep(slow_wait);
+	return n;
+}
+
+/* Runs one command, data transfer included, returns < 0 if the session broke */
+static int run_command(worker_t *w, ctrl_t *c, const char *cmd, unsigned char *buf) {
+	char text[MAX_LINE];
+	unsigned long long start, left, moved = 0;
+	long long expect = -1;
+	ssize_t n;
+	int code, data_fd = -1;
+	int download = is_download(cmd), upload = is_upload(cmd);
+	/* Only whole file transfers can be checked against SIZE */
+	int check = slow_bytes && (!strncasecmp(cmd, "RETR", 4) || !strncasecmp(cmd, "STOR", 4));
+
+	if (check && download) expect = file_size(c, cmd);
+	if ((download || upload) && (data_fd = open_pasv(w, c)) < 0) {
+		w->errors++;
+		return -1;
+	}
+
+	start = now_us();
+	code = ctrl_command(c, cmd, text, sizeof(text));
+	if (code < 0) {
+		if (data_fd >= 0) close(data_fd);
+		return -1;
+	}
+
+	if (data_fd >= 0) {
+		if (code == 150 || code == 125) {
+			if (download) {
+				while ((n = data_recv(data_fd, buf)) > 0) moved += n;
+			} else {
+				for (left = upload_size; left > 0; left -= n) {
+					n = data_send(data_fd, buf, left);
+					if (n <= 0) break;
+					moved += n;
+				}
+			}
+			w->bytes += moved;
+			close(data_fd);
+			code = ctrl_reply(c, text, sizeof(text));
+			if (code < 0) return -1;
+
+			/* A 226 has to mean all of it went through */
+			if (check && code == 226) {
+				if (upload) expect = moved == upload_size ? file_size(c, cmd) : -1;
+				if (expect < 0 || (unsigned long long)expect != moved) {
+					fprintf(stderr, "%s: 226 after %llu of %lld bytes\n", cmd, moved, expect);
+					w->short_xfers++;
+				}
+			}
+		} else {
+			close(data_fd);
+		}
+	}
+
+	samples_add(&w->cmd_latency, now_us() - start);
+	w->commands++;
+	if (code >= 400) w->errors++;
+	return 0;
+}
+
+static int run_session(worker_t *w, const script_t *sc, unsigned char *buf) {
+	char text[MAX_LINE];
+	char cmd[MAX_LINE];
+	ctrl_t c;
+	int i;
+
+	c.len = 0;
+	c.fd = tcp_connect(&server_addr, 0);
+	if (c.fd < 0) return -1;
+
+	if (ctrl_reply(&c, text, sizeof(text)) != 220) goto fail;
+	snprintf(cmd, sizeof(cmd), "USER %s", user);
+	if (ctrl_command(&c, cmd, text, sizeof(text)) < 0) goto fail;
+	snprintf(cmd, sizeof(cmd), "PASS %s", pass);
+	if (ctrl_command(&c, cmd, text, sizeof(text)) < 0) goto fail;
+	if (ctrl_command(&c, "TYPE I", text, sizeof(text)) < 0) goto fail;
+
+	for (i = 0; i < sc->count && !stop; i++) {
+		if (deadline && now_us() >= deadline) break;
+		if (run_command(w, &c, sc->lines[i], buf) < 0) goto fail;
+	}
+
+	ctrl_command(&c, "QUIT", text, sizeof(text));
+	close(c.fd);
+	w->sessions++;
+	return 0;
+
+fail:
+	w->errors++;
+	close(c.fd);
+	return -1;
+}
+
+static void *worker_thread(void *arg) {
+	worker_t *w = (worker_t *)arg;
+	unsigned char *buf = (unsigned char *)malloc(IO_BUF_SIZE);
+	int round;
+
+	memset(buf, 0x5A, IO_BUF_SIZE);
+	for (round = 0; !stop; round++) {
+		if (deadline) {
+			if (now_us() >= deadline) break;
+		} else if (round >= repeats) {
+			break;
+		}
+		run_session(w, &scripts[(w->id + round) % num_scripts], buf);
+	}
+	free(buf);
+	return NULL;
+}
+
+static void print_samples(const char *what, samples_t *s) {
+	qsort(s->v, s->count, sizeof(*s->v), cmp_ull);
+	printf("%-14s n=%-8zu p50 %8.2f ms  p90 %8.2f ms  p99 %8.2f ms  max %8.2f ms\n", what, s->count,
+		samples_pct(s, 50) / 1000.0, samples_pct(s, 90) / 1000.0,
+		samples_pct(s, 99) / 1000.0, samples_pct(s, 100) / 1000.0);
+}
+
+static void usage(const char *prog) {
+	fprintf(stderr,
+		"usage: %s [-c clients] [-n repeats | -d seconds] [-s upload_bytes] [-u user] [-p pass]\n"
+		"          [-r slow_bytes [-w slow_wait_us]] (-f script | -l info_log) host port\n", prog);
+	exit(1);
+}
+
+int main(int argc, char **argv) {
+	struct addrinfo hints, *res;
+	const char *script = NULL, *recording = NULL;
+	worker_t *workers;
+	samples_t latency, setup;
+	unsigned long long bytes = 0, commands = 0, errors = 0, sessions = 0, short_xfers = 0, start, elapsed;
+	int opt, i;
+
+	while ((opt = getopt(argc, argv, "c:n:d:s:u:p:f:l:r:w:")) != -1) {
+		switch (opt) {
+		case 'c': num_clients = atoi(optarg); break;
+		case 'n': repeats = atoi(optarg); break;
+		case 'd': duration = atoi(optarg); break;
+		case 's': upload_size = strtoull(optarg, NULL, 10); break;
+		case 'u': user = optarg; break;
+		case 'p': pass = optarg; break;
+		case 'f': script = optarg; break;
+		case 'l': recording = optarg; break;
+		case 'r': slow_bytes = atoi(optarg); break;
+		case 'w': slow_wait = atoi(optarg); break;
+		default: usage(argv[0]);
+		}
+	}
+	if (optind + 2 != argc || (!script == !recording) || num_clients < 1) usage(argv[0]);
+	host = argv[optind];
+	port = argv[optind + 1];
+
+	if ((script && load_script(script) < 0) || (recording && load_recording(recording) < 0)) {
+		fprintf(stderr, "Could not load %s\n", script ? script : recording);
+		return 1;
+	}
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+	if (getaddrinfo(host, port, &hints, &res) != 0) {
+		fprintf(stderr, "Could not resolve %s\n", host);
+		return 1;
+	}
+	memcpy(&server_addr, res->ai_addr, sizeof(server_addr));
+	freeaddrinfo(res);
+
+	printf("%i clients, %i script(s), %s %u\n", num_clients, num_scripts,
+		duration ? "seconds" : "rounds", duration ? duration : (unsigned int)repeats);
+
+	memset(&latency, 0, sizeof(latency));
+	memset(&setup, 0, sizeof(setup));
+	workers = (worker_t *)calloc(num_clients, sizeof(worker_t));
+	start = now_us();
+	if (duration) deadline = start + (unsigned long long)duration * 1000000;
+
+	for (i = 0; i < num_clients; i++) {
+		workers[i].id = i;
+		pthread_create(&workers[i].thid, NULL, worker_thread, &workers[i]);
+	}
+	for (i = 0; i < num_clients; i++) {
+		pthread_join(workers[i].thid, NULL);
+		samples_merge(&latency, &workers[i].cmd_latency);
+		samples_merge(&setup, &workers[i].data_setup);
+		bytes += workers[i].bytes;
+		commands += workers[i].commands;
+		errors += workers[i].errors;
+		sessions += workers[i].sessions;
+		short_xfers += workers[i].short_xfers;
+	}
+	elapsed = now_us() - start;
+
+	printf("%llu sessions, %llu commands, %llu errors in %.2f s\n", sessions, commands, errors, elapsed / 1e6);
+	printf("%.2f commands/s, %.2f MiB/s data\n",
+		commands * 1e6 / elapsed, bytes * 1e6 / elapsed / (1024.0 * 1024.0));
+	print_samples("command", &latency);
+	print_samples("data setup", &setup);
+	if (slow_bytes) printf("%llu short transfers\n", short_xfers);
+	return errors || short_xfers ? 2 : 0;
+}
@@ -0,0 +1,101 @@
+/*
+* Host stand-in for the libHB application.h.
+*
+* Lets the server's self-contained modules (ftp_sparse, ftp_io, ftp_path,
+* ftp_find, ...) build on Linux so the tools next to this directory can
+* test and benchmark them. Only what those modules use is mapped: Sys:: file
+* calls, the scePthread* primitives and the kernel clock, all on POSIX.
+*
+* Build tools with: g++ -O2 -pthread -Itools/host -Ips4_ftp ...
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+/* ftp_log.h only needs the name */
+class Logger;
+
+typedef pthread_t ScePthread;
+typedef pthread_mutex_t ScePthreadMutex;
+typedef pthread_cond_t ScePthreadCond;
+
+static inline int scePthreadCreate(ScePthread *thid, const void *attr, void *(*entry)(void *), void *arg, const char *name) {
+	(void)attr;
+	(void)name;
+	return pthread_create(thid, NULL, entry, arg) ? -1 : 0;
+}
+static inline int scePthreadJoin(ScePthread thid, void **ret) { return pthread_join(thid, ret); }
+
+static inline int scePthreadMutexInit(ScePthreadMutex *mtx, const void *attr, const char *name) {
+	(void)attr;
+	(void)name;
+	return pthread_mutex_init(mtx, NULL);
+}
+static inline int scePthreadMutexDestroy(ScePthreadMutex *mtx) { return pthread_mutex_destroy(mtx); }
+static inline int scePthreadMutexLock(ScePthreadMutex *mtx) { return pthread_mutex_lock(mtx); }
+static inline int scePthreadMutexUnlock(ScePthreadMutex *mtx) { return pthread_mutex_unlock(mtx); }
+
+static inline int scePthreadCondInit(ScePthreadCond *cond, const void *attr, const char *name) {
+	(void)attr;
+	(void)name;
+	return pthread_cond_init(cond, NULL);
+}
+static inline int scePthreadCondDestroy(ScePthreadCond *cond) { return pthread_cond_destroy(cond); }
+static inline int scePthreadCondSignal(ScePthreadCond *cond) { return pthread_cond_signal(cond); }
+static inline int scePthreadCondBroadcast(ScePthreadCond *cond) { return pthread_cond_broadcast(cond); }
+static inline int scePthreadCondWait(ScePthreadCond *cond, ScePthreadMutex *mtx) { return pthread_cond_wait(cond, mtx); }
+/* The timeout is in microseconds like on the console */
+static inline int scePthreadCondTimedwait(ScePthreadCond *cond, ScePthreadMutex *mtx, unsigned int usec) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_sec += usec / 1000000;
+	ts.tv_nsec += (long)(usec % 1000000) * 1000;
+	if (ts.tv_nsec >= 1000000000) {
+		ts.tv_sec++;
+		ts.tv_nsec -= 1000000000;
+	}
+	return pthread_cond_timedwait(cond, mtx, &ts);
+}
+
+static inline unsigned long long sceKernelGetProcessTime() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+static inline int sceKernelUsleep(unsigned int usec) { return usleep(usec); }
+
+namespace Sys {
+	static inline int open(const char *path, int flags, int mode) { return ::open(path, flags, mode); }
+	static inline int close(int fd) { return ::close(fd); }
+	static inline long read(int fd, void *buf, size_t len) { return ::read(fd, buf, len); }
+	static inline long write(int fd, const void *buf, size_t len) { return ::write(fd, buf, len); }
+	static inline long long lseek(int fd, long long offset, int whence) { return ::lseek(fd, offset, whence); }
+	static inline int stat(const char *path, struct stat *st) { return ::stat(path, st); }
+	static inline int fstat(int fd, struct stat *st) { return ::fstat(fd, st); }
+	static inline int ftruncate(int fd, long long len) { return ::ftruncate(fd, len); }
+	static inline int unlink(const char *path) { return ::unlink(path); }
+	static inline int rename(const char *from, const char *to) { return ::rename(from, to); }
+	static inline int mkdir(const char *path, int mode) { return ::mkdir(path, mode); }
+	static inline int rmdir(const char *path) { return ::rmdir(path); }
+	static inline int link(const char *from, const char *to) { return ::link(from, to); }
+	static inline int readlink(const char *path, char *buf, size_t len) { return (int)::readlink(path, buf, len); }
+	/* glibc's struct dirent has the linux_dirent64 layout on 64 bit hosts */
+	static inline int getdents(int fd, char *buf, size_t len) { return (int)syscall(SYS_getdents64, fd, buf, len); }
+}
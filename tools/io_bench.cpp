@@ -0,0 +1,206 @@
+/*
+* File I/O benchmark for the RETR/STOR engine (ftp_io).
+*
+* For each chunk size and start offset (block aligned, or a REST offset in
+* the middle of a block) it times:
+*   read   ftps4_io_seek_read/ftps4_io_read, as RETR does
+*   naive  read() of chunk bytes from the offset into an unaligned buffer,
+*          as RETR did before ftp_io
+*   direct O_DIRECT reads into an aligned buffer (aligned offsets only),
+*          to see whether bypassing the page cache would pay off
+*   write  ftps4_io fed in socket sized pieces, as STOR does
+*   nwrite write() of every piece as it comes, as STOR did before ftp_io
+* The page cache is dropped for the file before every read run.
+*
+* Run it on the storage you care about, e.g. a USB stick mounted on the PC.
+*
+* Host tool, build from the repository root with:
+* g++ -O2 -pthread -Itools/host -Ips4_ftp -o io_bench tools/io_bench.cpp ps4_ftp/ftp_io.cpp ps4_ftp/ftp_sparse.cpp
+*/
+
+#include <application.h>
+#include "ftp_io.h"
+
+/* What one recv on the data socket typically returns */
+#define PIECE_SIZE (64 * 1024 + 1460)
+
+static const unsigned int chunks[] = { 16 * 1024, 64 * 1024, 256 * 1024, 1024 * 1024, 4 * 1024 * 1024 };
+static const unsigned long long offsets[] = { 0, 1000 * 1000 + 7 };
+
+static unsigned long long now_us() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static double mib_s(unsigned long long bytes, unsigned long long us) {
+	return us ? bytes * 1e6 / us / (1024.0 * 1024.0) : 0.0;
+}
+
+static void drop_cache(int fd) {
+	fdatasync(fd);
+	posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+}
+
+static double bench_read(const char *path, unsigned int chunk, unsigned long long offset, unsigned long long size) {
+	ftps4_io_t io;
+	const unsigned char *data;
+	unsigned long long got = 0, start;
+	int fd, n;
+
+	if ((fd = Sys::open(path, O_RDONLY, 0)) < 0) return -1;
+	drop_cache(fd);
+	start = now_us();
+	if (ftps4_io_init(&io, fd, chunk) < 0 || ftps4_io_seek_read(&io, offset) < 0) {
+		Sys::close(fd);
+		return -1;
+	}
+	while ((n = ftps4_io_read(&io, &data)) > 0) got += n;
+	ftps4_io_fini(&io);
+	Sys::close(fd);
+	return got == size - offset ? mib_s(got, now_us() - start) : -1;
+}
+
+static double bench_naive_read(const char *path, unsigned int chunk, unsigned long long offset, unsigned long long size) {
+	unsigned char *raw = (unsigned char *)malloc(chunk + 1);
+	unsigned long long got = 0, start;
+	long n;
+	int fd;
+
+	if (!raw || (fd = Sys::open(path, O_RDONLY, 0)) < 0) {
+		free(raw);
+		return -1;
+	}
+	drop_cache(fd);
+	start = now_us();
+	Sys::lseek(fd, offset, SEEK_SET);
+	while ((n = Sys::read(fd, raw + 1, chunk)) > 0) got += n;
+	Sys::close(fd);
+	free(raw);
+	return got == size - offset ? mib_s(got, now_us() - start) : -1;
+}
+
+static double bench_direct_read(const char *path, unsigned int chunk, unsigned long long offset, unsigned long long size) {
+#if defined(O_DIRECT)
+	void *buf;
+	unsigned long long got = 0, start;
+	long n;
+	int fd;
+
+	if (offset % 4096 || posix_memalign(&buf, 4096, chunk) != 0) return -1;
+	if ((fd = Sys::open(path, O_RDONLY | O_DIRECT, 0)) < 0) {
+		free(buf);
+		return -1;
+	}
+	start = now_us();
+	Sys::lseek(fd, offset, SEEK_SET);
+	while ((n = Sys::read(fd, buf, chunk)) > 0) got += n;
+	Sys::close(fd);
+	free(buf);
+	return got == size - offset ? mib_s(got, now_us() - start) : -1;
+#else
+	(void)path; (void)chunk; (void)offset; (void)size;
+	return -1;
+#endif
+}
+
+/* Writes size - offset bytes from offset on, in PIECE_SIZE pieces */
+static double bench_write(const char *path, unsigned int chunk, unsigned long long offset, unsigned long long size,
+	const unsigned char *piece, int engine) {
+	ftps4_io_t io;
+	unsigned char *space;
+	unsigned long long pos, start, elapsed;
+	unsigned int n, room, left;
+	int fd, ret = 0;
+
+	if ((fd = Sys::open(path, O_RDWR, 0)) < 0) return -1;
+	drop_cache(fd);
+	start = now_us();
+	if (Sys::lseek(fd, offset, SEEK_SET) < 0 || (engine && ftps4_io_init(&io, fd, chunk) < 0)) {
+		Sys::close(fd);
+		return -1;
+	}
+	if (engine) ftps4_io_begin_write(&io, offset, NULL);
+
+	for (pos = offset; pos < size && ret == 0; pos += n) {
+		n = size - pos < PIECE_SIZE ? (unsigned int)(size - pos) : PIECE_SIZE;
+		if (!engine) {
+			ret = Sys::write(fd, piece, n) == (long)n ? 0 : -1;
+			continue;
+		}
+		/* The socket fills the engine's buffer, a piece may straddle two chunks */
+		for (left = n; left > 0 && ret == 0; left -= room) {
+			room = ftps4_io_space(&io, &space);
+			if (room > left) room = left;
+			memcpy(space, piece, room);
+			ret = ftps4_io_commit(&io, room);
+		}
+	}
+	if (engine) {
+		if (ret == 0) ret = ftps4_io_flush(&io);
+		ftps4_io_fini(&io);
+	}
+	if (ret == 0) ret = fdatasync(fd);
+	elapsed = now_us() - start;
+	Sys::close(fd);
+	return ret < 0 ? -1 : mib_s(size - offset, elapsed);
+}
+
+static void print_rate(double rate) {
+	if (rate < 0) printf(" %9s", "-");
+	else printf(" %9.1f", rate);
+}
+
+int main(int argc, char **argv) {
+	const char *dir = ".";
+	unsigned long long size = 256 * 1024 * 1024, pos;
+	unsigned char *piece;
+	char path[PATH_MAX];
+	size_t c, o;
+	int opt, fd;
+
+	while ((opt = getopt(argc, argv, "d:s:")) != -1) {
+		switch (opt) {
+		case 'd': dir = optarg; break;
+		case 's': size = strtoull(optarg, NULL, 10); break;
+		default:
+			fprintf(stderr, "usage: %s [-d dir] [-s file_bytes]\n", argv[0]);
+			return 1;
+		}
+	}
+	if (size < 16 * 1024 * 1024) size = 16 * 1024 * 1024;
+
+	piece = (unsigned char *)malloc(PIECE_SIZE);
+	if (!piece) return 1;
+	memset(piece, 0x5A, PIECE_SIZE);
+	snprintf(path, sizeof(path), "%s/io_bench.bin", dir);
+
+	/* The test file, written once up front */
+	if ((fd = Sys::open(path, O_CREAT | O_RDWR | O_TRUNC, 0644)) < 0) {
+		fprintf(stderr, "Could not create %s\n", path);
+		return 1;
+	}
+	for (pos = 0; pos < size; pos += PIECE_SIZE) {
+		if (Sys::write(fd, piece, size - pos < PIECE_SIZE ? size - pos : PIECE_SIZE) < 0) break;
+	}
+	Sys::close(fd);
+
+	printf("%llu MiB file in %s, MiB/s\n", size >> 20, dir);
+	printf("%8s %8s %9s %9s %9s %9s %9s\n", "chunk", "offset", "read", "naive", "direct", "write", "nwrite");
+	for (c = 0; c < sizeof(chunks) / sizeof(chunks[0]); c++) {
+		for (o = 0; o < sizeof(offsets) / sizeof(offsets[0]); o++) {
+			printf("%7uK %8llu", chunks[c] / 1024, offsets[o]);
+			print_rate(bench_read(path, chunks[c], offsets[o], size));
+			print_rate(bench_naive_read(path, chunks[c], offsets[o], size));
+			print_rate(bench_direct_read(path, chunks[c], offsets[o], size));
+			print_rate(bench_write(path, chunks[c], offsets[o], size, piece, 1));
+			print_rate(bench_write(path, chunks[c], offsets[o], size, piece, 0));
+			printf("\n");
+			fflush(stdout);
+		}
+	}
+
+	Sys::unlink(path);
+	free(piece);
+	return 0;
+}
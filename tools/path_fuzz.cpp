@@ -0,0 +1,294 @@
+/*
+* Fuzzer and microbenchmark for the path resolver (ftp_path).
+*
+* Every input is a working directory, a newline, and a command argument
+* (which may itself contain CR, LF or TAB, the resolver stops there). Both
+* are resolved, and the result is checked against the ftps4_path_t
+* invariants and against a simple reference resolver. tools/path_corpus
+* holds the seed inputs. Without libFuzzer the tool runs the corpus, then
+* -n random mutations of it, then times ftps4_path_resolve on typical
+* arguments.
+*
+* Host tool, build from the repository root with:
+* g++ -O2 -g -fsanitize=address,undefined -Itools/host -Ips4_ftp -o path_fuzz tools/path_fuzz.cpp ps4_ftp/ftp_path.cpp
+* and run: ./path_fuzz -c tools/path_corpus
+* or with libFuzzer:
+* clang++ -O1 -g -fsanitize=fuzzer,address -DPATH_FUZZ_LIBFUZZER -Itools/host -Ips4_ftp -o path_fuzz tools/path_fuzz.cpp ps4_ftp/ftp_path.cpp
+* ./path_fuzz tools/path_corpus
+*/
+
+#include <application.h>
+#include <ctype.h>
+#include <string>
+#include <vector>
+#include "ftp_path.h"
+
+#define FUZZ_MAX_INPUT 4096
+
+static int arg_end(char c) {
+	return c == '\0' || c == '\r' || c == '\n' || c == '\t';
+}
+
+/* What ftps4_path_resolve has to produce, the slow way. Returns < 0 where
+* the resolver must fail: too long or too deep at any point on the way. */
+static int reference_resolve(const std::vector<std::string> &base, const char *arg, std::vector<std::string> &out) {
+	std::vector<std::string> comps;
+	std::string comp;
+	size_t len, i;
+
+	if (arg[0] != '/') comps = base;
+	while (!arg_end(*arg)) {
+		while (*arg == '/') arg++;
+		comp.clear();
+		while (!arg_end(*arg) && *arg != '/') comp += *arg++;
+
+		if (comp.empty() || comp == ".") continue;
+		if (comp == "..") {
+			if (!comps.empty()) comps.pop_back();
+			continue;
+		}
+		if (comps.size() == FTPS4_PATH_MAX_DEPTH) return -1;
+		comps.push_back(comp);
+		for (len = 0, i = 0; i < comps.size(); i++) len += 1 + comps[i].size();
+		if (len >= PATH_MAXX) return -1;
+	}
+	out = comps;
+	return 0;
+}
+
+static std::string reference_string(const std::vector<std::string> &comps) {
+	std::string s;
+	size_t i;
+
+	if (comps.empty()) return "/";
+	for (i = 0; i < comps.size(); i++) s += "/" + comps[i];
+	return s;
+}
+
+static void fail(const char *what, const std::string &cwd, const char *arg) {
+	fprintf(stderr, "%s\n  cwd: \"%s\"\n  arg: \"", what, cwd.c_str());
+	for (; *arg; arg++) fprintf(stderr, isprint((unsigned char)*arg) ? "%c" : "\\x%02x", (unsigned char)*arg);
+	fprintf(stderr, "\"\n");
+	abort();
+}
+
+/* Checks the layout of a resolved path, returns its components */
+static std::vector<std::string> check_invariants(const ftps4_path_t *p, const std::string &cwd, const char *arg) {
+	std::vector<std::string> comps;
+	unsigned int len = ftps4_path_len(p), start = 1, i;
+
+	if (len >= PATH_MAXX || strlen(p->path) != len) fail("length doesn't match ends[]", cwd, arg);
+	if (p->path[0] != '/') fail("not absolute", cwd, arg);
+	if (p->depth > FTPS4_PATH_MAX_DEPTH) fail("too deep", cwd, arg);
+	if (!p->depth && len != 1) fail("root isn't \"/\"", cwd, arg);
+
+	for (i = 0; i < p->depth; i++) {
+		if (p->ends[i] <= start || p->ends[i] > len) fail("bad component end", cwd, arg);
+		comps.push_back(std::string(p->path + start, p->ends[i] - start));
+		if (comps.back() == "." || comps.back() == ".." || comps.back().find('/') != std::string::npos)
+			fail("component not canonical", cwd, arg);
+		if (i + 1 < p->depth && p->path[p->ends[i]] != '/') fail("missing separator", cwd, arg);
+		start = p->ends[i] + 1;
+	}
+	return comps;
+}
+
+/* Runs one input: cwd, '\n', arg */
+static void run_input(const unsigned char *data, size_t size) {
+	char input[FUZZ_MAX_INPUT + 1];
+	ftps4_path_t cwd, out, before;
+	std::vector<std::string> ref_cwd, ref_out;
+	std::string cwd_arg;
+	const char *arg;
+	char *nl;
+	int ret, ref;
+
+	if (size > FUZZ_MAX_INPUT) size = FUZZ_MAX_INPUT;
+	memcpy(input, data, size);
+	input[size] = '\0';
+	if ((nl = strchr(input, '\n'))) {
+		*nl = '\0';
+		arg = nl + 1;
+	} else {
+		arg = input + size;
+	}
+	cwd_arg = input;
+
+	/* The working directory is reached from the root like CWD does */
+	ftps4_path_root(&cwd);
+	if (ftps4_path_resolve(&cwd, input, &cwd) < 0) ftps4_path_root(&cwd);
+	ref_cwd = check_invariants(&cwd, cwd_arg, input);
+
+	memset(&out, 0xA5, sizeof(out));
+	before = out;
+	ret = ftps4_path_resolve(&cwd, arg, &out);
+	ref = reference_resolve(ref_cwd, arg, ref_out);
+
+	if ((ret < 0) != (ref < 0)) fail(ret < 0 ? "resolver failed, reference didn't" : "resolver didn't fail", cwd.path, arg);
+	if (ret < 0) {
+		if (memcmp(&out, &before, sizeof(out)) != 0) fail("out changed on failure", cwd.path, arg);
+		return;
+	}
+	check_invariants(&out, cwd.path, arg);
+	if (reference_string(ref_out) != out.path) fail("differs from the reference", cwd.path, arg);
+
+	/* Resolving in place must give the same */
+	before = cwd;
+	if (ftps4_path_resolve(&before, arg, &before) < 0 || strcmp(before.path, out.path) != 0)
+		fail("in place resolve differs", cwd.path, arg);
+}
+
+#if defined(PATH_FUZZ_LIBFUZZER)
+
+extern "C" int LLVMFuzzerTestOneInput(const unsigned char *data, size_t size) {
+	run_input(data, size);
+	return 0;
+}
+
+#else
+
+typedef struct {
+	unsigned char data[FUZZ_MAX_INPUT];
+	size_t size;
+} input_t;
+
+static unsigned long long rng = 0x2545F4914F6CDD1DULL;
+
+static unsigned int rnd(unsigned int n) {
+	rng ^= rng << 13;
+	rng ^= rng >> 7;
+	rng ^= rng << 17;
+	return (unsigned int)(rng % n);
+}
+
+static int load_corpus(const char *dir, std::vector<input_t> &corpus) {
+	char path[PATH_MAX];
+	struct dirent *de;
+	input_t in;
+	FILE *f;
+	DIR *d = opendir(dir);
+
+	if (!d) return -1;
+	while ((de = readdir(d))) {
+		if (de->d_name[0] == '.') continue;
+		snprintf(path, sizeof(path), "%s/%s", dir, de->d_name);
+		if (!(f = fopen(path, "rb"))) continue;
+		in.size = fread(in.data, 1, sizeof(in.data), f);
+		fclose(f);
+		corpus.push_back(in);
+	}
+	closedir(d);
+	return 0;
+}
+
+/* Pieces that matter to the resolver */
+static const char *tokens[] = { "/", "//", ".", "..", "./", "../", "/..", "a", "dir", "\r\n", "\t", "...", ".x" };
+
+static void mutate(input_t *in) {
+	unsigned int i, pos, n = 1 + rnd(8);
+	const char *tok;
+	size_t len;
+
+	while (n--) {
+		pos = in->size ? rnd((unsigned int)in->size + 1) : 0;
+		switch (rnd(5)) {
+		case 0: /* Insert a token */
+			tok = tokens[rnd(sizeof(tokens) / sizeof(tokens[0]))];
+			len = strlen(tok);
+			if (in->size + len > sizeof(in->data)) break;
+			memmove(in->data + pos + len, in->data + pos, in->size - pos);
+			memcpy(in->data + pos, tok, len);
+			in->size += len;
+			break;
+		case 1: /* Delete a run */
+			if (pos >= in->size) break;
+			len = 1 + rnd(16);
+			if (len > in->size - pos) len = in->size - pos;
+			memmove(in->data + pos, in->data + pos + len, in->size - pos - len);
+			in->size -= len;
+			break;
+		case 2: /* Flip a byte */
+			if (pos < in->size) in->data[pos] = (unsigned char)rnd(256);
+			break;
+		case 3: /* Repeat a run, grows names and depth past the limits */
+			len = 1 + rnd(40);
+			if (pos + len > in->size) break;
+			for (i = 0; i < 1 + rnd(12) && in->size + len <= sizeof(in->data); i++) {
+				memmove(in->data + pos + len, in->data + pos, in->size - pos);
+				in->size += len;
+			}
+			break;
+		default: /* Long name */
+			len = 1 + rnd(300);
+			if (in->size + len > sizeof(in->data)) break;
+			memmove(in->data + pos + len, in->data + pos, in->size - pos);
+			memset(in->data + pos, 'a' + rnd(26), len);
+			in->size += len;
+			break;
+		}
+	}
+}
+
+static unsigned long long now_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void bench(const char *cwd_arg, const char *arg) {
+	ftps4_path_t cwd, out;
+	unsigned long long start, elapsed;
+	int i, rounds = 2000000;
+
+	ftps4_path_root(&cwd);
+	ftps4_path_resolve(&cwd, cwd_arg, &cwd);
+	start = now_ns();
+	for (i = 0; i < rounds; i++) {
+		ftps4_path_resolve(&cwd, arg, &out);
+		/* Keep the call from being hoisted out of the loop */
+		__asm__ __volatile__("" : : "r"(&out) : "memory");
+	}
+	elapsed = now_ns() - start;
+	printf("%-34s %-28s %7.1f ns\n", cwd.path, arg, (double)elapsed / rounds);
+}
+
+int main(int argc, char **argv) {
+	const char *corpus_dir = "tools/path_corpus";
+	std::vector<input_t> corpus;
+	input_t in;
+	unsigned long long i, iterations = 1000000;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "c:n:")) != -1) {
+		switch (opt) {
+		case 'c': corpus_dir = optarg; break;
+		case 'n': iterations = strtoull(optarg, NULL, 10); break;
+		default:
+			fprintf(stderr, "usage: %s [-c corpus_dir] [-n iterations]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	if (load_corpus(corpus_dir, corpus) < 0 || corpus.empty()) {
+		fprintf(stderr, "No corpus in %s\n", corpus_dir);
+		return 1;
+	}
+	for (i = 0; i < corpus.size(); i++) run_input(corpus[i].data, corpus[i].size);
+	printf("%zu corpus inputs ok\n", corpus.size());
+
+	for (i = 0; i < iterations; i++) {
+		in = corpus[rnd((unsigned int)corpus.size())];
+		mutate(&in);
+		run_input(in.data, in.size);
+	}
+	printf("%llu mutated inputs ok\n", iterations);
+
+	bench("/", "file.bin");
+	bench("/user/app/CUSA00001/sce_sys", "param.sfo");
+	bench("/data/games/some/deep/dir/tree", "../../other/name.pkg");
+	bench("/data", "/mnt/usb0/PS4/UPDATE/PS4UPDATE.PUP");
+	bench("/mnt/usb0", "./a//b/./c/../d/");
+	return 0;
+}
+
+#endif
@@ -0,0 +1,229 @@
+/*
+* Readback check for sparse STOR.
+*
+* Writes a set of mostly empty images through the same path receive_file
+* uses (ftps4_io with ftps4_sparse, fed in the odd sized pieces a socket
+* returns), reads every file back and compares it byte for byte with what
+* was sent. Also prints the bytes left as holes, the disk space the file
+* takes and the time against a plain write of the same data.
+*
+* Host tool, build from the repository root with:
+* g++ -O2 -pthread -Itools/host -Ips4_ftp -o sparse_check tools/sparse_check.cpp ps4_ftp/ftp_io.cpp ps4_ftp/ftp_sparse.cpp
+*/
+
+#include <application.h>
+#include "ftp_io.h"
+#include "ftp_sparse.h"
+
+#define IO_BUF_SIZE (512 * 1024)
+#define MAX_PIECE (64 * 1024)
+
+typedef struct {
+	const char *name;
+	void (*fill)(unsigned char *buf, unsigned long long size);
+	/* Data already in the file before the upload resumes at this offset */
+	unsigned long long offset;
+} image_t;
+
+static unsigned long long rng = 0x9E3779B97F4A7C15ULL;
+
+static unsigned long long rand64() {
+	rng ^= rng << 13;
+	rng ^= rng >> 7;
+	rng ^= rng << 17;
+	return rng;
+}
+
+static void fill_random(unsigned char *buf, unsigned long long len) {
+	unsigned long long i, r;
+
+	for (i = 0; i + 8 <= len; i += 8) {
+		r = rand64();
+		memcpy(buf + i, &r, 8);
+	}
+	for (; i < len; i++) buf[i] = (unsigned char)rand64();
+}
+
+static void fill_zero(unsigned char *buf, unsigned long long size) { memset(buf, 0, size); }
+
+/* A partition table up front and a backup header at the end */
+static void fill_head_tail(unsigned char *buf, unsigned long long size) {
+	memset(buf, 0, size);
+	fill_random(buf, 1024 * 1024);
+	fill_random(buf + size - 64 * 1024, 64 * 1024);
+}
+
+/* A filesystem image, one 4 KiB block in a hundred is used */
+static void fill_scattered(unsigned char *buf, unsigned long long size) {
+	unsigned long long i;
+
+	memset(buf, 0, size);
+	for (i = 0; i + 4096 <= size; i += 4096) {
+		if (rand64() % 100 == 0) fill_random(buf + i, 4096);
+	}
+}
+
+/* Zero runs and data of odd lengths, nothing lines up with a block */
+static void fill_unaligned(unsigned char *buf, unsigned long long size) {
+	unsigned long long i, n;
+
+	memset(buf, 0, size);
+	for (i = 0; i < size; i += n) {
+		n = 1 + rand64() % 20000;
+		if (n > size - i) n = size - i;
+		if (rand64() & 1) fill_random(buf + i, n);
+	}
+}
+
+/* Data with a long empty tail, the hole has to end up inside the file size */
+static void fill_zero_tail(unsigned char *buf, unsigned long long size) {
+	memset(buf, 0, size);
+	fill_random(buf, size / 3 + 123);
+}
+
+/* Single zero bytes in data, must not turn into holes */
+static void fill_dense(unsigned char *buf, unsigned long long size) {
+	unsigned long long i;
+
+	fill_random(buf, size);
+	for (i = 0; i < size; i += 1 + rand64() % 300) buf[i] = 0;
+}
+
+static const image_t images[] = {
+	{ "zero", fill_zero, 0 },
+	{ "head+tail", fill_head_tail, 0 },
+	{ "scattered", fill_scattered, 0 },
+	{ "unaligned", fill_unaligned, 0 },
+	{ "zero tail", fill_zero_tail, 0 },
+	{ "dense", fill_dense, 0 },
+	/* REST inside a block: the first write isn't aligned, the part before it
+	* is already there */
+	{ "resume", fill_scattered, 1000 * 1000 + 7 },
+	{ "resume zero", fill_zero, 3 * 4096 + 100 },
+};
+
+static unsigned long long now_us() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* Uploads data[offset, size) to path the way receive_file does, the file
+* already holding data[0, offset). Returns the time taken or 0 on error. */
+static unsigned long long upload(const char *path, const unsigned char *data, unsigned long long size,
+	unsigned long long offset, int sparse, unsigned long long *skipped) {
+	ftps4_io_t io;
+	ftps4_sparse_t sp;
+	unsigned char *space;
+	unsigned long long pos, start;
+	unsigned int room, n;
+	int fd, ret = 0;
+
+	fd = Sys::open(path, O_CREAT | O_RDWR | O_TRUNC, 0644);
+	if (fd < 0) return 0;
+	if (offset && Sys::write(fd, data, offset) != (long)offset) ret = -1;
+
+	start = now_us();
+	if (ret < 0 || ftps4_io_init(&io, fd, IO_BUF_SIZE) < 0) {
+		Sys::close(fd);
+		return 0;
+	}
+	ftps4_sparse_begin(&sp);
+	ftps4_io_begin_write(&io, offset, sparse ? &sp : NULL);
+
+	for (pos = offset; pos < size && ret == 0; pos += n) {
+		room = ftps4_io_space(&io, &space);
+		n = 1 + rand64() % MAX_PIECE;
+		if (n > room) n = room;
+		if (n > size - pos) n = (unsigned int)(size - pos);
+		memcpy(space, data + pos, n);
+		ret = ftps4_io_commit(&io, n);
+	}
+	if (ret == 0) ret = ftps4_io_flush(&io);
+	if (ret == 0 && sparse) ret = ftps4_sparse_finish(&sp, fd);
+	if (ret == 0) fsync(fd);
+	ftps4_io_fini(&io);
+	Sys::close(fd);
+
+	*skipped = sp.skipped;
+	return ret < 0 ? 0 : now_us() - start + 1;
+}
+
+/* Reads path back and compares it with data, returns < 0 on a mismatch */
+static int readback(const char *path, const unsigned char *data, unsigned long long size, unsigned char *buf) {
+	unsigned long long pos = 0;
+	long n;
+	int fd = Sys::open(path, O_RDONLY, 0);
+
+	if (fd < 0) return -1;
+	while ((n = Sys::read(fd, buf, IO_BUF_SIZE)) > 0) {
+		if (pos + n > size || memcmp(buf, data + pos, n) != 0) {
+			fprintf(stderr, "  differs near offset %llu\n", pos);
+			Sys::close(fd);
+			return -1;
+		}
+		pos += n;
+	}
+	Sys::close(fd);
+	if (n < 0 || pos != size) {
+		fprintf(stderr, "  read back %llu of %llu bytes\n", pos, size);
+		return -1;
+	}
+	return 0;
+}
+
+int main(int argc, char **argv) {
+	const char *dir = ".";
+	unsigned long long size = 64 * 1024 * 1024, skipped, t_sparse, t_plain;
+	unsigned char *data, *buf;
+	char path[PATH_MAX];
+	struct stat st;
+	size_t i;
+	int opt, failed = 0;
+
+	while ((opt = getopt(argc, argv, "d:s:")) != -1) {
+		switch (opt) {
+		case 'd': dir = optarg; break;
+		case 's': size = strtoull(optarg, NULL, 10); break;
+		default:
+			fprintf(stderr, "usage: %s [-d dir] [-s image_bytes]\n", argv[0]);
+			return 1;
+		}
+	}
+	if (size < 4 * 1024 * 1024) size = 4 * 1024 * 1024;
+
+	data = (unsigned char *)malloc(size);
+	buf = (unsigned char *)malloc(IO_BUF_SIZE);
+	if (!data || !buf) return 1;
+	snprintf(path, sizeof(path), "%s/sparse_check.bin", dir);
+
+	printf("%-12s %12s %12s %10s %10s  %s\n", "image", "holes", "on disk", "sparse", "plain", "readback");
+	for (i = 0; i < sizeof(images) / sizeof(images[0]); i++) {
+		images[i].fill(data, size);
+
+		t_plain = upload(path, data, size, images[i].offset, 0, &skipped);
+		if (!t_plain || readback(path, data, size, buf) < 0) {
+			printf("%-12s plain upload failed\n", images[i].name);
+			failed = 1;
+			continue;
+		}
+		t_sparse = upload(path, data, size, images[i].offset, 1, &skipped);
+		if (!t_sparse || Sys::stat(path, &st) < 0) {
+			printf("%-12s sparse upload failed\n", images[i].name);
+			failed = 1;
+			continue;
+		}
+		if (readback(path, data, size, buf) < 0) failed = 1;
+
+		printf("%-12s %11.1fM %11.1fM %8.1fms %8.1fms  %s\n", images[i].name,
+			skipped / 1048576.0, st.st_blocks * 512 / 1048576.0,
+			t_sparse / 1000.0, t_plain / 1000.0, (unsigned long long)st.st_size == size ? "ok" : "wrong size");
+		if ((unsigned long long)st.st_size != size) failed = 1;
+	}
+
+	Sys::unlink(path);
+	free(buf);
+	free(data);
+	printf(failed ? "FAILED\n" : "all images read back identical\n");
+	return failed;
+}